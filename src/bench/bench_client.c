@@ -0,0 +1,351 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#include "bench_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void bench_samples_push(struct BenchSamples* s, double v) {
+    if (s->count == s->cap) {
+        const size_t cap = s->cap ? s->cap * 2 : 256;
+        double* p = realloc(s->v, cap * sizeof(*p));
+        if (!p) {
+            return;
+        }
+        s->v = p;
+        s->cap = cap;
+    }
+    s->v[s->count++] = v;
+}
+
+void bench_samples_merge(struct BenchSamples* dst, const struct BenchSamples* src) {
+    for (size_t i = 0; i < src->count; i++) {
+        bench_samples_push(dst, src->v[i]);
+    }
+}
+
+static int cmp_double(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double bench_samples_percentile(const struct BenchSamples* s, double p) {
+    if (!s->count) {
+        return 0;
+    }
+
+    // sorting in place is fine, the order isn't used for anything else.
+    qsort(s->v, s->count, sizeof(*s->v), cmp_double);
+    size_t i = (size_t)(p / 100.0 * (double)(s->count - 1) + 0.5);
+    if (i >= s->count) {
+        i = s->count - 1;
+    }
+    return s->v[i];
+}
+
+void bench_samples_free(struct BenchSamples* s) {
+    free(s->v);
+    memset(s, 0, sizeof(*s));
+}
+
+static int tcp_connect(const struct sockaddr_in* sa) {
+    const int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (const struct sockaddr*)sa, sizeof(*sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int send_all(int fd, const void* buf, size_t size) {
+    const char* p = buf;
+    while (size) {
+        const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// reads a single line (without CRLF) into out, returns its length or -1.
+static int read_line(struct BenchClient* c, char* out, size_t out_size) {
+    for (;;) {
+        char* nl = memchr(c->buf, '\n', c->buf_len);
+        if (nl) {
+            size_t len = nl - c->buf;
+            const size_t consumed = len + 1;
+            if (len && c->buf[len - 1] == '\r') {
+                len--;
+            }
+            if (len >= out_size) {
+                len = out_size - 1;
+            }
+            memcpy(out, c->buf, len);
+            out[len] = '\0';
+            memmove(c->buf, c->buf + consumed, c->buf_len - consumed);
+            c->buf_len -= consumed;
+            return len;
+        }
+
+        if (c->buf_len == sizeof(c->buf)) {
+            // line too long, drop what we have.
+            c->buf_len = 0;
+        }
+
+        const ssize_t n = recv(c->ctrl, c->buf + c->buf_len, sizeof(c->buf) - c->buf_len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            // the server closed the connection.
+            bench_client_close(c);
+            return -1;
+        }
+        c->buf_len += n;
+    }
+}
+
+static int parse_code(const char* line) {
+    if (line[0] < '1' || line[0] > '5' || line[1] < '0' || line[1] > '9' || line[2] < '0' || line[2] > '9') {
+        return -1;
+    }
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+int bench_client_reply(struct BenchClient* c) {
+    if (read_line(c, c->reply, sizeof(c->reply)) < 0) {
+        return -1;
+    }
+
+    const int code = parse_code(c->reply);
+    if (code < 0) {
+        return -1;
+    }
+
+    // multi-line reply, read until "xyz ".
+    if (c->reply[3] == '-') {
+        char line[1024];
+        for (;;) {
+            if (read_line(c, line, sizeof(line)) < 0) {
+                return -1;
+            }
+            if (parse_code(line) == code && line[3] == ' ') {
+                break;
+            }
+        }
+    }
+
+    return code;
+}
+
+static int vsend_cmd(struct BenchClient* c, const char* fmt, va_list va) {
+    char line[1024];
+    int len = vsnprintf(line, sizeof(line) - 2, fmt, va);
+    if (len < 0 || len >= (int)sizeof(line) - 2) {
+        return -1;
+    }
+    line[len++] = '\r';
+    line[len++] = '\n';
+    return send_all(c->ctrl, line, len);
+}
+
+int bench_client_send(struct BenchClient* c, const char* fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    const int rc = vsend_cmd(c, fmt, va);
+    va_end(va);
+    return rc;
+}
+
+int bench_client_cmd(struct BenchClient* c, const char* fmt, ...) {
+    const double start = bench_now();
+
+    va_list va;
+    va_start(va, fmt);
+    const int rc = vsend_cmd(c, fmt, va);
+    va_end(va);
+    if (rc < 0) {
+        return -1;
+    }
+
+    const int code = bench_client_reply(c);
+    if (c->latency && code > 0) {
+        bench_samples_push(c->latency, bench_now() - start);
+    }
+    return code;
+}
+
+int bench_client_connect(struct BenchClient* c, const char* host, unsigned port) {
+    struct BenchSamples* latency = c->latency;
+    memset(c, 0, sizeof(*c));
+    c->latency = latency;
+    c->ctrl = -1;
+
+    struct sockaddr_in sa = {
+        .sin_family = PF_INET,
+        .sin_port = htons(port),
+    };
+    if (inet_pton(PF_INET, host, &sa.sin_addr) != 1) {
+        return -1;
+    }
+
+    c->ctrl = tcp_connect(&sa);
+    if (c->ctrl < 0) {
+        return -1;
+    }
+
+    if (bench_client_reply(c) != 220) {
+        bench_client_close(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+int bench_client_login(struct BenchClient* c, const char* user, const char* pass) {
+    int code = bench_client_cmd(c, "USER %s", user);
+    if (code == 331) {
+        code = bench_client_cmd(c, "PASS %s", pass);
+    }
+    return code == 230 ? 0 : -1;
+}
+
+int bench_client_pasv(struct BenchClient* c) {
+    if (bench_client_cmd(c, "PASV") != 227) {
+        return -1;
+    }
+
+    const char* p = strchr(c->reply, '(');
+    unsigned h[6];
+    if (!p || sscanf(p, "(%u,%u,%u,%u,%u,%u)", &h[0], &h[1], &h[2], &h[3], &h[4], &h[5]) != 6) {
+        return -1;
+    }
+
+    struct sockaddr_in sa = {
+        .sin_family = PF_INET,
+        .sin_port = htons((h[4] << 8) | h[5]),
+        .sin_addr.s_addr = htonl((h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3]),
+    };
+
+    return tcp_connect(&sa);
+}
+
+long long bench_client_download(struct BenchClient* c, const char* cmd, const char* arg) {
+    const int fd = bench_client_pasv(c);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int code = arg ? bench_client_cmd(c, "%s %s", cmd, arg) : bench_client_cmd(c, "%s", cmd);
+    if (code != 150 && code != 125) {
+        close(fd);
+        return -1;
+    }
+
+    static __thread char buf[1024 * 64];
+    long long total = 0;
+    for (;;) {
+        const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            total = -1;
+            break;
+        } else if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+
+    code = bench_client_reply(c);
+    return code == 226 ? total : -1;
+}
+
+long long bench_client_upload(struct BenchClient* c, const char* cmd, const char* arg, long long size) {
+    const int fd = bench_client_pasv(c);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int code = bench_client_cmd(c, "%s %s", cmd, arg);
+    if (code != 150 && code != 125) {
+        close(fd);
+        return -1;
+    }
+
+    static __thread char buf[1024 * 64];
+    long long total = 0;
+    while (total < size) {
+        size_t chunk = sizeof(buf);
+        if ((long long)chunk > size - total) {
+            chunk = size - total;
+        }
+        if (send_all(fd, buf, chunk) < 0) {
+            total = -1;
+            break;
+        }
+        total += chunk;
+    }
+    close(fd);
+
+    code = bench_client_reply(c);
+    return code == 226 ? total : -1;
+}
+
+void bench_client_close(struct BenchClient* c) {
+    if (c->ctrl >= 0) {
+        close(c->ctrl);
+        c->ctrl = -1;
+    }
+}
+
+long bench_rss_kib(void) {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        long pages = 0, resident = 0;
+        const int n = fscanf(f, "%ld %ld", &pages, &resident);
+        fclose(f);
+        if (n == 2) {
+            return resident * (sysconf(_SC_PAGESIZE) / 1024);
+        }
+    }
+
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage)) {
+        return usage.ru_maxrss;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef BENCH_CLIENT_H
+#define BENCH_CLIENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// growable list of samples, used for latency percentiles.
+struct BenchSamples {
+    double* v;
+    size_t count;
+    size_t cap;
+};
+
+// minimal blocking ftp client, only what the benchmarks need.
+struct BenchClient {
+    int ctrl;           // -1 once the connection is closed.
+    char buf[4096];     // control read buffer.
+    size_t buf_len;
+    char reply[1024];   // last (first line of) reply.
+    struct BenchSamples* latency; // if set, each command's round trip is added here.
+};
+
+double bench_now(void);
+
+void bench_samples_push(struct BenchSamples* s, double v);
+void bench_samples_merge(struct BenchSamples* dst, const struct BenchSamples* src);
+// p in range [0, 100], returns 0 if empty.
+double bench_samples_percentile(const struct BenchSamples* s, double p);
+void bench_samples_free(struct BenchSamples* s);
+
+int bench_client_connect(struct BenchClient* c, const char* host, unsigned port);
+int bench_client_login(struct BenchClient* c, const char* user, const char* pass);
+// reads a full (possibly multi-line) reply, returns the code or -1.
+int bench_client_reply(struct BenchClient* c);
+// sends a command and waits for the reply, returns the code or -1.
+int bench_client_cmd(struct BenchClient* c, const char* fmt, ...);
+// sends a command without waiting for the reply.
+int bench_client_send(struct BenchClient* c, const char* fmt, ...);
+// issues PASV and connects, returns the data fd or -1.
+int bench_client_pasv(struct BenchClient* c);
+// PASV + cmd + reads the data connection to EOF, returns bytes read or -1.
+long long bench_client_download(struct BenchClient* c, const char* cmd, const char* arg);
+// PASV + cmd + writes size bytes, returns bytes written or -1.
+long long bench_client_upload(struct BenchClient* c, const char* cmd, const char* arg, long long size);
+void bench_client_close(struct BenchClient* c);
+
+// resident set size of the process in KiB, 0 if unknown.
+long bench_rss_kib(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BENCH_CLIENT_H
@@ -0,0 +1,830 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+// runs ftpsrv in-process on the unistd backends and drives concurrent
+// loopback clients through it, results are printed as json on stdout.
+#include "ftpsrv.h"
+#include "args/args.h"
+#include "bench_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#ifndef FTPBENCH_FILE_BUFFER_SIZE
+    #define FTPBENCH_FILE_BUFFER_SIZE 0
+#endif
+
+#ifndef FTPBENCH_MAX_SESSIONS
+    #define FTPBENCH_MAX_SESSIONS 0
+#endif
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_PROBE_LOOPS 1000
+#define BENCH_USER "bench"
+#define BENCH_PASS "bench"
+
+enum BenchOp {
+    BenchOp_RETR,
+    BenchOp_STOR,
+    BenchOp_LIST,
+    BenchOp_COUNT,
+};
+
+static const char* BENCH_OP_NAMES[BenchOp_COUNT] = {
+    [BenchOp_RETR] = "retr",
+    [BenchOp_STOR] = "stor",
+    [BenchOp_LIST] = "list",
+};
+
+struct BenchSize {
+    long long size;
+    unsigned count;
+};
+
+struct BenchOpStats {
+    unsigned long long count;
+    unsigned long long bytes;
+    unsigned long long errors;
+    struct BenchSamples durations;
+};
+
+struct Bench;
+
+struct BenchWorker {
+    pthread_t thread;
+    unsigned id;
+    struct Bench* bench;
+    struct BenchClient client;
+    struct BenchSamples latency;
+    struct BenchOpStats ops[BenchOp_COUNT];
+};
+
+struct Bench {
+    // options.
+    unsigned port;
+    unsigned clients;
+    unsigned iterations;
+    bool ops[BenchOp_COUNT];
+    struct BenchSize sizes[BENCH_MAX_SIZES];
+    unsigned size_count;
+    const char* sizes_str;
+    char root[4096];
+    bool keep;
+
+    // dataset, files are named "f<index>" in data/.
+    long long* files;
+    unsigned file_count;
+
+    // idle mode options.
+    unsigned connections;
+    unsigned step;
+    unsigned samples;
+
+    pthread_t server_thread;
+    volatile int server_stop;
+    // set by the main thread to have the server thread time ftpsrv_loop(0).
+    volatile int probe_request;
+    double probe_loop_us;
+    pthread_barrier_t barrier;
+    struct BenchWorker* workers;
+};
+
+enum ArgsId {
+    ArgsId_help,
+    ArgsId_mode,
+    ArgsId_port,
+    ArgsId_clients,
+    ArgsId_iterations,
+    ArgsId_sizes,
+    ArgsId_ops,
+    ArgsId_dir,
+    ArgsId_keep,
+    ArgsId_connections,
+    ArgsId_step,
+    ArgsId_samples,
+};
+
+#define ARGS_ENTRY(_key, _type, _single) \
+    { .key = #_key, .id = ArgsId_##_key, .type = _type, .single = _single },
+
+static const struct ArgsMeta ARGS_META[] = {
+    ARGS_ENTRY(help, ArgsValueType_NONE, 'h')
+    ARGS_ENTRY(mode, ArgsValueType_STR, 'm')
+    ARGS_ENTRY(port, ArgsValueType_INT, 'P')
+    ARGS_ENTRY(clients, ArgsValueType_INT, 'c')
+    ARGS_ENTRY(iterations, ArgsValueType_INT, 'i')
+    ARGS_ENTRY(sizes, ArgsValueType_STR, 's')
+    ARGS_ENTRY(ops, ArgsValueType_STR, 'o')
+    ARGS_ENTRY(dir, ArgsValueType_STR, 'd')
+    ARGS_ENTRY(keep, ArgsValueType_BOOL, 'k')
+    ARGS_ENTRY(connections, ArgsValueType_INT, 'n')
+    ARGS_ENTRY(step, ArgsValueType_INT, 0)
+    ARGS_ENTRY(samples, ArgsValueType_INT, 0)
+};
+
+static int print_usage(int code) {
+    printf("\
+[ftpbench " FTPSRV_VERSION_STR "] \n\n\
+Usage\n\n\
+    -h, --help        = Display help.\n\
+    -m, --mode        = throughput or idle (default throughput).\n\
+    -P, --port        = Set port (default 32121).\n\
+    -c, --clients     = Number of concurrent clients (default 4).\n\
+    -i, --iterations  = Iterations per client (default 8).\n\
+    -s, --sizes       = File size distribution, size:count,... (default 4K:64,1M:8).\n\
+    -o, --ops         = Operations to run, any of retr,stor,list (default retr,stor,list).\n\
+    -d, --dir         = Directory to create the dataset in (default mkdtemp in /tmp).\n\
+    -k, --keep        = Don't delete the dataset on exit.\n\
+\n\
+Idle mode\n\
+\n\
+    -n, --connections = Number of idle logged in connections to open (default 1024).\n\
+    --step            = Measure every step connections (default 128).\n\
+    --samples         = NOOP round trips per measurement (default 64).\n\
+    \n");
+
+    return code;
+}
+
+static double cpu_seconds(clockid_t id) {
+    struct timespec ts;
+    if (clock_gettime(id, &ts)) {
+        return 0;
+    }
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static long long parse_size(const char* s, char** end) {
+    long long v = strtoll(s, end, 10);
+    switch (**end) {
+        case 'k': case 'K': v *= 1024; (*end)++; break;
+        case 'm': case 'M': v *= 1024 * 1024; (*end)++; break;
+        case 'g': case 'G': v *= 1024 * 1024 * 1024; (*end)++; break;
+    }
+    return v;
+}
+
+// "4K:64,1M:8", count defaults to 1 if not set.
+static int parse_sizes(struct Bench* b, const char* s) {
+    b->size_count = 0;
+    b->sizes_str = s;
+
+    while (*s) {
+        if (b->size_count == BENCH_MAX_SIZES) {
+            return -1;
+        }
+
+        char* end;
+        struct BenchSize* e = &b->sizes[b->size_count];
+        e->size = parse_size(s, &end);
+        e->count = 1;
+        if (end == s || e->size < 0) {
+            return -1;
+        }
+
+        if (*end == ':') {
+            s = end + 1;
+            e->count = strtoul(s, &end, 10);
+            if (end == s) {
+                return -1;
+            }
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+
+        b->size_count++;
+        s = end;
+    }
+
+    return b->size_count ? 0 : -1;
+}
+
+static int parse_ops(struct Bench* b, const char* s) {
+    memset(b->ops, 0, sizeof(b->ops));
+
+    while (*s) {
+        const char* end = strchr(s, ',');
+        const size_t len = end ? (size_t)(end - s) : strlen(s);
+
+        int found = 0;
+        for (int i = 0; i < BenchOp_COUNT; i++) {
+            if (strlen(BENCH_OP_NAMES[i]) == len && !strncmp(BENCH_OP_NAMES[i], s, len)) {
+                b->ops[i] = true;
+                found = 1;
+            }
+        }
+
+        if (!found) {
+            return -1;
+        }
+
+        s += len + (end ? 1 : 0);
+    }
+
+    return 0;
+}
+
+static int write_file(const char* path, long long size, unsigned seed) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    static char buf[1024 * 64];
+    unsigned x = seed * 2654435761u + 1;
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        x = x * 1103515245u + 12345u;
+        buf[i] = x >> 16;
+    }
+
+    int rc = 0;
+    while (size > 0 && !rc) {
+        const size_t chunk = size < (long long)sizeof(buf) ? (size_t)size : sizeof(buf);
+        if (write(fd, buf, chunk) != (ssize_t)chunk) {
+            rc = -1;
+        }
+        size -= chunk;
+    }
+
+    close(fd);
+    return rc;
+}
+
+static int dataset_create(struct Bench* b) {
+    char path[4096 + 64];
+
+    snprintf(path, sizeof(path), "%s/data", b->root);
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/upload", b->root);
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        return -1;
+    }
+
+    b->file_count = 0;
+    for (unsigned i = 0; i < b->size_count; i++) {
+        b->file_count += b->sizes[i].count;
+    }
+
+    b->files = calloc(b->file_count ? b->file_count : 1, sizeof(*b->files));
+    if (!b->files) {
+        return -1;
+    }
+
+    // interleave the sizes so that clients walking the list hit a mix.
+    unsigned index = 0;
+    for (unsigned n = 0; index < b->file_count; n++) {
+        for (unsigned i = 0; i < b->size_count; i++) {
+            if (n < b->sizes[i].count) {
+                snprintf(path, sizeof(path), "%s/data/f%u", b->root, index);
+                if (write_file(path, b->sizes[i].size, index)) {
+                    return -1;
+                }
+                b->files[index++] = b->sizes[i].size;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void remove_dir(const char* path) {
+    DIR* dir = opendir(path);
+    if (dir) {
+        struct dirent* d;
+        char buf[4096 + 256];
+        while ((d = readdir(dir))) {
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
+                continue;
+            }
+            snprintf(buf, sizeof(buf), "%s/%s", path, d->d_name);
+            if (d->d_type == DT_DIR) {
+                remove_dir(buf);
+            } else {
+                unlink(buf);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+static void* server_thread(void* userdata) {
+    struct Bench* b = userdata;
+    while (!__atomic_load_n(&b->server_stop, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&b->probe_request, __ATOMIC_ACQUIRE)) {
+            // nothing is ready, so this is the cost of rebuilding the poll
+            // array, the poll() itself and scanning the results.
+            const double start = bench_now();
+            for (int i = 0; i < BENCH_PROBE_LOOPS; i++) {
+                ftpsrv_loop(0);
+            }
+            b->probe_loop_us = (bench_now() - start) / BENCH_PROBE_LOOPS * 1e6;
+            __atomic_store_n(&b->probe_request, 0, __ATOMIC_RELEASE);
+        }
+
+        if (ftpsrv_loop(10) != FTP_API_LOOP_ERROR_OK) {
+            fprintf(stderr, "ftpsrv_loop failed\n");
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void op_record(struct BenchWorker* w, enum BenchOp type, long long bytes, double start) {
+    struct BenchOpStats* op = &w->ops[type];
+    if (bytes < 0) {
+        fprintf(stderr, "client %u %s failed: %s\n", w->id, BENCH_OP_NAMES[type], w->client.reply);
+        op->errors++;
+    } else {
+        op->count++;
+        op->bytes += bytes;
+        bench_samples_push(&op->durations, bench_now() - start);
+    }
+}
+
+static void* worker_thread(void* userdata) {
+    struct BenchWorker* w = userdata;
+    struct Bench* b = w->bench;
+    struct BenchClient* c = &w->client;
+    char path[4096 + 64];
+
+    pthread_barrier_wait(&b->barrier);
+
+    for (unsigned i = 0; i < b->iterations; i++) {
+        // spread the clients over the dataset.
+        const unsigned index = (w->id * 7 + i) % b->file_count;
+
+        if (b->ops[BenchOp_RETR]) {
+            snprintf(path, sizeof(path), "%s/data/f%u", b->root, index);
+            const double start = bench_now();
+            long long n = bench_client_download(c, "RETR", path);
+            if (n >= 0 && n != b->files[index]) {
+                n = -1;
+            }
+            op_record(w, BenchOp_RETR, n, start);
+        }
+
+        if (b->ops[BenchOp_STOR]) {
+            snprintf(path, sizeof(path), "%s/upload/c%u_%u", b->root, w->id, i);
+            const double start = bench_now();
+            const long long n = bench_client_upload(c, "STOR", path, b->files[index]);
+            op_record(w, BenchOp_STOR, n, start);
+        }
+
+        if (b->ops[BenchOp_LIST]) {
+            snprintf(path, sizeof(path), "%s/data", b->root);
+            const double start = bench_now();
+            const long long n = bench_client_download(c, "LIST", path);
+            op_record(w, BenchOp_LIST, n, start);
+        }
+    }
+
+    return NULL;
+}
+
+static void print_latency(const char* name, const struct BenchSamples* s, double scale, const char* unit, bool last) {
+    printf("    \"%s\": { \"count\": %zu, \"p50_%s\": %.3f, \"p99_%s\": %.3f, \"max_%s\": %.3f }%s\n",
+        name, s->count,
+        unit, bench_samples_percentile(s, 50) * scale,
+        unit, bench_samples_percentile(s, 99) * scale,
+        unit, bench_samples_percentile(s, 100) * scale,
+        last ? "" : ",");
+}
+
+static int bench_server_start(struct Bench* b) {
+    struct FtpSrvConfig cfg = {
+        .user = BENCH_USER,
+        .pass = BENCH_PASS,
+        .port = b->port,
+    };
+
+    if (ftpsrv_init(&cfg) < 0) {
+        fprintf(stderr, "ftpsrv_init failed on port %u: %s\n", b->port, strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&b->server_thread, NULL, server_thread, b)) {
+        ftpsrv_exit();
+        return -1;
+    }
+
+    return 0;
+}
+
+static void bench_server_stop(struct Bench* b) {
+    __atomic_store_n(&b->server_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(b->server_thread, NULL);
+    ftpsrv_exit();
+}
+
+static double bench_server_probe(struct Bench* b) {
+    __atomic_store_n(&b->probe_request, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&b->probe_request, __ATOMIC_ACQUIRE)) {
+        usleep(100);
+    }
+    return b->probe_loop_us;
+}
+
+static int bench_run(struct Bench* b) {
+    int rc = -1;
+    unsigned connected = 0;
+
+    if (bench_server_start(b)) {
+        return -1;
+    }
+
+    b->workers = calloc(b->clients, sizeof(*b->workers));
+    if (!b->workers || pthread_barrier_init(&b->barrier, NULL, b->clients + 1)) {
+        goto stop_server;
+    }
+
+    // connect serially, the listen backlog is small and connection setup
+    // isn't what's being measured here.
+    for (; connected < b->clients; connected++) {
+        struct BenchWorker* w = &b->workers[connected];
+        w->id = connected;
+        w->bench = b;
+        w->client.latency = &w->latency;
+        if (bench_client_connect(&w->client, "127.0.0.1", b->port) || bench_client_login(&w->client, BENCH_USER, BENCH_PASS)) {
+            fprintf(stderr, "client %u failed to connect\n", connected);
+            bench_client_close(&w->client);
+            goto stop_clients;
+        }
+        bench_samples_free(&w->latency);
+    }
+
+    for (unsigned i = 0; i < b->clients; i++) {
+        if (pthread_create(&b->workers[i].thread, NULL, worker_thread, &b->workers[i])) {
+            fprintf(stderr, "failed to start client thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clockid_t server_clock;
+    if (pthread_getcpuclockid(b->server_thread, &server_clock)) {
+        server_clock = CLOCK_PROCESS_CPUTIME_ID;
+    }
+
+    pthread_barrier_wait(&b->barrier);
+    const double wall_start = bench_now();
+    const double server_cpu_start = cpu_seconds(server_clock);
+    const double process_cpu_start = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+
+    for (unsigned i = 0; i < b->clients; i++) {
+        pthread_join(b->workers[i].thread, NULL);
+    }
+
+    const double wall = bench_now() - wall_start;
+    const double server_cpu = cpu_seconds(server_clock) - server_cpu_start;
+    const double process_cpu = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - process_cpu_start;
+
+    // merge the per client stats.
+    struct BenchSamples latency = {0};
+    struct BenchOpStats ops[BenchOp_COUNT] = {0};
+    unsigned long long bytes = 0, errors = 0;
+    for (unsigned i = 0; i < b->clients; i++) {
+        const struct BenchWorker* w = &b->workers[i];
+        bench_samples_merge(&latency, &w->latency);
+        for (int j = 0; j < BenchOp_COUNT; j++) {
+            ops[j].count += w->ops[j].count;
+            ops[j].bytes += w->ops[j].bytes;
+            ops[j].errors += w->ops[j].errors;
+            bench_samples_merge(&ops[j].durations, &w->ops[j].durations);
+        }
+    }
+    for (int j = 0; j < BenchOp_COUNT; j++) {
+        bytes += ops[j].bytes;
+        errors += ops[j].errors;
+    }
+
+    const double gib = (double)bytes / (1024.0 * 1024.0 * 1024.0);
+    const double mib = (double)bytes / (1024.0 * 1024.0);
+
+    printf("{\n");
+    printf("  \"config\": { \"clients\": %u, \"iterations\": %u, \"sizes\": \"%s\", \"files\": %u, \"file_buffer_size\": %lld, \"max_sessions\": %u },\n",
+        b->clients, b->iterations, b->sizes_str, b->file_count, (long long)(FTPBENCH_FILE_BUFFER_SIZE), (unsigned)(FTPBENCH_MAX_SESSIONS));
+    printf("  \"wall_s\": %.6f,\n", wall);
+    printf("  \"bytes\": %llu,\n", bytes);
+    printf("  \"errors\": %llu,\n", errors);
+    printf("  \"throughput_mib_s\": %.3f,\n", wall > 0 ? mib / wall : 0);
+    printf("  \"server_cpu_s\": %.6f,\n", server_cpu);
+    printf("  \"process_cpu_s\": %.6f,\n", process_cpu);
+    printf("  \"server_cpu_s_per_gib\": %.6f,\n", gib > 0 ? server_cpu / gib : 0);
+    printf("  \"process_cpu_s_per_gib\": %.6f,\n", gib > 0 ? process_cpu / gib : 0);
+    printf("  \"command_latency\": {\n");
+    print_latency("all", &latency, 1e6, "us", true);
+    printf("  },\n");
+    printf("  \"ops\": {\n");
+    int last = -1;
+    for (int j = 0; j < BenchOp_COUNT; j++) {
+        if (b->ops[j]) {
+            last = j;
+        }
+    }
+    for (int j = 0; j < BenchOp_COUNT; j++) {
+        if (!b->ops[j]) {
+            continue;
+        }
+        double busy = 0;
+        for (size_t k = 0; k < ops[j].durations.count; k++) {
+            busy += ops[j].durations.v[k];
+        }
+        printf("    \"%s\": { \"count\": %llu, \"errors\": %llu, \"bytes\": %llu, \"stream_mib_s\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f }%s\n",
+            BENCH_OP_NAMES[j], ops[j].count, ops[j].errors, ops[j].bytes,
+            busy > 0 ? (double)ops[j].bytes / (1024.0 * 1024.0) / busy : 0,
+            bench_samples_percentile(&ops[j].durations, 50) * 1e3,
+            bench_samples_percentile(&ops[j].durations, 99) * 1e3,
+            j == last ? "" : ",");
+        bench_samples_free(&ops[j].durations);
+    }
+    printf("  }\n");
+    printf("}\n");
+    bench_samples_free(&latency);
+
+    rc = errors ? -1 : 0;
+
+stop_clients:
+    for (unsigned i = 0; i < connected; i++) {
+        struct BenchWorker* w = &b->workers[i];
+        bench_client_cmd(&w->client, "QUIT");
+        bench_client_close(&w->client);
+        bench_samples_free(&w->latency);
+        for (int j = 0; j < BenchOp_COUNT; j++) {
+            bench_samples_free(&w->ops[j].durations);
+        }
+    }
+    if (b->workers) {
+        pthread_barrier_destroy(&b->barrier);
+    }
+
+stop_server:
+    bench_server_stop(b);
+    free(b->workers);
+    return rc;
+}
+
+static void print_idle_point(unsigned sessions, long rss_base, long rss, double loop_us, const struct BenchSamples* noop, bool first) {
+    printf("%s    { \"sessions\": %u, \"rss_kib\": %ld, \"rss_per_session_kib\": %.3f, \"loop_us\": %.3f, \"noop_p50_us\": %.3f, \"noop_p99_us\": %.3f }",
+        first ? "" : ",\n",
+        sessions, rss,
+        sessions ? (double)(rss - rss_base) / sessions : 0,
+        loop_us,
+        bench_samples_percentile(noop, 50) * 1e6,
+        bench_samples_percentile(noop, 99) * 1e6);
+}
+
+// opens connections that log in and then sit idle, measuring memory and
+// loop cost every step connections.
+static int bench_idle(struct Bench* b) {
+    int rc = 0;
+    unsigned connected = 0;
+
+    // each connection is two fds in this process.
+    struct rlimit lim;
+    if (!getrlimit(RLIMIT_NOFILE, &lim) && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    struct BenchClient* clients = calloc(b->connections, sizeof(*clients));
+    if (!clients) {
+        return -1;
+    }
+    // fault in the client side up front so that it's part of the baseline.
+    memset(clients, 0xFF, b->connections * sizeof(*clients));
+    for (unsigned i = 0; i < b->connections; i++) {
+        clients[i].latency = NULL;
+        clients[i].ctrl = -1;
+    }
+
+    // ftpsrv_init() clears the whole of the static state, so every slot is
+    // resident from here on, regardless of how many are in use.
+    const long rss_pre_init = bench_rss_kib();
+    if (bench_server_start(b)) {
+        free(clients);
+        return -1;
+    }
+
+    // probe once before taking the baseline, this faults in the poll
+    // arrays which are a fixed cost.
+    struct BenchSamples noop = {0};
+    bench_server_probe(b);
+    const long rss_base = bench_rss_kib();
+
+    printf("{\n");
+    printf("  \"config\": { \"connections\": %u, \"step\": %u, \"samples\": %u, \"max_sessions\": %u, \"file_buffer_size\": %lld },\n",
+        b->connections, b->step, b->samples, (unsigned)(FTPBENCH_MAX_SESSIONS), (long long)(FTPBENCH_FILE_BUFFER_SIZE));
+    printf("  \"rss_pre_init_kib\": %ld,\n", rss_pre_init);
+    printf("  \"rss_base_kib\": %ld,\n", rss_base);
+    printf("  \"rss_per_slot_kib\": %.3f,\n", FTPBENCH_MAX_SESSIONS ? (double)(rss_base - rss_pre_init) / (FTPBENCH_MAX_SESSIONS) : 0);
+    printf("  \"points\": [\n");
+    print_idle_point(0, rss_base, rss_base, bench_server_probe(b), &noop, true);
+
+    while (connected < b->connections) {
+        struct BenchClient* c = &clients[connected];
+        if (bench_client_connect(c, "127.0.0.1", b->port) || bench_client_login(c, BENCH_USER, BENCH_PASS)) {
+            fprintf(stderr, "connection %u failed: %s\n", connected, strerror(errno));
+            bench_client_close(c);
+            rc = -1;
+            break;
+        }
+        connected++;
+
+        if (connected % b->step && connected != b->connections) {
+            continue;
+        }
+
+        const long rss = bench_rss_kib();
+        const double loop_us = bench_server_probe(b);
+
+        // spread the round trips over all of the open sessions.
+        noop.count = 0;
+        for (unsigned i = 0; i < b->samples; i++) {
+            struct BenchClient* sc = &clients[(unsigned long long)i * connected / b->samples];
+            const double start = bench_now();
+            if (bench_client_cmd(sc, "NOOP") != 200) {
+                rc = -1;
+                break;
+            }
+            bench_samples_push(&noop, bench_now() - start);
+        }
+
+        print_idle_point(connected, rss_base, rss, loop_us, &noop, false);
+        fflush(stdout);
+    }
+
+    printf("\n  ]\n");
+    printf("}\n");
+
+    bench_samples_free(&noop);
+    for (unsigned i = 0; i < connected; i++) {
+        bench_client_close(&clients[i]);
+    }
+    bench_server_stop(b);
+    free(clients);
+    return rc;
+}
+
+int main(int argc, char** argv) {
+    static struct Bench b = {
+        .port = 32121,
+        .clients = 4,
+        .iterations = 8,
+        .ops = { true, true, true },
+        .connections = 1024,
+        .step = 128,
+        .samples = 64,
+    };
+    const char* dir = NULL;
+    bool idle = false;
+    parse_sizes(&b, "4K:64,1M:8");
+
+    int arg_index = 1;
+    struct ArgsData arg_data;
+    enum ArgsResult arg_result;
+    while (!(arg_result = args_parse(&arg_index, argc, argv, ARGS_META, sizeof(ARGS_META) / sizeof(ARGS_META[0]), &arg_data))) {
+        switch (ARGS_META[arg_data.meta_index].id) {
+            case ArgsId_help:
+                return print_usage(EXIT_SUCCESS);
+            case ArgsId_mode:
+                if (!strcmp(arg_data.value.s, "idle")) {
+                    idle = true;
+                } else if (!strcmp(arg_data.value.s, "throughput")) {
+                    idle = false;
+                } else {
+                    fprintf(stderr, "bad mode [%s]\n", arg_data.value.s);
+                    return print_usage(EXIT_FAILURE);
+                }
+                break;
+            case ArgsId_port:
+                b.port = arg_data.value.i;
+                break;
+            case ArgsId_clients:
+                b.clients = arg_data.value.i;
+                break;
+            case ArgsId_iterations:
+                b.iterations = arg_data.value.i;
+                break;
+            case ArgsId_sizes:
+                if (parse_sizes(&b, arg_data.value.s)) {
+                    fprintf(stderr, "bad sizes [%s]\n", arg_data.value.s);
+                    return print_usage(EXIT_FAILURE);
+                }
+                break;
+            case ArgsId_ops:
+                if (parse_ops(&b, arg_data.value.s)) {
+                    fprintf(stderr, "bad ops [%s]\n", arg_data.value.s);
+                    return print_usage(EXIT_FAILURE);
+                }
+                break;
+            case ArgsId_dir:
+                dir = arg_data.value.s;
+                break;
+            case ArgsId_keep:
+                b.keep = arg_data.value.b;
+                break;
+            case ArgsId_connections:
+                b.connections = arg_data.value.i;
+                break;
+            case ArgsId_step:
+                b.step = arg_data.value.i;
+                break;
+            case ArgsId_samples:
+                b.samples = arg_data.value.i;
+                break;
+        }
+    }
+
+    // handle error.
+    if (arg_result < 0) {
+        if (arg_result == ArgsResult_UNKNOWN_KEY) {
+            fprintf(stderr, "unknown arg [%s]\n", argv[arg_index]);
+        }
+        else if (arg_result == ArgsResult_BAD_VALUE) {
+            fprintf(stderr, "arg [--%s] had bad value type [%s]\n", ARGS_META[arg_data.meta_index].key, arg_data.value.s);
+        }
+        else if (arg_result == ArgsResult_MISSING_VALUE) {
+            fprintf(stderr, "arg [--%s] requires a value\n", ARGS_META[arg_data.meta_index].key);
+        }
+        else {
+            fprintf(stderr, "bad args: %d\n", arg_result);
+        }
+        return print_usage(EXIT_FAILURE);
+    }
+
+    if (!b.port || !b.clients || !b.iterations) {
+        fprintf(stderr, "port, clients and iterations must be non-zero\n");
+        return EXIT_FAILURE;
+    }
+
+    if (idle) {
+        if (!b.connections || !b.step || !b.samples) {
+            fprintf(stderr, "connections, step and samples must be non-zero\n");
+            return EXIT_FAILURE;
+        }
+
+        if (FTPBENCH_MAX_SESSIONS && b.connections > FTPBENCH_MAX_SESSIONS) {
+            fprintf(stderr, "connections (%u) exceeds FTP_MAX_SESSIONS (%u)\n", b.connections, (unsigned)(FTPBENCH_MAX_SESSIONS));
+            return EXIT_FAILURE;
+        }
+
+        return bench_idle(&b) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (FTPBENCH_MAX_SESSIONS && b.clients > FTPBENCH_MAX_SESSIONS) {
+        fprintf(stderr, "clients (%u) exceeds FTP_MAX_SESSIONS (%u)\n", b.clients, (unsigned)(FTPBENCH_MAX_SESSIONS));
+        return EXIT_FAILURE;
+    }
+
+    if (dir) {
+        snprintf(b.root, sizeof(b.root), "%s", dir);
+        if (mkdir(b.root, 0755) && errno != EEXIST) {
+            fprintf(stderr, "failed to create %s: %s\n", b.root, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    } else {
+        snprintf(b.root, sizeof(b.root), "/tmp/ftpbench.XXXXXX");
+        if (!mkdtemp(b.root)) {
+            fprintf(stderr, "mkdtemp failed: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    int rc = dataset_create(&b);
+    if (rc) {
+        fprintf(stderr, "failed to create dataset in %s: %s\n", b.root, strerror(errno));
+    } else {
+        rc = bench_run(&b);
+    }
+
+    if (!b.keep) {
+        char path[4096 + 64];
+        snprintf(path, sizeof(path), "%s/data", b.root);
+        remove_dir(path);
+        snprintf(path, sizeof(path), "%s/upload", b.root);
+        remove_dir(path);
+        if (!dir) {
+            rmdir(b.root);
+        }
+    }
+
+    free(b.files);
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,375 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+// microbenchmarks for the listing and path helpers in ftpsrv.c. those are
+// static, so ftpsrv.c is built as part of this file rather than linked,
+// which keeps them inlined exactly as they are in the server.
+// the vfs counts every call made into it and the data connection is an
+// in-memory loopback socket, results are printed as json on stdout.
+#include "ftpsrv.c"
+#include "args/args.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// number of synthetic stats cycled through by the list entry benchmark.
+#define BENCH_STAT_COUNT 1024
+
+struct BenchResult {
+    uint64_t entries;
+    uint64_t bytes;
+    double ns;
+    struct VfsBenchStats vfs;
+    uint64_t sends;
+};
+
+struct Bench {
+    unsigned iterations;
+    const char* entries;
+    const char* path;
+    bool first;
+};
+
+enum ArgsId {
+    ArgsId_help,
+    ArgsId_iterations,
+    ArgsId_entries,
+    ArgsId_path,
+};
+
+#define ARGS_ENTRY(_key, _type, _single) \
+    { .key = #_key, .id = ArgsId_##_key, .type = _type, .single = _single },
+
+static const struct ArgsMeta ARGS_META[] = {
+    ARGS_ENTRY(help, ArgsValueType_NONE, 'h')
+    ARGS_ENTRY(iterations, ArgsValueType_INT, 'i')
+    ARGS_ENTRY(entries, ArgsValueType_STR, 'e')
+    ARGS_ENTRY(path, ArgsValueType_STR, 'p')
+};
+
+static int print_usage(int code) {
+    printf("\
+[ftpbench_list " FTPSRV_VERSION_STR "] \n\n\
+Usage\n\n\
+    -h, --help        = Display help.\n\
+    -i, --iterations  = Calls made to each path / entry helper (default 1000000).\n\
+    -e, --entries     = Sizes of the synthetic dirs listed (default 1000,10000,100000,1000000).\n\
+    -p, --path        = List this real dir instead of the synthetic ones.\n\
+    \n");
+
+    return code;
+}
+
+static uint64_t ns_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// stops the compiler from throwing away results.
+static volatile size_t g_sink;
+
+static void report_begin(struct Bench* b, const char* name) {
+    printf("%s\n    \"%s\": ", b->first ? "" : ",", name);
+    b->first = false;
+}
+
+static void bench_remove_slashes(struct Bench* b) {
+    static const struct {
+        const char* name;
+        const char* path;
+    } cases[] = {
+        { "clean", "/home/user/downloads/file.bin" },
+        { "dirty", "//home///user\\downloads//file.bin/" },
+        { "deep", "/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/u/v/w/x/y/z/0/1/2/3/4/5/6/7/8/9" },
+    };
+
+    report_begin(b, "remove_slashes");
+    printf("{");
+    for (size_t c = 0; c < FTP_ARR_SZ(cases); c++) {
+        static struct Pathname path;
+        const size_t len = strlen(cases[c].path) + 1;
+
+        // the copy is needed to reset the input, it is timed separately.
+        uint64_t start = ns_now();
+        for (unsigned i = 0; i < b->iterations; i++) {
+            memcpy(path.s, cases[c].path, len);
+            g_sink += path.s[i % len];
+        }
+        const uint64_t copy_ns = ns_now() - start;
+
+        start = ns_now();
+        for (unsigned i = 0; i < b->iterations; i++) {
+            memcpy(path.s, cases[c].path, len);
+            remove_slashes(&path);
+            g_sink += path.s[i % len];
+        }
+        const uint64_t ns = ns_now() - start;
+        const double per = ((double)ns - (double)copy_ns) / b->iterations;
+
+        printf("%s \"%s\": { \"ns_per_op\": %.1f }", c ? "," : "", cases[c].name, per < 0 ? 0 : per);
+    }
+    printf(" }");
+}
+
+static void bench_build_fullpath(struct Bench* b) {
+    static const struct {
+        const char* name;
+        const char* pwd;
+        const char* path;
+    } cases[] = {
+        { "absolute", "/home/user", "/srv/ftp/file.bin" },
+        { "relative", "/home/user", "downloads/file.bin" },
+        { "relative_root", "/", "file.bin" },
+        { "parent", "/home/user/downloads", ".." },
+    };
+
+    struct FtpSession* session = &g_ftp.sessions[0];
+    report_begin(b, "build_fullpath");
+    printf("{");
+    for (size_t c = 0; c < FTP_ARR_SZ(cases); c++) {
+        static struct Pathname in, out;
+        strcpy(session->pwd.s, cases[c].pwd);
+        strcpy(in.s, cases[c].path);
+
+        const uint64_t start = ns_now();
+        for (unsigned i = 0; i < b->iterations; i++) {
+            g_sink += build_fullpath(session, &out, in);
+            g_sink += out.s[1];
+        }
+        const uint64_t ns = ns_now() - start;
+
+        printf("%s \"%s\": { \"ns_per_op\": %.1f }", c ? "," : "", cases[c].name, (double)ns / b->iterations);
+    }
+    printf(" }");
+}
+
+static void bench_list_entry(struct Bench* b) {
+    static struct stat stats[BENCH_STAT_COUNT];
+    static const enum FTP_TRANSFER_MODE modes[] = { FTP_TRANSFER_MODE_LIST, FTP_TRANSFER_MODE_NLST };
+    static const char* mode_names[] = { "list", "nlst" };
+
+    vfs_bench_set_synthetic(1);
+    for (unsigned i = 0; i < BENCH_STAT_COUNT; i++) {
+        vfs_bench_synthetic_stat(i, &stats[i]);
+    }
+    vfs_bench_set_synthetic(0);
+
+    struct FtpSession* session = &g_ftp.sessions[0];
+    session->last_update_time = time(NULL);
+    static const struct Pathname fullpath = { "/srv/ftp/file_0000000" };
+
+    report_begin(b, "ftp_build_list_entry");
+    printf("{");
+    for (size_t m = 0; m < FTP_ARR_SZ(modes); m++) {
+        session->transfer.mode = modes[m];
+        vfs_bench_reset_stats();
+
+        uint64_t bytes = 0;
+        const uint64_t start = ns_now();
+        for (unsigned i = 0; i < b->iterations; i++) {
+            ftp_build_list_entry(session, &fullpath, "file_0000000", &stats[i & (BENCH_STAT_COUNT - 1)]);
+            bytes += session->transfer.size;
+        }
+        const uint64_t ns = ns_now() - start;
+
+        const struct VfsBenchStats* vfs = vfs_bench_stats();
+        const double n = b->iterations;
+        printf("%s \"%s\": { \"ns_per_entry\": %.1f, \"bytes_per_entry\": %.1f, \"getpwuid_per_entry\": %.2f, \"getgrgid_per_entry\": %.2f, \"readlink_per_entry\": %.3f }",
+            m ? "," : "", mode_names[m], (double)ns / n, (double)bytes / n,
+            vfs->getpwuid / n, vfs->getgrgid / n, vfs->readlink / n);
+    }
+    printf(" }");
+    session->transfer.mode = FTP_TRANSFER_MODE_NONE;
+}
+
+// runs the same loop as a LIST / NLST on the data connection, the client end
+// is drained whenever the server would block, outside of the timed part.
+static int bench_dir_transfer(const char* path, enum FTP_TRANSFER_MODE mode, struct BenchResult* r) {
+    struct FtpSession* session = &g_ftp.sessions[0];
+    struct FtpTransfer* transfer = &session->transfer;
+    static char drain_buf[1024 * 64];
+
+    memset(r, 0, sizeof(*r));
+    loopback_reset();
+    const int listener = loopback_listen(0);
+    struct sockaddr_in addr = {0};
+    size_t addrlen = sizeof(addr);
+    struct FtpSocket listen_sock = { .s = listener };
+    ftp_socket_getsockname(&listen_sock, (struct sockaddr*)&addr, &addrlen);
+    const int client = loopback_connect(&addr);
+    session->data_sock.s = loopback_accept(listener);
+    if (listener <= 0 || client <= 0 || session->data_sock.s <= 0) {
+        fprintf(stderr, "failed to create the data connection\n");
+        return -1;
+    }
+
+    memset(transfer, 0, offsetof(struct FtpTransfer, list_buf));
+    transfer->mode = mode;
+    session->last_update_time = time(NULL);
+    snprintf(session->temp_path.s, sizeof(session->temp_path), "%s", path);
+
+    vfs_bench_reset_stats();
+    const uint64_t sends = loopback_stats()->sends;
+    uint64_t drain_ns = 0;
+    int rc = 0;
+
+    const uint64_t start = ns_now();
+    if (ftp_vfs_opendir(&transfer->dir_vfs, path)) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return -1;
+    }
+
+    for (;;) {
+        const enum FTP_FILE_TRANSFER_STATE state = ftp_dir_data_transfer_progress(session, transfer);
+        if (state == FTP_FILE_TRANSFER_STATE_FINISHED) {
+            break;
+        } else if (state == FTP_FILE_TRANSFER_STATE_ERROR) {
+            rc = -1;
+            break;
+        } else if (state == FTP_FILE_TRANSFER_STATE_BLOCKING) {
+            const uint64_t drain_start = ns_now();
+            int n;
+            while ((n = loopback_recv(client, drain_buf, sizeof(drain_buf))) > 0) {
+                r->bytes += n;
+            }
+            drain_ns += ns_now() - drain_start;
+        }
+    }
+    ftp_vfs_closedir(&transfer->dir_vfs);
+    const uint64_t ns = ns_now() - start;
+
+    int n;
+    while ((n = loopback_recv(client, drain_buf, sizeof(drain_buf))) > 0) {
+        r->bytes += n;
+    }
+
+    r->ns = (double)(ns - drain_ns);
+    r->vfs = *vfs_bench_stats();
+    r->entries = r->vfs.dirlstat;
+    r->sends = loopback_stats()->sends - sends;
+
+    loopback_close(client);
+    loopback_close(listener);
+    ftp_socket_close(&session->data_sock);
+    transfer->mode = FTP_TRANSFER_MODE_NONE;
+    return rc;
+}
+
+static void report_dir_transfer(const char* mode, const struct BenchResult* r, bool last) {
+    const double n = r->entries ? (double)r->entries : 1;
+    // everything but readdir is one syscall per call on the unistd vfs,
+    // readdir is batched by libc so it is reported on its own.
+    const double syscalls = (double)(r->vfs.dirlstat + r->vfs.readlink + r->sends) / n;
+    printf("\"%s\": { \"ns_per_entry\": %.1f, \"bytes_per_entry\": %.1f, \"syscalls_per_entry\": %.3f, \"readdir_per_entry\": %.3f, \"lstat_per_entry\": %.3f, \"readlink_per_entry\": %.3f, \"getpwuid_per_entry\": %.3f, \"getgrgid_per_entry\": %.3f, \"sends_per_entry\": %.3f }%s",
+        mode, r->ns / n, (double)r->bytes / n, syscalls,
+        r->vfs.readdir / n, r->vfs.dirlstat / n, r->vfs.readlink / n,
+        r->vfs.getpwuid / n, r->vfs.getgrgid / n, (double)r->sends / n,
+        last ? "" : ", ");
+}
+
+static int bench_dir(struct Bench* b, const char* name, const char* path) {
+    struct BenchResult list, nlst;
+    if (bench_dir_transfer(path, FTP_TRANSFER_MODE_LIST, &list) || bench_dir_transfer(path, FTP_TRANSFER_MODE_NLST, &nlst)) {
+        return -1;
+    }
+
+    printf(",\n        \"%s\": { \"entries\": %llu, ", name, (unsigned long long)list.entries);
+    report_dir_transfer("list", &list, false);
+    report_dir_transfer("nlst", &nlst, true);
+    printf(" }");
+    return 0;
+}
+
+static int bench_dirs(struct Bench* b) {
+    report_begin(b, "dir_transfer");
+    printf("{ \"source\": \"%s\"", b->path ? "real" : "synthetic");
+
+    int rc = 0;
+    if (b->path) {
+        vfs_bench_set_synthetic(0);
+        rc = bench_dir(b, b->path, b->path);
+    } else {
+        const char* s = b->entries;
+        while (*s && !rc) {
+            char* end;
+            const unsigned long entries = strtoul(s, &end, 10);
+            if (end == s || !entries) {
+                fprintf(stderr, "bad entries [%s]\n", b->entries);
+                return -1;
+            }
+
+            char name[32];
+            snprintf(name, sizeof(name), "%lu", entries);
+            vfs_bench_set_synthetic(entries);
+            rc = bench_dir(b, name, "/srv/ftp");
+            s = *end == ',' ? end + 1 : end;
+        }
+        vfs_bench_set_synthetic(0);
+    }
+
+    printf(" }");
+    return rc;
+}
+
+int main(int argc, char** argv) {
+    static struct Bench b = {
+        .iterations = 1000000,
+        .entries = "1000,10000,100000,1000000",
+        .first = true,
+    };
+
+    int arg_index = 1;
+    struct ArgsData arg_data;
+    enum ArgsResult arg_result;
+    while (!(arg_result = args_parse(&arg_index, argc, argv, ARGS_META, sizeof(ARGS_META) / sizeof(ARGS_META[0]), &arg_data))) {
+        switch (ARGS_META[arg_data.meta_index].id) {
+            case ArgsId_help:
+                return print_usage(EXIT_SUCCESS);
+            case ArgsId_iterations:
+                b.iterations = arg_data.value.i;
+                break;
+            case ArgsId_entries:
+                b.entries = arg_data.value.s;
+                break;
+            case ArgsId_path:
+                b.path = arg_data.value.s;
+                break;
+        }
+    }
+
+    // handle error.
+    if (arg_result < 0) {
+        if (arg_result == ArgsResult_UNKNOWN_KEY) {
+            fprintf(stderr, "unknown arg [%s]\n", argv[arg_index]);
+        }
+        else if (arg_result == ArgsResult_BAD_VALUE) {
+            fprintf(stderr, "arg [--%s] had bad value type [%s]\n", ARGS_META[arg_data.meta_index].key, arg_data.value.s);
+        }
+        else if (arg_result == ArgsResult_MISSING_VALUE) {
+            fprintf(stderr, "arg [--%s] requires a value\n", ARGS_META[arg_data.meta_index].key);
+        }
+        else {
+            fprintf(stderr, "bad args: %d\n", arg_result);
+        }
+        return print_usage(EXIT_FAILURE);
+    }
+
+    if (!b.iterations) {
+        b.iterations = 1;
+    }
+
+    printf("{");
+    bench_remove_slashes(&b);
+    bench_build_fullpath(&b);
+    bench_list_entry(&b);
+    const int rc = bench_dirs(&b);
+    printf("\n}\n");
+
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
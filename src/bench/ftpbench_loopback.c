@@ -0,0 +1,708 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+// drives the server over the in-memory loopback sockets from a single
+// thread, so the cpu time measured is that of ftpsrv.c and the vfs, without
+// the kernel tcp stack. results are printed as json on stdout.
+#include "ftpsrv.h"
+#include "ftpsrv_socket.h"
+#include "args/args.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define BENCH_PORT 21
+#define BENCH_USER "bench"
+#define BENCH_PASS "bench"
+// number of loops with nothing to do before the driver gives up.
+#define BENCH_MAX_IDLE_LOOPS 1000
+
+enum BenchOp {
+    BenchOp_NOOP,
+    BenchOp_RETR,
+    BenchOp_STOR,
+    BenchOp_LIST,
+    BenchOp_REST,
+    BenchOp_COUNT,
+};
+
+static const char* BENCH_OP_NAMES[BenchOp_COUNT] = {
+    [BenchOp_NOOP] = "noop",
+    [BenchOp_RETR] = "retr",
+    [BenchOp_STOR] = "stor",
+    [BenchOp_LIST] = "list",
+    [BenchOp_REST] = "rest",
+};
+
+struct LoopClient {
+    int ctrl;
+    char buf[4096];
+    size_t buf_len;
+    char reply[1024];
+};
+
+struct BenchOpStats {
+    unsigned long long count;
+    unsigned long long errors;
+    unsigned long long bytes;
+    double cpu_s;
+    uint64_t sim_us;
+    uint64_t polls;
+};
+
+struct Bench {
+    unsigned iterations;
+    long long size;
+    unsigned files;
+    uint64_t bandwidth;
+    uint64_t latency_us;
+    bool read_share;
+    bool ops[BenchOp_COUNT];
+    char root[4096];
+    struct BenchOpStats stats[BenchOp_COUNT];
+};
+
+enum ArgsId {
+    ArgsId_help,
+    ArgsId_iterations,
+    ArgsId_size,
+    ArgsId_files,
+    ArgsId_bandwidth,
+    ArgsId_latency,
+    ArgsId_readshare,
+    ArgsId_ops,
+};
+
+#define ARGS_ENTRY(_key, _type, _single) \
+    { .key = #_key, .id = ArgsId_##_key, .type = _type, .single = _single },
+
+static const struct ArgsMeta ARGS_META[] = {
+    ARGS_ENTRY(help, ArgsValueType_NONE, 'h')
+    ARGS_ENTRY(iterations, ArgsValueType_INT, 'i')
+    ARGS_ENTRY(size, ArgsValueType_INT, 's')
+    ARGS_ENTRY(files, ArgsValueType_INT, 'f')
+    ARGS_ENTRY(bandwidth, ArgsValueType_INT, 'b')
+    ARGS_ENTRY(latency, ArgsValueType_INT, 'l')
+    ARGS_ENTRY(readshare, ArgsValueType_NONE, 'r')
+    ARGS_ENTRY(ops, ArgsValueType_STR, 'o')
+};
+
+static int print_usage(int code) {
+    printf("\
+[ftpbench_loopback " FTPSRV_VERSION_STR "] \n\n\
+Usage\n\n\
+    -h, --help        = Display help.\n\
+    -i, --iterations  = Iterations of each op (default 1000).\n\
+    -s, --size        = Size in bytes of the file used by retr / stor (default 1048576).\n\
+    -f, --files       = Number of entries in the dir used by list (default 1000).\n\
+    -b, --bandwidth   = Link bandwidth in bytes per second, 0 is unlimited (default 0).\n\
+    -l, --latency     = One way link latency in us (default 0).\n\
+    -r, --readshare   = Share the blocks read between sessions reading the same file.\n\
+    -o, --ops         = Operations to run, any of noop,retr,stor,list,rest (default all).\n\
+                        rest reads the file from two sessions at once, then checks\n\
+                        that a download resumed part way returns the right data.\n\
+    \n");
+
+    return code;
+}
+
+static double cpu_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// runs the server once, the clock jumps forward if nothing is ready.
+static int bench_step(unsigned* idle) {
+    const uint64_t bytes = loopback_stats()->bytes;
+    const uint64_t now = loopback_now_us();
+
+    if (ftpsrv_loop(-1) != FTP_API_LOOP_ERROR_OK) {
+        return -1;
+    }
+
+    // nothing was sent and the clock didn't move, the client is waiting on
+    // something that will never happen.
+    if (loopback_now_us() == now && loopback_stats()->bytes == bytes) {
+        if (++*idle >= BENCH_MAX_IDLE_LOOPS) {
+            return -1;
+        }
+    } else {
+        *idle = 0;
+    }
+
+    return 0;
+}
+
+static int parse_code(const char* line) {
+    if (line[0] < '1' || line[0] > '5' || line[1] < '0' || line[1] > '9' || line[2] < '0' || line[2] > '9') {
+        return -1;
+    }
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+// pops a line from the buffer, returns 0 if there isn't a full one yet.
+static int client_pop_line(struct LoopClient* c, char* out, size_t out_size) {
+    char* nl = memchr(c->buf, '\n', c->buf_len);
+    if (!nl) {
+        return 0;
+    }
+
+    size_t len = nl - c->buf;
+    const size_t consumed = len + 1;
+    if (len && c->buf[len - 1] == '\r') {
+        len--;
+    }
+    if (len >= out_size) {
+        len = out_size - 1;
+    }
+    memcpy(out, c->buf, len);
+    out[len] = '\0';
+    memmove(c->buf, c->buf + consumed, c->buf_len - consumed);
+    c->buf_len -= consumed;
+    return 1;
+}
+
+static int client_read_line(struct LoopClient* c, char* out, size_t out_size) {
+    unsigned idle = 0;
+    while (!client_pop_line(c, out, out_size)) {
+        if (c->buf_len == sizeof(c->buf)) {
+            c->buf_len = 0;
+        }
+
+        const int n = loopback_recv(c->ctrl, c->buf + c->buf_len, sizeof(c->buf) - c->buf_len);
+        if (n > 0) {
+            c->buf_len += n;
+        } else if (n == 0 || errno != EAGAIN || bench_step(&idle)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int client_reply(struct LoopClient* c) {
+    if (client_read_line(c, c->reply, sizeof(c->reply))) {
+        return -1;
+    }
+
+    const int code = parse_code(c->reply);
+    if (code > 0 && c->reply[3] == '-') {
+        char line[1024];
+        do {
+            if (client_read_line(c, line, sizeof(line))) {
+                return -1;
+            }
+        } while (parse_code(line) != code || line[3] != ' ');
+    }
+
+    return code;
+}
+
+static int client_send_all(int h, const void* buf, size_t size) {
+    unsigned idle = 0;
+    const char* p = buf;
+    while (size) {
+        const int n = loopback_send(h, p, size);
+        if (n > 0) {
+            p += n;
+            size -= n;
+        } else if (errno != EAGAIN || bench_step(&idle)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int client_cmd(struct LoopClient* c, const char* fmt, ...) {
+    char line[1024];
+    va_list va;
+    va_start(va, fmt);
+    int len = vsnprintf(line, sizeof(line) - 2, fmt, va);
+    va_end(va);
+    if (len < 0 || len >= (int)sizeof(line) - 2) {
+        return -1;
+    }
+    line[len++] = '\r';
+    line[len++] = '\n';
+
+    if (client_send_all(c->ctrl, line, len)) {
+        return -1;
+    }
+    return client_reply(c);
+}
+
+static int client_pasv(struct LoopClient* c) {
+    if (client_cmd(c, "PASV") != 227) {
+        return -1;
+    }
+
+    const char* p = strchr(c->reply, '(');
+    unsigned h[6];
+    if (!p || sscanf(p, "(%u,%u,%u,%u,%u,%u)", &h[0], &h[1], &h[2], &h[3], &h[4], &h[5]) != 6) {
+        return -1;
+    }
+
+    const struct sockaddr_in sa = {
+        .sin_family = PF_INET,
+        .sin_port = htons((h[4] << 8) | h[5]),
+        .sin_addr.s_addr = htonl((h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3]),
+    };
+    return loopback_connect(&sa);
+}
+
+// the files are filled with the offset of every 4th byte, so that data
+// read from the wrong offset can be spotted.
+static unsigned char pattern_byte(unsigned long long off) {
+    return (uint32_t)(off & ~3ull) >> ((off & 3) * 8);
+}
+
+static bool pattern_check(const char* buf, size_t size, unsigned long long off) {
+    for (size_t i = 0; i < size; i++) {
+        if ((unsigned char)buf[i] != pattern_byte(off + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int client_open_data(struct LoopClient* c, const char* cmd, const char* arg) {
+    const int fd = client_pasv(c);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const int code = client_cmd(c, "%s %s", cmd, arg);
+    if (code != 150 && code != 125) {
+        loopback_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// check_off is the file offset the data starts at, which is checked
+// against the pattern, or -1 to not check it.
+static long long client_download(struct LoopClient* c, const char* cmd, const char* arg, long long check_off) {
+    const int fd = client_open_data(c, cmd, arg);
+    if (fd < 0) {
+        return -1;
+    }
+
+    static char buf[1024 * 64];
+    long long total = 0;
+    unsigned idle = 0;
+    for (;;) {
+        const int n = loopback_recv(fd, buf, sizeof(buf));
+        if (n > 0) {
+            if (check_off >= 0 && !pattern_check(buf, n, check_off + total)) {
+                total = -1;
+                break;
+            }
+            total += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno != EAGAIN || bench_step(&idle)) {
+            total = -1;
+            break;
+        }
+    }
+    loopback_close(fd);
+
+    return client_reply(c) == 226 ? total : -1;
+}
+
+static long long client_upload(struct LoopClient* c, const char* cmd, const char* arg, long long size) {
+    const int fd = client_open_data(c, cmd, arg);
+    if (fd < 0) {
+        return -1;
+    }
+
+    static char buf[1024 * 64];
+    long long total = 0;
+    while (total < size) {
+        const size_t chunk = size - total < (long long)sizeof(buf) ? (size_t)(size - total) : sizeof(buf);
+        if (client_send_all(fd, buf, chunk)) {
+            total = -1;
+            break;
+        }
+        total += chunk;
+    }
+    loopback_close(fd);
+
+    return client_reply(c) == 226 ? total : -1;
+}
+
+static int write_file(const char* path, long long size) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    static unsigned char buf[1024 * 64];
+    int rc = 0;
+    for (long long off = 0; off < size && !rc; off += sizeof(buf)) {
+        const size_t chunk = size - off < (long long)sizeof(buf) ? (size_t)(size - off) : sizeof(buf);
+        for (size_t i = 0; i < chunk; i++) {
+            buf[i] = pattern_byte(off + i);
+        }
+        if (write(fd, buf, chunk) != (ssize_t)chunk) {
+            rc = -1;
+        }
+    }
+
+    close(fd);
+    return rc;
+}
+
+static int dataset_create(struct Bench* b) {
+    char path[4096 + 64];
+
+    snprintf(path, sizeof(path), "%s/dir", b->root);
+    if (mkdir(path, 0755)) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < b->files; i++) {
+        snprintf(path, sizeof(path), "%s/dir/entry_%u", b->root, i);
+        if (write_file(path, 0)) {
+            return -1;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/file", b->root);
+    return write_file(path, b->size);
+}
+
+static void dataset_remove(struct Bench* b) {
+    char path[4096 + 256 + 64];
+
+    snprintf(path, sizeof(path), "%s/dir", b->root);
+    DIR* dir = opendir(path);
+    if (dir) {
+        struct dirent* d;
+        while ((d = readdir(dir))) {
+            if (strcmp(d->d_name, ".") && strcmp(d->d_name, "..")) {
+                snprintf(path, sizeof(path), "%s/dir/%s", b->root, d->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dir);
+    }
+
+    snprintf(path, sizeof(path), "%s/dir", b->root);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/file", b->root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/upload", b->root);
+    unlink(path);
+    rmdir(b->root);
+}
+
+static int client_login(struct LoopClient* c) {
+    const struct sockaddr_in sa = {
+        .sin_family = PF_INET,
+        .sin_port = htons(BENCH_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    c->ctrl = loopback_connect(&sa);
+    if (c->ctrl < 0 || client_reply(c) != 220 || client_cmd(c, "USER %s", BENCH_USER) != 331 || client_cmd(c, "PASS %s", BENCH_PASS) != 230) {
+        return -1;
+    }
+    return 0;
+}
+
+// reads the file from c and a second session at once, so that the blocks
+// are shared when read_share is set, then resumes a download of it from
+// an offset that isn't on a block boundary and checks what comes back.
+static long long bench_rest(struct Bench* b, struct LoopClient* c, const char* path) {
+    struct LoopClient c2 = {0};
+    int fds[2] = { -1, -1 };
+    long long rc = -1;
+
+    if (client_login(&c2) || (fds[0] = client_open_data(c, "RETR", path)) < 0 || (fds[1] = client_open_data(&c2, "RETR", path)) < 0) {
+        goto done;
+    }
+
+    static char buf[1024 * 64];
+    long long got[2] = {0};
+    bool eof[2] = {false};
+    unsigned idle = 0;
+    while (!eof[0] || !eof[1]) {
+        bool moved = false;
+        for (int i = 0; i < 2; i++) {
+            if (eof[i]) {
+                continue;
+            }
+
+            const int n = loopback_recv(fds[i], buf, sizeof(buf));
+            if (n > 0) {
+                if (!pattern_check(buf, n, got[i])) {
+                    goto done;
+                }
+                got[i] += n;
+                moved = true;
+            } else if (n == 0) {
+                eof[i] = true;
+                moved = true;
+            } else if (errno != EAGAIN) {
+                goto done;
+            }
+        }
+
+        if (!moved && bench_step(&idle)) {
+            goto done;
+        }
+    }
+
+    loopback_close(fds[0]);
+    loopback_close(fds[1]);
+    fds[0] = fds[1] = -1;
+    if (client_reply(c) != 226 || client_reply(&c2) != 226 || got[0] != b->size || got[1] != b->size) {
+        goto done;
+    }
+
+    const long long off = b->size > 1000 ? 1000 : 0;
+    if (client_cmd(c, "REST %lld", off) != 350) {
+        goto done;
+    }
+    rc = client_download(c, "RETR", path, off);
+    if (rc >= 0 && rc != b->size - off) {
+        rc = -1;
+    }
+
+done:
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            loopback_close(fds[i]);
+        }
+    }
+    if (c2.ctrl > 0) {
+        client_cmd(&c2, "QUIT");
+        loopback_close(c2.ctrl);
+    }
+    return rc;
+}
+
+static void bench_op(struct Bench* b, struct LoopClient* c, enum BenchOp op) {
+    struct BenchOpStats* st = &b->stats[op];
+    char path[4096 + 64];
+
+    const double cpu_start = cpu_now();
+    const uint64_t sim_start = loopback_now_us();
+    const uint64_t polls_start = loopback_stats()->polls;
+
+    long long rc = -1;
+    switch (op) {
+        case BenchOp_NOOP:
+            rc = client_cmd(c, "NOOP") == 200 ? 0 : -1;
+            break;
+        case BenchOp_RETR:
+            snprintf(path, sizeof(path), "%s/file", b->root);
+            rc = client_download(c, "RETR", path, -1);
+            break;
+        case BenchOp_STOR:
+            snprintf(path, sizeof(path), "%s/upload", b->root);
+            rc = client_upload(c, "STOR", path, b->size);
+            break;
+        case BenchOp_LIST:
+            snprintf(path, sizeof(path), "%s/dir", b->root);
+            rc = client_download(c, "LIST", path, -1);
+            break;
+        case BenchOp_REST:
+            snprintf(path, sizeof(path), "%s/file", b->root);
+            rc = bench_rest(b, c, path);
+            break;
+        case BenchOp_COUNT:
+            break;
+    }
+
+    st->cpu_s += cpu_now() - cpu_start;
+    st->sim_us += loopback_now_us() - sim_start;
+    st->polls += loopback_stats()->polls - polls_start;
+    if (rc < 0) {
+        st->errors++;
+    } else {
+        st->count++;
+        st->bytes += rc;
+    }
+}
+
+static int bench_run(struct Bench* b) {
+    struct FtpSrvConfig cfg = {
+        .user = BENCH_USER,
+        .pass = BENCH_PASS,
+        .port = BENCH_PORT,
+        .read_share = b->read_share,
+    };
+
+    loopback_reset();
+    loopback_set_default_link(b->bandwidth, b->latency_us);
+    if (ftpsrv_init(&cfg) < 0) {
+        fprintf(stderr, "ftpsrv_init failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int rc = -1;
+    struct LoopClient c = {0};
+    if (client_login(&c)) {
+        fprintf(stderr, "failed to login: %s\n", c.reply);
+        goto done;
+    }
+
+    for (int op = 0; op < BenchOp_COUNT; op++) {
+        if (!b->ops[op]) {
+            continue;
+        }
+        for (unsigned i = 0; i < b->iterations; i++) {
+            bench_op(b, &c, op);
+        }
+    }
+
+    client_cmd(&c, "QUIT");
+    rc = 0;
+
+done:
+    if (c.ctrl > 0) {
+        loopback_close(c.ctrl);
+    }
+    ftpsrv_exit();
+    return rc;
+}
+
+// returns the number of ops that failed.
+static unsigned long long bench_report(const struct Bench* b) {
+    int last = -1;
+    unsigned long long errors = 0;
+    for (int op = 0; op < BenchOp_COUNT; op++) {
+        if (b->ops[op]) {
+            last = op;
+        }
+        errors += b->stats[op].errors;
+    }
+
+    printf("{\n");
+    printf("  \"config\": { \"iterations\": %u, \"size\": %lld, \"files\": %u, \"bandwidth\": %llu, \"latency_us\": %llu },\n",
+        b->iterations, b->size, b->files, (unsigned long long)b->bandwidth, (unsigned long long)b->latency_us);
+    printf("  \"errors\": %llu,\n", errors);
+    printf("  \"ops\": {\n");
+    for (int op = 0; op < BenchOp_COUNT; op++) {
+        if (!b->ops[op]) {
+            continue;
+        }
+        const struct BenchOpStats* st = &b->stats[op];
+        const double n = st->count ? (double)st->count : 1;
+        printf("    \"%s\": { \"count\": %llu, \"errors\": %llu, \"cpu_ns_per_op\": %.1f, \"cpu_ns_per_byte\": %.4f, \"sim_us_per_op\": %.1f, \"polls_per_op\": %.2f }%s\n",
+            BENCH_OP_NAMES[op], st->count, st->errors,
+            st->cpu_s * 1e9 / n,
+            st->bytes ? st->cpu_s * 1e9 / (double)st->bytes : 0,
+            (double)st->sim_us / n,
+            (double)st->polls / n,
+            op == last ? "" : ",");
+    }
+    printf("  }\n");
+    printf("}\n");
+    return errors;
+}
+
+int main(int argc, char** argv) {
+    static struct Bench b = {
+        .iterations = 1000,
+        .size = 1024 * 1024,
+        .files = 1000,
+        .ops = { true, true, true, true, true },
+    };
+
+    int arg_index = 1;
+    struct ArgsData arg_data;
+    enum ArgsResult arg_result;
+    while (!(arg_result = args_parse(&arg_index, argc, argv, ARGS_META, sizeof(ARGS_META) / sizeof(ARGS_META[0]), &arg_data))) {
+        switch (ARGS_META[arg_data.meta_index].id) {
+            case ArgsId_help:
+                return print_usage(EXIT_SUCCESS);
+            case ArgsId_iterations:
+                b.iterations = arg_data.value.i;
+                break;
+            case ArgsId_size:
+                b.size = arg_data.value.i;
+                break;
+            case ArgsId_files:
+                b.files = arg_data.value.i;
+                break;
+            case ArgsId_bandwidth:
+                b.bandwidth = arg_data.value.i;
+                break;
+            case ArgsId_latency:
+                b.latency_us = arg_data.value.i;
+                break;
+            case ArgsId_readshare:
+                b.read_share = true;
+                break;
+            case ArgsId_ops: {
+                memset(b.ops, 0, sizeof(b.ops));
+                const char* s = arg_data.value.s;
+                while (*s) {
+                    const char* end = strchr(s, ',');
+                    const size_t len = end ? (size_t)(end - s) : strlen(s);
+                    bool found = false;
+                    for (int op = 0; op < BenchOp_COUNT; op++) {
+                        if (strlen(BENCH_OP_NAMES[op]) == len && !strncmp(BENCH_OP_NAMES[op], s, len)) {
+                            b.ops[op] = found = true;
+                        }
+                    }
+                    if (!found) {
+                        fprintf(stderr, "bad ops [%s]\n", arg_data.value.s);
+                        return print_usage(EXIT_FAILURE);
+                    }
+                    s += len + (end ? 1 : 0);
+                }
+            }   break;
+        }
+    }
+
+    // handle error.
+    if (arg_result < 0) {
+        if (arg_result == ArgsResult_UNKNOWN_KEY) {
+            fprintf(stderr, "unknown arg [%s]\n", argv[arg_index]);
+        }
+        else if (arg_result == ArgsResult_BAD_VALUE) {
+            fprintf(stderr, "arg [--%s] had bad value type [%s]\n", ARGS_META[arg_data.meta_index].key, arg_data.value.s);
+        }
+        else if (arg_result == ArgsResult_MISSING_VALUE) {
+            fprintf(stderr, "arg [--%s] requires a value\n", ARGS_META[arg_data.meta_index].key);
+        }
+        else {
+            fprintf(stderr, "bad args: %d\n", arg_result);
+        }
+        return print_usage(EXIT_FAILURE);
+    }
+
+    snprintf(b.root, sizeof(b.root), "/tmp/ftpbench_loopback.XXXXXX");
+    if (!mkdtemp(b.root)) {
+        fprintf(stderr, "mkdtemp failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int rc = dataset_create(&b);
+    if (rc) {
+        fprintf(stderr, "failed to create dataset in %s: %s\n", b.root, strerror(errno));
+    } else {
+        // any op that failed fails the run, so that it can be used as a check.
+        rc = bench_run(&b);
+        if (!rc && bench_report(&b)) {
+            rc = -1;
+        }
+    }
+
+    dataset_remove(&b);
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
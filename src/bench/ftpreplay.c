@@ -0,0 +1,486 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+// replays traces recorded with ftpexe --trace against a running server,
+// results are printed as json on stdout.
+#include "ftpsrv.h"
+#include "args/args.h"
+#include "trace/trace.h"
+#include "bench_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define REPLAY_MAX_VERBS 64
+
+struct ReplayCommand {
+    uint64_t time_us;
+    char verb[8];
+    char* args;         // NULL if the command had none.
+    uint64_t bytes;     // STOR / APPE / STOU: bytes the client sent.
+    int expected;       // final reply code in the trace, 0 if unknown.
+};
+
+struct ReplaySession {
+    uint64_t open_us;
+    struct ReplayCommand* cmds;
+    size_t count;
+    size_t cap;
+};
+
+struct ReplayVerb {
+    char verb[8];
+    unsigned long long errors;
+    unsigned long long mismatched;
+    struct BenchSamples latency;
+};
+
+struct ReplayWorker {
+    pthread_t thread;
+    const struct ReplaySession* session;
+    struct BenchClient client;
+    struct ReplayVerb verbs[REPLAY_MAX_VERBS];
+    unsigned verb_count;
+    unsigned long long commands;
+    unsigned long long skipped;
+    bool connect_failed;
+};
+
+struct Replay {
+    const char* host;
+    unsigned port;
+    const char* user;
+    const char* pass;
+    double speed;
+    unsigned parallel;
+
+    struct ReplaySession* sessions;
+    size_t session_count;
+    double start;
+};
+
+static struct Replay g_replay = {
+    .host = "127.0.0.1",
+    .port = 21,
+    .user = "anonymous",
+    .pass = "",
+    .speed = 1,
+    .parallel = 1,
+};
+
+enum ArgsId {
+    ArgsId_help,
+    ArgsId_host,
+    ArgsId_port,
+    ArgsId_user,
+    ArgsId_pass,
+    ArgsId_speed,
+    ArgsId_parallel,
+};
+
+#define ARGS_ENTRY(_key, _type, _single) \
+    { .key = #_key, .id = ArgsId_##_key, .type = _type, .single = _single },
+
+static const struct ArgsMeta ARGS_META[] = {
+    ARGS_ENTRY(help, ArgsValueType_NONE, 'h')
+    ARGS_ENTRY(host, ArgsValueType_STR, 'H')
+    ARGS_ENTRY(port, ArgsValueType_INT, 'P')
+    ARGS_ENTRY(user, ArgsValueType_STR, 'u')
+    ARGS_ENTRY(pass, ArgsValueType_STR, 'p')
+    ARGS_ENTRY(speed, ArgsValueType_DOUBLE, 's')
+    ARGS_ENTRY(parallel, ArgsValueType_INT, 'j')
+};
+
+static int print_usage(int code) {
+    printf("\
+[ftpreplay " FTPSRV_VERSION_STR "] \n\n\
+Usage: ftpreplay [options] trace\n\n\
+    -h, --help      = Display help.\n\
+    -H, --host      = Server ipv4 address (default 127.0.0.1).\n\
+    -P, --port      = Server port (default 21).\n\
+    -u, --user      = Replaces the user of every session (default anonymous).\n\
+    -p, --pass      = Replaces the password of every session.\n\
+    -s, --speed     = Time scale, 1 is real time, 0 is as fast as possible (default 1).\n\
+    -j, --parallel  = Number of copies of each session to run at once (default 1).\n\
+    \n");
+
+    return code;
+}
+
+static bool verb_is(const char* verb, const char* name) {
+    return !strcmp(verb, name);
+}
+
+static bool verb_is_download(const char* verb) {
+    return verb_is(verb, "RETR") || verb_is(verb, "LIST") || verb_is(verb, "NLST") || verb_is(verb, "MLSD");
+}
+
+static bool verb_is_upload(const char* verb) {
+    return verb_is(verb, "STOR") || verb_is(verb, "APPE") || verb_is(verb, "STOU");
+}
+
+// the data connection is always opened with PASV by the replay.
+static bool verb_is_skipped(const char* verb) {
+    return verb_is(verb, "PASV") || verb_is(verb, "EPSV") || verb_is(verb, "PORT") || verb_is(verb, "EPRT");
+}
+
+static struct ReplaySession* session_new(uint64_t time_us) {
+    struct Replay* r = &g_replay;
+    struct ReplaySession* sessions = realloc(r->sessions, (r->session_count + 1) * sizeof(*sessions));
+    if (!sessions) {
+        return NULL;
+    }
+
+    r->sessions = sessions;
+    struct ReplaySession* s = &sessions[r->session_count++];
+    memset(s, 0, sizeof(*s));
+    s->open_us = time_us;
+    return s;
+}
+
+static struct ReplayCommand* session_push(struct ReplaySession* s) {
+    if (s->count == s->cap) {
+        const size_t cap = s->cap ? s->cap * 2 : 16;
+        struct ReplayCommand* cmds = realloc(s->cmds, cap * sizeof(*cmds));
+        if (!cmds) {
+            return NULL;
+        }
+        s->cmds = cmds;
+        s->cap = cap;
+    }
+
+    struct ReplayCommand* cmd = &s->cmds[s->count++];
+    memset(cmd, 0, sizeof(*cmd));
+    return cmd;
+}
+
+// splits the trace into sessions, slot indices are reused by the server so
+// they are mapped to the session that is currently open in that slot.
+static int replay_load(const char* path) {
+    struct TraceFile f;
+    if (trace_load(&f, path)) {
+        return -1;
+    }
+
+    long* slots = NULL;
+    size_t slot_count = 0;
+    struct TraceEntry e;
+    int rc;
+
+    while ((rc = trace_next(&f, &e)) == 1) {
+        const uint32_t slot = e.record.session;
+        if (slot >= slot_count) {
+            long* p = realloc(slots, (slot + 1) * sizeof(*p));
+            if (!p) {
+                rc = -2;
+                break;
+            }
+            for (size_t i = slot_count; i <= slot; i++) {
+                p[i] = -1;
+            }
+            slots = p;
+            slot_count = slot + 1;
+        }
+
+        if (e.record.type == TraceRecordType_OPEN) {
+            if (!session_new(e.record.time_us)) {
+                rc = -2;
+                break;
+            }
+            slots[slot] = g_replay.session_count - 1;
+            continue;
+        } else if (e.record.type == TraceRecordType_CLOSE) {
+            slots[slot] = -1;
+            continue;
+        }
+
+        // the trace may have started with the session already open.
+        if (slots[slot] < 0) {
+            if (!session_new(e.record.time_us)) {
+                rc = -2;
+                break;
+            }
+            slots[slot] = g_replay.session_count - 1;
+        }
+
+        struct ReplaySession* s = &g_replay.sessions[slots[slot]];
+        struct ReplayCommand* last = s->count ? &s->cmds[s->count - 1] : NULL;
+
+        if (e.record.type == TraceRecordType_COMMAND) {
+            struct ReplayCommand* cmd = session_push(s);
+            if (!cmd) {
+                rc = -2;
+                break;
+            }
+
+            const size_t len = e.record.name_len < sizeof(cmd->verb) - 1 ? e.record.name_len : sizeof(cmd->verb) - 1;
+            memcpy(cmd->verb, e.name, len);
+            cmd->time_us = e.record.time_us;
+            if (e.record.text_len) {
+                cmd->args = malloc(e.record.text_len + 1);
+                if (!cmd->args) {
+                    rc = -2;
+                    break;
+                }
+                memcpy(cmd->args, e.text, e.record.text_len);
+                cmd->args[e.record.text_len] = '\0';
+            }
+        } else if (e.record.type == TraceRecordType_REPLY && last) {
+            // the last reply before the next command is the final one.
+            last->expected = e.record.value;
+        } else if (e.record.type == TraceRecordType_TRANSFER && last && verb_is_upload(last->verb)) {
+            last->bytes = e.record.value;
+        }
+    }
+
+    // the capture may have been killed part way through a record.
+    if (rc == -1) {
+        fprintf(stderr, "trace is truncated, replaying what was read\n");
+    }
+
+    free(slots);
+    trace_free(&f);
+    return rc == -2 ? -1 : 0;
+}
+
+static void replay_wait(uint64_t time_us) {
+    if (g_replay.speed <= 0) {
+        return;
+    }
+
+    const double delay = g_replay.start + (double)time_us / 1e6 / g_replay.speed - bench_now();
+    if (delay > 0) {
+        usleep(delay * 1e6);
+    }
+}
+
+static struct ReplayVerb* worker_verb(struct ReplayWorker* w, const char* verb) {
+    for (unsigned i = 0; i < w->verb_count; i++) {
+        if (!strcmp(w->verbs[i].verb, verb)) {
+            return &w->verbs[i];
+        }
+    }
+
+    if (w->verb_count == REPLAY_MAX_VERBS) {
+        return NULL;
+    }
+
+    struct ReplayVerb* v = &w->verbs[w->verb_count++];
+    snprintf(v->verb, sizeof(v->verb), "%s", verb);
+    return v;
+}
+
+static void* worker_thread(void* userdata) {
+    struct ReplayWorker* w = userdata;
+    const struct ReplaySession* s = w->session;
+    struct BenchClient* c = &w->client;
+
+    replay_wait(s->open_us);
+    if (bench_client_connect(c, g_replay.host, g_replay.port)) {
+        w->connect_failed = true;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < s->count; i++) {
+        const struct ReplayCommand* cmd = &s->cmds[i];
+        if (verb_is_skipped(cmd->verb)) {
+            w->skipped++;
+            continue;
+        }
+
+        replay_wait(cmd->time_us);
+
+        c->reply[0] = '\0';
+        const double start = bench_now();
+        long long rc;
+        if (verb_is(cmd->verb, "USER")) {
+            rc = bench_client_cmd(c, "USER %s", g_replay.user);
+        } else if (verb_is(cmd->verb, "PASS")) {
+            rc = bench_client_cmd(c, "PASS %s", g_replay.pass);
+        } else if (verb_is_download(cmd->verb)) {
+            rc = bench_client_download(c, cmd->verb, cmd->args);
+        } else if (verb_is_upload(cmd->verb)) {
+            rc = bench_client_upload(c, cmd->verb, cmd->args ? cmd->args : "", cmd->bytes);
+        } else if (cmd->args) {
+            rc = bench_client_cmd(c, "%s %s", cmd->verb, cmd->args);
+        } else {
+            rc = bench_client_cmd(c, "%s", cmd->verb);
+        }
+        const double elapsed = bench_now() - start;
+        w->commands++;
+
+        struct ReplayVerb* v = worker_verb(w, cmd->verb);
+        if (v) {
+            const int code = atoi(c->reply);
+            bench_samples_push(&v->latency, elapsed);
+            if (rc < 0 || code >= 400) {
+                v->errors++;
+            }
+            if (cmd->expected && code != cmd->expected) {
+                v->mismatched++;
+            }
+        }
+
+        // the connection is gone, nothing else can be sent.
+        if (c->ctrl < 0) {
+            break;
+        }
+        if (verb_is(cmd->verb, "QUIT")) {
+            break;
+        }
+    }
+
+    bench_client_close(c);
+    return NULL;
+}
+
+static void replay_report(struct ReplayWorker* workers, size_t count, double wall) {
+    struct ReplayWorker total = {0};
+    unsigned long long connect_errors = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct ReplayWorker* w = &workers[i];
+        total.commands += w->commands;
+        total.skipped += w->skipped;
+        connect_errors += w->connect_failed;
+
+        for (unsigned j = 0; j < w->verb_count; j++) {
+            struct ReplayVerb* v = worker_verb(&total, w->verbs[j].verb);
+            if (v) {
+                v->errors += w->verbs[j].errors;
+                v->mismatched += w->verbs[j].mismatched;
+                bench_samples_merge(&v->latency, &w->verbs[j].latency);
+            }
+            bench_samples_free(&w->verbs[j].latency);
+        }
+    }
+
+    struct BenchSamples all = {0};
+    for (unsigned j = 0; j < total.verb_count; j++) {
+        bench_samples_merge(&all, &total.verbs[j].latency);
+    }
+
+    printf("{\n");
+    printf("  \"config\": { \"sessions\": %zu, \"parallel\": %u, \"speed\": %.3f },\n", g_replay.session_count, g_replay.parallel, g_replay.speed);
+    printf("  \"wall_s\": %.6f,\n", wall);
+    printf("  \"commands\": %llu,\n", total.commands);
+    printf("  \"skipped\": %llu,\n", total.skipped);
+    printf("  \"connect_errors\": %llu,\n", connect_errors);
+    printf("  \"commands_per_s\": %.3f,\n", wall > 0 ? total.commands / wall : 0);
+    printf("  \"reply_latency_us\": { \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+        bench_samples_percentile(&all, 50) * 1e6,
+        bench_samples_percentile(&all, 90) * 1e6,
+        bench_samples_percentile(&all, 99) * 1e6,
+        bench_samples_percentile(&all, 100) * 1e6);
+    printf("  \"verbs\": {\n");
+    for (unsigned j = 0; j < total.verb_count; j++) {
+        const struct ReplayVerb* v = &total.verbs[j];
+        printf("    \"%s\": { \"count\": %zu, \"errors\": %llu, \"mismatched\": %llu, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f }%s\n",
+            v->verb, v->latency.count, v->errors, v->mismatched,
+            bench_samples_percentile(&v->latency, 50) * 1e6,
+            bench_samples_percentile(&v->latency, 99) * 1e6,
+            bench_samples_percentile(&v->latency, 100) * 1e6,
+            j + 1 == total.verb_count ? "" : ",");
+        bench_samples_free(&total.verbs[j].latency);
+    }
+    printf("  }\n");
+    printf("}\n");
+
+    bench_samples_free(&all);
+}
+
+int main(int argc, char** argv) {
+    int arg_index = 1;
+    struct ArgsData arg_data;
+    enum ArgsResult arg_result;
+    while (!(arg_result = args_parse(&arg_index, argc, argv, ARGS_META, sizeof(ARGS_META) / sizeof(ARGS_META[0]), &arg_data))) {
+        switch (ARGS_META[arg_data.meta_index].id) {
+            case ArgsId_help:
+                return print_usage(EXIT_SUCCESS);
+            case ArgsId_host:
+                g_replay.host = arg_data.value.s;
+                break;
+            case ArgsId_port:
+                g_replay.port = arg_data.value.i;
+                break;
+            case ArgsId_user:
+                g_replay.user = arg_data.value.s;
+                break;
+            case ArgsId_pass:
+                g_replay.pass = arg_data.value.s;
+                break;
+            case ArgsId_speed:
+                g_replay.speed = arg_data.value.d;
+                break;
+            case ArgsId_parallel:
+                g_replay.parallel = arg_data.value.i;
+                break;
+        }
+    }
+
+    // the trace path is the trailing value.
+    if (arg_result != ArgsResult_EXTRA_ARGS) {
+        if (arg_result == ArgsResult_UNKNOWN_KEY) {
+            fprintf(stderr, "unknown arg [%s]\n", argv[arg_index]);
+        }
+        else if (arg_result == ArgsResult_BAD_VALUE) {
+            fprintf(stderr, "arg [--%s] had bad value type [%s]\n", ARGS_META[arg_data.meta_index].key, arg_data.value.s);
+        }
+        else if (arg_result == ArgsResult_MISSING_VALUE) {
+            fprintf(stderr, "arg [--%s] requires a value\n", ARGS_META[arg_data.meta_index].key);
+        }
+        else {
+            fprintf(stderr, "missing trace path\n");
+        }
+        return print_usage(EXIT_FAILURE);
+    }
+
+    const char* path = argv[arg_index];
+    if (!g_replay.parallel) {
+        g_replay.parallel = 1;
+    }
+
+    if (replay_load(path)) {
+        fprintf(stderr, "failed to load trace [%s]: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    const size_t count = g_replay.session_count * g_replay.parallel;
+    struct ReplayWorker* workers = calloc(count ? count : 1, sizeof(*workers));
+    if (!workers) {
+        return EXIT_FAILURE;
+    }
+
+    g_replay.start = bench_now();
+    size_t started = 0;
+    for (; started < count; started++) {
+        workers[started].session = &g_replay.sessions[started / g_replay.parallel];
+        if (pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started])) {
+            fprintf(stderr, "failed to start session %zu\n", started);
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    const double wall = bench_now() - g_replay.start;
+
+    replay_report(workers, started, wall);
+
+    for (size_t i = 0; i < g_replay.session_count; i++) {
+        for (size_t j = 0; j < g_replay.sessions[i].count; j++) {
+            free(g_replay.sessions[i].cmds[j].args);
+        }
+        free(g_replay.sessions[i].cmds);
+    }
+    free(g_replay.sessions);
+    free(workers);
+    return started == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,250 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#include "ftpsrv_vfs.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#if defined(HAVE_LSTAT) && !HAVE_LSTAT
+    #define lstat stat
+#endif
+
+static struct VfsBenchStats g_stats;
+static unsigned g_synth_entries;
+static time_t g_synth_recent;
+
+// same layout as a typical download dir, mostly files with some dirs and
+// symlinks, half modified recently so that both date formats are used.
+void vfs_bench_synthetic_stat(unsigned i, struct stat* st) {
+    memset(st, 0, sizeof(*st));
+    if (i % 64 == 63) {
+        st->st_mode = S_IFLNK | 0777;
+        st->st_nlink = 1;
+    } else if (i % 16 == 15) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size = ((off_t)i * 7919) % (1024 * 1024 * 1024);
+    }
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_mtime = (i & 1) ? 1577836800 : g_synth_recent - (time_t)(i % 3600);
+}
+
+void vfs_bench_set_synthetic(unsigned entries) {
+    g_synth_entries = entries;
+    g_synth_recent = time(NULL);
+}
+
+const struct VfsBenchStats* vfs_bench_stats(void) {
+    return &g_stats;
+}
+
+void vfs_bench_reset_stats(void) {
+    memset(&g_stats, 0, sizeof(g_stats));
+}
+
+int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mode) {
+    int flags = 0, args = 0;
+
+    switch (mode) {
+        case FtpVfsOpenMode_READ:
+            flags = O_RDONLY;
+            args = 0;
+            break;
+        case FtpVfsOpenMode_WRITE:
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            args = 0666;
+            break;
+        case FtpVfsOpenMode_APPEND:
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            args = 0666;
+            break;
+        case FtpVfsOpenMode_UPDATE:
+            flags = O_WRONLY | O_CREAT;
+            args = 0666;
+            break;
+    }
+
+    g_stats.open++;
+    f->fd = open(path, flags, args);
+    if (f->fd >= 0) {
+        f->valid = 1;
+    }
+    return f->fd;
+}
+
+int ftp_vfs_read(struct FtpVfsFile* f, void* buf, size_t size) {
+    return read(f->fd, buf, size);
+}
+
+int ftp_vfs_write(struct FtpVfsFile* f, const void* buf, size_t size) {
+    return write(f->fd, buf, size);
+}
+
+int ftp_vfs_seek(struct FtpVfsFile* f, const void* buf, size_t size, size_t off) {
+    return lseek(f->fd, off, SEEK_SET);
+}
+
+int ftp_vfs_close(struct FtpVfsFile* f) {
+    int rc = 0;
+    if (ftp_vfs_isfile_open(f)) {
+        rc = close(f->fd);
+        f->fd = -1;
+        f->valid = 0;
+    }
+    return rc;
+}
+
+int ftp_vfs_isfile_open(struct FtpVfsFile* f) {
+    return f->valid && f->fd >= 0;
+}
+
+int ftp_vfs_opendir(struct FtpVfsDir* f, const char* path) {
+    g_stats.opendir++;
+    f->synth_index = 0;
+    f->synth_count = g_synth_entries;
+    if (f->synth_count) {
+        f->fd = NULL;
+        return 0;
+    }
+
+    f->fd = opendir(path);
+    if (!f->fd) {
+        return -1;
+    }
+    return 0;
+}
+
+const char* ftp_vfs_readdir(struct FtpVfsDir* f, struct FtpVfsDirEntry* entry) {
+    g_stats.readdir++;
+    if (f->synth_count) {
+        const unsigned i = f->synth_index;
+        if (i >= f->synth_count + 2) {
+            return NULL;
+        }
+        f->synth_index++;
+
+        if (i == 0) {
+            return ".";
+        } else if (i == 1) {
+            return "..";
+        }
+
+        struct stat st;
+        vfs_bench_synthetic_stat(i - 2, &st);
+        const char* prefix = S_ISDIR(st.st_mode) ? "dir" : S_ISLNK(st.st_mode) ? "link" : "file";
+        snprintf(entry->synth_name, sizeof(entry->synth_name), "%s_%07u", prefix, i - 2);
+        entry->synth_index = i - 2;
+        return entry->synth_name;
+    }
+
+    entry->buf = readdir(f->fd);
+    if (!entry->buf) {
+        return NULL;
+    }
+    return entry->buf->d_name;
+}
+
+int ftp_vfs_dirlstat(struct FtpVfsDir* f, const struct FtpVfsDirEntry* entry, const char* path, struct stat* st) {
+    g_stats.dirlstat++;
+    if (f->synth_count) {
+        vfs_bench_synthetic_stat(entry->synth_index, st);
+        return 0;
+    }
+    return lstat(path, st);
+}
+
+int ftp_vfs_closedir(struct FtpVfsDir* f) {
+    int rc = 0;
+    if (ftp_vfs_isdir_open(f)) {
+        if (f->fd) {
+            rc = closedir(f->fd);
+        }
+        f->fd = NULL;
+        f->synth_count = 0;
+    }
+    return rc;
+}
+
+int ftp_vfs_isdir_open(struct FtpVfsDir* f) {
+    return f->fd != NULL || f->synth_count;
+}
+
+int ftp_vfs_stat(const char* path, struct stat* st) {
+    g_stats.stat++;
+    return stat(path, st);
+}
+
+int ftp_vfs_lstat(const char* path, struct stat* st) {
+    g_stats.lstat++;
+    return lstat(path, st);
+}
+
+int ftp_vfs_mkdir(const char* path) {
+    return mkdir(path, 0777);
+}
+
+int ftp_vfs_unlink(const char* path) {
+    return unlink(path);
+}
+
+int ftp_vfs_rmdir(const char* path) {
+    return rmdir(path);
+}
+
+int ftp_vfs_rename(const char* src, const char* dst) {
+    return rename(src, dst);
+}
+
+int ftp_vfs_readlink(const char* path, char* buf, size_t buflen) {
+    g_stats.readlink++;
+    if (g_synth_entries) {
+        return snprintf(buf, buflen, "target");
+    }
+#if defined(HAVE_READLINK) && HAVE_READLINK
+    return readlink(path, buf, buflen);
+#else
+    return -1;
+#endif
+}
+
+// these always hit the real user / group database, as they would with the
+// unistd vfs, so that their cost shows up in the listing numbers.
+#if defined(HAVE_GETPWUID) && HAVE_GETPWUID
+#include <pwd.h>
+const char* ftp_vfs_getpwuid(const struct stat* st) {
+    g_stats.getpwuid++;
+    const struct passwd *pw = getpwuid(st->st_uid);
+    return pw ? pw->pw_name : "unknown";
+}
+#else
+const char* ftp_vfs_getpwuid(const struct stat* st) {
+    g_stats.getpwuid++;
+    return "unknown";
+}
+#endif
+
+#if defined(HAVE_GETGRGID) && HAVE_GETGRGID
+#include <grp.h>
+const char* ftp_vfs_getgrgid(const struct stat* st) {
+    g_stats.getgrgid++;
+    const struct group *gr = getgrgid(st->st_gid);
+    return gr ? gr->gr_name : "unknown";
+}
+#else
+const char* ftp_vfs_getgrgid(const struct stat* st) {
+    g_stats.getgrgid++;
+    return "unknown";
+}
+#endif
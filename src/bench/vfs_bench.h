@@ -0,0 +1,55 @@
+// Copyright 2024 TotalJustice.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// unistd vfs that counts every call made into it, and that can serve
+// synthetic directories so that listings of any size can be measured
+// without creating the files.
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdint.h>
+
+struct FtpVfsFile {
+    int fd;
+    int valid;
+};
+
+struct FtpVfsDir {
+    DIR* fd;
+    unsigned synth_index; // next synthetic entry, includes "." and "..".
+    unsigned synth_count; // 0 if the dir is real.
+};
+
+struct FtpVfsDirEntry {
+    struct dirent* buf;
+    unsigned synth_index;
+    char synth_name[32];
+};
+
+struct VfsBenchStats {
+    uint64_t open;
+    uint64_t opendir;
+    uint64_t readdir;
+    uint64_t dirlstat;
+    uint64_t stat;
+    uint64_t lstat;
+    uint64_t readlink;
+    uint64_t getpwuid;
+    uint64_t getgrgid;
+};
+
+// if entries != 0, every opendir() after this returns a synthetic dir
+// with that many entries (plus "." and ".."), otherwise the real fs is used.
+void vfs_bench_set_synthetic(unsigned entries);
+// fills st with the stat of synthetic entry i.
+void vfs_bench_synthetic_stat(unsigned i, struct stat* st);
+const struct VfsBenchStats* vfs_bench_stats(void);
+void vfs_bench_reset_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -12,6 +12,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 #include <time.h>
 #include <unistd.h>
@@ -51,8 +52,242 @@
     #define FTP_SENDBUF_SIZE 1024
 #endif
 
+// number of stat / lstat results kept, set to 0 to disable.
+// the cache is only used if cfg.stat_cache_ttl_ms is set.
+#ifndef FTP_STAT_CACHE_SIZE
+    #define FTP_STAT_CACHE_SIZE 32
+#endif
+
+// paths longer than this are never cached.
+#ifndef FTP_STAT_CACHE_PATH_SIZE
+    #define FTP_STAT_CACHE_PATH_SIZE 256
+#endif
+
+// number of file blocks kept for sessions reading the same file, set to 0
+// to disable. the blocks are only allocated if cfg.read_share is set.
+#ifndef FTP_READ_SHARE_SEGMENTS
+    #define FTP_READ_SHARE_SEGMENTS 0
+#endif
+
+#ifndef FTP_READ_SHARE_SEGMENT_SIZE
+    #define FTP_READ_SHARE_SEGMENT_SIZE (FTP_FILE_BUFFER_SIZE)
+#endif
+
+// number of different files that can be shared at once.
+#ifndef FTP_READ_SHARE_FILES
+    #define FTP_READ_SHARE_FILES 8
+#endif
+
+// most bytes of small files kept in memory, set to 0 to disable. the cache
+// is only allocated if cfg.file_cache_size is set, and is that size if lower.
+#ifndef FTP_FILE_CACHE_SIZE
+    #define FTP_FILE_CACHE_SIZE 0
+#endif
+
+// files larger than this are never cached.
+#ifndef FTP_FILE_CACHE_MAX_FILE
+    #define FTP_FILE_CACHE_MAX_FILE (1024 * 64)
+#endif
+
+// number of files tracked, cached or not.
+#ifndef FTP_FILE_CACHE_ENTRIES
+    #define FTP_FILE_CACHE_ENTRIES 64
+#endif
+
+#ifndef FTP_FILE_CACHE_PATH_SIZE
+    #define FTP_FILE_CACHE_PATH_SIZE 256
+#endif
+
+// number of files after the one being downloaded that are read ahead,
+// in the order of the last dir listed, set to 0 to disable.
+// only used if cfg.prefetch_files is set, which can be lower.
+#ifndef FTP_PREFETCH_WINDOW
+    #define FTP_PREFETCH_WINDOW 0
+#endif
+
+// names longer than this end the read ahead.
+#ifndef FTP_PREFETCH_NAME_SIZE
+    #define FTP_PREFETCH_NAME_SIZE 256
+#endif
+
+// most dir entries read on each RETR, looking for the file in the listing
+// or for the next files to read ahead, so that large dirs don't stall
+// the loop. the read ahead stops if the file isn't found within these.
+#ifndef FTP_PREFETCH_SCAN
+    #define FTP_PREFETCH_SCAN 64
+#endif
+
+// page cache hints for large transfers (ftp_vfs_advise()), set to 0 to
+// disable. only used if cfg.page_cache_min_size is set.
+#ifndef FTP_VFS_ADVISE
+    #define FTP_VFS_ADVISE 0
+#endif
+
+// default for cfg.page_cache_window.
+#ifndef FTP_VFS_ADVISE_WINDOW
+    #define FTP_VFS_ADVISE_WINDOW (1024 * 1024 * 8)
+#endif
+
+// journal of the offset flushed to disk, kept next to uploads in progress
+// so that they can be resumed after a crash, set to 0 to disable.
+// only used if cfg.upload_journal is set.
+#ifndef FTP_UPLOAD_JOURNAL
+    #define FTP_UPLOAD_JOURNAL 0
+#endif
+
+#ifndef FTP_UPLOAD_JOURNAL_SUFFIX
+    #define FTP_UPLOAD_JOURNAL_SUFFIX ".ftpsrv-part"
+#endif
+
+// number of segmented uploads (SITE SEGBEGIN) in progress at once, set to
+// 0 to disable. needs ftp_vfs_fallocate().
+#ifndef FTP_SEGMENT_UPLOADS
+    #define FTP_SEGMENT_UPLOADS 0
+#endif
+
+// ranges that have been written are merged as they arrive, this is the
+// most gaps that can be tracked between them.
+#ifndef FTP_SEGMENT_RANGES
+    #define FTP_SEGMENT_RANGES 64
+#endif
+
+// uploads that nobody has written to for this long can be replaced.
+#ifndef FTP_SEGMENT_TIMEOUT
+    #define FTP_SEGMENT_TIMEOUT (60 * 60)
+#endif
+
+#ifndef FTP_SEGMENT_SUFFIX
+    #define FTP_SEGMENT_SUFFIX ".ftpsrv-seg"
+#endif
+
+// HASH and the XCRC / XMD5 / XSHA1 / XSHA256 commands, set to 0 to disable.
+// needs src/hash/hash.c.
+#ifndef FTP_HASH
+    #define FTP_HASH 0
+#endif
+
+// the digest of a whole file (cfg.upload_hash) is kept in <file><suffix>,
+// along with the size and mtime it was taken at.
+#ifndef FTP_HASH_SIDECAR_SUFFIX
+    #define FTP_HASH_SIDECAR_SUFFIX ".ftpsrv-hash"
+#endif
+
+// SITE DELTASIG and SITE DELTA, uploads that only send what changed from
+// a file already on the server, set to 0 to disable. needs FTP_HASH.
+#ifndef FTP_DELTA_UPLOADS
+    #define FTP_DELTA_UPLOADS 0
+#endif
+
+// smallest block size that signatures can be asked for with, the largest
+// is FTP_FILE_BUFFER_SIZE.
+#ifndef FTP_DELTA_MIN_BLOCK
+    #define FTP_DELTA_MIN_BLOCK 512
+#endif
+
+#ifndef FTP_DELTA_SUFFIX
+    #define FTP_DELTA_SUFFIX ".ftpsrv-delta"
+#endif
+
+// how deep SITE MANIFEST walks into a tree, dirs below this are listed but
+// not opened. set to 0 to disable.
+#ifndef FTP_MANIFEST_DEPTH
+    #define FTP_MANIFEST_DEPTH 0
+#endif
+
+// SITE MSTAT, size / mtime / type of many paths at once, set to 0 to disable.
+#ifndef FTP_MSTAT
+    #define FTP_MSTAT 0
+#endif
+
+// SITE WATCH / UNWATCH / CHANGES, dirs that can be watched at once across
+// all sessions, set to 0 to disable.
+#ifndef FTP_WATCH_DIRS
+    #define FTP_WATCH_DIRS 0
+#endif
+
+// dirs each session can watch.
+#ifndef FTP_WATCH_SESSION_DIRS
+    #define FTP_WATCH_SESSION_DIRS 8
+#endif
+
+// changes queued for each session, once full they're merged into a
+// change to each dir, which has to be listed again.
+#ifndef FTP_WATCH_EVENTS
+    #define FTP_WATCH_EVENTS 32
+#endif
+
+#ifndef FTP_WATCH_NAME_SIZE
+    #define FTP_WATCH_NAME_SIZE 256
+#endif
+
+// ms between checking for changes while a session is waiting for them.
+#ifndef FTP_WATCH_INTERVAL
+    #define FTP_WATCH_INTERVAL 100
+#endif
+
+// ms between stats of dirs that the vfs can't watch.
+#ifndef FTP_WATCH_POLL_INTERVAL
+    #define FTP_WATCH_POLL_INTERVAL 2000
+#endif
+
+// longest SITE CHANGES can wait for, in seconds.
+#ifndef FTP_WATCH_MAX_WAIT
+    #define FTP_WATCH_MAX_WAIT 300
+#endif
+
+// RETR of <dir>.zip / <dir>.tar streams an archive of the dir, made as it
+// is sent. this is how deep it walks into the tree, dirs below this are
+// added but not opened. set to 0 to disable, needs FTP_HASH for the zip crc.
+#ifndef FTP_ARCHIVE_DEPTH
+    #define FTP_ARCHIVE_DEPTH 0
+#endif
+
+// the zip central dir is spooled to <dir><suffix>.<session> next to the dir
+// until every entry has been sent.
+#ifndef FTP_ARCHIVE_SPOOL_SUFFIX
+    #define FTP_ARCHIVE_SPOOL_SUFFIX ".ftpsrv-spool"
+#endif
+
+// SITE MANIFEST and archives walk the tree the same way, with one open dir
+// per level.
+#if FTP_MANIFEST_DEPTH > FTP_ARCHIVE_DEPTH
+    #define FTP_WALK_DEPTH FTP_MANIFEST_DEPTH
+#else
+    #define FTP_WALK_DEPTH FTP_ARCHIVE_DEPTH
+#endif
+
+#if FTP_WATCH_DIRS && FTP_WATCH_EVENTS <= FTP_WATCH_SESSION_DIRS
+    #error "FTP_WATCH_EVENTS must be larger than FTP_WATCH_SESSION_DIRS"
+#endif
+
+#if FTP_DELTA_UPLOADS && !FTP_HASH
+    #error "FTP_DELTA_UPLOADS needs FTP_HASH"
+#endif
+
+#if FTP_ARCHIVE_DEPTH && !FTP_HASH
+    #error "FTP_ARCHIVE_DEPTH needs FTP_HASH"
+#endif
+
+#if FTP_HASH
+    #include "hash/hash.h"
+#endif
+
 #define TELNET_EOL "\r\n"
 
+// static tracepoints (usdt), these compile to a single nop when enabled
+// and are removed entirely if sys/sdt.h is not available.
+// list them with: bpftrace -l 'usdt:/path/to/ftpexe:ftpsrv:*'
+#if defined(HAVE_SYS_SDT_H) && HAVE_SYS_SDT_H
+    #include <sys/sdt.h>
+    #define FTP_TRACE2(name, a, b) DTRACE_PROBE2(ftpsrv, name, a, b)
+    #define FTP_TRACE3(name, a, b, c) DTRACE_PROBE3(ftpsrv, name, a, b, c)
+    #define FTP_TRACE4(name, a, b, c, d) DTRACE_PROBE4(ftpsrv, name, a, b, c, d)
+#else
+    #define FTP_TRACE2(name, a, b)
+    #define FTP_TRACE3(name, a, b, c)
+    #define FTP_TRACE4(name, a, b, c, d)
+#endif
+
 enum FTP_TYPE {
     FTP_TYPE_ASCII,  // unsupported
     FTP_TYPE_EBCDIC, // unsupported
@@ -84,6 +319,11 @@ enum FTP_TRANSFER_MODE {
     FTP_TRANSFER_MODE_STOR, // transfer using STOR
     FTP_TRANSFER_MODE_LIST, // transfer using LIST
     FTP_TRANSFER_MODE_NLST, // transfer using NLST
+    FTP_TRANSFER_MODE_DELTASIG, // transfer using SITE DELTASIG
+    FTP_TRANSFER_MODE_MANIFEST, // transfer using SITE MANIFEST
+    FTP_TRANSFER_MODE_MSTAT, // transfer using SITE MSTAT
+    FTP_TRANSFER_MODE_WATCH, // transfer using SITE CHANGES STREAM
+    FTP_TRANSFER_MODE_ARCHIVE, // transfer using RETR of <dir>.zip / <dir>.tar
 };
 
 enum FTP_AUTH_MODE {
@@ -110,13 +350,143 @@ struct Pathname {
     char s[FTP_PATHNAME_SIZE];
 };
 
+#if FTP_WALK_DEPTH
+enum FTP_WALK_RESULT {
+    FTP_WALK_END,   // every dir has been read.
+    FTP_WALK_AGAIN, // nothing was read this time, call again.
+    FTP_WALK_ENTRY, // path is the next entry.
+};
+
+// a tree walked an entry at a time, so that it carries on from where it
+// was on the next call.
+struct FtpWalk {
+    unsigned depth;             // dirs open in dirs, the last is being read.
+    size_t len[FTP_WALK_DEPTH]; // length of path for each open dir.
+    struct FtpVfsDir dirs[FTP_WALK_DEPTH];
+    struct Pathname path;       // the entry last read, a byte is left to add a slash.
+};
+#endif
+
+#if FTP_ARCHIVE_DEPTH
+enum FTP_ARCHIVE_STATE {
+    FTP_ARCHIVE_STATE_NEXT,    // read the next entry of the tree.
+    FTP_ARCHIVE_STATE_HEADER,  // tar header(s) / zip local header.
+    FTP_ARCHIVE_STATE_DATA,    // the file's data.
+    FTP_ARCHIVE_STATE_TRAILER, // tar padding / zip data descriptor.
+    FTP_ARCHIVE_STATE_CENTRAL, // zip central dir, a header for each entry.
+    FTP_ARCHIVE_STATE_END,     // tar end blocks / zip end of central dir.
+};
+#endif
+
+#if FTP_MANIFEST_DEPTH
+// SITE MANIFEST.
+struct FtpManifest {
+    struct FtpWalk walk; // the tree being sent.
+    bool hash;           // digests kept in the hash sidecars are listed.
+    size_t root;         // length of the path asked for, names are relative to it.
+};
+#endif
+
+#if FTP_MSTAT
+// SITE MSTAT, with the paths sent over the data connection.
+struct FtpMstat {
+    bool eof;   // the client has sent all of its paths.
+    size_t len; // bytes of in received.
+    char in[FTP_PATHNAME_SIZE + 1]; // paths received, one per line.
+};
+#endif
+
+#if FTP_ARCHIVE_DEPTH
+// RETR of <dir>.zip / <dir>.tar.
+struct FtpArchive {
+    struct FtpWalk walk; // the tree being sent.
+    bool zip;            // a zip, otherwise a tar.
+    bool record;         // a central dir record has been read into the entry.
+    enum FTP_ARCHIVE_STATE state;
+    size_t name;         // offset of the entry's name in the archive into walk.path, dirs end with a slash.
+    struct stat st;      // of the entry being sent.
+    size_t off;          // bytes of the current header / trailer that have been sent.
+    size_t left;         // bytes of the entry's data still to send.
+    size_t entry;        // offset of the entry's zip local header, or of the end records.
+    size_t count;        // zip: entries in the central dir.
+    size_t cd_off;       // zip: offset of the central dir.
+    uint32_t crc;        // zip: of the entry, once it has all been sent.
+    struct HashCtx hash; // zip: crc32 of the entry's data sent so far.
+    struct FtpVfsFile spool;    // zip: the central dir records, sent once every entry has been.
+    struct Pathname spool_path; // zip: empty if there's no spool.
+};
+#endif
+
 struct FtpTransfer {
     enum FTP_TRANSFER_MODE mode;
     bool connection_pending;
 
     size_t offset;
-    size_t size; // only set during RETR, LIST and NLIST.
+    size_t size; // only set during RETR, LIST, NLIST and DELTASIG.
     size_t index; // only used for NLIST and LIST devices.
+    size_t transferred; // bytes sent / received on the data connection.
+    size_t start_offset; // file offset when the transfer was opened.
+    size_t start_time; // timestamp in ms when the transfer was opened.
+    size_t end; // file offset the transfer stops at (RANG), 0 for the whole file.
+
+#if FTP_READ_SHARE_SEGMENTS
+    unsigned share_file; // 1 based index into read_share_files, 0 if not shared.
+    unsigned share_gen;  // gen of the shared file when it was joined.
+    size_t file_pos;     // offset of file_vfs, which may lag behind offset.
+#endif
+
+#if FTP_FILE_CACHE_SIZE
+    unsigned file_cache; // 1 based index into file_cache, 0 if read from file_vfs.
+#endif
+
+#if FTP_VFS_ADVISE
+    bool advise;        // page cache hints are given for this transfer.
+    size_t advise_off;  // everything before this has been dropped / written back.
+    size_t advise_prev; // STOR: start of the range that is being written back.
+#endif
+
+#if FTP_UPLOAD_JOURNAL
+    bool journal;       // the journal is updated as this upload moves.
+    size_t journal_off; // offset last flushed and written to the journal.
+#endif
+
+#if FTP_SEGMENT_UPLOADS
+    unsigned segment; // 1 based index into segment_uploads, 0 if not a segment.
+#endif
+
+#if FTP_HASH
+    bool hash; // STOR: the upload is hashed as it arrives (cfg.upload_hash).
+    struct HashCtx hash_ctx;
+#endif
+
+#if FTP_DELTA_UPLOADS
+    size_t sig_block; // DELTASIG: block size.
+    size_t sig_sent;  // DELTASIG: bytes of list_buf that have been sent.
+    size_t sig_len;   // DELTASIG: bytes of records in list_buf.
+
+    bool delta;         // STOR: the data is a delta against delta_vfs (SITE DELTA).
+    bool delta_end;     // the end op has been received, only EOF may follow.
+    bool delta_copy;    // delta_left bytes are read from delta_vfs, otherwise received.
+    size_t delta_left;  // bytes of the current literal / copy still to write.
+    size_t delta_op_len; // bytes of delta_op received.
+    unsigned char delta_op[13];
+    struct FtpVfsFile delta_vfs; // the basis file.
+#endif
+
+#if FTP_MANIFEST_DEPTH || FTP_MSTAT || FTP_ARCHIVE_DEPTH
+    // only the one for mode is used.
+    union {
+#if FTP_MANIFEST_DEPTH
+        struct FtpManifest manifest;
+#endif
+#if FTP_MSTAT
+        struct FtpMstat mstat;
+#endif
+#if FTP_ARCHIVE_DEPTH
+        struct FtpArchive archive;
+#endif
+    };
+#endif
 
     struct FtpVfsFile file_vfs;
     struct FtpVfsDir dir_vfs;
@@ -124,6 +494,52 @@ struct FtpTransfer {
     char list_buf[FTP_LISTBUF_SIZE];
 };
 
+#if FTP_PREFETCH_WINDOW
+// follows the last dir listed, so that the files after the one being
+// downloaded can be read ahead.
+struct FtpPrefetch {
+    bool listed;    // dir_path was listed, following starts at the next RETR in it.
+    unsigned count; // names in window.
+    struct FtpVfsDir dir; // open while following the listing.
+    struct Pathname dir_path;
+    char window[FTP_PREFETCH_WINDOW][FTP_PREFETCH_NAME_SIZE]; // next files, already read ahead.
+};
+#endif
+
+#if FTP_HASH
+// a file being hashed, which is read a bit each loop. commands sent after
+// it wait until the reply has been sent.
+struct FtpHash {
+    bool active;
+    bool x_reply;       // XCRC / XMD5 / XSHA1 / XSHA256, the reply is just the digest.
+    enum HashType type; // algorithm used by HASH, set with OPTS HASH.
+    size_t start;       // file offset hashing started at.
+    size_t offset;      // next file offset to read.
+    size_t end;         // file offset hashing stops at, 0 for EOF.
+    struct HashCtx ctx;
+    struct FtpVfsFile file;
+    struct stat st;       // of the file when hashing started.
+    struct Pathname path; // as sent by the client, for the reply.
+    struct Pathname fullpath;
+};
+#endif
+
+#if FTP_WATCH_DIRS
+struct FtpWatchEvent {
+    unsigned watch; // 1 based index into watches.
+    char name[FTP_WATCH_NAME_SIZE]; // empty if the whole dir changed.
+};
+
+// dirs a session is watching and the changes it hasn't been sent yet.
+struct FtpWatchSession {
+    bool waiting;    // SITE CHANGES is waiting for a change.
+    size_t wait_end; // timestamp in ms the wait ends at.
+    unsigned watches[FTP_WATCH_SESSION_DIRS]; // 1 based indices into watches, 0 if unused.
+    unsigned event_count;
+    struct FtpWatchEvent events[FTP_WATCH_EVENTS];
+};
+#endif
+
 struct FtpSession {
     enum FTP_SESSION_STATE state;
     enum FTP_AUTH_MODE auth_mode;
@@ -139,10 +555,12 @@ struct FtpSession {
     struct FtpSocket pasv_sock;    // socket for PASV listen fd
 
     struct sockaddr_in control_sockaddr;
+    struct sockaddr_in peer_sockaddr;
     struct sockaddr_in data_sockaddr;
     struct sockaddr_in pasv_sockaddr;
 
     long server_marker; // file offset when using REST
+    size_t range_end;   // one past the last byte when using RANG, 0 if not set.
 
     time_t last_update_time; // time since sessions last updated
 
@@ -155,16 +573,124 @@ struct FtpSession {
 
     struct Pathname pwd;   // current directory
     struct Pathname temp_path; // rename from buffer / LIST fullpath
+
+#if FTP_PREFETCH_WINDOW
+    struct FtpPrefetch prefetch;
+#endif
+
+#if FTP_HASH
+    struct FtpHash hash;
+#endif
+
+#if FTP_DELTA_UPLOADS
+    struct Pathname delta_basis; // SITE DELTA, used by the next STOR.
+#endif
+
+#if FTP_WATCH_DIRS
+    struct FtpWatchSession watch;
+#endif
+};
+
+#if FTP_STAT_CACHE_SIZE
+struct FtpStatCacheEntry {
+    unsigned gen;  // generation it was added in, 0 if unused.
+    unsigned hash;
+    size_t time;   // timestamp in ms when it was added.
+    bool is_lstat; // result of lstat rather than stat.
+    int err;       // 0 if st is valid, otherwise the errno (ENOENT).
+    struct stat st;
+    char path[FTP_STAT_CACHE_PATH_SIZE];
+};
+#endif
+
+#if FTP_READ_SHARE_SEGMENTS
+// a file being read by one or more sessions, identified by its stat.
+struct FtpReadShareFile {
+    unsigned gen;  // bumped when the slot is reused or the file changed.
+    unsigned refs; // sessions reading it.
+    bool valid;    // false once the file changed, no new sessions join it.
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    size_t last_used;
+};
+
+// a block of a shared file, refs on the file keep it from being evicted
+// before the blocks of files that nobody is reading.
+struct FtpReadShareSegment {
+    unsigned file; // 1 based index into read_share_files, 0 if unused.
+    unsigned gen;  // gen of the file when it was read.
+    size_t block;  // file offset / FTP_READ_SHARE_SEGMENT_SIZE.
+    size_t len;    // less than a full segment only at the end of the file.
+    size_t last_used;
+    unsigned char data[FTP_READ_SHARE_SEGMENT_SIZE];
+};
+#endif
+
+#if FTP_FILE_CACHE_SIZE
+// a small file that has been asked for, its data is only in memory once
+// it has been asked for cfg.file_cache_admit times.
+struct FtpFileCacheEntry {
+    bool used;
+    bool resident; // data is at file_cache_data + off.
+    bool stale;    // changed while being sent, freed once refs drops to 0.
+    unsigned refs; // sessions sending it.
+    unsigned hits;
+    unsigned hash;
+    size_t off;
+    size_t size;
+    time_t mtime;
+    size_t last_used;
+    char path[FTP_FILE_CACHE_PATH_SIZE];
+};
+#endif
+
+#if FTP_SEGMENT_UPLOADS
+struct FtpSegmentRange {
+    size_t start;
+    size_t end;
+};
+
+// a file being uploaded in parts by several sessions. STORs to the path
+// write to a temp file next to it, which is renamed over it on commit.
+struct FtpSegmentUpload {
+    bool used;
+    unsigned refs; // sessions writing to it.
+    size_t size;
+    time_t last_used;
+    unsigned range_count;
+    struct FtpSegmentRange ranges[FTP_SEGMENT_RANGES]; // sorted and merged.
+    struct Pathname path;
+};
+#endif
+
+#if FTP_WATCH_DIRS
+// a dir watched by one or more sessions.
+struct FtpWatch {
+    unsigned refs; // sessions watching it, 0 if unused.
+    int id;        // from ftp_vfs_watch_add(), -1 if it's polled.
+    bool exists;   // polled: the dir was there when last checked.
+    time_t mtime;  // polled: of the dir when last checked.
+    struct Pathname path;
 };
+#endif
 
 struct FtpCommand {
-    const char name[5];
+    const char name[8];
     void (*func)(struct FtpSession* session, const char* data);
     bool auth_required;
     bool args_required;
     bool data_connection_required;
 };
 
+// SITE <SP> <name> [<SP> <args>], see FTP_SITE_COMMANDS.
+struct FtpSiteCommand {
+    const char* name;
+    void (*func)(struct FtpSession* session, const char* data);
+    bool args_required;
+};
+
 struct Ftp {
     int initialised;
     struct FtpSocket server_sock;
@@ -174,6 +700,44 @@ struct Ftp {
 
     unsigned char data_buf[FTP_FILE_BUFFER_SIZE];
     struct FtpSrvConfig cfg;
+
+    // resolved at init, NULL if nothing is listening.
+    FtpSrvEventCallback event_callback;
+
+#if FTP_STAT_CACHE_SIZE
+    // bumped to drop every entry at once.
+    unsigned stat_cache_gen;
+    unsigned stat_cache_next;
+    struct FtpStatCacheEntry stat_cache[FTP_STAT_CACHE_SIZE];
+#endif
+
+#if FTP_READ_SHARE_SEGMENTS
+    size_t read_share_tick; // lru counter for files and segments.
+    struct FtpReadShareFile read_share_files[FTP_READ_SHARE_FILES];
+    struct FtpReadShareSegment* read_share_segments; // FTP_READ_SHARE_SEGMENTS, NULL unless cfg.read_share.
+#endif
+
+#if FTP_FILE_CACHE_SIZE
+    size_t file_cache_tick; // lru counter.
+    struct FtpFileCacheEntry file_cache[FTP_FILE_CACHE_ENTRIES];
+    unsigned char* file_cache_data; // cfg.file_cache_size bytes, NULL if it's 0.
+#endif
+
+#if FTP_SEGMENT_UPLOADS
+    struct FtpSegmentUpload segment_uploads[FTP_SEGMENT_UPLOADS];
+#endif
+
+#if FTP_HASH
+    unsigned hash_count; // sessions that are hashing a file.
+    bool upload_hash;    // cfg.upload_hash is a known algorithm.
+    enum HashType upload_hash_type;
+#endif
+
+#if FTP_WATCH_DIRS
+    size_t watch_last_check; // timestamp in ms changes were last read.
+    size_t watch_last_poll;  // timestamp in ms polled dirs were last checked.
+    struct FtpWatch watches[FTP_WATCH_DIRS];
+#endif
 };
 
 static struct Ftp g_ftp = {0};
@@ -214,18 +778,58 @@ static struct tm* unpack_time(const time_t* timer, struct tm* buf) {
     return r;
 }
 
+static inline unsigned ftp_session_index(const struct FtpSession* session) {
+    return session - g_ftp.sessions;
+}
+
 static size_t ftp_get_timestamp_ms(void) {
     struct timeval ts;
     gettimeofday(&ts, NULL);
     return (ts.tv_sec * 1000000UL + ts.tv_usec) / 1000UL;
 }
 
-static void ftp_log_callback(enum FTP_API_LOG_TYPE type, const char* msg) {
-    if (g_ftp.cfg.log_callback) {
-        g_ftp.cfg.log_callback(type, msg);
+static const char* ftp_transfer_mode_name(enum FTP_TRANSFER_MODE mode) {
+    switch (mode) {
+        case FTP_TRANSFER_MODE_NONE: return "NONE";
+        case FTP_TRANSFER_MODE_RETR: return "RETR";
+        case FTP_TRANSFER_MODE_STOR: return "STOR";
+        case FTP_TRANSFER_MODE_LIST: return "LIST";
+        case FTP_TRANSFER_MODE_NLST: return "NLST";
+        case FTP_TRANSFER_MODE_DELTASIG: return "DELTASIG";
+        case FTP_TRANSFER_MODE_MANIFEST: return "MANIFEST";
+        case FTP_TRANSFER_MODE_MSTAT: return "MSTAT";
+        case FTP_TRANSFER_MODE_WATCH: return "WATCH";
+        case FTP_TRANSFER_MODE_ARCHIVE: return "ARCHIVE";
+    }
+    return "NONE";
+}
+
+// forwards the events that the string callback has always received.
+static void ftp_legacy_log_callback(const struct FtpSrvEvent* event, void* userdata) {
+    switch (event->type) {
+        case FTP_API_EVENT_TYPE_COMMAND:
+            g_ftp.cfg.log_callback(FTP_API_LOG_TYPE_COMMAND, event->name);
+            break;
+        case FTP_API_EVENT_TYPE_REPLY:
+            g_ftp.cfg.log_callback(FTP_API_LOG_TYPE_RESPONSE, event->text);
+            break;
+        case FTP_API_EVENT_TYPE_ERROR:
+            g_ftp.cfg.log_callback(FTP_API_LOG_TYPE_ERROR, event->text);
+            break;
+        default:
+            break;
     }
 }
 
+// callers must check g_ftp.event_callback first, so that building the
+// event is skipped when nothing is listening.
+static void ftp_event_emit(const struct FtpSession* session, struct FtpSrvEvent* event) {
+    event->session = ftp_session_index(session);
+    event->addr = session->peer_sockaddr.sin_addr.s_addr;
+    event->port = ntohs(session->peer_sockaddr.sin_port);
+    g_ftp.event_callback(event, g_ftp.cfg.event_userdata);
+}
+
 static void ftp_set_server_socket_options(struct FtpSocket* sock) {
     ftp_socket_set_nonblocking_enable(sock, 1);
     ftp_socket_set_reuseaddr_enable(sock, 1);
@@ -276,6 +880,46 @@ static void remove_slashes(struct Pathname* pathname) {
     }
 }
 
+// the files the server keeps next to the ones it serves (journals, hash
+// sidecars, segments, deltas and archive spools, and their ".tmp" files). they're hidden
+// from listings and can't be named by clients, so that they can't be
+// forged, removed or overwritten. only the features built in reserve theirs.
+static bool ftp_is_reserved_name(const char* name) {
+#if FTP_UPLOAD_JOURNAL || FTP_SEGMENT_UPLOADS || FTP_HASH || FTP_DELTA_UPLOADS || FTP_ARCHIVE_DEPTH
+    static const char* const suffixes[] = {
+    #if FTP_UPLOAD_JOURNAL
+        FTP_UPLOAD_JOURNAL_SUFFIX,
+    #endif
+    #if FTP_SEGMENT_UPLOADS
+        FTP_SEGMENT_SUFFIX,
+    #endif
+    #if FTP_HASH
+        FTP_HASH_SIDECAR_SUFFIX,
+    #endif
+    #if FTP_DELTA_UPLOADS
+        FTP_DELTA_SUFFIX,
+    #endif
+    #if FTP_ARCHIVE_DEPTH
+        FTP_ARCHIVE_SPOOL_SUFFIX,
+    #endif
+    };
+
+    const char* base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        const size_t len = strlen(suffixes[i]);
+        for (const char* p = strstr(base, suffixes[i]); p; p = strstr(p + 1, suffixes[i])) {
+            if (p[len] == '\0' || p[len] == '.') {
+                return true;
+            }
+        }
+    }
+#endif
+
+    return false;
+}
+
 static int build_fullpath(const struct FtpSession* session, struct Pathname* out, struct Pathname pathname) {
     int rc = 0;
     remove_slashes(&pathname);
@@ -305,6 +949,9 @@ static int build_fullpath(const struct FtpSession* session, struct Pathname* out
     // return an error if the output was truncated or it failed.
     if (rc < 0 || rc >= sizeof(*out)) {
         rc = -1;
+    } else if (ftp_is_reserved_name(out->s)) {
+        errno = EACCES;
+        rc = -1;
     } else {
         rc = 0;
     }
@@ -312,298 +959,3020 @@ static int build_fullpath(const struct FtpSession* session, struct Pathname* out
     return rc;
 }
 
-static void ftp_update_session_time(struct FtpSession* session) {
-    if (session->state != FTP_SESSION_STATE_NONE) {
-        session->last_update_time = time(NULL);
+#if FTP_STAT_CACHE_SIZE || FTP_FILE_CACHE_SIZE
+// fnv-1a
+static unsigned ftp_path_hash(const char* path) {
+    unsigned hash = 2166136261u;
+    for (; *path; path++) {
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
     }
+    return hash;
 }
+#endif
 
-// SOURCE: https://cr.yp.to/ftp/list/binls.html
-static int ftp_build_list_entry(struct FtpSession* session, const struct Pathname* fullpath, const char* name, const struct stat* st) {
-    int rc;
-    struct FtpTransfer* transfer = &session->transfer;
+#if FTP_STAT_CACHE_SIZE
 
-    if (transfer->mode == FTP_TRANSFER_MODE_NLST) {
-        rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "%s" TELNET_EOL, name);
-    } else {
-        static const char months[12][4] = {
-            "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
-        };
+static struct FtpStatCacheEntry* ftp_stat_cache_find(const char* path, unsigned hash, bool is_lstat) {
+    const size_t now = ftp_get_timestamp_ms();
 
-        char perms[11] = {0};
-        switch (st->st_mode & S_IFMT) {
-            case S_IFREG:   perms[0] = '-'; break;
-            case S_IFDIR:   perms[0] = 'd'; break;
-            case S_IFLNK:   perms[0] = 'l'; break;
-            case S_IFIFO:   perms[0] = 'p'; break;
-            case S_IFSOCK:  perms[0] = 's'; break;
-            case S_IFCHR:   perms[0] = 'c'; break;
-            case S_IFBLK:   perms[0] = 'b'; break;
-            default:        perms[0] = '?'; break;
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.stat_cache); i++) {
+        struct FtpStatCacheEntry* e = &g_ftp.stat_cache[i];
+        if (e->gen != g_ftp.stat_cache_gen || e->hash != hash || e->is_lstat != is_lstat) {
+            continue;
         }
 
-        perms[1] = (st->st_mode & S_IRUSR) ? 'r' : '-';
-        perms[2] = (st->st_mode & S_IWUSR) ? 'w' : '-';
-        perms[3] = (st->st_mode & S_IXUSR) ? 'x' : '-';
-        perms[4] = (st->st_mode & S_IRGRP) ? 'r' : '-';
-        perms[5] = (st->st_mode & S_IWGRP) ? 'w' : '-';
-        perms[6] = (st->st_mode & S_IXGRP) ? 'x' : '-';
-        perms[7] = (st->st_mode & S_IROTH) ? 'r' : '-';
-        perms[8] = (st->st_mode & S_IWOTH) ? 'w' : '-';
-        perms[9] = (st->st_mode & S_IXOTH) ? 'x' : '-';
-
-        struct Pathname symlink_path = {0};
-        if (perms[0] == 'l') {
-            strcpy(symlink_path.s, " -> ");
-            const int len = ftp_vfs_readlink(fullpath->s, symlink_path.s + strlen(symlink_path.s), sizeof(symlink_path) - strlen(symlink_path.s));
-            if (len < 0) {
-                symlink_path.s[0] = '\0';
-            }
+        if (now - e->time >= g_ftp.cfg.stat_cache_ttl_ms) {
+            e->gen = 0;
+        } else if (!strcmp(e->path, path)) {
+            return e;
         }
+    }
 
-        struct tm tm = {0};
-        unpack_time(&st->st_mtime, &tm);
+    return NULL;
+}
 
-        // if the time is greater than 6 months, show year rather than time
-        char date[6] = {0};
-        const long six_months = 60ll * 60ll * 24ll * (365ll / 2ll);
-        if (labs(difftime(session->last_update_time, st->st_mtime)) > six_months) {
-            snprintf(date, sizeof(date), "%5u", tm.tm_year + 1900);
-        } else {
-            snprintf(date, sizeof(date), "%02u:%02u", tm.tm_hour, tm.tm_min);
+static void ftp_stat_cache_add(const char* path, unsigned hash, bool is_lstat, int err, const struct stat* st) {
+    // prefer a free / stale slot, otherwise replace in order.
+    struct FtpStatCacheEntry* e = NULL;
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.stat_cache); i++) {
+        if (g_ftp.stat_cache[i].gen != g_ftp.stat_cache_gen) {
+            e = &g_ftp.stat_cache[i];
+            break;
         }
+    }
 
-        const unsigned nlink = st->st_nlink;
-        const size_t size = S_ISDIR(st->st_mode) ? 0 : st->st_size;
+    if (!e) {
+        e = &g_ftp.stat_cache[g_ftp.stat_cache_next++ % FTP_ARR_SZ(g_ftp.stat_cache)];
+    }
 
-        rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "%s %3u %s %s %13zu %s %3d %s %s%s" TELNET_EOL,
-            perms,
-            nlink,
+    e->gen = g_ftp.stat_cache_gen;
+    e->hash = hash;
+    e->time = ftp_get_timestamp_ms();
+    e->is_lstat = is_lstat;
+    e->err = err;
+    if (!err) {
+        e->st = *st;
+    }
+    strcpy(e->path, path);
+}
+#endif
+
+// stat / lstat through the cache, ENOENT is cached as well.
+static int ftp_stat_cached(const char* path, struct stat* st, bool is_lstat) {
+#if FTP_STAT_CACHE_SIZE
+    const bool cacheable = g_ftp.cfg.stat_cache_ttl_ms && strlen(path) < FTP_STAT_CACHE_PATH_SIZE;
+    unsigned hash = 0;
+
+    if (cacheable) {
+        hash = ftp_path_hash(path);
+        const struct FtpStatCacheEntry* e = ftp_stat_cache_find(path, hash, is_lstat);
+        if (e) {
+            FTP_TRACE2(stat__cache, 1, e->err);
+            if (e->err) {
+                errno = e->err;
+                return -1;
+            }
+            *st = e->st;
+            return 0;
+        }
+    }
+#endif
+
+    const int rc = is_lstat ? ftp_vfs_lstat(path, st) : ftp_vfs_stat(path, st);
+
+#if FTP_STAT_CACHE_SIZE
+    if (cacheable) {
+        FTP_TRACE2(stat__cache, 0, rc < 0 ? errno : 0);
+        if (rc >= 0) {
+            ftp_stat_cache_add(path, hash, is_lstat, 0, st);
+        } else if (errno == ENOENT) {
+            ftp_stat_cache_add(path, hash, is_lstat, ENOENT, NULL);
+        }
+    }
+#endif
+
+    return rc;
+}
+
+// returns true if the path is cached as not existing.
+static bool ftp_stat_cache_is_missing(const char* path) {
+#if FTP_STAT_CACHE_SIZE
+    if (g_ftp.cfg.stat_cache_ttl_ms && strlen(path) < FTP_STAT_CACHE_PATH_SIZE) {
+        const unsigned hash = ftp_path_hash(path);
+        for (int i = 0; i < 2; i++) {
+            const struct FtpStatCacheEntry* e = ftp_stat_cache_find(path, hash, i);
+            if (e && e->err == ENOENT) {
+                errno = ENOENT;
+                return true;
+            }
+        }
+    }
+#endif
+    return false;
+}
+
+// drops the entries for a path and its parent dir, used after a file is
+// created, written to or removed.
+static void ftp_stat_cache_invalidate(const char* path) {
+#if FTP_STAT_CACHE_SIZE
+    if (!g_ftp.cfg.stat_cache_ttl_ms) {
+        return;
+    }
+
+    const char* last_slash = strrchr(path, '/');
+    const size_t parent_len = last_slash ? (size_t)(last_slash - path) : 0;
+
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.stat_cache); i++) {
+        struct FtpStatCacheEntry* e = &g_ftp.stat_cache[i];
+        if (e->gen != g_ftp.stat_cache_gen) {
+            continue;
+        }
+
+        if (!strcmp(e->path, path)) {
+            e->gen = 0;
+        } else if (parent_len ? (!strncmp(e->path, path, parent_len) && e->path[parent_len] == '\0') : !strcmp(e->path, "/")) {
+            e->gen = 0;
+        }
+    }
+#endif
+}
+
+// drops everything, used when a whole tree may have moved (RNTO). RMD only
+// removes empty dirs, so invalidating the dir itself is enough there.
+static void ftp_stat_cache_flush(void) {
+#if FTP_STAT_CACHE_SIZE
+    // 0 is reserved for unused entries.
+    if (!++g_ftp.stat_cache_gen) {
+        memset(g_ftp.stat_cache, 0, sizeof(g_ftp.stat_cache));
+        g_ftp.stat_cache_gen = 1;
+    }
+#endif
+}
+
+#if FTP_READ_SHARE_SEGMENTS
+// returns the shared file the transfer is reading, NULL if it isn't shared
+// or the file has changed since.
+static struct FtpReadShareFile* ftp_read_share_get(const struct FtpTransfer* transfer) {
+    if (!transfer->share_file) {
+        return NULL;
+    }
+
+    struct FtpReadShareFile* file = &g_ftp.read_share_files[transfer->share_file - 1];
+    return file->gen == transfer->share_gen ? file : NULL;
+}
+
+static struct FtpReadShareSegment* ftp_read_share_find(unsigned file_index, unsigned gen, size_t block) {
+    for (unsigned i = 0; i < FTP_READ_SHARE_SEGMENTS; i++) {
+        struct FtpReadShareSegment* seg = &g_ftp.read_share_segments[i];
+        if (seg->file == file_index && seg->gen == gen && seg->block == block) {
+            return seg;
+        }
+    }
+
+    return NULL;
+}
+
+// prefer an unused / stale segment, then the oldest of a file that nobody
+// is reading, then one that every session reading its file has gone past.
+// returns NULL if every segment may still be needed.
+static struct FtpReadShareSegment* ftp_read_share_evict(void) {
+    size_t min_offset[FTP_READ_SHARE_FILES];
+    memset(min_offset, 0xFF, sizeof(min_offset));
+
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+        const struct FtpTransfer* transfer = &g_ftp.sessions[i].transfer;
+        if (ftp_read_share_get(transfer) && transfer->offset < min_offset[transfer->share_file - 1]) {
+            min_offset[transfer->share_file - 1] = transfer->offset;
+        }
+    }
+
+    struct FtpReadShareSegment* idle = NULL;
+    struct FtpReadShareSegment* behind = NULL;
+
+    for (unsigned i = 0; i < FTP_READ_SHARE_SEGMENTS; i++) {
+        struct FtpReadShareSegment* seg = &g_ftp.read_share_segments[i];
+        if (!seg->file) {
+            return seg;
+        }
+
+        const struct FtpReadShareFile* file = &g_ftp.read_share_files[seg->file - 1];
+        if (file->gen != seg->gen) {
+            return seg;
+        }
+
+        if (!file->refs) {
+            if (!idle || seg->last_used < idle->last_used) {
+                idle = seg;
+            }
+        } else if ((seg->block + 1) * FTP_READ_SHARE_SEGMENT_SIZE <= min_offset[seg->file - 1]) {
+            if (!behind || seg->last_used < behind->last_used) {
+                behind = seg;
+            }
+        }
+    }
+
+    return idle ? idle : behind;
+}
+#endif
+
+// joins the shared file for path, or creates it, so that other sessions
+// reading the same file can reuse the blocks this one reads.
+static void ftp_read_share_open(struct FtpTransfer* transfer, const char* path) {
+#if FTP_READ_SHARE_SEGMENTS
+    transfer->share_file = 0;
+    transfer->file_pos = transfer->offset;
+
+    struct stat st;
+    if (!g_ftp.cfg.read_share || ftp_vfs_stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    struct FtpReadShareFile* file = NULL;
+    struct FtpReadShareFile* free_slot = NULL;
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.read_share_files); i++) {
+        struct FtpReadShareFile* f = &g_ftp.read_share_files[i];
+        if (f->valid && f->dev == st.st_dev && f->ino == st.st_ino && f->size == st.st_size && f->mtime == st.st_mtime) {
+            file = f;
+            break;
+        }
+
+        if (!f->refs && (!free_slot || f->last_used < free_slot->last_used)) {
+            free_slot = f;
+        }
+    }
+
+    if (!file) {
+        // every slot is being read, this session reads on its own.
+        if (!free_slot) {
+            return;
+        }
+
+        file = free_slot;
+        file->gen++;
+        file->valid = true;
+        file->dev = st.st_dev;
+        file->ino = st.st_ino;
+        file->size = st.st_size;
+        file->mtime = st.st_mtime;
+    }
+
+    file->refs++;
+    file->last_used = ++g_ftp.read_share_tick;
+    transfer->share_file = file - g_ftp.read_share_files + 1;
+    transfer->share_gen = file->gen;
+#endif
+}
+
+static void ftp_read_share_close(struct FtpTransfer* transfer) {
+#if FTP_READ_SHARE_SEGMENTS
+    if (transfer->share_file) {
+        g_ftp.read_share_files[transfer->share_file - 1].refs--;
+        transfer->share_file = 0;
+    }
+#endif
+}
+
+// drops the shared blocks of the file at path, used before it is written
+// to or removed. sessions already reading it carry on with their own reads.
+static void ftp_read_share_invalidate(const char* path) {
+#if FTP_READ_SHARE_SEGMENTS
+    struct stat st;
+    if (!g_ftp.cfg.read_share || ftp_vfs_stat(path, &st) < 0) {
+        return;
+    }
+
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.read_share_files); i++) {
+        struct FtpReadShareFile* f = &g_ftp.read_share_files[i];
+        if (f->valid && f->dev == st.st_dev && f->ino == st.st_ino) {
+            f->gen++;
+            f->valid = false;
+        }
+    }
+#endif
+}
+
+#if FTP_READ_SHARE_SEGMENTS
+// reads the data at transfer->offset, from a shared block if another
+// session has read it already. out is set to the data, which is only valid
+// until the next read. returns the size, 0 on eof or -1 on error.
+static int ftp_read_share_read(struct FtpSession* session, struct FtpTransfer* transfer, struct FtpReadShareFile* file, const unsigned char** out) {
+    const unsigned file_index = transfer->share_file;
+    const size_t block = transfer->offset / FTP_READ_SHARE_SEGMENT_SIZE;
+    const size_t block_off = transfer->offset % FTP_READ_SHARE_SEGMENT_SIZE;
+
+    struct FtpReadShareSegment* seg = ftp_read_share_find(file_index, file->gen, block);
+    FTP_TRACE3(read__share, ftp_session_index(session), seg != NULL, transfer->offset);
+
+    if (!seg) {
+        // nobody else is reading it or every segment is still needed, so
+        // read into data_buf rather than evicting blocks others may need.
+        if (file->refs >= 2) {
+            seg = ftp_read_share_evict();
+        }
+
+        const bool alone = !seg;
+        const size_t pos = alone ? transfer->offset : transfer->offset - block_off;
+
+        // the file_vfs only moves on a miss, so catch it up first.
+        if (transfer->file_pos != pos) {
+            if (ftp_vfs_seek(&transfer->file_vfs, NULL, 0, pos) < 0) {
+                return -1;
+            }
+            transfer->file_pos = pos;
+        }
+
+        if (alone) {
+            const int n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, sizeof(g_ftp.data_buf));
+            if (n > 0) {
+                transfer->file_pos += n;
+            }
+            *out = g_ftp.data_buf;
+            return n;
+        }
+
+        seg->file = 0;
+        seg->len = 0;
+
+        // a short segment marks the end of the file, so fill it completely.
+        while (seg->len < sizeof(seg->data)) {
+            const int n = ftp_vfs_read(&transfer->file_vfs, seg->data + seg->len, sizeof(seg->data) - seg->len);
+            if (n < 0) {
+                return -1;
+            } else if (n == 0) {
+                break;
+            }
+            seg->len += n;
+            transfer->file_pos += n;
+        }
+
+        seg->file = file_index;
+        seg->gen = file->gen;
+        seg->block = block;
+    }
+
+    seg->last_used = ++g_ftp.read_share_tick;
+    if (block_off >= seg->len) {
+        return 0;
+    }
+
+    *out = seg->data + block_off;
+    return seg->len - block_off;
+}
+#endif
+
+#if FTP_FILE_CACHE_SIZE
+static void ftp_file_cache_drop(struct FtpFileCacheEntry* e) {
+    memset(e, 0, sizeof(*e));
+}
+
+static struct FtpFileCacheEntry* ftp_file_cache_find(const char* path, unsigned hash) {
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.file_cache); i++) {
+        struct FtpFileCacheEntry* e = &g_ftp.file_cache[i];
+        if (e->used && !e->stale && e->hash == hash && !strcmp(e->path, path)) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+// the least recently used entry that isn't being sent, preferring ones
+// that only hold a hit count.
+static struct FtpFileCacheEntry* ftp_file_cache_lru(bool resident) {
+    struct FtpFileCacheEntry* lru = NULL;
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.file_cache); i++) {
+        struct FtpFileCacheEntry* e = &g_ftp.file_cache[i];
+        if (e->used && !e->refs && e->resident == resident && (!lru || e->last_used < lru->last_used)) {
+            lru = e;
+        }
+    }
+
+    return lru;
+}
+
+static struct FtpFileCacheEntry* ftp_file_cache_new_entry(void) {
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.file_cache); i++) {
+        if (!g_ftp.file_cache[i].used) {
+            return &g_ftp.file_cache[i];
+        }
+    }
+
+    struct FtpFileCacheEntry* e = ftp_file_cache_lru(false);
+    if (!e) {
+        e = ftp_file_cache_lru(true);
+    }
+
+    if (e) {
+        ftp_file_cache_drop(e);
+    }
+    return e;
+}
+
+// returns true if nothing resident overlaps [off, off + size).
+static bool ftp_file_cache_is_free(size_t off, size_t size) {
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.file_cache); i++) {
+        const struct FtpFileCacheEntry* e = &g_ftp.file_cache[i];
+        if (e->resident && off < e->off + e->size && e->off < off + size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// finds room for size bytes inside the budget, first fit, evicting the
+// least recently used files until it does.
+static bool ftp_file_cache_alloc(size_t size, size_t* out) {
+    const size_t budget = g_ftp.cfg.file_cache_size;
+
+    for (;;) {
+        // a gap can only start at 0 or right after another file.
+        if (size <= budget && ftp_file_cache_is_free(0, size)) {
+            *out = 0;
+            return true;
+        }
+
+        for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.file_cache); i++) {
+            const struct FtpFileCacheEntry* e = &g_ftp.file_cache[i];
+            const size_t off = e->off + e->size;
+            if (e->resident && off + size <= budget && ftp_file_cache_is_free(off, size)) {
+                *out = off;
+                return true;
+            }
+        }
+
+        struct FtpFileCacheEntry* victim = ftp_file_cache_lru(true);
+        if (!victim) {
+            return false;
+        }
+        ftp_file_cache_drop(victim);
+    }
+}
+
+// reads the whole file into the cache.
+static bool ftp_file_cache_fill(struct FtpTransfer* transfer, struct FtpFileCacheEntry* e) {
+    size_t off;
+    if (!ftp_file_cache_alloc(e->size, &off)) {
+        return false;
+    }
+
+    if (ftp_vfs_open(&transfer->file_vfs, e->path, FtpVfsOpenMode_READ) < 0) {
+        return false;
+    }
+
+    size_t size = 0;
+    int n = 0;
+    // read one byte past the end to make sure the size hasn't changed.
+    unsigned char extra;
+    while (size < e->size && (n = ftp_vfs_read(&transfer->file_vfs, g_ftp.file_cache_data + off + size, e->size - size)) > 0) {
+        size += n;
+    }
+    if (n >= 0 && size == e->size) {
+        n = ftp_vfs_read(&transfer->file_vfs, &extra, 1);
+    }
+
+    ftp_vfs_close(&transfer->file_vfs);
+    if (n != 0 || size != e->size) {
+        return false;
+    }
+
+    e->off = off;
+    e->resident = true;
+    return true;
+}
+#endif
+
+// serves small files that are asked for often from memory, the file is
+// validated against the size and mtime from stat (which may itself be
+// cached). returns true if the transfer will be sent from the cache.
+static bool ftp_file_cache_open(struct FtpSession* session, struct FtpTransfer* transfer, const char* path) {
+#if FTP_FILE_CACHE_SIZE
+    transfer->file_cache = 0;
+    if (!g_ftp.cfg.file_cache_size || strlen(path) >= FTP_FILE_CACHE_PATH_SIZE) {
+        return false;
+    }
+
+    struct stat st;
+    if (ftp_stat_cached(path, &st, false) < 0 || !S_ISREG(st.st_mode) || st.st_size > FTP_FILE_CACHE_MAX_FILE) {
+        return false;
+    }
+
+    const unsigned hash = ftp_path_hash(path);
+    struct FtpFileCacheEntry* e = ftp_file_cache_find(path, hash);
+    if (e && (e->size != (size_t)st.st_size || e->mtime != st.st_mtime)) {
+        if (e->refs) {
+            e->stale = true;
+        } else {
+            ftp_file_cache_drop(e);
+        }
+        e = NULL;
+    }
+
+    if (!e) {
+        if (!(e = ftp_file_cache_new_entry())) {
+            return false;
+        }
+        e->used = true;
+        e->hash = hash;
+        e->size = st.st_size;
+        e->mtime = st.st_mtime;
+        strcpy(e->path, path);
+    }
+
+    e->last_used = ++g_ftp.file_cache_tick;
+    const bool hit = e->resident;
+    if (!hit && (++e->hits < g_ftp.cfg.file_cache_admit || !ftp_file_cache_fill(transfer, e))) {
+        return false;
+    }
+
+    FTP_TRACE3(file__cache, ftp_session_index(session), hit, e->size);
+    e->refs++;
+    transfer->file_cache = e - g_ftp.file_cache + 1;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void ftp_file_cache_close(struct FtpTransfer* transfer) {
+#if FTP_FILE_CACHE_SIZE
+    if (transfer->file_cache) {
+        struct FtpFileCacheEntry* e = &g_ftp.file_cache[transfer->file_cache - 1];
+        if (!--e->refs && e->stale) {
+            ftp_file_cache_drop(e);
+        }
+        transfer->file_cache = 0;
+    }
+#endif
+}
+
+// drops the cached file at path, used when it is written to or removed.
+static void ftp_file_cache_invalidate(const char* path) {
+#if FTP_FILE_CACHE_SIZE
+    if (!g_ftp.cfg.file_cache_size || strlen(path) >= FTP_FILE_CACHE_PATH_SIZE) {
+        return;
+    }
+
+    struct FtpFileCacheEntry* e = ftp_file_cache_find(path, ftp_path_hash(path));
+    if (e) {
+        if (e->refs) {
+            e->stale = true;
+        } else {
+            ftp_file_cache_drop(e);
+        }
+    }
+#endif
+}
+
+// drops everything, used when a whole tree may have changed (RNTO).
+static void ftp_file_cache_flush(void) {
+#if FTP_FILE_CACHE_SIZE
+    for (unsigned i = 0; i < FTP_ARR_SZ(g_ftp.file_cache); i++) {
+        struct FtpFileCacheEntry* e = &g_ftp.file_cache[i];
+        if (e->refs) {
+            e->stale = true;
+        } else {
+            ftp_file_cache_drop(e);
+        }
+    }
+#endif
+}
+
+static void ftp_prefetch_stop(struct FtpSession* session) {
+#if FTP_PREFETCH_WINDOW
+    ftp_vfs_closedir(&session->prefetch.dir);
+    session->prefetch.listed = false;
+    session->prefetch.count = 0;
+#endif
+}
+
+// remembers the dir that was just listed, called once the listing is sent.
+static void ftp_prefetch_listed(struct FtpSession* session, const char* path) {
+#if FTP_PREFETCH_WINDOW
+    ftp_prefetch_stop(session);
+    if (g_ftp.cfg.prefetch_files) {
+        snprintf(session->prefetch.dir_path.s, sizeof(session->prefetch.dir_path), "%s", path);
+        session->prefetch.listed = true;
+    }
+#endif
+}
+
+#if FTP_PREFETCH_WINDOW
+static int ftp_prefetch_build_path(const struct FtpSession* session, struct Pathname* out, const char* name) {
+    const char* dir = session->prefetch.dir_path.s;
+    const int rc = snprintf(out->s, sizeof(*out), dir[strlen(dir) - 1] != '/' ? "%s/%s" : "%s%s", dir, name);
+    return rc <= 0 || rc >= sizeof(*out) ? -1 : 0;
+}
+
+// tops the window up with the next files in the listing, and hints to the
+// vfs that the start of each one will be read soon.
+static void ftp_prefetch_fill(struct FtpSession* session) {
+    struct FtpPrefetch* prefetch = &session->prefetch;
+    const unsigned max = g_ftp.cfg.prefetch_files < FTP_PREFETCH_WINDOW ? g_ftp.cfg.prefetch_files : FTP_PREFETCH_WINDOW;
+
+    // the rest is filled on the next RETR if there are lots of dirs.
+    for (unsigned scanned = 0; scanned < FTP_PREFETCH_SCAN && prefetch->count < max && ftp_vfs_isdir_open(&prefetch->dir); scanned++) {
+        struct FtpVfsDirEntry entry;
+        const char* name = ftp_vfs_readdir(&prefetch->dir, &entry);
+        if (!name) {
+            ftp_vfs_closedir(&prefetch->dir);
+            break;
+        }
+
+        if (!strcmp(".", name) || !strcmp("..", name) || ftp_is_reserved_name(name)) {
+            continue;
+        }
+
+        struct Pathname path;
+        struct stat st;
+        if (strlen(name) >= FTP_PREFETCH_NAME_SIZE || ftp_prefetch_build_path(session, &path, name) < 0) {
+            ftp_vfs_closedir(&prefetch->dir);
+            break;
+        }
+
+        // dirs are listed but never downloaded.
+        if (ftp_vfs_dirlstat(&prefetch->dir, &entry, path.s, &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        const size_t size = (size_t)st.st_size < g_ftp.cfg.prefetch_size ? (size_t)st.st_size : g_ftp.cfg.prefetch_size;
+        // best effort, a failed hint is the same as no hint.
+        ftp_vfs_prefetch(path.s, size);
+        FTP_TRACE2(prefetch, ftp_session_index(session), size);
+        strcpy(prefetch->window[prefetch->count++], name);
+    }
+}
+#endif
+
+// called when a file is about to be downloaded. if it is the next file in
+// the last listing (files skipped by the client are fine), the window is
+// moved past it and refilled, anything else stops the read ahead.
+static void ftp_prefetch_retr(struct FtpSession* session, const char* path) {
+#if FTP_PREFETCH_WINDOW
+    struct FtpPrefetch* prefetch = &session->prefetch;
+    if (!prefetch->listed && !prefetch->count) {
+        return;
+    }
+
+    const char* name = strrchr(path, '/');
+    const size_t dir_len = name && name != path ? (size_t)(name - path) : 1;
+    if (!name || strlen(prefetch->dir_path.s) != dir_len || strncmp(prefetch->dir_path.s, path, dir_len)) {
+        ftp_prefetch_stop(session);
+        return;
+    }
+    name++;
+
+    if (prefetch->listed) {
+        // first download since the listing, catch up with it. clients
+        // usually start at the top, so don't read the whole dir to find it.
+        prefetch->listed = false;
+        if (ftp_vfs_opendir(&prefetch->dir, prefetch->dir_path.s) < 0) {
+            return;
+        }
+
+        const char* entry_name;
+        struct FtpVfsDirEntry entry;
+        unsigned scanned = 0;
+        while ((entry_name = ftp_vfs_readdir(&prefetch->dir, &entry)) && strcmp(entry_name, name) && ++scanned < FTP_PREFETCH_SCAN) {
+        }
+
+        if (!entry_name || scanned == FTP_PREFETCH_SCAN) {
+            ftp_prefetch_stop(session);
+            return;
+        }
+    } else {
+        unsigned i = 0;
+        while (i < prefetch->count && strcmp(prefetch->window[i], name)) {
+            i++;
+        }
+
+        if (i == prefetch->count) {
+            ftp_prefetch_stop(session);
+            return;
+        }
+
+        prefetch->count -= i + 1;
+        memmove(prefetch->window, prefetch->window[i + 1], sizeof(prefetch->window[0]) * prefetch->count);
+    }
+
+    ftp_prefetch_fill(session);
+#endif
+}
+
+// called once the file is open. RETRs of large files are read further
+// ahead, uploads are only checked once they grow large. appends are left
+// alone as the offset in the file isn't known.
+static void ftp_advise_open(struct FtpTransfer* transfer, const char* path, enum FtpVfsOpenMode mode) {
+#if FTP_VFS_ADVISE
+    transfer->advise = false;
+    if (!g_ftp.cfg.page_cache_min_size || mode == FtpVfsOpenMode_APPEND) {
+        return;
+    }
+
+    transfer->advise_off = transfer->advise_prev = transfer->offset;
+    if (mode == FtpVfsOpenMode_READ) {
+        struct stat st;
+        if (ftp_stat_cached(path, &st, false) < 0 || (size_t)st.st_size < g_ftp.cfg.page_cache_min_size) {
+            return;
+        }
+        ftp_vfs_advise(&transfer->file_vfs, 0, 0, FtpVfsAdvice_SEQUENTIAL);
+    }
+
+    transfer->advise = true;
+#endif
+}
+
+// called as the transfer moves. every window, a RETR drops what it has
+// sent from the page cache. a STOR starts writing back the last window
+// and drops the one before, which has had a window to be written, so
+// that dirty pages don't pile up.
+static void ftp_advise_progress(struct FtpTransfer* transfer) {
+#if FTP_VFS_ADVISE
+    const size_t window = g_ftp.cfg.page_cache_window ? g_ftp.cfg.page_cache_window : FTP_VFS_ADVISE_WINDOW;
+    if (!transfer->advise || transfer->offset - transfer->advise_off < window) {
+        return;
+    }
+
+    if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
+#if FTP_READ_SHARE_SEGMENTS
+        // other sessions reading the same file still need these pages.
+        const struct FtpReadShareFile* file = ftp_read_share_get(transfer);
+        if (!file || file->refs < 2)
+#endif
+        {
+            ftp_vfs_advise(&transfer->file_vfs, transfer->advise_off, transfer->offset - transfer->advise_off, FtpVfsAdvice_DONTNEED);
+        }
+    } else {
+        if (transfer->offset < g_ftp.cfg.page_cache_min_size) {
+            return;
+        }
+
+        if (transfer->advise_prev < transfer->advise_off) {
+            ftp_vfs_advise(&transfer->file_vfs, transfer->advise_prev, transfer->advise_off - transfer->advise_prev, FtpVfsAdvice_DONTNEED);
+        }
+        ftp_vfs_advise(&transfer->file_vfs, transfer->advise_off, transfer->offset - transfer->advise_off, FtpVfsAdvice_WRITEOUT);
+        transfer->advise_prev = transfer->advise_off;
+    }
+
+    transfer->advise_off = transfer->offset;
+#endif
+}
+
+#if FTP_UPLOAD_JOURNAL
+static bool ftp_journal_path(struct Pathname* journal, const char* path, const char* suffix) {
+    const int rc = snprintf(journal->s, sizeof(journal->s), "%s" FTP_UPLOAD_JOURNAL_SUFFIX "%s", path, suffix);
+    return rc > 0 && rc < sizeof(journal->s);
+}
+
+// written to a temp file and renamed over the journal, so that a crash
+// leaves either the old or the new offset.
+static void ftp_journal_write(const char* path, size_t off) {
+    struct Pathname journal, temp;
+    if (!ftp_journal_path(&journal, path, "") || !ftp_journal_path(&temp, path, ".tmp")) {
+        return;
+    }
+
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "%zu\n", off);
+    struct FtpVfsFile f = {0};
+    if (ftp_vfs_open(&f, temp.s, FtpVfsOpenMode_WRITE) < 0) {
+        return;
+    }
+
+    const bool ok = ftp_vfs_write(&f, buf, len) == len && !ftp_vfs_sync(&f);
+    if (ftp_vfs_close(&f) || !ok || ftp_vfs_rename(temp.s, journal.s)) {
+        ftp_vfs_unlink(temp.s);
+    }
+}
+
+static bool ftp_journal_read(const char* path, size_t* off) {
+    struct Pathname journal;
+    struct FtpVfsFile f = {0};
+    if (!ftp_journal_path(&journal, path, "") || ftp_vfs_open(&f, journal.s, FtpVfsOpenMode_READ) < 0) {
+        return false;
+    }
+
+    char buf[32];
+    const int n = ftp_vfs_read(&f, buf, sizeof(buf) - 1);
+    ftp_vfs_close(&f);
+    if (n <= 0) {
+        return false;
+    }
+
+    char* end;
+    buf[n] = '\0';
+    *off = strtoull(buf, &end, 10);
+    return end != buf && *end == '\n';
+}
+#endif
+
+static void ftp_journal_remove(const char* path) {
+#if FTP_UPLOAD_JOURNAL
+    struct Pathname journal;
+    if (g_ftp.cfg.upload_journal && ftp_journal_path(&journal, path, "")) {
+        ftp_vfs_unlink(journal.s);
+    }
+#endif
+}
+
+// the journal follows the file, so that a cut short upload can still be
+// resumed under its new name.
+static void ftp_journal_rename(const char* src, const char* dst) {
+#if FTP_UPLOAD_JOURNAL
+    struct Pathname src_journal, dst_journal;
+    if (g_ftp.cfg.upload_journal && ftp_journal_path(&src_journal, src, "") && ftp_journal_path(&dst_journal, dst, "")) {
+        ftp_vfs_unlink(dst_journal.s);
+        ftp_vfs_rename(src_journal.s, dst_journal.s);
+    }
+#endif
+}
+
+// the size of the file that is known to be on disk, which is less than
+// its size while an upload is in progress, or if one was cut short.
+static size_t ftp_journal_size(const char* path, size_t size) {
+#if FTP_UPLOAD_JOURNAL
+    size_t off;
+    if (g_ftp.cfg.upload_journal && ftp_journal_read(path, &off) && off < size) {
+        return off;
+    }
+#endif
+    return size;
+}
+
+// called once an upload is open. a new upload removes the journal left
+// by an older one, a resumed one keeps it until it moves past it.
+static void ftp_journal_open(struct FtpSession* session, enum FtpVfsOpenMode mode) {
+#if FTP_UPLOAD_JOURNAL
+    struct FtpTransfer* transfer = &session->transfer;
+    transfer->journal = false;
+    if (!g_ftp.cfg.upload_journal || mode == FtpVfsOpenMode_APPEND) {
+        return;
+    }
+
+    if (mode == FtpVfsOpenMode_WRITE) {
+        ftp_journal_remove(session->temp_path.s);
+    }
+    transfer->journal = true;
+    transfer->journal_off = transfer->offset;
+#endif
+}
+
+// flushes the upload every cfg.upload_journal bytes and records how far
+// it got. if the vfs can't flush, the journal is left as it is.
+static void ftp_journal_progress(struct FtpSession* session, bool force) {
+#if FTP_UPLOAD_JOURNAL
+    struct FtpTransfer* transfer = &session->transfer;
+    if (!transfer->journal || transfer->offset == transfer->journal_off || (!force && transfer->offset - transfer->journal_off < g_ftp.cfg.upload_journal)) {
+        return;
+    }
+
+    if (ftp_vfs_sync(&transfer->file_vfs)) {
+        transfer->journal = false;
+    } else {
+        ftp_journal_write(session->temp_path.s, transfer->offset);
+        transfer->journal_off = transfer->offset;
+    }
+#endif
+}
+
+// called once the upload has completed and been closed.
+static void ftp_journal_finish(struct FtpSession* session) {
+#if FTP_UPLOAD_JOURNAL
+    if (session->transfer.journal) {
+        session->transfer.journal = false;
+        ftp_journal_remove(session->temp_path.s);
+    }
+#endif
+}
+
+#if FTP_HASH
+static bool ftp_hash_sidecar_path(struct Pathname* sidecar, const char* path, const char* suffix) {
+    const int rc = snprintf(sidecar->s, sizeof(sidecar->s), "%s" FTP_HASH_SIDECAR_SUFFIX "%s", path, suffix);
+    return rc > 0 && rc < sizeof(sidecar->s);
+}
+
+// "<name> <size> <mtime> <hex>", written to a temp file and renamed over
+// the sidecar.
+static void ftp_hash_sidecar_write(const char* path, enum HashType type, const char* hex, const struct stat* st) {
+    struct Pathname sidecar, temp;
+    if (!ftp_hash_sidecar_path(&sidecar, path, "") || !ftp_hash_sidecar_path(&temp, path, ".tmp")) {
+        return;
+    }
+
+    char buf[128];
+    const int len = snprintf(buf, sizeof(buf), "%s %lld %lld %s\n", hash_name(type), (long long)st->st_size, (long long)st->st_mtime, hex);
+    struct FtpVfsFile f = {0};
+    if (ftp_vfs_open(&f, temp.s, FtpVfsOpenMode_WRITE) < 0) {
+        return;
+    }
+
+    const bool ok = ftp_vfs_write(&f, buf, len) == len;
+    if (ftp_vfs_close(&f) || !ok || ftp_vfs_rename(temp.s, sidecar.s)) {
+        ftp_vfs_unlink(temp.s);
+    }
+}
+
+// copies the digest to hex if the sidecar was written with this algorithm
+// for a file of the same size and mtime.
+static bool ftp_hash_sidecar_read(const char* path, enum HashType type, const struct stat* st, char* hex) {
+    struct Pathname sidecar;
+    struct FtpVfsFile f = {0};
+    if (!ftp_hash_sidecar_path(&sidecar, path, "") || ftp_vfs_open(&f, sidecar.s, FtpVfsOpenMode_READ) < 0) {
+        return false;
+    }
+
+    char buf[128];
+    const int n = ftp_vfs_read(&f, buf, sizeof(buf) - 1);
+    ftp_vfs_close(&f);
+    if (n <= 0) {
+        return false;
+    }
+
+    char name[16];
+    char digest[HASH_MAX_SIZE * 2 + 1];
+    long long size, mtime;
+    buf[n] = '\0';
+    if (sscanf(buf, "%15s %lld %lld %64s", name, &size, &mtime, digest) != 4 || strcmp(name, hash_name(type))) {
+        return false;
+    }
+
+    if (size != st->st_size || mtime != st->st_mtime || strlen(digest) != hash_size(type) * 2) {
+        return false;
+    }
+
+    strcpy(hex, digest);
+    return true;
+}
+#endif
+
+// drops the digest kept for path, called whenever the file changes.
+static void ftp_hash_sidecar_remove(const char* path) {
+#if FTP_HASH
+    struct Pathname sidecar;
+    if (g_ftp.upload_hash && ftp_hash_sidecar_path(&sidecar, path, "")) {
+        ftp_vfs_unlink(sidecar.s);
+    }
+#endif
+}
+
+// the digest follows the file, a rename doesn't change its mtime.
+static void ftp_hash_sidecar_rename(const char* src, const char* dst) {
+#if FTP_HASH
+    struct Pathname src_sidecar, dst_sidecar;
+    if (g_ftp.upload_hash && ftp_hash_sidecar_path(&src_sidecar, src, "") && ftp_hash_sidecar_path(&dst_sidecar, dst, "")) {
+        ftp_vfs_unlink(dst_sidecar.s);
+        ftp_vfs_rename(src_sidecar.s, dst_sidecar.s);
+    }
+#endif
+}
+
+// called once an upload is open. only uploads of a whole file can be
+// hashed as they arrive, other writes just drop the old digest.
+static void ftp_hash_upload_open(struct FtpSession* session, enum FtpVfsOpenMode mode) {
+#if FTP_HASH
+    struct FtpTransfer* transfer = &session->transfer;
+    transfer->hash = false;
+    if (!g_ftp.upload_hash) {
+        return;
+    }
+
+    ftp_hash_sidecar_remove(session->temp_path.s);
+    if (mode == FtpVfsOpenMode_WRITE) {
+        hash_init(&transfer->hash_ctx, g_ftp.upload_hash_type);
+        transfer->hash = true;
+    }
+#endif
+}
+
+static void ftp_hash_upload_progress(struct FtpTransfer* transfer, const void* buf, size_t size) {
+#if FTP_HASH
+    if (transfer->hash) {
+        hash_update(&transfer->hash_ctx, buf, size);
+    }
+#endif
+}
+
+// called once the upload has completed and been closed. the digest is
+// kept with the size and mtime the file ended up with, and is written to
+// reply as " <name> <hex>".
+static void ftp_hash_upload_finish(struct FtpSession* session, char* reply, size_t reply_size) {
+#if FTP_HASH
+    struct FtpTransfer* transfer = &session->transfer;
+    if (!transfer->hash) {
+        return;
+    }
+
+    uint8_t digest[HASH_MAX_SIZE];
+    char hex[HASH_MAX_SIZE * 2 + 1];
+    struct stat st;
+    transfer->hash = false;
+    hash_final(&transfer->hash_ctx, digest);
+    hash_to_hex(digest, hash_size(g_ftp.upload_hash_type), hex);
+    snprintf(reply, reply_size, " %s %s", hash_name(g_ftp.upload_hash_type), hex);
+
+    ftp_stat_cache_invalidate(session->temp_path.s);
+    if (!ftp_stat_cached(session->temp_path.s, &st, false) && (size_t)st.st_size == transfer->offset) {
+        ftp_hash_sidecar_write(session->temp_path.s, g_ftp.upload_hash_type, hex, &st);
+    }
+#endif
+}
+
+#if FTP_SEGMENT_UPLOADS
+static bool ftp_segment_temp_path(struct Pathname* temp, const char* path) {
+    const int rc = snprintf(temp->s, sizeof(temp->s), "%s" FTP_SEGMENT_SUFFIX, path);
+    return rc > 0 && rc < sizeof(temp->s);
+}
+
+static struct FtpSegmentUpload* ftp_segment_find(const char* path) {
+    for (size_t i = 0; i < FTP_SEGMENT_UPLOADS; i++) {
+        struct FtpSegmentUpload* u = &g_ftp.segment_uploads[i];
+        if (u->used && !strcmp(u->path.s, path)) {
+            return u;
+        }
+    }
+    return NULL;
+}
+
+// returns false if the range doesn't fit, in which case it's not counted
+// and the client will have to send it again.
+static bool ftp_segment_add_range(struct FtpSegmentUpload* u, size_t start, size_t end) {
+    if (start >= end) {
+        return true;
+    }
+
+    // i is the first range that reaches start, [i, j) are merged into it.
+    unsigned i = 0;
+    while (i < u->range_count && u->ranges[i].end < start) {
+        i++;
+    }
+
+    unsigned j = i;
+    while (j < u->range_count && u->ranges[j].start <= end) {
+        if (u->ranges[j].start < start) {
+            start = u->ranges[j].start;
+        }
+        if (u->ranges[j].end > end) {
+            end = u->ranges[j].end;
+        }
+        j++;
+    }
+
+    if (i == j) {
+        if (u->range_count == FTP_SEGMENT_RANGES) {
+            return false;
+        }
+        memmove(&u->ranges[i + 1], &u->ranges[i], sizeof(u->ranges[0]) * (u->range_count - i));
+        u->range_count++;
+    } else {
+        memmove(&u->ranges[i + 1], &u->ranges[j], sizeof(u->ranges[0]) * (u->range_count - j));
+        u->range_count -= j - i - 1;
+    }
+
+    u->ranges[i].start = start;
+    u->ranges[i].end = end;
+    return true;
+}
+#endif
+
+// if a segmented upload of path is in progress, the STOR joins it and
+// writes to its temp file instead.
+static bool ftp_segment_open(struct FtpTransfer* transfer, const char* path, struct Pathname* temp) {
+#if FTP_SEGMENT_UPLOADS
+    transfer->segment = 0;
+    struct FtpSegmentUpload* u = ftp_segment_find(path);
+    if (!u || !ftp_segment_temp_path(temp, path)) {
+        return false;
+    }
+
+    u->refs++;
+    u->last_used = time(NULL);
+    transfer->segment = u - g_ftp.segment_uploads + 1;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// false if writing size more bytes would go past the end of the upload.
+static bool ftp_segment_fits(const struct FtpTransfer* transfer, size_t size) {
+#if FTP_SEGMENT_UPLOADS
+    return !transfer->segment || transfer->offset + size <= g_ftp.segment_uploads[transfer->segment - 1].size;
+#else
+    return true;
+#endif
+}
+
+// written is set once the data is known to be in the file.
+static void ftp_segment_close(struct FtpTransfer* transfer, bool written) {
+#if FTP_SEGMENT_UPLOADS
+    if (transfer->segment) {
+        struct FtpSegmentUpload* u = &g_ftp.segment_uploads[transfer->segment - 1];
+        if (written) {
+            ftp_segment_add_range(u, transfer->start_offset, transfer->offset);
+        }
+        u->refs--;
+        u->last_used = time(NULL);
+        transfer->segment = 0;
+    }
+#endif
+}
+
+// a segmented upload of src that no one is writing to follows it to dst,
+// along with its temp file. one that is still being written to stays.
+static void ftp_segment_rename(const char* src, const char* dst) {
+#if FTP_SEGMENT_UPLOADS
+    struct FtpSegmentUpload* u = ftp_segment_find(src);
+    struct FtpSegmentUpload* old = ftp_segment_find(dst);
+    struct Pathname src_temp, dst_temp;
+    if (!u || u->refs || (old && old->refs) || !ftp_segment_temp_path(&src_temp, src) || !ftp_segment_temp_path(&dst_temp, dst)) {
+        return;
+    }
+
+    if (ftp_vfs_rename(src_temp.s, dst_temp.s) < 0) {
+        return;
+    }
+
+    // the temp file of the one dst had has just been replaced.
+    if (old) {
+        old->used = false;
+    }
+    snprintf(u->path.s, sizeof(u->path.s), "%s", dst);
+    u->last_used = time(NULL);
+#endif
+}
+
+#if FTP_DELTA_UPLOADS
+static bool ftp_delta_temp_path(struct Pathname* temp, const char* path) {
+    const int rc = snprintf(temp->s, sizeof(temp->s), "%s" FTP_DELTA_SUFFIX, path);
+    return rc > 0 && rc < sizeof(temp->s);
+}
+
+static void ftp_delta_put_be(unsigned char* p, uint64_t v, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        p[i] = v >> ((size - 1 - i) * 8);
+    }
+}
+
+static uint64_t ftp_delta_get_be(const unsigned char* p, size_t size) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < size; i++) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+// op byte followed by its big endian args:
+// 'L' <u32 size> <size bytes>, literal data.
+// 'C' <u64 offset> <u32 size>, copied from the basis.
+// 'E' <u64 size>, the end of the file, which must be the size written.
+static size_t ftp_delta_op_size(unsigned char op) {
+    switch (op) {
+        case 'L': return 1 + 4;
+        case 'C': return 1 + 8 + 4;
+        case 'E': return 1 + 8;
+    }
+    return 0;
+}
+
+// writes the next part of a delta upload. copies are read from the basis
+// a buffer at a time. otherwise, only as much is received as the op being
+// parsed needs, so data_buf is free again for the copy that may follow.
+static enum FTP_FILE_TRANSFER_STATE ftp_delta_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
+    int n;
+
+    if (transfer->delta_left && transfer->delta_copy) {
+        const size_t size = transfer->delta_left < sizeof(g_ftp.data_buf) ? transfer->delta_left : sizeof(g_ftp.data_buf);
+        n = ftp_vfs_read(&transfer->delta_vfs, g_ftp.data_buf, size);
+        if (n < 0) {
+            return FTP_FILE_TRANSFER_STATE_ERROR;
+        } else if (n == 0) {
+            // the copy goes past the end of the basis.
+            errno = EINVAL;
+            return FTP_FILE_TRANSFER_STATE_ERROR;
+        }
+    } else {
+        unsigned char* buf = g_ftp.data_buf;
+        size_t want;
+        if (transfer->delta_left) {
+            want = transfer->delta_left < sizeof(g_ftp.data_buf) ? transfer->delta_left : sizeof(g_ftp.data_buf);
+        } else if (transfer->delta_end) {
+            want = 1;
+        } else {
+            // every op is at least as large as 'L', which is read first.
+            const size_t op_size = transfer->delta_op_len < ftp_delta_op_size('L') ? ftp_delta_op_size('L') : ftp_delta_op_size(transfer->delta_op[0]);
+            buf = transfer->delta_op + transfer->delta_op_len;
+            want = op_size - transfer->delta_op_len;
+        }
+
+        n = ftp_socket_recv(&session->data_sock, buf, want, 0);
+        if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
+            } else {
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            }
+        } else if (n == 0) {
+            if (transfer->delta_end) {
+                return FTP_FILE_TRANSFER_STATE_FINISHED;
+            }
+            errno = EINVAL;
+            return FTP_FILE_TRANSFER_STATE_ERROR;
+        }
+
+        transfer->transferred += n;
+        if (!transfer->delta_left) {
+            const size_t op_size = ftp_delta_op_size(transfer->delta_op[0]);
+            transfer->delta_op_len += n;
+            if (transfer->delta_end || !op_size) {
+                errno = EINVAL;
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            } else if (transfer->delta_op_len < op_size) {
+                return FTP_FILE_TRANSFER_STATE_CONTINUE;
+            }
+
+            const unsigned char* args = transfer->delta_op + 1;
+            transfer->delta_op_len = 0;
+            if (transfer->delta_op[0] == 'L') {
+                transfer->delta_copy = false;
+                transfer->delta_left = ftp_delta_get_be(args, 4);
+            } else if (transfer->delta_op[0] == 'C') {
+                transfer->delta_copy = true;
+                transfer->delta_left = ftp_delta_get_be(args + 8, 4);
+                if (transfer->delta_left && ftp_vfs_seek(&transfer->delta_vfs, NULL, 0, ftp_delta_get_be(args, 8)) < 0) {
+                    return FTP_FILE_TRANSFER_STATE_ERROR;
+                }
+            } else {
+                if (ftp_delta_get_be(args, 8) != transfer->offset) {
+                    errno = EINVAL;
+                    return FTP_FILE_TRANSFER_STATE_ERROR;
+                }
+                transfer->delta_end = true;
+            }
+            return FTP_FILE_TRANSFER_STATE_CONTINUE;
+        }
+    }
+
+    n = ftp_vfs_write(&transfer->file_vfs, g_ftp.data_buf, n);
+    FTP_TRACE4(file__chunk, ftp_session_index(session), transfer->mode, n, transfer->offset);
+    if (n < 0) {
+        return FTP_FILE_TRANSFER_STATE_ERROR;
+    }
+
+    ftp_hash_upload_progress(transfer, g_ftp.data_buf, n);
+    transfer->offset += n;
+    transfer->delta_left -= n;
+    ftp_advise_progress(transfer);
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+}
+
+// sends the records in list_buf, then fills it again with the signature
+// of each block, one block per call.
+static enum FTP_FILE_TRANSFER_STATE ftp_delta_sig_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
+    const size_t record_size = 4 + 16;
+
+    if (transfer->sig_len && (transfer->offset >= transfer->size || transfer->sig_len + record_size > sizeof(transfer->list_buf))) {
+        const int n = ftp_socket_send(&session->data_sock, transfer->list_buf + transfer->sig_sent, transfer->sig_len - transfer->sig_sent, 0);
+        FTP_TRACE3(dir__chunk, ftp_session_index(session), n, transfer->transferred);
+        if (n < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            } else {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
+            }
+        }
+
+        transfer->transferred += n;
+        transfer->sig_sent += n;
+        if (transfer->sig_sent != transfer->sig_len) {
+            return FTP_FILE_TRANSFER_STATE_BLOCKING;
+        }
+        transfer->sig_sent = transfer->sig_len = 0;
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
+    } else if (transfer->offset >= transfer->size) {
+        return FTP_FILE_TRANSFER_STATE_FINISHED;
+    }
+
+    const size_t left = transfer->size - transfer->offset;
+    const size_t size = left < transfer->sig_block ? left : transfer->sig_block;
+    size_t read = 0;
+    while (read < size) {
+        const int n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf + read, size - read);
+        if (n < 0) {
+            return FTP_FILE_TRANSFER_STATE_ERROR;
+        } else if (n == 0) {
+            // the file shrank since the size was sent.
+            errno = EIO;
+            return FTP_FILE_TRANSFER_STATE_ERROR;
+        }
+        read += n;
+    }
+
+    struct HashCtx ctx;
+    uint8_t digest[HASH_MAX_SIZE];
+    unsigned char* record = (unsigned char*)transfer->list_buf + transfer->sig_len;
+    hash_init(&ctx, HashType_SHA256);
+    hash_update(&ctx, g_ftp.data_buf, size);
+    hash_final(&ctx, digest);
+    ftp_delta_put_be(record, hash_rolling(g_ftp.data_buf, size), 4);
+    memcpy(record + 4, digest, 16);
+
+    transfer->sig_len += record_size;
+    transfer->offset += size;
+    ftp_advise_progress(transfer);
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+}
+#endif
+
+// if SITE DELTA was sent, the upload writes to a temp file, built from the
+// basis and the data received, which is renamed over path once complete.
+// returns 1 if it was opened, 0 if this isn't a delta upload, and -1 on
+// error. the basis is only used by one upload, and only by a whole STOR.
+static int ftp_delta_open(struct FtpSession* session, const char* path, enum FtpVfsOpenMode mode) {
+#if FTP_DELTA_UPLOADS
+    struct FtpTransfer* transfer = &session->transfer;
+    struct Pathname basis = session->delta_basis;
+    struct Pathname temp;
+    session->delta_basis.s[0] = '\0';
+    if (!basis.s[0]) {
+        return 0;
+    } else if (mode != FtpVfsOpenMode_WRITE) {
+        errno = EINVAL;
+        return -1;
+    } else if (!ftp_delta_temp_path(&temp, path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (ftp_vfs_open(&transfer->delta_vfs, basis.s, FtpVfsOpenMode_READ) < 0) {
+        return -1;
+    }
+
+    if (ftp_vfs_open(&transfer->file_vfs, temp.s, FtpVfsOpenMode_WRITE) < 0) {
+        ftp_vfs_close(&transfer->delta_vfs);
+        return -1;
+    }
+
+    ftp_stat_cache_invalidate(temp.s);
+    transfer->delta = true;
+    transfer->delta_end = false;
+    transfer->delta_left = 0;
+    transfer->delta_op_len = 0;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// called once the upload has completed and been closed, the temp file
+// replaces the old one.
+static int ftp_delta_finish(struct FtpSession* session) {
+#if FTP_DELTA_UPLOADS
+    struct FtpTransfer* transfer = &session->transfer;
+    struct Pathname temp;
+    if (!transfer->delta) {
+        return 0;
+    }
+
+    ftp_vfs_close(&transfer->delta_vfs);
+    // a new file could be given the same inode.
+    ftp_read_share_invalidate(session->temp_path.s);
+    if (!ftp_delta_temp_path(&temp, session->temp_path.s) || ftp_vfs_rename(temp.s, session->temp_path.s)) {
+        return -1;
+    }
+
+    transfer->delta = false;
+    ftp_stat_cache_invalidate(temp.s);
+    ftp_journal_remove(session->temp_path.s);
+#endif
+    return 0;
+}
+
+// closes the basis, and removes the temp file of an upload that didn't
+// complete.
+static void ftp_delta_close(struct FtpTransfer* transfer, const char* path) {
+#if FTP_DELTA_UPLOADS
+    struct Pathname temp;
+    ftp_vfs_close(&transfer->delta_vfs);
+    if (transfer->delta) {
+        transfer->delta = false;
+        if (ftp_delta_temp_path(&temp, path)) {
+            ftp_vfs_unlink(temp.s);
+            ftp_stat_cache_invalidate(temp.s);
+        }
+    }
+#endif
+}
+
+#if FTP_WALK_DEPTH
+// closes the dirs left open by a walk that didn't finish.
+static void ftp_walk_close(struct FtpWalk* walk) {
+    while (walk->depth) {
+        ftp_vfs_closedir(&walk->dirs[--walk->depth]);
+    }
+}
+#endif
+
+#if FTP_ARCHIVE_DEPTH
+// closes the dirs left open by an archive, and closes and removes the spool.
+static void ftp_archive_close(struct FtpTransfer* transfer) {
+    ftp_walk_close(&transfer->archive.walk);
+    if (transfer->archive.spool_path.s[0]) {
+        ftp_vfs_close(&transfer->archive.spool);
+        ftp_vfs_unlink(transfer->archive.spool_path.s);
+        ftp_stat_cache_invalidate(transfer->archive.spool_path.s);
+        transfer->archive.spool_path.s[0] = '\0';
+    }
+}
+#endif
+
+// closes what a SITE MANIFEST or archive left open, mode is the one the
+// transfer was opened with, as the state for each shares the same storage.
+static void ftp_transfer_state_close(struct FtpTransfer* transfer, enum FTP_TRANSFER_MODE mode) {
+#if FTP_MANIFEST_DEPTH
+    if (mode == FTP_TRANSFER_MODE_MANIFEST) {
+        ftp_walk_close(&transfer->manifest.walk);
+    }
+#endif
+#if FTP_ARCHIVE_DEPTH
+    if (mode == FTP_TRANSFER_MODE_ARCHIVE) {
+        ftp_archive_close(transfer);
+    }
+#endif
+}
+
+static void ftp_update_session_time(struct FtpSession* session) {
+    if (session->state != FTP_SESSION_STATE_NONE) {
+        session->last_update_time = time(NULL);
+    }
+}
+
+// SOURCE: https://cr.yp.to/ftp/list/binls.html
+static int ftp_build_list_entry(struct FtpSession* session, const struct Pathname* fullpath, const char* name, const struct stat* st) {
+    int rc;
+    struct FtpTransfer* transfer = &session->transfer;
+
+    if (transfer->mode == FTP_TRANSFER_MODE_NLST) {
+        rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "%s" TELNET_EOL, name);
+    } else {
+        static const char months[12][4] = {
+            "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+        };
+
+        char perms[11] = {0};
+        switch (st->st_mode & S_IFMT) {
+            case S_IFREG:   perms[0] = '-'; break;
+            case S_IFDIR:   perms[0] = 'd'; break;
+            case S_IFLNK:   perms[0] = 'l'; break;
+            case S_IFIFO:   perms[0] = 'p'; break;
+            case S_IFSOCK:  perms[0] = 's'; break;
+            case S_IFCHR:   perms[0] = 'c'; break;
+            case S_IFBLK:   perms[0] = 'b'; break;
+            default:        perms[0] = '?'; break;
+        }
+
+        perms[1] = (st->st_mode & S_IRUSR) ? 'r' : '-';
+        perms[2] = (st->st_mode & S_IWUSR) ? 'w' : '-';
+        perms[3] = (st->st_mode & S_IXUSR) ? 'x' : '-';
+        perms[4] = (st->st_mode & S_IRGRP) ? 'r' : '-';
+        perms[5] = (st->st_mode & S_IWGRP) ? 'w' : '-';
+        perms[6] = (st->st_mode & S_IXGRP) ? 'x' : '-';
+        perms[7] = (st->st_mode & S_IROTH) ? 'r' : '-';
+        perms[8] = (st->st_mode & S_IWOTH) ? 'w' : '-';
+        perms[9] = (st->st_mode & S_IXOTH) ? 'x' : '-';
+
+        struct Pathname symlink_path = {0};
+        if (perms[0] == 'l') {
+            strcpy(symlink_path.s, " -> ");
+            const int len = ftp_vfs_readlink(fullpath->s, symlink_path.s + strlen(symlink_path.s), sizeof(symlink_path) - strlen(symlink_path.s));
+            if (len < 0) {
+                symlink_path.s[0] = '\0';
+            }
+        }
+
+        struct tm tm = {0};
+        unpack_time(&st->st_mtime, &tm);
+
+        // if the time is greater than 6 months, show year rather than time
+        char date[6] = {0};
+        const long six_months = 60ll * 60ll * 24ll * (365ll / 2ll);
+        if (labs(difftime(session->last_update_time, st->st_mtime)) > six_months) {
+            snprintf(date, sizeof(date), "%5u", tm.tm_year + 1900);
+        } else {
+            snprintf(date, sizeof(date), "%02u:%02u", tm.tm_hour, tm.tm_min);
+        }
+
+        const unsigned nlink = st->st_nlink;
+        const size_t size = S_ISDIR(st->st_mode) ? 0 : st->st_size;
+
+        rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "%s %3u %s %s %13zu %s %3d %s %s%s" TELNET_EOL,
+            perms,
+            nlink,
             ftp_vfs_getpwuid(st), ftp_vfs_getgrgid(st),
             size,
             months[tm.tm_mon], tm.tm_mday, date,
             name, symlink_path.s);
     }
 
-    // don't send anything on error or truncated
-    if (rc <= 0 || rc > sizeof(transfer->list_buf)) {
-        rc = -1;
+    // don't send anything on error or truncated
+    if (rc <= 0 || rc > sizeof(transfer->list_buf)) {
+        rc = -1;
+    } else {
+        transfer->size = rc;
+    }
+
+    return rc;
+}
+
+static void ftp_session_send(struct FtpSession* session);
+
+static void ftp_client_msg(struct FtpSession* session, unsigned code, const char* fmt, ...) {
+    const int err = errno;
+
+    // prepend with the code.
+    const size_t size = sizeof(session->send_buf);
+    const size_t code_len = snprintf(session->send_buf, size, "%u ", code);
+    const size_t eol_padding = code_len * 2 + 4 + 3;
+
+    // append message.
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(session->send_buf + code_len, size - eol_padding, fmt, va);
+    va_end(va);
+
+    // if multiline message, append END.
+    const size_t len = strlen(session->send_buf);
+    if (len > code_len && session->send_buf[code_len] == '-') {
+        memmove(session->send_buf + code_len - 1, session->send_buf + code_len, len - code_len);
+        snprintf(session->send_buf + len - 1, size - len - 3, "%d END", code);
+    }
+
+    if (g_ftp.event_callback) {
+        struct FtpSrvEvent event = {
+            .type = code < 400 ? FTP_API_EVENT_TYPE_REPLY : FTP_API_EVENT_TYPE_ERROR,
+            .code = code,
+            .err = code < 400 ? 0 : err,
+            .text = session->send_buf,
+            .text_len = strlen(session->send_buf),
+        };
+        ftp_event_emit(session, &event);
+    }
+
+    // finally, append EOL and send message.
+    strcat(session->send_buf, TELNET_EOL);
+    session->send_buf_offset = 0;
+    session->send_buf_size = strlen(session->send_buf);
+    session->state = FTP_SESSION_STATE_POLLOUT;
+    FTP_TRACE3(command__reply, ftp_session_index(session), code, session->send_buf_size);
+
+    // try to send immediately.
+    ftp_session_send(session);
+}
+
+static void ftp_data_transfer_end(struct FtpSession* session) {
+    FTP_TRACE3(data__end, ftp_session_index(session), session->transfer.mode, session->transfer.transferred);
+
+    if (g_ftp.event_callback && session->transfer.mode != FTP_TRANSFER_MODE_NONE) {
+        struct FtpSrvEvent event = {
+            .type = FTP_API_EVENT_TYPE_TRANSFER_END,
+            .name = ftp_transfer_mode_name(session->transfer.mode),
+            .offset = session->transfer.start_offset,
+            .bytes = session->transfer.transferred,
+            .duration_ms = ftp_get_timestamp_ms() - session->transfer.start_time,
+        };
+        ftp_event_emit(session, &event);
+    }
+
+    switch (session->data_connection) {
+        case FTP_DATA_CONNECTION_NONE:
+            break;
+        case FTP_DATA_CONNECTION_ACTIVE:
+            ftp_socket_close(&session->data_sock);
+            break;
+        case FTP_DATA_CONNECTION_PASSIVE:
+            ftp_socket_close(&session->data_sock);
+            ftp_socket_close(&session->pasv_sock);
+            break;
+    }
+
+    // an upload that didn't finish records how far it got.
+    if (session->transfer.mode == FTP_TRANSFER_MODE_STOR && ftp_vfs_isfile_open(&session->transfer.file_vfs)) {
+        ftp_journal_progress(session, true);
+        ftp_segment_close(&session->transfer, !ftp_vfs_close(&session->transfer.file_vfs));
+    }
+    // the data connection may have failed before the transfer started.
+    ftp_segment_close(&session->transfer, false);
+
+    ftp_vfs_close(&session->transfer.file_vfs);
+    ftp_vfs_closedir(&session->transfer.dir_vfs);
+    ftp_delta_close(&session->transfer, session->temp_path.s);
+    ftp_transfer_state_close(&session->transfer, session->transfer.mode);
+
+    ftp_read_share_close(&session->transfer);
+    ftp_file_cache_close(&session->transfer);
+
+    // the upload changed the size / mtime of the file.
+    if (session->transfer.mode == FTP_TRANSFER_MODE_STOR) {
+        ftp_stat_cache_invalidate(session->temp_path.s);
+        ftp_read_share_invalidate(session->temp_path.s);
+        ftp_file_cache_invalidate(session->temp_path.s);
+    }
+
+    session->transfer.connection_pending = false;
+    session->temp_path.s[0] = '\0';
+    session->transfer.offset = 0;
+    session->transfer.size = 0;
+    session->transfer.transferred = 0;
+    session->transfer.mode = FTP_TRANSFER_MODE_NONE;
+    session->data_connection = FTP_DATA_CONNECTION_NONE;
+}
+
+static void ftp_data_poll(struct FtpSession* session) {
+    int rc = 0;
+
+    if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
+        rc = ftp_socket_connect(&session->data_sock, (struct sockaddr*)&session->data_sockaddr, sizeof(session->data_sockaddr));
+        FTP_TRACE2(data__connect, ftp_session_index(session), rc);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EINPROGRESS || errno == EALREADY) {
+                // blocking...
+            } else if (errno == EISCONN) {
+                session->transfer.connection_pending = false;
+            } else {
+                ftp_client_msg(session, 425, "Can't open data connection, [poll] %d %s.", errno, strerror(errno));
+                ftp_data_transfer_end(session);
+            }
+        } else {
+            session->transfer.connection_pending = false;
+        }
+    } else {
+        size_t socklen = sizeof(session->pasv_sockaddr);
+        rc = ftp_socket_accept(&session->data_sock, &session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, &socklen);
+        FTP_TRACE2(data__accept, ftp_session_index(session), rc);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // blocking...
+            } else {
+                ftp_client_msg(session, 425, "Can't open data connection, [poll] %d %s.", errno, strerror(errno));
+                ftp_data_transfer_end(session);
+            }
+        } else {
+            ftp_set_data_socket_options(&session->data_sock);
+            session->transfer.connection_pending = false;
+        }
+    }
+}
+
+static void ftp_data_open(struct FtpSession* session, enum FTP_TRANSFER_MODE mode) {
+    int rc = 0;
+    ftp_client_msg(session, 150, "File status okay; about to open data connection.");
+
+    if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
+        rc = ftp_socket_open(&session->data_sock, PF_INET, SOCK_STREAM, 0);
+        if (rc >= 0) {
+            ftp_set_data_socket_options(&session->data_sock);
+        }
+    }
+
+    if (rc < 0) {
+        ftp_client_msg(session, 425, "Can't open data connection [NORM], %s.", strerror(errno));
+        // the mode isn't set yet, so what was opened for it is closed here.
+        ftp_transfer_state_close(&session->transfer, mode);
+        ftp_data_transfer_end(session);
+    } else {
+        session->transfer.mode = mode;
+        session->transfer.index = 0;
+        session->transfer.connection_pending = true;
+        session->transfer.start_offset = session->transfer.offset;
+        session->transfer.start_time = ftp_get_timestamp_ms();
+        FTP_TRACE3(data__open, ftp_session_index(session), mode, session->transfer.offset);
+
+        if (g_ftp.event_callback) {
+            struct FtpSrvEvent event = {
+                .type = FTP_API_EVENT_TYPE_TRANSFER_START,
+                .name = ftp_transfer_mode_name(mode),
+                .offset = session->transfer.offset,
+            };
+            ftp_event_emit(session, &event);
+        }
+
+        // try to open immediately.
+        ftp_data_poll(session);
+    }
+}
+
+// sends as much of the entry in list_buf as possible, returns CONTINUE
+// once all of it has been sent.
+static enum FTP_FILE_TRANSFER_STATE ftp_list_buf_send(struct FtpSession* session, struct FtpTransfer* transfer) {
+    const int n = ftp_socket_send(&session->data_sock, transfer->list_buf + transfer->offset, transfer->size, 0);
+    FTP_TRACE3(dir__chunk, ftp_session_index(session), n, transfer->transferred);
+    if (n < 0) {
+        // check if it failed due to anything but blocking.
+        if (errno != EWOULDBLOCK && errno != EAGAIN) {
+            return FTP_FILE_TRANSFER_STATE_ERROR;
+        } else {
+            return FTP_FILE_TRANSFER_STATE_BLOCKING;
+        }
+    }
+
+    transfer->transferred += n;
+    if (n != transfer->size) {
+        // partial transfer.
+        transfer->offset += n;
+        transfer->size -= n;
+        return FTP_FILE_TRANSFER_STATE_BLOCKING;
+    }
+
+    transfer->list_buf[0] = '\0';
+    transfer->offset = 0;
+    transfer->size = 0;
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+}
+
+static enum FTP_FILE_TRANSFER_STATE ftp_dir_data_transfer_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
+    // send as much data as possible.
+    if (transfer->size) {
+        const enum FTP_FILE_TRANSFER_STATE state = ftp_list_buf_send(session, transfer);
+        if (state != FTP_FILE_TRANSFER_STATE_CONTINUE) {
+            return state;
+        }
+
+        // check if we are finished with this transfer.
+        if (!ftp_vfs_isdir_open(&transfer->dir_vfs)) {
+            return FTP_FILE_TRANSFER_STATE_FINISHED;
+        }
+    } else {
+        // parse the next file.
+        static struct FtpVfsDirEntry entry;
+        const char* name = ftp_vfs_readdir(&transfer->dir_vfs, &entry);
+        if (!name) {
+            return FTP_FILE_TRANSFER_STATE_FINISHED;
+        }
+
+        if (!strcmp(".", name) || !strcmp("..", name) || ftp_is_reserved_name(name)) {
+            return FTP_FILE_TRANSFER_STATE_CONTINUE;
+        }
+
+        int rc;
+        struct Pathname filepath;
+        if (session->temp_path.s[strlen(session->temp_path.s) - 1] != '/') {
+            rc = snprintf(filepath.s, sizeof(filepath), "%s/%s", session->temp_path.s, name);
+        } else {
+            rc = snprintf(filepath.s, sizeof(filepath), "%s%s", session->temp_path.s, name);
+        }
+
+        if (rc <= 0 || rc >= sizeof(filepath)) {
+            return FTP_FILE_TRANSFER_STATE_CONTINUE;
+        }
+
+        struct stat st = {0};
+        rc = ftp_vfs_dirlstat(&transfer->dir_vfs, &entry, filepath.s, &st);
+        if (rc < 0) {
+            return FTP_FILE_TRANSFER_STATE_CONTINUE;
+        }
+
+        ftp_build_list_entry(session, &filepath, name, &st);
+    }
+
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+}
+
+#if FTP_MANIFEST_DEPTH || FTP_MSTAT
+// "type=<type>;size=<size>;modify=<time>;<facts> <name>", the lines sent by
+// SITE MANIFEST and SITE MSTAT. a NULL st is a path that doesn't exist,
+// "type=none; <name>". returns the length, or -1 if it doesn't fit.
+static int ftp_build_facts(char* out, size_t size, const struct stat* st, size_t file_size, const char* facts, const char* name) {
+    int rc;
+    struct tm tm = {0};
+    if (!st || !unpack_time(&st->st_mtime, &tm)) {
+        rc = snprintf(out, size, "type=none; %s" TELNET_EOL, name);
+    } else {
+        const char* type = "file";
+        if (S_ISDIR(st->st_mode)) {
+            type = "dir";
+            file_size = 0;
+        } else if (S_ISLNK(st->st_mode)) {
+            type = "OS.unix=symlink";
+        }
+
+        rc = snprintf(out, size, "type=%s;size=%zu;modify=%04d%02d%02d%02d%02d%02d;%s %s" TELNET_EOL,
+            type, file_size,
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+            facts, name);
+    }
+
+    return rc > 0 && rc < size ? rc : -1;
+}
+#endif
+
+#if FTP_WALK_DEPTH
+// starts walking the dir at path, which is also the first entry.
+static int ftp_walk_open(struct FtpWalk* walk, const struct Pathname* path) {
+    walk->depth = 0;
+    if (ftp_vfs_opendir(&walk->dirs[0], path->s) < 0) {
+        return -1;
+    }
+
+    walk->path = *path;
+    walk->len[0] = strlen(path->s);
+    walk->depth = 1;
+    return 0;
+}
+
+// reads the next entry into walk->path and st, dirs less than max_depth
+// deep are opened so that what's in them comes next. err is set if the
+// entry couldn't be stat'd (st is zeroed), or is a dir that won't be walked.
+static enum FTP_WALK_RESULT ftp_walk_next(struct FtpWalk* walk, unsigned max_depth, struct stat* st, int* err) {
+    if (!walk->depth) {
+        return FTP_WALK_END;
+    }
+
+    static struct FtpVfsDirEntry entry;
+    struct FtpVfsDir* dir = &walk->dirs[walk->depth - 1];
+    const size_t dir_len = walk->len[walk->depth - 1];
+    walk->path.s[dir_len] = '\0';
+
+    const char* name = ftp_vfs_readdir(dir, &entry);
+    if (!name) {
+        ftp_vfs_closedir(dir);
+        walk->depth--;
+        return FTP_WALK_AGAIN;
+    }
+
+    if (!strcmp(".", name) || !strcmp("..", name) || ftp_is_reserved_name(name)) {
+        return FTP_WALK_AGAIN;
+    }
+
+    memset(st, 0, sizeof(*st));
+    *err = 0;
+
+    const size_t sep = walk->path.s[dir_len - 1] != '/';
+    const size_t len = dir_len + sep + strlen(name);
+    if (len + 1 >= sizeof(walk->path.s)) {
+        *err = ENAMETOOLONG;
+        return FTP_WALK_ENTRY;
+    }
+
+    walk->path.s[dir_len] = '/';
+    strcpy(walk->path.s + dir_len + sep, name);
+    if (ftp_vfs_dirlstat(dir, &entry, walk->path.s, st) < 0) {
+        *err = errno;
+        memset(st, 0, sizeof(*st));
+        return FTP_WALK_ENTRY;
+    }
+
+    // symlinks aren't followed, so the walk can't loop.
+    if (S_ISDIR(st->st_mode)) {
+        if (walk->depth >= max_depth) {
+            *err = ELOOP;
+        } else if (ftp_vfs_opendir(&walk->dirs[walk->depth], walk->path.s) < 0) {
+            *err = errno;
+        } else {
+            walk->len[walk->depth++] = len;
+        }
+    }
+
+    return FTP_WALK_ENTRY;
+}
+#endif
+
+#if FTP_MANIFEST_DEPTH
+// builds the line for the next entry of the tree, walking into dirs as
+// they are found.
+static enum FTP_FILE_TRANSFER_STATE ftp_manifest_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
+    if (transfer->size) {
+        return ftp_list_buf_send(session, transfer);
+    }
+
+    struct stat st;
+    int err;
+    const enum FTP_WALK_RESULT walk = ftp_walk_next(&transfer->manifest.walk, FTP_MANIFEST_DEPTH, &st, &err);
+    if (walk == FTP_WALK_END) {
+        return FTP_FILE_TRANSFER_STATE_FINISHED;
+    } else if (walk == FTP_WALK_AGAIN) {
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
+    } else if (err == ENAMETOOLONG) {
+        // the entry can't be named, so the manifest can't be complete.
+        errno = err;
+        return FTP_FILE_TRANSFER_STATE_ERROR;
+    }
+
+    // names are relative to the dir that was asked for.
+    const char* path = transfer->manifest.walk.path.s;
+    const char* rel = path + transfer->manifest.root;
+    rel += *rel == '/';
+
+    // entries that couldn't be stat'd and dirs that weren't walked are
+    // marked, rather than left out, so that clients know what's missing.
+    int rc;
+    if (!st.st_mode) {
+        rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "type=unknown;walk=error; %s" TELNET_EOL, rel);
+        rc = rc > 0 && rc < sizeof(transfer->list_buf) ? rc : -1;
+    } else if (err) {
+        rc = ftp_build_facts(transfer->list_buf, sizeof(transfer->list_buf), &st, st.st_size, "walk=error;", rel);
+    } else {
+        char hash[128] = "";
+#if FTP_HASH
+        char hex[HASH_MAX_SIZE * 2 + 1];
+        if (transfer->manifest.hash && S_ISREG(st.st_mode) && ftp_hash_sidecar_read(path, g_ftp.upload_hash_type, &st, hex)) {
+            snprintf(hash, sizeof(hash), "hash=%s:%s;", hash_name(g_ftp.upload_hash_type), hex);
+        }
+#endif
+        rc = ftp_build_facts(transfer->list_buf, sizeof(transfer->list_buf), &st, st.st_size, hash, rel);
+    }
+
+    // a line that doesn't fit would be left out, so it fails instead.
+    if (rc < 0) {
+        errno = ENAMETOOLONG;
+        return FTP_FILE_TRANSFER_STATE_ERROR;
+    }
+
+    transfer->size = rc;
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+}
+#endif
+
+#if FTP_MSTAT
+// the facts of a path sent by the client, or "type=none" if it can't be
+// stat'd. the size is that of SIZE.
+static int ftp_mstat_build(struct FtpSession* session, char* out, size_t size, const char* name) {
+    struct Pathname pathname, fullpath;
+    struct stat st;
+    const int rc = snprintf(pathname.s, sizeof(pathname), "%s", name);
+    if (rc <= 0 || rc >= sizeof(pathname) || build_fullpath(session, &fullpath, pathname) < 0 || ftp_stat_cached(fullpath.s, &st, false) < 0) {
+        return ftp_build_facts(out, size, NULL, 0, "", name);
+    }
+    return ftp_build_facts(out, size, &st, ftp_journal_size(fullpath.s, st.st_size), "", name);
+}
+
+// true while waiting for the next path from the client, otherwise the
+// line for the last one is being sent.
+static bool ftp_mstat_wants_recv(const struct FtpTransfer* transfer) {
+    return !transfer->size && !transfer->mstat.eof && !memchr(transfer->mstat.in, '\n', transfer->mstat.len);
+}
+
+// receives paths, one per line, and sends the line for each once it has
+// been received. the client should read the replies while it is still
+// sending, or the socket buffers may fill up both ways.
+static enum FTP_FILE_TRANSFER_STATE ftp_mstat_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
+    if (transfer->size) {
+        return ftp_list_buf_send(session, transfer);
+    }
+
+    char* in = transfer->mstat.in;
+    char* eol = memchr(in, '\n', transfer->mstat.len);
+    if (!eol && !transfer->mstat.eof) {
+        if (transfer->mstat.len == sizeof(transfer->mstat.in) - 1) {
+            errno = ENAMETOOLONG;
+            return FTP_FILE_TRANSFER_STATE_ERROR;
+        }
+
+        const int n = ftp_socket_recv(&session->data_sock, in + transfer->mstat.len, sizeof(transfer->mstat.in) - 1 - transfer->mstat.len, 0);
+        if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
+            } else {
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            }
+        } else if (n == 0) {
+            transfer->mstat.eof = true;
+        }
+
+        transfer->mstat.len += n;
+        transfer->transferred += n;
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
+    } else if (!eol && !transfer->mstat.len) {
+        return FTP_FILE_TRANSFER_STATE_FINISHED;
+    }
+
+    // the last path may not end with a newline.
+    const size_t line_len = eol ? eol - in : transfer->mstat.len;
+    const size_t used = eol ? line_len + 1 : line_len;
+    in[line_len] = '\0';
+    if (line_len && in[line_len - 1] == '\r') {
+        in[line_len - 1] = '\0';
+    }
+
+    if (in[0]) {
+        int rc = ftp_mstat_build(session, transfer->list_buf, sizeof(transfer->list_buf), in);
+        // the name is too long to echo back, but every path still gets a
+        // line, so the replies stay in step with the paths sent.
+        if (rc <= 0) {
+            rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "type=none;error=toolong; " TELNET_EOL);
+        }
+        transfer->size = rc;
+    }
+
+    memmove(in, in + used, transfer->mstat.len - used);
+    transfer->mstat.len -= used;
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+}
+#endif
+
+#if FTP_WATCH_DIRS
+// writes "<dir>/<name>", or "<dir>/" if the whole dir changed.
+static int ftp_watch_event_path(const struct FtpWatchEvent* event, char* out, size_t size) {
+    const char* dir = g_ftp.watches[event->watch - 1].path.s;
+    const char* sep = dir[strlen(dir) - 1] == '/' ? "" : "/";
+    const int rc = snprintf(out, size, "%s%s%s", dir, sep, event->name);
+    return rc > 0 && rc < size ? rc : -1;
+}
+
+static void ftp_watch_event_remove(struct FtpWatchSession* w, unsigned index, unsigned count) {
+    memmove(&w->events[index], &w->events[index + count], (w->event_count - index - count) * sizeof(*w->events));
+    w->event_count -= count;
+}
+
+// queues a change for the session, unless it's already queued. a change to
+// the whole dir replaces those to entries in it, and once the queue is full
+// every change becomes one to its dir.
+static void ftp_watch_push(struct FtpSession* session, unsigned watch, const char* name) {
+    struct FtpWatchSession* w = &session->watch;
+    unsigned i = 0;
+    while (i < w->event_count) {
+        const struct FtpWatchEvent* e = &w->events[i];
+        if (e->watch == watch && (!e->name[0] || !strcmp(e->name, name))) {
+            return;
+        } else if (e->watch == watch && !name[0]) {
+            ftp_watch_event_remove(w, i, 1);
+        } else {
+            i++;
+        }
+    }
+
+    if (w->event_count == FTP_WATCH_EVENTS) {
+        unsigned count = 0;
+        for (i = 0; i < w->event_count; i++) {
+            const unsigned event_watch = w->events[i].watch;
+            unsigned j = 0;
+            while (j < count && w->events[j].watch != event_watch) {
+                j++;
+            }
+            if (j == count) {
+                w->events[count].watch = event_watch;
+                w->events[count].name[0] = '\0';
+                count++;
+            }
+        }
+        w->event_count = count;
+
+        // a session only has FTP_WATCH_SESSION_DIRS, so there's room now.
+        for (i = 0; i < w->event_count; i++) {
+            if (w->events[i].watch == watch) {
+                return;
+            }
+        }
+        name = "";
+    }
+
+    struct FtpWatchEvent* e = &w->events[w->event_count++];
+    e->watch = watch;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+}
+
+// queues the change for every session watching the dir.
+static void ftp_watch_notify(unsigned watch, const char* name) {
+    struct FtpWatch* dir = &g_ftp.watches[watch - 1];
+    struct Pathname path;
+    const char* sep = dir->path.s[strlen(dir->path.s) - 1] == '/' ? "" : "/";
+    const int rc = snprintf(path.s, sizeof(path.s), "%s%s%s", dir->path.s, sep, name);
+    if (rc > 0 && rc < sizeof(path.s)) {
+        ftp_stat_cache_invalidate(path.s);
+    }
+
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+        struct FtpSession* session = &g_ftp.sessions[i];
+        if (session->state == FTP_SESSION_STATE_NONE) {
+            continue;
+        }
+
+        for (size_t j = 0; j < FTP_WATCH_SESSION_DIRS; j++) {
+            if (session->watch.watches[j] == watch) {
+                ftp_watch_push(session, watch, name);
+                break;
+            }
+        }
+    }
+}
+
+// a dir changed in the last second may change again within the same
+// second, so it's checked again next time.
+static time_t ftp_watch_settled_mtime(const struct stat* st) {
+    return st->st_mtime < time(NULL) ? st->st_mtime : 0;
+}
+
+// the dir is stat'd every FTP_WATCH_POLL_INTERVAL from now on.
+static void ftp_watch_poll_start(struct FtpWatch* watch) {
+    struct stat st;
+    watch->id = -1;
+    watch->exists = !ftp_vfs_stat(watch->path.s, &st) && S_ISDIR(st.st_mode);
+    watch->mtime = watch->exists ? ftp_watch_settled_mtime(&st) : 0;
+}
+
+// stops the vfs watch, unless another path is the same dir.
+static void ftp_watch_vfs_remove(struct FtpWatch* watch) {
+    if (watch->id < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < FTP_WATCH_DIRS; i++) {
+        const struct FtpWatch* other = &g_ftp.watches[i];
+        if (other != watch && other->refs && other->id == watch->id) {
+            watch->id = -1;
+            return;
+        }
+    }
+
+    ftp_vfs_watch_remove(watch->id);
+    watch->id = -1;
+}
+
+// returns the 1 based index of the watch for fullpath, adding it if it's
+// new, or 0 if all FTP_WATCH_DIRS are used.
+static unsigned ftp_watch_ref(const char* fullpath) {
+    unsigned free = 0;
+    for (size_t i = 0; i < FTP_WATCH_DIRS; i++) {
+        struct FtpWatch* watch = &g_ftp.watches[i];
+        if (watch->refs && !strcmp(watch->path.s, fullpath)) {
+            watch->refs++;
+            return i + 1;
+        } else if (!watch->refs && !free) {
+            free = i + 1;
+        }
+    }
+
+    if (free) {
+        struct FtpWatch* watch = &g_ftp.watches[free - 1];
+        memset(watch, 0, sizeof(*watch));
+        snprintf(watch->path.s, sizeof(watch->path.s), "%s", fullpath);
+        watch->refs = 1;
+        watch->id = ftp_vfs_watch_add(fullpath);
+        if (watch->id < 0) {
+            ftp_watch_poll_start(watch);
+        }
+    }
+    return free;
+}
+
+// removes the session's watch in slot, and the changes queued for it.
+static void ftp_watch_unref(struct FtpSession* session, size_t slot) {
+    struct FtpWatchSession* w = &session->watch;
+    const unsigned watch = w->watches[slot];
+    w->watches[slot] = 0;
+
+    unsigned i = 0;
+    while (i < w->event_count) {
+        if (w->events[i].watch == watch) {
+            ftp_watch_event_remove(w, i, 1);
+        } else {
+            i++;
+        }
+    }
+
+    struct FtpWatch* dir = &g_ftp.watches[watch - 1];
+    if (!--dir->refs) {
+        ftp_watch_vfs_remove(dir);
+    }
+}
+#endif
+
+// true while SITE CHANGES is waiting for a change.
+static bool ftp_watch_busy(const struct FtpSession* session) {
+#if FTP_WATCH_DIRS
+    return session->watch.waiting;
+#else
+    return false;
+#endif
+}
+
+// true if any session is waiting for changes or streaming them.
+static bool ftp_watch_waiting(void) {
+#if FTP_WATCH_DIRS
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+        const struct FtpSession* session = &g_ftp.sessions[i];
+        if (session->state != FTP_SESSION_STATE_NONE && (session->watch.waiting || session->transfer.mode == FTP_TRANSFER_MODE_WATCH)) {
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+// called each loop, reads the changes from the vfs and stats polled dirs.
+// changes are read at most every FTP_WATCH_INTERVAL unless forced.
+static void ftp_watch_progress(bool force) {
+#if FTP_WATCH_DIRS
+    const size_t now = ftp_get_timestamp_ms();
+    if (!force && now - g_ftp.watch_last_check < FTP_WATCH_INTERVAL) {
+        return;
+    }
+    g_ftp.watch_last_check = now;
+
+    char name[FTP_WATCH_NAME_SIZE];
+    int id;
+    while (ftp_vfs_watch_read(&id, name, sizeof(name)) > 0) {
+        for (size_t i = 0; i < FTP_WATCH_DIRS; i++) {
+            struct FtpWatch* watch = &g_ftp.watches[i];
+            if (!watch->refs || watch->id < 0 || (id >= 0 && watch->id != id)) {
+                continue;
+            }
+
+            // changes were dropped, everything has to be listed again.
+            if (id < 0) {
+                name[0] = '\0';
+            }
+
+            // the dir itself may have been removed or moved, so whatever
+            // is at the path from now on is polled.
+            struct stat st;
+            if (!name[0] && (ftp_vfs_stat(watch->path.s, &st) < 0 || !S_ISDIR(st.st_mode))) {
+                ftp_watch_vfs_remove(watch);
+                ftp_watch_poll_start(watch);
+            }
+
+            if (!ftp_is_reserved_name(name)) {
+                ftp_watch_notify(i + 1, name);
+            }
+        }
+    }
+
+    if (now - g_ftp.watch_last_poll >= FTP_WATCH_POLL_INTERVAL) {
+        g_ftp.watch_last_poll = now;
+        for (size_t i = 0; i < FTP_WATCH_DIRS; i++) {
+            struct FtpWatch* watch = &g_ftp.watches[i];
+            if (!watch->refs || watch->id >= 0) {
+                continue;
+            }
+
+            struct stat st;
+            const bool exists = !ftp_vfs_stat(watch->path.s, &st) && S_ISDIR(st.st_mode);
+            if (exists != watch->exists || (exists && st.st_mtime != watch->mtime)) {
+                watch->exists = exists;
+                watch->mtime = exists ? ftp_watch_settled_mtime(&st) : 0;
+                ftp_watch_notify(i + 1, "");
+
+                // a dir that came back may be watched by the vfs again.
+                if (exists) {
+                    watch->id = ftp_vfs_watch_add(watch->path.s);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+        struct FtpSession* session = &g_ftp.sessions[i];
+        if (session->state != FTP_SESSION_STATE_NONE && (session->watch.waiting || session->transfer.mode == FTP_TRANSFER_MODE_WATCH)) {
+            ftp_update_session_time(session);
+        }
+    }
+#endif
+}
+
+#if FTP_WATCH_DIRS
+// replies with as many of the queued changes as fit, the rest stay queued
+// for the next SITE CHANGES.
+static void ftp_watch_reply(struct FtpSession* session) {
+    struct FtpWatchSession* w = &session->watch;
+    w->waiting = false;
+
+    if (!w->event_count) {
+        ftp_client_msg(session, 213, "No changes.");
+        return;
+    }
+
+    char lines[FTP_SENDBUF_SIZE - 64] = {0};
+    char path[FTP_PATHNAME_SIZE + FTP_WATCH_NAME_SIZE];
+    const unsigned total = w->event_count;
+    unsigned count = 0;
+    size_t len = 0;
+
+    while (count < w->event_count) {
+        const int rc = ftp_watch_event_path(&w->events[count], path, sizeof(path));
+        if (rc > 0 && len + rc + 3 >= sizeof(lines)) {
+            // one that would never fit is dropped.
+            if (len) {
+                break;
+            }
+        } else if (rc > 0) {
+            len += snprintf(lines + len, sizeof(lines) - len, " %s" TELNET_EOL, path);
+        }
+        count++;
+    }
+
+    ftp_watch_event_remove(w, 0, count);
+    ftp_client_msg(session, 213, "-%u of %u changes." TELNET_EOL "%s", count, total, lines);
+}
+
+// SITE CHANGES STREAM, sends a line for each change as it's queued until
+// the client closes the data connection.
+static enum FTP_FILE_TRANSFER_STATE ftp_watch_stream_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
+    struct FtpWatchSession* w = &session->watch;
+    if (transfer->size) {
+        return ftp_list_buf_send(session, transfer);
+    }
+
+    if (w->event_count) {
+        const int rc = ftp_watch_event_path(&w->events[0], transfer->list_buf, sizeof(transfer->list_buf) - strlen(TELNET_EOL));
+        ftp_watch_event_remove(w, 0, 1);
+        if (rc > 0) {
+            strcpy(transfer->list_buf + rc, TELNET_EOL);
+            transfer->size = rc + strlen(TELNET_EOL);
+        }
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
+    }
+
+    // nothing to send, so the socket is only polled for the client closing it.
+    char buf[64];
+    const int n = ftp_socket_recv(&session->data_sock, buf, sizeof(buf), 0);
+    if (n < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return FTP_FILE_TRANSFER_STATE_BLOCKING;
+        }
+        return FTP_FILE_TRANSFER_STATE_ERROR;
+    } else if (n == 0) {
+        return FTP_FILE_TRANSFER_STATE_FINISHED;
+    }
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+}
+#endif
+
+// called each loop while SITE CHANGES is waiting, replies once there's a
+// change or the wait is over. interrupted ends it early with the changes
+// so far, when the client has sent another command.
+static void ftp_watch_wait_progress(struct FtpSession* session, bool interrupted) {
+#if FTP_WATCH_DIRS
+    const struct FtpWatchSession* w = &session->watch;
+    if (w->waiting && interrupted) {
+        ftp_watch_progress(true);
+    }
+    if (w->waiting && (interrupted || w->event_count || ftp_get_timestamp_ms() >= w->wait_end)) {
+        ftp_watch_reply(session);
+    }
+#endif
+}
+
+// stops the session's watches, called when it's closed.
+static void ftp_watch_stop(struct FtpSession* session) {
+#if FTP_WATCH_DIRS
+    for (size_t i = 0; i < FTP_WATCH_SESSION_DIRS; i++) {
+        if (session->watch.watches[i]) {
+            ftp_watch_unref(session, i);
+        }
+    }
+    session->watch.waiting = false;
+#endif
+}
+
+#if FTP_ARCHIVE_DEPTH
+#define FTP_ZIP_LOCAL_SIG 0x04034B50
+#define FTP_ZIP_DESCRIPTOR_SIG 0x08074B50
+#define FTP_ZIP_CENTRAL_SIG 0x02014B50
+#define FTP_ZIP64_END_SIG 0x06064B50
+#define FTP_ZIP64_LOCATOR_SIG 0x07064B50
+#define FTP_ZIP_END_SIG 0x06054B50
+#define FTP_ZIP_FLAG_DESCRIPTOR (1 << 3)
+#define FTP_ZIP_FLAG_UTF8 (1 << 11)
+#define FTP_ZIP_MAX32 0xFFFFFFFFull
+#define FTP_TAR_BLOCK 512
+#define FTP_TAR_MAX_SIZE 077777777777ull // 11 octal digits.
+
+// written to the spool for each entry, followed by its name.
+struct FtpArchiveRecord {
+    uint64_t size;
+    uint64_t offset;
+    int64_t mtime;
+    uint32_t crc;
+    uint32_t mode;
+    uint32_t name_len;
+};
+
+static unsigned char* ftp_archive_put_le(unsigned char* p, uint64_t v, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        p[i] = v >> (i * 8);
+    }
+    return p + size;
+}
+
+static const char* ftp_archive_name(const struct FtpTransfer* transfer) {
+    return transfer->archive.walk.path.s + transfer->archive.name;
+}
+
+// ms-dos time and date, in the server's time (see use_localtime).
+static uint32_t ftp_archive_dos_time(time_t mtime) {
+    struct tm tm = {0};
+    if (!unpack_time(&mtime, &tm) || tm.tm_year < 80) {
+        return 0x210000; // 1980-01-01
+    }
+    const uint32_t time = (tm.tm_sec / 2) | (tm.tm_min << 5) | (tm.tm_hour << 11);
+    const uint32_t date = tm.tm_mday | ((tm.tm_mon + 1) << 5) | ((tm.tm_year - 80) << 9);
+    return time | date << 16;
+}
+
+// the extended timestamp extra field, which has the mtime in utc.
+static unsigned char* ftp_archive_zip_put_mtime(unsigned char* p, time_t mtime) {
+    p = ftp_archive_put_le(p, 0x5455, 2);
+    p = ftp_archive_put_le(p, 5, 2);
+    *p++ = 1;
+    return ftp_archive_put_le(p, (uint32_t)mtime, 4);
+}
+
+// the fields that are the same in the local and central headers, from the
+// version needed up to the length of the name.
+static unsigned char* ftp_archive_zip_put_common(const struct FtpTransfer* transfer, unsigned char* p, uint32_t crc, bool zip64) {
+    const bool is_dir = S_ISDIR(transfer->archive.st.st_mode);
+    p = ftp_archive_put_le(p, zip64 ? 45 : 20, 2);
+    p = ftp_archive_put_le(p, FTP_ZIP_FLAG_UTF8 | (is_dir ? 0 : FTP_ZIP_FLAG_DESCRIPTOR), 2);
+    p = ftp_archive_put_le(p, 0, 2); // stored.
+    p = ftp_archive_put_le(p, ftp_archive_dos_time(transfer->archive.st.st_mtime), 4);
+    return ftp_archive_put_le(p, crc, 4);
+}
+
+// local header, the crc and sizes follow the data in the data descriptor.
+static size_t ftp_archive_zip_local(const struct FtpTransfer* transfer, unsigned char* out, size_t size) {
+    const char* name = ftp_archive_name(transfer);
+    const size_t name_len = strlen(name);
+    const bool zip64 = (uint64_t)transfer->archive.st.st_size >= FTP_ZIP_MAX32 && S_ISREG(transfer->archive.st.st_mode);
+    if (30 + name_len + 20 + 9 > size) {
+        return 0;
+    }
+
+    unsigned char* p = ftp_archive_put_le(out, FTP_ZIP_LOCAL_SIG, 4);
+    p = ftp_archive_zip_put_common(transfer, p, 0, zip64);
+    p = ftp_archive_put_le(p, zip64 ? FTP_ZIP_MAX32 : 0, 4);
+    p = ftp_archive_put_le(p, zip64 ? FTP_ZIP_MAX32 : 0, 4);
+    p = ftp_archive_put_le(p, name_len, 2);
+    p = ftp_archive_put_le(p, (zip64 ? 20 : 0) + 9, 2);
+    memcpy(p, name, name_len);
+    p += name_len;
+
+    // the descriptor then has 8 byte sizes.
+    if (zip64) {
+        p = ftp_archive_put_le(p, 1, 2);
+        p = ftp_archive_put_le(p, 16, 2);
+        p = ftp_archive_put_le(p, 0, 8);
+        p = ftp_archive_put_le(p, 0, 8);
+    }
+    p = ftp_archive_zip_put_mtime(p, transfer->archive.st.st_mtime);
+    return p - out;
+}
+
+static size_t ftp_archive_zip_descriptor(const struct FtpTransfer* transfer, unsigned char* out) {
+    const uint64_t file_size = transfer->archive.st.st_size;
+    const size_t size_len = file_size >= FTP_ZIP_MAX32 ? 8 : 4;
+    unsigned char* p = ftp_archive_put_le(out, FTP_ZIP_DESCRIPTOR_SIG, 4);
+    p = ftp_archive_put_le(p, transfer->archive.crc, 4);
+    p = ftp_archive_put_le(p, file_size, size_len);
+    p = ftp_archive_put_le(p, file_size, size_len);
+    return p - out;
+}
+
+// central dir header, sizes and the offset that don't fit in 32 bits are
+// in the zip64 extra field instead.
+static size_t ftp_archive_zip_central(const struct FtpTransfer* transfer, unsigned char* out, size_t size) {
+    const char* name = ftp_archive_name(transfer);
+    const size_t name_len = strlen(name);
+    const uint64_t file_size = S_ISREG(transfer->archive.st.st_mode) ? transfer->archive.st.st_size : 0;
+    const uint64_t offset = transfer->archive.entry;
+    const bool large_size = file_size >= FTP_ZIP_MAX32;
+    const bool large_offset = offset >= FTP_ZIP_MAX32;
+    const size_t zip64_len = (large_size ? 16 : 0) + (large_offset ? 8 : 0);
+    if (46 + name_len + 4 + zip64_len + 9 > size) {
+        return 0;
+    }
+
+    unsigned char* p = ftp_archive_put_le(out, FTP_ZIP_CENTRAL_SIG, 4);
+    p = ftp_archive_put_le(p, 3 << 8 | 45, 2); // made by unix.
+    p = ftp_archive_zip_put_common(transfer, p, transfer->archive.crc, zip64_len);
+    p = ftp_archive_put_le(p, large_size ? FTP_ZIP_MAX32 : file_size, 4);
+    p = ftp_archive_put_le(p, large_size ? FTP_ZIP_MAX32 : file_size, 4);
+    p = ftp_archive_put_le(p, name_len, 2);
+    p = ftp_archive_put_le(p, (zip64_len ? 4 + zip64_len : 0) + 9, 2);
+    p = ftp_archive_put_le(p, 0, 2); // comment.
+    p = ftp_archive_put_le(p, 0, 2); // disk.
+    p = ftp_archive_put_le(p, 0, 2); // internal attributes.
+    p = ftp_archive_put_le(p, (uint32_t)(transfer->archive.st.st_mode & 0xFFFF) << 16 | (S_ISDIR(transfer->archive.st.st_mode) ? 0x10 : 0), 4);
+    p = ftp_archive_put_le(p, large_offset ? FTP_ZIP_MAX32 : offset, 4);
+    memcpy(p, name, name_len);
+    p += name_len;
+
+    if (zip64_len) {
+        p = ftp_archive_put_le(p, 1, 2);
+        p = ftp_archive_put_le(p, zip64_len, 2);
+        if (large_size) {
+            p = ftp_archive_put_le(p, file_size, 8);
+            p = ftp_archive_put_le(p, file_size, 8);
+        }
+        if (large_offset) {
+            p = ftp_archive_put_le(p, offset, 8);
+        }
+    }
+    p = ftp_archive_zip_put_mtime(p, transfer->archive.st.st_mtime);
+    return p - out;
+}
+
+// end of central dir record, preceded by the zip64 one and its locator if
+// the counts or offsets don't fit.
+static size_t ftp_archive_zip_end(const struct FtpTransfer* transfer, unsigned char* out) {
+    const uint64_t count = transfer->archive.count;
+    const uint64_t cd_off = transfer->archive.cd_off;
+    const uint64_t cd_size = transfer->archive.entry - cd_off;
+    const bool zip64 = count >= 0xFFFF || cd_off >= FTP_ZIP_MAX32 || cd_size >= FTP_ZIP_MAX32;
+    unsigned char* p = out;
+
+    if (zip64) {
+        p = ftp_archive_put_le(p, FTP_ZIP64_END_SIG, 4);
+        p = ftp_archive_put_le(p, 44, 8); // size of the rest of the record.
+        p = ftp_archive_put_le(p, 3 << 8 | 45, 2);
+        p = ftp_archive_put_le(p, 45, 2);
+        p = ftp_archive_put_le(p, 0, 4);
+        p = ftp_archive_put_le(p, 0, 4);
+        p = ftp_archive_put_le(p, count, 8);
+        p = ftp_archive_put_le(p, count, 8);
+        p = ftp_archive_put_le(p, cd_size, 8);
+        p = ftp_archive_put_le(p, cd_off, 8);
+
+        p = ftp_archive_put_le(p, FTP_ZIP64_LOCATOR_SIG, 4);
+        p = ftp_archive_put_le(p, 0, 4);
+        p = ftp_archive_put_le(p, transfer->archive.entry, 8);
+        p = ftp_archive_put_le(p, 1, 4);
+    }
+
+    p = ftp_archive_put_le(p, FTP_ZIP_END_SIG, 4);
+    p = ftp_archive_put_le(p, 0, 2);
+    p = ftp_archive_put_le(p, 0, 2);
+    p = ftp_archive_put_le(p, zip64 ? 0xFFFF : count, 2);
+    p = ftp_archive_put_le(p, zip64 ? 0xFFFF : count, 2);
+    p = ftp_archive_put_le(p, zip64 ? FTP_ZIP_MAX32 : cd_size, 4);
+    p = ftp_archive_put_le(p, zip64 ? FTP_ZIP_MAX32 : cd_off, 4);
+    p = ftp_archive_put_le(p, 0, 2);
+    return p - out;
+}
+
+// a ustar header block, name is split into the prefix if it's too long.
+// returns false if it doesn't fit either way.
+static bool ftp_archive_tar_block(unsigned char* out, const char* name, const struct stat* st, char type, uint64_t size) {
+    const size_t name_len = strlen(name);
+    size_t split = 0;
+    if (name_len > 100) {
+        // the last char is skipped, it's the slash of a dir.
+        for (split = 1; split < name_len - 1; split++) {
+            if (name[split] == '/' && name_len - split - 1 <= 100) {
+                break;
+            }
+        }
+        if (split >= name_len - 1 || split > 155) {
+            return false;
+        }
+    }
+
+    char* h = (char*)out;
+    memset(h, 0, FTP_TAR_BLOCK);
+    if (split) {
+        memcpy(h, name + split + 1, name_len - split - 1);
+        memcpy(h + 345, name, split);
     } else {
-        transfer->size = rc;
+        memcpy(h, name, name_len);
     }
 
-    return rc;
+    // each field is NULL terminated, snprintf writes the NULL.
+    snprintf(h + 100, 8, "%07o", (unsigned)(st->st_mode & 07777));
+    snprintf(h + 108, 8, "%07o", (unsigned)(st->st_uid <= 07777777 ? st->st_uid : 0));
+    snprintf(h + 116, 8, "%07o", (unsigned)(st->st_gid <= 07777777 ? st->st_gid : 0));
+    snprintf(h + 124, 12, "%011llo", (unsigned long long)(size <= FTP_TAR_MAX_SIZE ? size : 0));
+    const unsigned long long mtime = st->st_mtime > 0 ? st->st_mtime : 0;
+    snprintf(h + 136, 12, "%011llo", mtime <= FTP_TAR_MAX_SIZE ? mtime : FTP_TAR_MAX_SIZE);
+    h[156] = type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    unsigned sum = 0;
+    memset(h + 148, ' ', 8);
+    for (size_t i = 0; i < FTP_TAR_BLOCK; i++) {
+        sum += out[i];
+    }
+    snprintf(h + 148, 8, "%06o", sum);
+    return true;
 }
 
-static void ftp_session_send(struct FtpSession* session);
+// "<len> <key>=<value>\n", where len includes itself.
+static int ftp_archive_pax_record(char* out, size_t size, const char* key, const char* value) {
+    const size_t len = strlen(key) + strlen(value) + 3;
+    size_t total = len + 1;
+    while ((size_t)snprintf(NULL, 0, "%zu", total) + len != total) {
+        total++;
+    }
+    return snprintf(out, size, "%zu %s=%s\n", total, key, value);
+}
 
-static void ftp_client_msg(struct FtpSession* session, unsigned code, const char* fmt, ...) {
-    // prepend with the code.
-    const size_t size = sizeof(session->send_buf);
-    const size_t code_len = snprintf(session->send_buf, size, "%u ", code);
-    const size_t eol_padding = code_len * 2 + 4 + 3;
+// tar header of the entry, with a pax header before it for names and sizes
+// that ustar can't hold.
+static size_t ftp_archive_tar_header(const struct FtpTransfer* transfer, unsigned char* out, size_t size) {
+    const struct stat* st = &transfer->archive.st;
+    const char* name = ftp_archive_name(transfer);
+    const bool is_dir = S_ISDIR(st->st_mode);
+    const uint64_t file_size = is_dir ? 0 : st->st_size;
+    if (size < FTP_TAR_BLOCK) {
+        return 0;
+    } else if (file_size <= FTP_TAR_MAX_SIZE && ftp_archive_tar_block(out, name, st, is_dir ? '5' : '0', file_size)) {
+        return FTP_TAR_BLOCK;
+    }
 
-    // append message.
-    va_list va;
-    va_start(va, fmt);
-    vsnprintf(session->send_buf + code_len, size - eol_padding, fmt, va);
-    va_end(va);
+    char num[32];
+    char* records = (char*)out + FTP_TAR_BLOCK;
+    const size_t records_size = size - FTP_TAR_BLOCK;
+    int len = ftp_archive_pax_record(records, records_size, "path", name);
+    if (len > 0 && len < records_size && file_size > FTP_TAR_MAX_SIZE) {
+        snprintf(num, sizeof(num), "%llu", (unsigned long long)file_size);
+        len += ftp_archive_pax_record(records + len, records_size - len, "size", num);
+    }
 
-    // if multiline message, append END.
-    const size_t len = strlen(session->send_buf);
-    if (len > code_len && session->send_buf[code_len] == '-') {
-        memmove(session->send_buf + code_len - 1, session->send_buf + code_len, len - code_len);
-        snprintf(session->send_buf + len - 1, size - len - 3, "%d END", code);
+    const size_t padded = (len + FTP_TAR_BLOCK - 1) / FTP_TAR_BLOCK * FTP_TAR_BLOCK;
+    if (len <= 0 || FTP_TAR_BLOCK + padded + FTP_TAR_BLOCK > size) {
+        return 0;
     }
+    memset(records + len, 0, padded - len);
+    ftp_archive_tar_block(out, "././@PaxHeader", st, 'x', len);
+
+    // the pax header has the real name, this one only has to fit.
+    char short_name[100];
+    snprintf(short_name, sizeof(short_name), "%s", name);
+    ftp_archive_tar_block(out + FTP_TAR_BLOCK + padded, short_name, st, is_dir ? '5' : '0', file_size);
+    return FTP_TAR_BLOCK + padded + FTP_TAR_BLOCK;
+}
 
-    if (code < 400) {
-        ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, session->send_buf);
-    } else {
-        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, session->send_buf);
+// sends what's left of a header / trailer, which is built again on each
+// call. returns CONTINUE once all of it has been sent.
+static enum FTP_FILE_TRANSFER_STATE ftp_archive_send(struct FtpSession* session, struct FtpTransfer* transfer, const unsigned char* buf, size_t size) {
+    const int n = ftp_socket_send(&session->data_sock, buf + transfer->archive.off, size - transfer->archive.off, 0);
+    if (n < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return FTP_FILE_TRANSFER_STATE_BLOCKING;
+        }
+        return FTP_FILE_TRANSFER_STATE_ERROR;
     }
 
-    // finally, append EOL and send message.
-    strcat(session->send_buf, TELNET_EOL);
-    session->send_buf_offset = 0;
-    session->send_buf_size = strlen(session->send_buf);
-    session->state = FTP_SESSION_STATE_POLLOUT;
+    FTP_TRACE3(dir__chunk, ftp_session_index(session), n, transfer->transferred);
+    transfer->archive.off += n;
+    transfer->transferred += n;
+    if (transfer->archive.off < size) {
+        return FTP_FILE_TRANSFER_STATE_BLOCKING;
+    }
 
-    // try to send immediately.
-    ftp_session_send(session);
+    transfer->archive.off = 0;
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
 }
 
-static void ftp_data_transfer_end(struct FtpSession* session) {
-    switch (session->data_connection) {
-        case FTP_DATA_CONNECTION_NONE:
-            break;
-        case FTP_DATA_CONNECTION_ACTIVE:
-            ftp_socket_close(&session->data_sock);
-            break;
-        case FTP_DATA_CONNECTION_PASSIVE:
-            ftp_socket_close(&session->data_sock);
-            ftp_socket_close(&session->pasv_sock);
-            break;
+// once an entry has been sent, its zip central dir record is spooled.
+static enum FTP_FILE_TRANSFER_STATE ftp_archive_entry_done(struct FtpTransfer* transfer) {
+    transfer->archive.state = FTP_ARCHIVE_STATE_NEXT;
+    if (!transfer->archive.zip) {
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
     }
 
-    ftp_vfs_close(&session->transfer.file_vfs);
-    ftp_vfs_closedir(&session->transfer.dir_vfs);
-
-    session->transfer.connection_pending = false;
-    session->temp_path.s[0] = '\0';
-    session->transfer.offset = 0;
-    session->transfer.size = 0;
-    session->transfer.mode = FTP_TRANSFER_MODE_NONE;
-    session->data_connection = FTP_DATA_CONNECTION_NONE;
+    const char* name = ftp_archive_name(transfer);
+    const struct FtpArchiveRecord record = {
+        .size = S_ISREG(transfer->archive.st.st_mode) ? transfer->archive.st.st_size : 0,
+        .offset = transfer->archive.entry,
+        .mtime = transfer->archive.st.st_mtime,
+        .crc = transfer->archive.crc,
+        .mode = transfer->archive.st.st_mode,
+        .name_len = strlen(name),
+    };
+
+    // written at once, as the vfs may not buffer.
+    unsigned char buf[sizeof(record) + FTP_PATHNAME_SIZE];
+    const size_t len = sizeof(record) + record.name_len;
+    memcpy(buf, &record, sizeof(record));
+    memcpy(buf + sizeof(record), name, record.name_len);
+    if (ftp_vfs_write(&transfer->archive.spool, buf, len) != len) {
+        return FTP_FILE_TRANSFER_STATE_ERROR;
+    }
+    transfer->archive.count++;
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
 }
 
-static void ftp_data_poll(struct FtpSession* session) {
-    int rc = 0;
+// sets up the entry for path, which is added to the archive as name.
+static void ftp_archive_entry(struct FtpTransfer* transfer, const struct stat* st) {
+    transfer->archive.st = *st;
+    transfer->archive.left = S_ISREG(st->st_mode) ? st->st_size : 0;
+    transfer->archive.entry = transfer->transferred;
+    transfer->archive.crc = 0;
+    hash_init(&transfer->archive.hash, HashType_CRC32);
+    transfer->archive.state = FTP_ARCHIVE_STATE_HEADER;
+}
 
-    if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
-        rc = ftp_socket_connect(&session->data_sock, (struct sockaddr*)&session->data_sockaddr, sizeof(session->data_sockaddr));
-        if (rc < 0) {
-            if (errno == EAGAIN || errno == EINPROGRESS || errno == EALREADY) {
-                // blocking...
-            } else if (errno == EISCONN) {
-                session->transfer.connection_pending = false;
-            } else {
-                ftp_client_msg(session, 425, "Can't open data connection, [poll] %d %s.", errno, strerror(errno));
-                ftp_data_transfer_end(session);
-            }
-        } else {
-            session->transfer.connection_pending = false;
-        }
-    } else {
-        size_t socklen = sizeof(session->pasv_sockaddr);
-        rc = ftp_socket_accept(&session->data_sock, &session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, &socklen);
-        if (rc < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // blocking...
-            } else {
-                ftp_client_msg(session, 425, "Can't open data connection, [poll] %d %s.", errno, strerror(errno));
-                ftp_data_transfer_end(session);
+// reads the next entry of the tree, files that can't be opened are left out.
+static enum FTP_FILE_TRANSFER_STATE ftp_archive_next(struct FtpTransfer* transfer) {
+    struct stat st;
+    int err;
+    const enum FTP_WALK_RESULT walk = ftp_walk_next(&transfer->archive.walk, FTP_ARCHIVE_DEPTH, &st, &err);
+    if (walk == FTP_WALK_END) {
+        if (transfer->archive.zip) {
+            // reopened to read back what has been written.
+            if (ftp_vfs_close(&transfer->archive.spool) < 0 || ftp_vfs_open(&transfer->archive.spool, transfer->archive.spool_path.s, FtpVfsOpenMode_READ) < 0) {
+                return FTP_FILE_TRANSFER_STATE_ERROR;
             }
+            transfer->archive.cd_off = transfer->transferred;
+            transfer->archive.name = 0;
+            transfer->archive.record = false;
+            transfer->archive.state = FTP_ARCHIVE_STATE_CENTRAL;
         } else {
-            ftp_set_data_socket_options(&session->data_sock);
-            session->transfer.connection_pending = false;
+            transfer->archive.state = FTP_ARCHIVE_STATE_END;
         }
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
     }
-}
 
-static void ftp_data_open(struct FtpSession* session, enum FTP_TRANSFER_MODE mode) {
-    int rc = 0;
-    ftp_client_msg(session, 150, "File status okay; about to open data connection.");
+    if (walk == FTP_WALK_AGAIN || !st.st_mode) {
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
+    }
 
-    if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
-        rc = ftp_socket_open(&session->data_sock, PF_INET, SOCK_STREAM, 0);
-        if (rc >= 0) {
-            ftp_set_data_socket_options(&session->data_sock);
+    // dirs that aren't walked are still added. symlinks and anything else
+    // that isn't a file or dir are left out.
+    struct Pathname* path = &transfer->archive.walk.path;
+    if (S_ISDIR(st.st_mode)) {
+        strcat(path->s, "/");
+    } else if (!S_ISREG(st.st_mode) || ftp_vfs_open(&transfer->file_vfs, path->s, FtpVfsOpenMode_READ) < 0) {
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
+    }
+
+    ftp_archive_entry(transfer, &st);
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+}
+
+// sends exactly the size the file had when it was added, a file that shrank
+// meanwhile is padded with zeros.
+static enum FTP_FILE_TRANSFER_STATE ftp_archive_data(struct FtpSession* session, struct FtpTransfer* transfer) {
+    if (!transfer->archive.left) {
+        ftp_vfs_close(&transfer->file_vfs);
+        transfer->archive.crc = 0;
+        if (transfer->archive.zip) {
+            uint8_t crc[4];
+            hash_final(&transfer->archive.hash, crc);
+            transfer->archive.crc = (uint32_t)crc[0] << 24 | crc[1] << 16 | crc[2] << 8 | crc[3];
         }
+        transfer->archive.state = FTP_ARCHIVE_STATE_TRAILER;
+        return FTP_FILE_TRANSFER_STATE_CONTINUE;
     }
 
-    if (rc < 0) {
-        ftp_client_msg(session, 425, "Can't open data connection [NORM], %s.", strerror(errno));
-        ftp_data_transfer_end(session);
+    size_t size = transfer->archive.left < sizeof(g_ftp.data_buf) ? transfer->archive.left : sizeof(g_ftp.data_buf);
+    int n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, size);
+    if (n < 0) {
+        return FTP_FILE_TRANSFER_STATE_ERROR;
+    } else if (n) {
+        size = n;
     } else {
-        session->transfer.mode = mode;
-        session->transfer.index = 0;
-        session->transfer.connection_pending = true;
+        // the file shrank after the header went out, pad it to the size given.
+        memset(g_ftp.data_buf, 0, size);
+    }
 
-        // try to open immediately.
-        ftp_data_poll(session);
+    const size_t offset = transfer->archive.st.st_size - transfer->archive.left;
+    n = ftp_socket_send(&session->data_sock, g_ftp.data_buf, size, 0);
+    FTP_TRACE4(file__chunk, ftp_session_index(session), transfer->mode, n, offset);
+    if (n < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            ftp_vfs_seek(&transfer->file_vfs, g_ftp.data_buf, 0, offset);
+            return FTP_FILE_TRANSFER_STATE_BLOCKING;
+        }
+        return FTP_FILE_TRANSFER_STATE_ERROR;
+    }
+
+    if (transfer->archive.zip) {
+        hash_update(&transfer->archive.hash, g_ftp.data_buf, n);
     }
+    transfer->archive.left -= n;
+    transfer->transferred += n;
+    if (n != size) {
+        ftp_vfs_seek(&transfer->file_vfs, g_ftp.data_buf, n, offset + n);
+        return FTP_FILE_TRANSFER_STATE_BLOCKING;
+    }
+    return FTP_FILE_TRANSFER_STATE_CONTINUE;
 }
 
-static enum FTP_FILE_TRANSFER_STATE ftp_dir_data_transfer_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
-    // send as much data as possible.
-    if (transfer->size) {
-        const int n = ftp_socket_send(&session->data_sock, transfer->list_buf + transfer->offset, transfer->size, 0);
-        if (n < 0) {
-            // check if it failed due to anything but blocking.
-            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+// reads the next record from the spool into the entry, returns 1 if one
+// was read, 0 once they've all been read, or -1 on error.
+static int ftp_archive_read_record(struct FtpTransfer* transfer) {
+    struct FtpArchiveRecord record;
+    const int n = ftp_vfs_read(&transfer->archive.spool, &record, sizeof(record));
+    if (n <= 0) {
+        return n;
+    } else if (n != sizeof(record) || record.name_len >= sizeof(transfer->archive.walk.path.s)) {
+        errno = EIO;
+        return -1;
+    } else if (record.name_len && ftp_vfs_read(&transfer->archive.spool, transfer->archive.walk.path.s, record.name_len) != record.name_len) {
+        errno = EIO;
+        return -1;
+    }
+
+    transfer->archive.walk.path.s[record.name_len] = '\0';
+    transfer->archive.st.st_size = record.size;
+    transfer->archive.st.st_mtime = record.mtime;
+    transfer->archive.st.st_mode = record.mode;
+    transfer->archive.entry = record.offset;
+    transfer->archive.crc = record.crc;
+    return 1;
+}
+
+// RETR of <dir>.zip / <dir>.tar, a header and the data for each entry as
+// the tree is walked, then the zip central dir from the spool.
+static enum FTP_FILE_TRANSFER_STATE ftp_archive_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
+    unsigned char* buf = g_ftp.data_buf;
+    enum FTP_FILE_TRANSFER_STATE state;
+    size_t size;
+
+    switch (transfer->archive.state) {
+        case FTP_ARCHIVE_STATE_NEXT:
+            return ftp_archive_next(transfer);
+
+        case FTP_ARCHIVE_STATE_HEADER:
+            if (transfer->archive.zip) {
+                size = ftp_archive_zip_local(transfer, buf, sizeof(g_ftp.data_buf));
+            } else {
+                size = ftp_archive_tar_header(transfer, buf, sizeof(g_ftp.data_buf));
+            }
+
+            if (!size) {
+                errno = ENAMETOOLONG;
                 return FTP_FILE_TRANSFER_STATE_ERROR;
+            }
+
+            state = ftp_archive_send(session, transfer, buf, size);
+            if (state == FTP_FILE_TRANSFER_STATE_CONTINUE) {
+                if (S_ISREG(transfer->archive.st.st_mode)) {
+                    transfer->archive.state = FTP_ARCHIVE_STATE_DATA;
+                } else {
+                    return ftp_archive_entry_done(transfer);
+                }
+            }
+            return state;
+
+        case FTP_ARCHIVE_STATE_DATA:
+            return ftp_archive_data(session, transfer);
+
+        case FTP_ARCHIVE_STATE_TRAILER:
+            if (transfer->archive.zip) {
+                size = ftp_archive_zip_descriptor(transfer, buf);
             } else {
-                return FTP_FILE_TRANSFER_STATE_BLOCKING;
+                size = (FTP_TAR_BLOCK - transfer->archive.st.st_size % FTP_TAR_BLOCK) % FTP_TAR_BLOCK;
+                memset(buf, 0, size);
             }
-        } else if (n != transfer->size) {
-            // partial transfer.
-            transfer->offset += n;
-            transfer->size -= n;
-            return FTP_FILE_TRANSFER_STATE_BLOCKING;
-        } else {
-            transfer->list_buf[0] = '\0';
-            transfer->offset = 0;
-            transfer->size = 0;
 
-            // check if we are finished with this transfer.
-            if (!ftp_vfs_isdir_open(&transfer->dir_vfs)) {
-                return FTP_FILE_TRANSFER_STATE_FINISHED;
+            state = size ? ftp_archive_send(session, transfer, buf, size) : FTP_FILE_TRANSFER_STATE_CONTINUE;
+            if (state == FTP_FILE_TRANSFER_STATE_CONTINUE) {
+                return ftp_archive_entry_done(transfer);
             }
-        }
-    } else {
-        // parse the next file.
-        static struct FtpVfsDirEntry entry;
-        const char* name = ftp_vfs_readdir(&transfer->dir_vfs, &entry);
-        if (!name) {
-            return FTP_FILE_TRANSFER_STATE_FINISHED;
-        }
+            return state;
 
-        if (!strcmp(".", name) || !strcmp("..", name)) {
-            return FTP_FILE_TRANSFER_STATE_CONTINUE;
-        }
+        case FTP_ARCHIVE_STATE_CENTRAL:
+            if (!transfer->archive.record) {
+                const int rc = ftp_archive_read_record(transfer);
+                if (rc < 0) {
+                    return FTP_FILE_TRANSFER_STATE_ERROR;
+                } else if (!rc) {
+                    transfer->archive.entry = transfer->transferred;
+                    transfer->archive.state = FTP_ARCHIVE_STATE_END;
+                    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+                }
+                transfer->archive.record = true;
+            }
 
-        int rc;
-        struct Pathname filepath;
-        if (session->temp_path.s[strlen(session->temp_path.s) - 1] != '/') {
-            rc = snprintf(filepath.s, sizeof(filepath), "%s/%s", session->temp_path.s, name);
-        } else {
-            rc = snprintf(filepath.s, sizeof(filepath), "%s%s", session->temp_path.s, name);
-        }
+            size = ftp_archive_zip_central(transfer, buf, sizeof(g_ftp.data_buf));
+            if (!size) {
+                errno = ENAMETOOLONG;
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            }
 
-        if (rc <= 0 || rc >= sizeof(filepath)) {
-            return FTP_FILE_TRANSFER_STATE_CONTINUE;
-        }
+            state = ftp_archive_send(session, transfer, buf, size);
+            if (state == FTP_FILE_TRANSFER_STATE_CONTINUE) {
+                transfer->archive.record = false;
+            }
+            return state;
 
-        struct stat st = {0};
-        rc = ftp_vfs_dirlstat(&transfer->dir_vfs, &entry, filepath.s, &st);
-        if (rc < 0) {
-            return FTP_FILE_TRANSFER_STATE_CONTINUE;
-        }
+        case FTP_ARCHIVE_STATE_END:
+            if (transfer->archive.zip) {
+                size = ftp_archive_zip_end(transfer, buf);
+            } else {
+                size = FTP_TAR_BLOCK * 2;
+                memset(buf, 0, size);
+            }
 
-        ftp_build_list_entry(session, &filepath, name, &st);
+            state = ftp_archive_send(session, transfer, buf, size);
+            if (state == FTP_FILE_TRANSFER_STATE_CONTINUE) {
+                return FTP_FILE_TRANSFER_STATE_FINISHED;
+            }
+            return state;
     }
 
-    return FTP_FILE_TRANSFER_STATE_CONTINUE;
+    return FTP_FILE_TRANSFER_STATE_ERROR;
+}
+#endif
+
+// true if the data connection is read from rather than written to.
+static bool ftp_transfer_is_recv(const struct FtpSession* session) {
+    const struct FtpTransfer* transfer = &session->transfer;
+#if FTP_MSTAT
+    if (transfer->mode == FTP_TRANSFER_MODE_MSTAT) {
+        return ftp_mstat_wants_recv(transfer);
+    }
+#endif
+#if FTP_WATCH_DIRS
+    // a stream is only written to when there's a change to send.
+    if (transfer->mode == FTP_TRANSFER_MODE_WATCH) {
+        return !transfer->size && !session->watch.event_count;
+    }
+#endif
+    return transfer->mode == FTP_TRANSFER_MODE_STOR;
+}
+
+// size capped to what is left of a RANG transfer.
+static size_t ftp_transfer_left(const struct FtpTransfer* transfer, size_t size) {
+    if (transfer->end) {
+        const size_t left = transfer->offset < transfer->end ? transfer->end - transfer->offset : 0;
+        return size < left ? size : left;
+    }
+    return size;
 }
 
 static enum FTP_FILE_TRANSFER_STATE ftp_file_data_transfer_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
     int n;
 
     if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
-        const int read = n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, sizeof(g_ftp.data_buf));
+        const size_t size = ftp_transfer_left(transfer, sizeof(g_ftp.data_buf));
+        if (!size) {
+            return FTP_FILE_TRANSFER_STATE_FINISHED;
+        }
+
+        const unsigned char* buf = g_ftp.data_buf;
+        // set if the data didn't come from a plain read of file_vfs, which
+        // then doesn't need to be rewound after a partial send.
+        bool no_rewind = false;
+        int read;
+
+#if FTP_FILE_CACHE_SIZE
+        if (transfer->file_cache) {
+            const struct FtpFileCacheEntry* e = &g_ftp.file_cache[transfer->file_cache - 1];
+            no_rewind = true;
+            buf = g_ftp.file_cache_data + e->off + transfer->offset;
+            read = n = transfer->offset < e->size ? ftp_transfer_left(transfer, e->size - transfer->offset) : 0;
+        }
+#endif
+
+#if FTP_READ_SHARE_SEGMENTS
+        if (!no_rewind && transfer->share_file) {
+            struct FtpReadShareFile* file = ftp_read_share_get(transfer);
+            if (file) {
+                no_rewind = true;
+                read = n = ftp_read_share_read(session, transfer, file, &buf);
+                if (n > 0) {
+                    read = n = ftp_transfer_left(transfer, n);
+                }
+            } else {
+                // the file changed part way through, carry on reading it alone.
+                ftp_read_share_close(transfer);
+                if (ftp_vfs_seek(&transfer->file_vfs, NULL, 0, transfer->offset) < 0) {
+                    return FTP_FILE_TRANSFER_STATE_ERROR;
+                }
+            }
+        }
+#endif
+
+        if (!no_rewind) {
+            read = n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, size);
+        }
+
         if (n < 0) {
             return FTP_FILE_TRANSFER_STATE_ERROR;
         } else if (n == 0) {
             return FTP_FILE_TRANSFER_STATE_FINISHED;
         } else {
-            n = ftp_socket_send(&session->data_sock, g_ftp.data_buf, n, 0);
+            n = ftp_socket_send(&session->data_sock, buf, n, 0);
+            FTP_TRACE4(file__chunk, ftp_session_index(session), transfer->mode, n, transfer->offset);
             if (n < 0) {
                 if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                    ftp_vfs_seek(&transfer->file_vfs, g_ftp.data_buf, 0, transfer->offset);
+                    if (!no_rewind) {
+                        ftp_vfs_seek(&transfer->file_vfs, buf, 0, transfer->offset);
+                    }
                     return FTP_FILE_TRANSFER_STATE_BLOCKING;
                 } else {
                     return FTP_FILE_TRANSFER_STATE_ERROR;
                 }
             } else {
                 transfer->offset += (size_t)n;
+                transfer->transferred += (size_t)n;
+                ftp_advise_progress(transfer);
                 if (n != read) {
-                    ftp_vfs_seek(&transfer->file_vfs, g_ftp.data_buf, n, transfer->offset);
+                    if (!no_rewind) {
+                        ftp_vfs_seek(&transfer->file_vfs, buf, n, transfer->offset);
+                    }
                     return FTP_FILE_TRANSFER_STATE_BLOCKING;
                 }
             }
         }
     } else {
+#if FTP_DELTA_UPLOADS
+        if (transfer->delta) {
+            return ftp_delta_progress(session, transfer);
+        }
+#endif
+
         n = ftp_socket_recv(&session->data_sock, g_ftp.data_buf, sizeof(g_ftp.data_buf), 0);
         if (n < 0) {
             if (errno == EWOULDBLOCK || errno == EAGAIN) {
@@ -613,12 +3982,20 @@ static enum FTP_FILE_TRANSFER_STATE ftp_file_data_transfer_progress(struct FtpSe
             }
         } else if (n == 0) {
             return FTP_FILE_TRANSFER_STATE_FINISHED;
+        } else if (!ftp_segment_fits(transfer, n) || ftp_transfer_left(transfer, n) < (size_t)n) {
+            errno = EFBIG;
+            return FTP_FILE_TRANSFER_STATE_ERROR;
         } else {
             n = ftp_vfs_write(&transfer->file_vfs, g_ftp.data_buf, n);
+            FTP_TRACE4(file__chunk, ftp_session_index(session), transfer->mode, n, transfer->offset);
             if (n < 0) {
                 return FTP_FILE_TRANSFER_STATE_ERROR;
             } else {
+                ftp_hash_upload_progress(transfer, g_ftp.data_buf, n);
                 transfer->offset += n;
+                transfer->transferred += n;
+                ftp_advise_progress(transfer);
+                ftp_journal_progress(session, false);
             }
         }
     }
@@ -634,6 +4011,26 @@ static void ftp_data_transfer_progress(struct FtpSession* session) {
     while (state == FTP_FILE_TRANSFER_STATE_CONTINUE) {
         if (transfer->mode == FTP_TRANSFER_MODE_RETR || transfer->mode == FTP_TRANSFER_MODE_STOR) {
             state = ftp_file_data_transfer_progress(session, transfer);
+#if FTP_DELTA_UPLOADS
+        } else if (transfer->mode == FTP_TRANSFER_MODE_DELTASIG) {
+            state = ftp_delta_sig_progress(session, transfer);
+#endif
+#if FTP_MANIFEST_DEPTH
+        } else if (transfer->mode == FTP_TRANSFER_MODE_MANIFEST) {
+            state = ftp_manifest_progress(session, transfer);
+#endif
+#if FTP_MSTAT
+        } else if (transfer->mode == FTP_TRANSFER_MODE_MSTAT) {
+            state = ftp_mstat_progress(session, transfer);
+#endif
+#if FTP_WATCH_DIRS
+        } else if (transfer->mode == FTP_TRANSFER_MODE_WATCH) {
+            state = ftp_watch_stream_progress(session, transfer);
+#endif
+#if FTP_ARCHIVE_DEPTH
+        } else if (transfer->mode == FTP_TRANSFER_MODE_ARCHIVE) {
+            state = ftp_archive_progress(session, transfer);
+#endif
         } else {
             state = ftp_dir_data_transfer_progress(session, transfer);
         }
@@ -652,7 +4049,22 @@ static void ftp_data_transfer_progress(struct FtpSession* session) {
         ftp_client_msg(session, 426, "Connection closed; transfer aborted, %s", strerror(errno));
         ftp_data_transfer_end(session);
     } else if (state == FTP_FILE_TRANSFER_STATE_FINISHED) {
-        ftp_client_msg(session, 226, "Closing data connection.");
+        char hash[96] = "";
+
+        // the vfs may buffer writes, only report success once they're out.
+        if (transfer->mode == FTP_TRANSFER_MODE_STOR && (ftp_vfs_close(&transfer->file_vfs) < 0 || ftp_delta_finish(session) < 0)) {
+            ftp_client_msg(session, 451, "Requested action aborted: local error in processing, %s", strerror(errno));
+        } else {
+            // the dir is still open if a dir was listed rather than a file.
+            if ((transfer->mode == FTP_TRANSFER_MODE_LIST || transfer->mode == FTP_TRANSFER_MODE_NLST) && ftp_vfs_isdir_open(&transfer->dir_vfs)) {
+                ftp_prefetch_listed(session, session->temp_path.s);
+            } else if (transfer->mode == FTP_TRANSFER_MODE_STOR) {
+                ftp_journal_finish(session);
+                ftp_segment_close(transfer, true);
+                ftp_hash_upload_finish(session, hash, sizeof(hash));
+            }
+            ftp_client_msg(session, 226, "Closing data connection.%s", hash);
+        }
         ftp_data_transfer_end(session);
     }
 
@@ -711,7 +4123,7 @@ static void ftp_set_directory(struct FtpSession* session, const struct Pathname*
     if (rc >= 0) {
         if (strcmp("/", fullpath.s)) {
             struct stat st = {0};
-            rc = ftp_vfs_stat(fullpath.s, &st);
+            rc = ftp_stat_cached(fullpath.s, &st, false);
             if (!S_ISDIR(st.st_mode)) {
                 errno = ENOTDIR;
                 rc = -1;
@@ -814,9 +4226,17 @@ static void ftp_cmd_PASV(struct FtpSession* session, const char* data) {
 
         // copy current over ip addr
         session->pasv_sockaddr = session->control_sockaddr;
-        session->pasv_sockaddr.sin_port = htons(socket_bind_port());
 
-        rc = ftp_socket_bind(&session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, sizeof(session->pasv_sockaddr));
+        // the port may already be taken by another socket (such as a client's
+        // ephemeral port on loopback), so try a few before giving up.
+        for (int i = 0; i < 16; i++) {
+            session->pasv_sockaddr.sin_port = htons(socket_bind_port());
+            rc = ftp_socket_bind(&session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, sizeof(session->pasv_sockaddr));
+            if (rc >= 0 || errno != EADDRINUSE) {
+                break;
+            }
+        }
+
         if (rc < 0) {
             ftp_client_msg(session, 501, "bind failed Syntax error in parameters or arguments, %s", strerror(errno));
         } else {
@@ -901,20 +4321,75 @@ static void ftp_open_file(struct FtpSession* session, const char* data, enum Ftp
         session->server_marker = 0;
     }
 
+    session->transfer.end = open_mode != FtpVfsOpenMode_APPEND ? session->range_end : 0;
+    session->range_end = 0;
+
+    // a resumed upload keeps what is already in the file, as does one
+    // that writes a range.
+    if (open_mode == FtpVfsOpenMode_WRITE && (session->transfer.offset || session->transfer.end)) {
+        open_mode = FtpVfsOpenMode_UPDATE;
+    }
+
     struct Pathname pathname = {0};
     int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
 
-    if (rc <= 0 || rc >= sizeof(pathname)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
-    } else {
-        struct Pathname fullpath = {0};
-        rc = build_fullpath(session, &fullpath, pathname);
-        if (rc < 0) {
-            ftp_client_msg(session, error_code, "Requested action not taken.");
-        } else {
-            rc = ftp_vfs_open(&session->transfer.file_vfs, fullpath.s, open_mode);
+    if (rc <= 0 || rc >= sizeof(pathname)) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    } else {
+        struct Pathname fullpath = {0};
+        rc = build_fullpath(session, &fullpath, pathname);
+        if (rc < 0) {
+            ftp_client_msg(session, error_code, "Requested action not taken.");
+        } else {
+            bool cached = false;
+            struct stat st;
+            struct Pathname segment_path;
+            const int delta = open_mode != FtpVfsOpenMode_READ ? ftp_delta_open(session, fullpath.s, open_mode) : 0;
+            const bool segment = !delta && open_mode != FtpVfsOpenMode_READ && open_mode != FtpVfsOpenMode_APPEND && ftp_segment_open(&session->transfer, fullpath.s, &segment_path);
+            if (delta < 0) {
+                ftp_client_msg(session, error_code, "Requested action not taken, %s Failed to open delta: %s.", strerror(errno), fullpath.s);
+                return;
+            } else if (delta) {
+                // the basis is opened along with the temp file.
+                rc = 0;
+            } else if (segment) {
+                // segments are written in place, the file is already the full size.
+                if (ftp_segment_fits(&session->transfer, 0)) {
+                    rc = ftp_vfs_open(&session->transfer.file_vfs, segment_path.s, FtpVfsOpenMode_UPDATE);
+                } else {
+                    ftp_segment_close(&session->transfer, false);
+                    ftp_client_msg(session, 554, "Requested action not taken: invalid REST parameter.");
+                    return;
+                }
+            } else if (open_mode == FtpVfsOpenMode_UPDATE && ftp_journal_size(fullpath.s, ftp_stat_cached(fullpath.s, &st, false) ? 0 : st.st_size) < session->transfer.offset) {
+                // resuming past the end would leave a hole in the file.
+                ftp_client_msg(session, 554, "Requested action not taken: invalid REST parameter.");
+                return;
+            } else if (open_mode == FtpVfsOpenMode_READ && ftp_stat_cache_is_missing(fullpath.s)) {
+                rc = -1;
+            } else if (open_mode == FtpVfsOpenMode_READ && ftp_file_cache_open(session, &session->transfer, fullpath.s)) {
+                cached = true;
+                rc = 0;
+            } else {
+                if (open_mode != FtpVfsOpenMode_READ) {
+                    ftp_read_share_invalidate(fullpath.s);
+                }
+                rc = ftp_vfs_open(&session->transfer.file_vfs, fullpath.s, open_mode);
+            }
+
+            if (rc >= 0 && open_mode != FtpVfsOpenMode_READ) {
+                // kept so that the cache can be invalidated again once the upload ends.
+                ftp_stat_cache_invalidate(fullpath.s);
+                ftp_file_cache_invalidate(fullpath.s);
+                session->temp_path = fullpath;
+            }
+
             if (rc < 0) {
+                ftp_segment_close(&session->transfer, false);
                 ftp_client_msg(session, error_code, "Requested action not taken, %s Failed to open path: %s.", strerror(errno), fullpath.s);
+            } else if (cached) {
+                ftp_prefetch_retr(session, fullpath.s);
+                ftp_data_open(session, transfer_mode);
             } else {
                 if (session->transfer.offset) {
                     rc = ftp_vfs_seek(&session->transfer.file_vfs, NULL, 0, session->transfer.offset);
@@ -922,8 +4397,22 @@ static void ftp_open_file(struct FtpSession* session, const char* data, enum Ftp
 
                 if (rc < 0) {
                     ftp_vfs_close(&session->transfer.file_vfs);
+                    ftp_segment_close(&session->transfer, false);
+                    session->temp_path.s[0] = '\0';
                     ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to fseek path: %s", strerror(errno), fullpath.s);
                 } else {
+                    if (open_mode == FtpVfsOpenMode_READ) {
+                        ftp_read_share_open(&session->transfer, fullpath.s);
+                        ftp_prefetch_retr(session, fullpath.s);
+                    }
+                    ftp_advise_open(&session->transfer, fullpath.s, open_mode);
+                    if (open_mode != FtpVfsOpenMode_READ && !segment) {
+                        // the journal's offset would be that of the temp file.
+                        if (!delta) {
+                            ftp_journal_open(session, open_mode);
+                        }
+                        ftp_hash_upload_open(session, open_mode);
+                    }
                     ftp_data_open(session, transfer_mode);
                 }
             }
@@ -931,9 +4420,87 @@ static void ftp_open_file(struct FtpSession* session, const char* data, enum Ftp
     }
 }
 
+// RETR of <dir>.zip / <dir>.tar, where only the dir exists, streams an
+// archive of the dir. returns true if it did, or replied with an error.
+static bool ftp_archive_open(struct FtpSession* session, const char* data) {
+#if FTP_ARCHIVE_DEPTH
+    struct FtpTransfer* transfer = &session->transfer;
+    struct Pathname pathname = {0}, fullpath;
+    struct stat st;
+    const size_t len = strlen(data);
+    const bool zip = len > 4 && !strcasecmp(data + len - 4, ".zip");
+    if (!zip && (len <= 4 || strcasecmp(data + len - 4, ".tar"))) {
+        return false;
+    }
+
+    // a file with that name is sent as it is.
+    const int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    if (rc <= 0 || rc >= sizeof(pathname) || build_fullpath(session, &fullpath, pathname) < 0 || !ftp_stat_cached(fullpath.s, &st, false)) {
+        return false;
+    }
+
+    const size_t dir_len = strlen(fullpath.s) - 4;
+    fullpath.s[dir_len] = '\0';
+    const char* base = strrchr(fullpath.s, '/');
+    if (!base || !base[1] || ftp_stat_cached(fullpath.s, &st, false) < 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+
+    // it's made as it's sent, so it can't be resumed.
+    if (session->server_marker || session->range_end) {
+        session->server_marker = 0;
+        session->range_end = 0;
+        ftp_client_msg(session, 554, "Requested action not taken: invalid REST parameter.");
+        return true;
+    }
+
+    // the spool is a hidden file next to the dir, so that it's on storage
+    // the vfs can write to rather than in memory.
+    transfer->archive.walk.depth = 0;
+    memset(&transfer->archive.spool, 0, sizeof(transfer->archive.spool));
+    transfer->archive.spool_path.s[0] = '\0';
+    if (zip) {
+        const int n = snprintf(transfer->archive.spool_path.s, sizeof(transfer->archive.spool_path.s), "%s" FTP_ARCHIVE_SPOOL_SUFFIX ".%u", fullpath.s, ftp_session_index(session));
+        if (n <= 0 || n >= sizeof(transfer->archive.spool_path.s)) {
+            transfer->archive.spool_path.s[0] = '\0';
+            ftp_client_msg(session, 451, "Requested action aborted: local error in processing, %s", strerror(ENAMETOOLONG));
+            return true;
+        } else if (ftp_vfs_open(&transfer->archive.spool, transfer->archive.spool_path.s, FtpVfsOpenMode_WRITE) < 0) {
+            const int err = errno;
+            ftp_archive_close(transfer);
+            ftp_client_msg(session, 451, "Requested action aborted: local error in processing, %s", strerror(err));
+            return true;
+        }
+    }
+
+    if (ftp_walk_open(&transfer->archive.walk, &fullpath) < 0) {
+        const int err = errno;
+        ftp_archive_close(transfer);
+        ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to open dir: %s.", strerror(err), fullpath.s);
+        return true;
+    }
+
+    // the dir is the first entry, names are relative to its parent.
+    transfer->archive.zip = zip;
+    transfer->archive.count = 0;
+    transfer->archive.off = 0;
+    strcpy(transfer->archive.walk.path.s + dir_len, "/");
+    transfer->archive.name = base + 1 - fullpath.s;
+    transfer->offset = 0;
+    transfer->size = 0;
+    ftp_archive_entry(transfer, &st);
+    ftp_data_open(session, FTP_TRANSFER_MODE_ARCHIVE);
+    return true;
+#else
+    return false;
+#endif
+}
+
 // RETR <SP> <pathname> <CRLF> | 125, 150, (110), 226, 250, 425, 426, 451, 450, 550, 500, 501, 421, 530
 static void ftp_cmd_RETR(struct FtpSession* session, const char* data) {
-    ftp_open_file(session, data, FtpVfsOpenMode_READ, FTP_TRANSFER_MODE_RETR, 550);
+    if (!ftp_archive_open(session, data)) {
+        ftp_open_file(session, data, FtpVfsOpenMode_READ, FTP_TRANSFER_MODE_RETR, 550);
+    }
 }
 
 // STOR <SP> <pathname> <CRLF> | 125, 150, (110), 226, 250, 425, 426, 451, 551, 552, 532, 450, 452, 553, 500, 501, 421, 530
@@ -960,10 +4527,35 @@ static void ftp_cmd_REST(struct FtpSession* session, const char* data) {
         ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
     } else {
         session->server_marker = server_marker;
+        session->range_end = 0;
         ftp_client_msg(session, 350, "Requested file action pending further information.");
     }
 }
 
+// RANG <SP> <start-point> <SP> <end-point> <CRLF> | 350, 500, 501, 502, 421, 530
+// SOURCE: https://datatracker.ietf.org/doc/html/draft-bryan-ftp-range
+// the end point is inclusive, "RANG 1 0" clears the range.
+static void ftp_cmd_RANG(struct FtpSession* session, const char* data) {
+    char* end_ptr;
+    const unsigned long long start = strtoull(data, &end_ptr, 10);
+    const char* end_str = end_ptr;
+    const unsigned long long end = strtoull(end_str, &end_ptr, 10);
+
+    if (data == end_str || *end_str != ' ' || end_str == end_ptr || *end_ptr || start > LONG_MAX || end >= LONG_MAX) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    } else if (start == 1 && end == 0) {
+        session->server_marker = 0;
+        session->range_end = 0;
+        ftp_client_msg(session, 350, "Restarting at 0. Ending byte at EOF.");
+    } else if (end < start) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    } else {
+        session->server_marker = start;
+        session->range_end = end + 1;
+        ftp_client_msg(session, 350, "Restarting at %llu. Ending byte at %llu.", start, end);
+    }
+}
+
 // RNFR <SP> <pathname> <CRLF> | 450, 550, 500, 501, 502, 421, 530, 350
 static void ftp_cmd_RNFR(struct FtpSession* session, const char* data) {
     struct Pathname pathname = {0};
@@ -1001,6 +4593,12 @@ static void ftp_cmd_RNTO(struct FtpSession* session, const char* data) {
                 if (rc < 0) {
                     ftp_client_msg(session, 553, "Requested action not taken, %s.", strerror(errno));
                 } else {
+                    // a dir may have been moved, so everything below it changed.
+                    ftp_stat_cache_flush();
+                    ftp_file_cache_flush();
+                    ftp_journal_rename(session->temp_path.s, dst_path.s);
+                    ftp_segment_rename(session->temp_path.s, dst_path.s);
+                    ftp_hash_sidecar_rename(session->temp_path.s, dst_path.s);
                     ftp_client_msg(session, 250, "Requested file action okay, completed.");
                 }
             }
@@ -1039,10 +4637,16 @@ static void ftp_remove_file(struct FtpSession* session, const char* data, int (*
         if (rc < 0) {
             ftp_client_msg(session, 550, "Requested action not taken, %s.", strerror(errno));
         } else {
+            // a new file could be given the same inode.
+            ftp_read_share_invalidate(fullpath.s);
             rc = func(fullpath.s);
             if (rc < 0) {
                 ftp_client_msg(session, 550, "Requested action not taken, %s.", strerror(errno));
             } else {
+                ftp_stat_cache_invalidate(fullpath.s);
+                ftp_file_cache_invalidate(fullpath.s);
+                ftp_journal_remove(fullpath.s);
+                ftp_hash_sidecar_remove(fullpath.s);
                 ftp_client_msg(session, 250, "Requested file action okay, completed.");
             }
         }
@@ -1076,70 +4680,600 @@ static void ftp_cmd_MKD(struct FtpSession* session, const char* data) {
             if (rc < 0) {
                 ftp_client_msg(session, 550, "Requested action not taken, %s.", strerror(errno));
             } else {
+                ftp_stat_cache_invalidate(fullpath.s);
                 ftp_client_msg(session, 257, "\"%s\" created.", fullpath.s);
             }
         }
     }
 }
 
-// PWD  <CRLF> | 257, 500, 501, 502, 421, 550
-static void ftp_cmd_PWD(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 257, "\"%s\" opened.", session->pwd.s);
+// PWD  <CRLF> | 257, 500, 501, 502, 421, 550
+static void ftp_cmd_PWD(struct FtpSession* session, const char* data) {
+    ftp_client_msg(session, 257, "\"%s\" opened.", session->pwd.s);
+}
+
+// used by LIST and NLIST
+static void ftp_list_directory(struct FtpSession* session, const char* data, enum FTP_TRANSFER_MODE mode) {
+    struct Pathname pathname = {0};
+    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+
+    // see issue: #2
+    if (rc == 0 || !strcmp("-a", pathname.s) || !strcmp("-la", pathname.s)) {
+        session->temp_path = session->pwd;
+    } else {
+        rc = build_fullpath(session, &session->temp_path, pathname);
+    }
+
+    if (rc < 0 || rc >= sizeof(pathname)) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    } else {
+        struct stat st = {0};
+        rc = ftp_stat_cached(session->temp_path.s, &st, true);
+        if (rc < 0) {
+            ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to stat path: %s.", strerror(errno), session->temp_path.s);
+        } else {
+            if (S_ISDIR(st.st_mode)) {
+                rc = ftp_vfs_opendir(&session->transfer.dir_vfs, session->temp_path.s);
+                if (rc < 0) {
+                    ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to open dir: %s.", strerror(errno), session->temp_path.s);
+                } else {
+                    ftp_data_open(session, mode);
+                }
+            } else if (mode == FTP_TRANSFER_MODE_LIST) {
+                rc = ftp_build_list_entry(session, &session->temp_path, pathname.s, &st);
+                if (rc < 0) {
+                    ftp_client_msg(session, 450, "Requested file action not taken, %s. Failed to build entry: %s.", strerror(errno), session->temp_path.s);
+                } else {
+                    ftp_data_open(session, mode);
+                }
+            } else {
+                ftp_client_msg(session, 450, "Requested file action not taken. Nlist on file is not valid.");
+            }
+        }
+    }
+}
+
+// LIST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
+static void ftp_cmd_LIST(struct FtpSession* session, const char* data) {
+    ftp_list_directory(session, data, FTP_TRANSFER_MODE_LIST);
+}
+
+// NLST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
+static void ftp_cmd_NLST(struct FtpSession* session, const char* data) {
+    ftp_list_directory(session, data, FTP_TRANSFER_MODE_NLST);
+}
+
+#if FTP_SEGMENT_UPLOADS || FTP_DELTA_UPLOADS || FTP_MANIFEST_DEPTH || FTP_WATCH_DIRS
+// builds the full path of a SITE command's path arg, replying on failure.
+static int ftp_site_fullpath(struct FtpSession* session, const char* data, struct Pathname* fullpath) {
+    struct Pathname pathname = {0};
+    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+
+    if (rc <= 0 || rc >= sizeof(pathname)) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        return -1;
+    }
+
+    rc = build_fullpath(session, fullpath, pathname);
+    if (rc < 0) {
+        ftp_client_msg(session, 553, "Requested action not taken, %s.", strerror(errno));
+    }
+    return rc;
+}
+#endif
+
+#if FTP_SEGMENT_UPLOADS
+// an unused slot, or one that has been left for FTP_SEGMENT_TIMEOUT, in
+// which case its temp file is removed.
+static struct FtpSegmentUpload* ftp_segment_alloc(void) {
+    const time_t now = time(NULL);
+    for (size_t i = 0; i < FTP_SEGMENT_UPLOADS; i++) {
+        struct FtpSegmentUpload* u = &g_ftp.segment_uploads[i];
+        if (!u->used) {
+            return u;
+        }
+
+        struct Pathname temp;
+        if (!u->refs && now - u->last_used >= FTP_SEGMENT_TIMEOUT && ftp_segment_temp_path(&temp, u->path.s)) {
+            ftp_vfs_unlink(temp.s);
+            ftp_stat_cache_invalidate(temp.s);
+            u->used = false;
+            return u;
+        }
+    }
+    return NULL;
+}
+
+// SITE SEGBEGIN <SP> <size> <SP> <pathname>
+// creates the temp file that STORs to pathname will write to, at their
+// REST offset, until SEGCOMMIT. beginning again with the same size keeps
+// what has been sent so far.
+static void ftp_site_SEGBEGIN(struct FtpSession* session, const char* data) {
+    char* end;
+    const size_t size = strtoull(data, &end, 10);
+    if (end == data || *end != ' ' || !end[1]) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        return;
+    }
+
+    struct Pathname fullpath = {0};
+    if (ftp_site_fullpath(session, end + 1, &fullpath) < 0) {
+        return;
+    }
+
+    struct FtpSegmentUpload* u = ftp_segment_find(fullpath.s);
+    if (u) {
+        if (u->size != size) {
+            ftp_client_msg(session, 550, "Requested action not taken, upload of a different size in progress.");
+        } else {
+            ftp_client_msg(session, 200, "Segmented upload resumed, %u ranges received.", u->range_count);
+        }
+        return;
+    }
+
+    struct Pathname temp;
+    if (!ftp_segment_temp_path(&temp, fullpath.s)) {
+        ftp_client_msg(session, 553, "Requested action not taken, File name not allowed.");
+        return;
+    }
+
+    if (!(u = ftp_segment_alloc())) {
+        ftp_client_msg(session, 450, "Requested file action not taken, too many segmented uploads.");
+        return;
+    }
+
+    struct FtpVfsFile f = {0};
+    if (ftp_vfs_open(&f, temp.s, FtpVfsOpenMode_WRITE) < 0) {
+        ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to open path: %s", strerror(errno), temp.s);
+        return;
+    }
+
+    // the file is grown to its full size up front, so the space is
+    // reserved and segments can be written in any order.
+    if (size && ftp_vfs_fallocate(&f, 0, size) && errno == ENOSPC) {
+        ftp_vfs_close(&f);
+        ftp_vfs_unlink(temp.s);
+        ftp_client_msg(session, 452, "Requested action not taken, %s.", strerror(ENOSPC));
+        return;
+    }
+
+    ftp_vfs_close(&f);
+    ftp_stat_cache_invalidate(temp.s);
+
+    u->used = true;
+    u->refs = 0;
+    u->size = size;
+    u->last_used = time(NULL);
+    u->range_count = 0;
+    u->path = fullpath;
+    ftp_client_msg(session, 200, "Segmented upload of %zu bytes started.", size);
+}
+
+// SITE SEGCOMMIT <SP> <pathname>
+// renames the temp file over pathname once every byte has been written.
+static void ftp_site_SEGCOMMIT(struct FtpSession* session, const char* data) {
+    struct Pathname fullpath = {0};
+    if (ftp_site_fullpath(session, data, &fullpath) < 0) {
+        return;
+    }
+
+    struct Pathname temp;
+    struct FtpSegmentUpload* u = ftp_segment_find(fullpath.s);
+    if (!u || !ftp_segment_temp_path(&temp, fullpath.s)) {
+        ftp_client_msg(session, 550, "Requested action not taken, no segmented upload in progress.");
+        return;
+    }
+
+    if (u->refs) {
+        ftp_client_msg(session, 450, "Requested file action not taken, segments are still being written.");
+        return;
+    }
+
+    const size_t written = !u->range_count || u->ranges[0].start ? 0 : u->ranges[0].end;
+    if (written < u->size) {
+        ftp_client_msg(session, 550, "Requested action not taken, missing data at offset %zu.", written);
+        return;
+    }
+
+    // a new file could be given the same inode.
+    ftp_read_share_invalidate(fullpath.s);
+    if (ftp_vfs_rename(temp.s, fullpath.s)) {
+        ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to rename path: %s", strerror(errno), fullpath.s);
+        return;
+    }
+
+    ftp_stat_cache_invalidate(temp.s);
+    ftp_stat_cache_invalidate(fullpath.s);
+    ftp_file_cache_invalidate(fullpath.s);
+    ftp_journal_remove(fullpath.s);
+    ftp_hash_sidecar_remove(fullpath.s);
+    u->used = false;
+    ftp_client_msg(session, 250, "Requested file action okay, completed.");
+}
+
+// SITE SEGABORT <SP> <pathname>
+static void ftp_site_SEGABORT(struct FtpSession* session, const char* data) {
+    struct Pathname fullpath = {0};
+    if (ftp_site_fullpath(session, data, &fullpath) < 0) {
+        return;
+    }
+
+    struct Pathname temp;
+    struct FtpSegmentUpload* u = ftp_segment_find(fullpath.s);
+    if (!u || !ftp_segment_temp_path(&temp, fullpath.s)) {
+        ftp_client_msg(session, 550, "Requested action not taken, no segmented upload in progress.");
+    } else if (u->refs) {
+        ftp_client_msg(session, 450, "Requested file action not taken, segments are still being written.");
+    } else {
+        ftp_vfs_unlink(temp.s);
+        ftp_stat_cache_invalidate(temp.s);
+        u->used = false;
+        ftp_client_msg(session, 250, "Requested file action okay, completed.");
+    }
+}
+#endif
+
+#if FTP_DELTA_UPLOADS
+// stats a SITE command's path arg, replying if it isn't a file.
+static int ftp_site_file(struct FtpSession* session, const char* data, struct Pathname* fullpath, struct stat* st) {
+    if (ftp_site_fullpath(session, data, fullpath) < 0) {
+        return -1;
+    }
+
+    if (ftp_stat_cached(fullpath->s, st, false) < 0) {
+        ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to stat path: %s", strerror(errno), fullpath->s);
+        return -1;
+    } else if (!S_ISREG(st->st_mode)) {
+        ftp_client_msg(session, 550, "Requested action not taken, not a file: %s", fullpath->s);
+        return -1;
+    }
+    return 0;
+}
+
+// SITE DELTASIG <SP> <block size> <SP> <pathname>
+// sends the signature of each block of pathname over the data connection:
+// <u64 file size> <u32 block size>, then <u32 hash_rolling()> <16 bytes
+// of sha256> for each block, the last of which may be short. all big endian.
+static void ftp_site_DELTASIG(struct FtpSession* session, const char* data) {
+    char* end;
+    const size_t block = strtoull(data, &end, 10);
+    if (end == data || *end != ' ' || !end[1] || block < FTP_DELTA_MIN_BLOCK || block > sizeof(g_ftp.data_buf)) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments, block size must be %d to %zu.", FTP_DELTA_MIN_BLOCK, sizeof(g_ftp.data_buf));
+        return;
+    } else if (session->data_connection == FTP_DATA_CONNECTION_NONE) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments, no data connection.");
+        return;
+    }
+
+    struct stat st;
+    struct Pathname fullpath = {0};
+    if (ftp_site_file(session, end + 1, &fullpath, &st) < 0) {
+        return;
+    }
+
+    struct FtpTransfer* transfer = &session->transfer;
+    if (ftp_vfs_open(&transfer->file_vfs, fullpath.s, FtpVfsOpenMode_READ) < 0) {
+        ftp_client_msg(session, 550, "Requested action not taken, %s Failed to open path: %s.", strerror(errno), fullpath.s);
+        return;
+    }
+
+#if FTP_VFS_ADVISE
+    ftp_vfs_advise(&transfer->file_vfs, 0, 0, FtpVfsAdvice_SEQUENTIAL);
+#endif
+
+    transfer->offset = 0;
+    transfer->end = 0;
+    transfer->size = st.st_size;
+    transfer->sig_block = block;
+    transfer->sig_sent = 0;
+    transfer->sig_len = 8 + 4;
+    ftp_delta_put_be((unsigned char*)transfer->list_buf, transfer->size, 8);
+    ftp_delta_put_be((unsigned char*)transfer->list_buf + 8, block, 4);
+    ftp_data_open(session, FTP_TRANSFER_MODE_DELTASIG);
+}
+
+// SITE DELTA <SP> <pathname>
+// the next STOR sends a delta against pathname, which may be the file that
+// is being replaced, see ftp_delta_progress() for the format.
+static void ftp_site_DELTA(struct FtpSession* session, const char* data) {
+    struct stat st;
+    struct Pathname fullpath = {0};
+    if (ftp_site_file(session, data, &fullpath, &st) < 0) {
+        return;
+    }
+
+    session->delta_basis = fullpath;
+    ftp_client_msg(session, 350, "Requested file action pending further information.");
+}
+#endif
+
+#if FTP_MANIFEST_DEPTH
+// SITE MANIFEST [<SP> -H] [<SP> <pathname>]
+// sends a line for every file and dir below pathname (the current dir by
+// default) over the data connection, "type=<type>;size=<size>;modify=<time>; <name>",
+// with names relative to pathname. -H adds "hash=<name>:<hex>;" for files
+// whose digest is kept in a hash sidecar.
+static void ftp_site_MANIFEST(struct FtpSession* session, const char* data) {
+    struct FtpTransfer* transfer = &session->transfer;
+    transfer->manifest.hash = false;
+    if (!strncasecmp(data, "-H", 2) && (!data[2] || data[2] == ' ')) {
+        transfer->manifest.hash = true;
+        data += data[2] ? 3 : 2;
+    }
+
+    if (session->data_connection == FTP_DATA_CONNECTION_NONE) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments, no data connection.");
+        return;
+    }
+
+    struct Pathname fullpath = session->pwd;
+    if (data[0] && ftp_site_fullpath(session, data, &fullpath) < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (ftp_stat_cached(fullpath.s, &st, false) < 0) {
+        ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to stat path: %s", strerror(errno), fullpath.s);
+        return;
+    } else if (!S_ISDIR(st.st_mode)) {
+        ftp_client_msg(session, 550, "Requested action not taken, not a dir: %s", fullpath.s);
+        return;
+    } else if (ftp_walk_open(&transfer->manifest.walk, &fullpath) < 0) {
+        ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to open dir: %s.", strerror(errno), fullpath.s);
+        return;
+    }
+
+    transfer->offset = 0;
+    transfer->size = 0;
+    transfer->manifest.root = strlen(fullpath.s);
+    ftp_data_open(session, FTP_TRANSFER_MODE_MANIFEST);
+}
+#endif
+
+#if FTP_MSTAT
+// SITE MSTAT [<SP> <pathname> [<SP> <pathname> ...]]
+// replies with a line for each path, the same as those of SITE MANIFEST.
+// paths with spaces are quoted, and as many as fit in the reply are
+// answered. without paths, they're read from the data connection one per
+// line, and the line for each is sent back on it.
+static void ftp_site_MSTAT(struct FtpSession* session, const char* data) {
+    if (!data[0]) {
+        struct FtpTransfer* transfer = &session->transfer;
+        if (session->data_connection == FTP_DATA_CONNECTION_NONE) {
+            ftp_client_msg(session, 501, "Syntax error in parameters or arguments, no data connection.");
+            return;
+        }
+
+        transfer->offset = 0;
+        transfer->size = 0;
+        transfer->mstat.len = 0;
+        transfer->mstat.eof = false;
+        ftp_data_open(session, FTP_TRANSFER_MODE_MSTAT);
+        return;
+    }
+
+    char lines[FTP_SENDBUF_SIZE - 64] = {0};
+    size_t len = 0;
+    unsigned count = 0, total = 0;
+    while (*data) {
+        const char* name = data;
+        size_t name_len;
+        if (*data == '"') {
+            const char* quote = strchr(data + 1, '"');
+            if (!quote) {
+                break;
+            }
+            name++;
+            name_len = quote - name;
+            data = quote + 1;
+        } else {
+            name_len = strcspn(data, " ");
+            data += name_len;
+        }
+
+        if (*data && *data != ' ') {
+            break;
+        }
+        while (*data == ' ') {
+            data++;
+        }
+
+        // once one doesn't fit, the rest are only counted.
+        struct Pathname pathname;
+        total++;
+        if (count + 1 == total && name_len < sizeof(pathname.s)) {
+            snprintf(pathname.s, sizeof(pathname.s), "%.*s", (int)name_len, name);
+            const int rc = ftp_mstat_build(session, lines + len + 1, sizeof(lines) - len - 1, pathname.s);
+            if (rc > 0) {
+                lines[len] = ' ';
+                len += rc + 1;
+                count++;
+            } else {
+                lines[len] = '\0';
+            }
+        }
+    }
+
+    if (*data || !total) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    } else {
+        ftp_client_msg(session, 213, "-Status of %u of %u paths." TELNET_EOL "%s", count, total, lines);
+    }
+}
+#endif
+
+#if FTP_WATCH_DIRS
+// SITE WATCH <SP> <pathname>
+// changes to the entries of the dir are queued until SITE CHANGES asks for
+// them, dirs below it aren't watched.
+static void ftp_site_WATCH(struct FtpSession* session, const char* data) {
+    struct FtpWatchSession* w = &session->watch;
+    struct Pathname fullpath;
+    if (ftp_site_fullpath(session, data, &fullpath) < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (ftp_stat_cached(fullpath.s, &st, false) < 0) {
+        ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to stat path: %s", strerror(errno), fullpath.s);
+        return;
+    } else if (!S_ISDIR(st.st_mode)) {
+        ftp_client_msg(session, 550, "Requested action not taken, not a dir: %s", fullpath.s);
+        return;
+    }
+
+    size_t slot = FTP_WATCH_SESSION_DIRS;
+    for (size_t i = 0; i < FTP_WATCH_SESSION_DIRS; i++) {
+        if (w->watches[i] && !strcmp(g_ftp.watches[w->watches[i] - 1].path.s, fullpath.s)) {
+            ftp_client_msg(session, 200, "Already watching %s.", fullpath.s);
+            return;
+        } else if (!w->watches[i] && slot == FTP_WATCH_SESSION_DIRS) {
+            slot = i;
+        }
+    }
+
+    if (slot == FTP_WATCH_SESSION_DIRS) {
+        ftp_client_msg(session, 450, "Requested file action not taken, %d dirs are already watched.", FTP_WATCH_SESSION_DIRS);
+        return;
+    }
+
+    w->watches[slot] = ftp_watch_ref(fullpath.s);
+    if (!w->watches[slot]) {
+        ftp_client_msg(session, 450, "Requested file action not taken, too many dirs are being watched.");
+    } else if (g_ftp.watches[w->watches[slot] - 1].id < 0) {
+        ftp_client_msg(session, 200, "Watching %s, polled every %d ms.", fullpath.s, FTP_WATCH_POLL_INTERVAL);
+    } else {
+        ftp_client_msg(session, 200, "Watching %s.", fullpath.s);
+    }
+}
+
+// SITE UNWATCH <SP> <pathname>
+static void ftp_site_UNWATCH(struct FtpSession* session, const char* data) {
+    struct FtpWatchSession* w = &session->watch;
+    struct Pathname fullpath;
+    if (ftp_site_fullpath(session, data, &fullpath) < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < FTP_WATCH_SESSION_DIRS; i++) {
+        if (w->watches[i] && !strcmp(g_ftp.watches[w->watches[i] - 1].path.s, fullpath.s)) {
+            ftp_watch_unref(session, i);
+            ftp_client_msg(session, 200, "No longer watching %s.", fullpath.s);
+            return;
+        }
+    }
+
+    ftp_client_msg(session, 550, "Requested action not taken, not watched: %s", fullpath.s);
 }
 
-// used by LIST and NLIST
-static void ftp_list_directory(struct FtpSession* session, const char* data, enum FTP_TRANSFER_MODE mode) {
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+// SITE CHANGES [<SP> <seconds> | <SP> STREAM]
+// replies with the changes to watched dirs since the last SITE CHANGES,
+// " <dir>/<name>" for each entry that changed, or " <dir>/" if the whole
+// dir has to be listed again. if there aren't any, waits up to seconds
+// for one, during which no other commands are run. STREAM sends a line
+// for each change over the data connection until the client closes it.
+static void ftp_site_CHANGES(struct FtpSession* session, const char* data) {
+    struct FtpWatchSession* w = &session->watch;
+    size_t i = 0;
+    while (i < FTP_WATCH_SESSION_DIRS && !w->watches[i]) {
+        i++;
+    }
 
-    // see issue: #2
-    if (rc == 0 || !strcmp("-a", pathname.s) || !strcmp("-la", pathname.s)) {
-        session->temp_path = session->pwd;
-    } else {
-        rc = build_fullpath(session, &session->temp_path, pathname);
+    if (i == FTP_WATCH_SESSION_DIRS) {
+        ftp_client_msg(session, 503, "Bad sequence of commands, no dirs are watched.");
+        return;
     }
 
-    if (rc < 0 || rc >= sizeof(pathname)) {
+    if (!strcasecmp(data, "STREAM")) {
+        if (session->data_connection == FTP_DATA_CONNECTION_NONE) {
+            ftp_client_msg(session, 501, "Syntax error in parameters or arguments, no data connection.");
+            return;
+        }
+
+        ftp_watch_progress(true);
+        session->transfer.offset = 0;
+        session->transfer.size = 0;
+        ftp_data_open(session, FTP_TRANSFER_MODE_WATCH);
+        return;
+    }
+
+    char* end;
+    size_t seconds = strtoull(data, &end, 10);
+    if (*end) {
         ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        return;
+    } else if (seconds > FTP_WATCH_MAX_WAIT) {
+        seconds = FTP_WATCH_MAX_WAIT;
+    }
+
+    ftp_watch_progress(true);
+    if (w->event_count || !seconds) {
+        ftp_watch_reply(session);
     } else {
-        struct stat st = {0};
-        rc = ftp_vfs_lstat(session->temp_path.s, &st);
-        if (rc < 0) {
-            ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to stat path: %s.", strerror(errno), session->temp_path.s);
-        } else {
-            if (S_ISDIR(st.st_mode)) {
-                rc = ftp_vfs_opendir(&session->transfer.dir_vfs, session->temp_path.s);
-                if (rc < 0) {
-                    ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to open dir: %s.", strerror(errno), session->temp_path.s);
-                } else {
-                    ftp_data_open(session, mode);
-                }
-            } else if (mode == FTP_TRANSFER_MODE_LIST) {
-                rc = ftp_build_list_entry(session, &session->temp_path, pathname.s, &st);
-                if (rc < 0) {
-                    ftp_client_msg(session, 450, "Requested file action not taken, %s. Failed to build entry: %s.", strerror(errno), session->temp_path.s);
-                } else {
-                    ftp_data_open(session, mode);
-                }
-            } else {
-                ftp_client_msg(session, 450, "Requested file action not taken. Nlist on file is not valid.");
-            }
-        }
+        w->waiting = true;
+        w->wait_end = ftp_get_timestamp_ms() + seconds * 1000;
     }
 }
+#endif
 
-// LIST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
-static void ftp_cmd_LIST(struct FtpSession* session, const char* data) {
-    ftp_list_directory(session, data, FTP_TRANSFER_MODE_LIST);
-}
+static void ftp_site_HELP(struct FtpSession* session, const char* data);
 
-// NLST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
-static void ftp_cmd_NLST(struct FtpSession* session, const char* data) {
-    ftp_list_directory(session, data, FTP_TRANSFER_MODE_NLST);
+static const struct FtpSiteCommand FTP_SITE_COMMANDS[] = {
+    { .name = "HELP", .func = ftp_site_HELP, .args_required = 0 },
+#if FTP_SEGMENT_UPLOADS
+    { .name = "SEGBEGIN", .func = ftp_site_SEGBEGIN, .args_required = 1 },
+    { .name = "SEGCOMMIT", .func = ftp_site_SEGCOMMIT, .args_required = 1 },
+    { .name = "SEGABORT", .func = ftp_site_SEGABORT, .args_required = 1 },
+#endif
+#if FTP_DELTA_UPLOADS
+    { .name = "DELTASIG", .func = ftp_site_DELTASIG, .args_required = 1 },
+    { .name = "DELTA", .func = ftp_site_DELTA, .args_required = 1 },
+#endif
+#if FTP_MANIFEST_DEPTH
+    { .name = "MANIFEST", .func = ftp_site_MANIFEST, .args_required = 0 },
+#endif
+#if FTP_MSTAT
+    { .name = "MSTAT", .func = ftp_site_MSTAT, .args_required = 0 },
+#endif
+#if FTP_WATCH_DIRS
+    { .name = "WATCH", .func = ftp_site_WATCH, .args_required = 1 },
+    { .name = "UNWATCH", .func = ftp_site_UNWATCH, .args_required = 1 },
+    { .name = "CHANGES", .func = ftp_site_CHANGES, .args_required = 0 },
+#endif
+};
+
+// SITE HELP
+static void ftp_site_HELP(struct FtpSession* session, const char* data) {
+    char names[256] = {0};
+    size_t len = 0;
+    for (size_t i = 0; i < FTP_ARR_SZ(FTP_SITE_COMMANDS); i++) {
+        const int rc = snprintf(names + len, sizeof(names) - len, " %s" TELNET_EOL, FTP_SITE_COMMANDS[i].name);
+        if (rc < 0 || rc >= sizeof(names) - len) {
+            break;
+        }
+        len += rc;
+    }
+
+    ftp_client_msg(session, 214, "-The following SITE commands are recognized." TELNET_EOL "%s", names);
 }
 
 // SITE [<SP> <string>] <CRLF> | 200, 202, 500, 501, 530
 static void ftp_cmd_SITE(struct FtpSession* session, const char* data) {
+    const size_t name_len = strcspn(data, " ");
+    const char* args = data[name_len] ? data + name_len + 1 : data + name_len;
+
+    for (size_t i = 0; i < FTP_ARR_SZ(FTP_SITE_COMMANDS); i++) {
+        const struct FtpSiteCommand* cmd = &FTP_SITE_COMMANDS[i];
+        if (strlen(cmd->name) == name_len && !strncasecmp(data, cmd->name, name_len)) {
+            if (cmd->args_required && !args[0]) {
+                ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+            } else {
+                cmd->func(session, args);
+            }
+            return;
+        }
+    }
+
     ftp_client_msg(session, 500, "Syntax error, command unrecognized.");
 }
 
@@ -1165,12 +5299,25 @@ static void ftp_cmd_NOOP(struct FtpSession* session, const char* data) {
 
 // FEAT <CRLF> | 211, 550
 static void ftp_cmd_FEAT(struct FtpSession* session, const char* data) {
+    char hash[128] = "";
+#if FTP_HASH
+    // the algorithm used by HASH is marked with a *.
+    size_t len = snprintf(hash, sizeof(hash), " HASH ");
+    for (int i = 0; i < HashType_COUNT; i++) {
+        len += snprintf(hash + len, sizeof(hash) - len, "%s%s%s", i ? ";" : "", hash_name(i), i == session->hash.type ? "*" : "");
+    }
+    snprintf(hash + len, sizeof(hash) - len, TELNET_EOL " XCRC" TELNET_EOL " XMD5" TELNET_EOL " XSHA1" TELNET_EOL " XSHA256" TELNET_EOL);
+#endif
+
     ftp_client_msg(session, 211,
         "-Extensions supported:" TELNET_EOL
         " SIZE" TELNET_EOL
+        " REST STREAM" TELNET_EOL
+        " RANG STREAM" TELNET_EOL
         " UTF8" TELNET_EOL
         " MDTM" TELNET_EOL
         " TVFS" TELNET_EOL
+        "%s", hash
     );
 }
 
@@ -1182,6 +5329,18 @@ static void ftp_cmd_OPTS(struct FtpSession* session, const char* data) {
         ftp_client_msg(session, 200, "Command okay.");
     } else if (!strcasecmp(data, "UTF8")) {
         ftp_client_msg(session, 200, "Command okay.");
+#if FTP_HASH
+    } else if (!strcasecmp(data, "HASH")) {
+        ftp_client_msg(session, 200, "%s", hash_name(session->hash.type));
+    } else if (!strncasecmp(data, "HASH ", strlen("HASH "))) {
+        enum HashType type;
+        if (hash_from_name(data + strlen("HASH "), &type)) {
+            ftp_client_msg(session, 501, "Unknown algorithm, current selection not changed.");
+        } else {
+            session->hash.type = type;
+            ftp_client_msg(session, 200, "%s", hash_name(type));
+        }
+#endif
     } else {
         ftp_client_msg(session, 501, "Syntax error in parameters or arguments. %s", data);
     }
@@ -1199,7 +5358,7 @@ static int ftp_get_stat(struct FtpSession* session, const char* data, struct Pat
         if (rc < 0) {
             ftp_client_msg(session, 501, "Syntax error in parameters or arguments, %s.", strerror(errno));
         } else {
-            rc = ftp_vfs_stat(fullpath->s, st);
+            rc = ftp_stat_cached(fullpath->s, st, false);
             if (rc < 0) {
                 ftp_client_msg(session, 550, "Requested action not taken, %s. Bad path: %s.", strerror(errno), fullpath->s);
             }
@@ -1216,7 +5375,7 @@ static void ftp_cmd_SIZE(struct FtpSession* session, const char* data) {
     int rc = ftp_get_stat(session, data, &fullpath, &st);
 
     if (!rc) {
-        ftp_client_msg(session, 213, "%d", st.st_size);
+        ftp_client_msg(session, 213, "%zu", ftp_journal_size(fullpath.s, st.st_size));
     }
 }
 
@@ -1236,6 +5395,203 @@ static void ftp_cmd_MDTM(struct FtpSession* session, const char* data) {
     }
 }
 
+// true while a file is being hashed.
+static bool ftp_hash_busy(const struct FtpSession* session) {
+#if FTP_HASH
+    return session->hash.active;
+#else
+    return false;
+#endif
+}
+
+// true while commands wait for a hash or SITE CHANGES to reply.
+static bool ftp_session_busy(const struct FtpSession* session) {
+    return ftp_hash_busy(session) || ftp_watch_busy(session);
+}
+
+static void ftp_hash_stop(struct FtpSession* session) {
+#if FTP_HASH
+    if (session->hash.active) {
+        ftp_vfs_close(&session->hash.file);
+        session->hash.active = false;
+        g_ftp.hash_count--;
+    }
+#endif
+}
+
+#if FTP_HASH
+// the range is hash->start up to hash->offset.
+static void ftp_hash_reply(struct FtpSession* session, enum HashType type, const char* hex) {
+    const struct FtpHash* hash = &session->hash;
+    if (hash->x_reply) {
+        ftp_client_msg(session, 250, "%s", hex);
+    } else {
+        // the end of the range is inclusive, as with RANG.
+        const size_t last = hash->offset > hash->start ? hash->offset - 1 : hash->start;
+        ftp_client_msg(session, 213, "%s %zu-%zu %s %s", hash_name(type), hash->start, last, hex, hash->path.s);
+    }
+}
+#endif
+
+// called each loop while hashing, reads for up to 1ms then carries on in
+// the next loop. the reply is sent once the end is reached.
+static void ftp_hash_progress(struct FtpSession* session) {
+#if FTP_HASH
+    struct FtpHash* hash = &session->hash;
+    if (!hash->active) {
+        return;
+    }
+
+    const size_t start = ftp_get_timestamp_ms();
+    int n;
+
+    do {
+        size_t size = sizeof(g_ftp.data_buf);
+        if (hash->end && hash->end - hash->offset < size) {
+            size = hash->end - hash->offset;
+        }
+
+        n = size ? ftp_vfs_read(&hash->file, g_ftp.data_buf, size) : 0;
+        if (n > 0) {
+            hash_update(&hash->ctx, g_ftp.data_buf, n);
+            hash->offset += n;
+        }
+    } while (n > 0 && ftp_get_timestamp_ms() - start < 1);
+
+    ftp_update_session_time(session);
+    if (n > 0) {
+        return;
+    }
+
+    ftp_hash_stop(session);
+    if (n < 0) {
+        ftp_client_msg(session, 451, "Requested action aborted: local error in processing, %s", strerror(errno));
+    } else {
+        uint8_t digest[HASH_MAX_SIZE];
+        char hex[HASH_MAX_SIZE * 2 + 1];
+        hash_final(&hash->ctx, digest);
+        hash_to_hex(digest, hash_size(hash->ctx.type), hex);
+
+        // not kept in the sidecar, only digests of uploads are written
+        // there so that a query doesn't write into the tree.
+        ftp_hash_reply(session, hash->ctx.type, hex);
+    }
+#endif
+}
+
+#if FTP_HASH
+// opens the file and starts hashing from start to end (0 for EOF), see
+// ftp_hash_progress(). the REST / RANG marker is used up either way.
+// whole files are answered from the sidecar if it's up to date.
+static void ftp_hash_start(struct FtpSession* session, const struct Pathname* pathname, enum HashType type, bool x_reply, size_t start, size_t end) {
+    struct FtpHash* hash = &session->hash;
+    char hex[HASH_MAX_SIZE * 2 + 1];
+
+    session->server_marker = 0;
+    session->range_end = 0;
+    hash->x_reply = x_reply;
+    hash->start = hash->offset = start;
+    hash->end = end;
+    hash->path = *pathname;
+
+    if (build_fullpath(session, &hash->fullpath, *pathname) < 0 || ftp_stat_cached(hash->fullpath.s, &hash->st, false) < 0) {
+        ftp_client_msg(session, 550, "Requested action not taken, %s. Bad path: %s.", strerror(errno), pathname->s);
+    } else if (start > (size_t)hash->st.st_size) {
+        ftp_client_msg(session, 554, "Requested action not taken: invalid REST parameter.");
+    } else if (g_ftp.upload_hash && !start && !end && ftp_hash_sidecar_read(hash->fullpath.s, type, &hash->st, hex)) {
+        hash->offset = hash->st.st_size;
+        ftp_hash_reply(session, type, hex);
+    } else if (ftp_vfs_open(&hash->file, hash->fullpath.s, FtpVfsOpenMode_READ) < 0) {
+        ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to open path: %s.", strerror(errno), pathname->s);
+    } else if (start && ftp_vfs_seek(&hash->file, NULL, 0, start) < 0) {
+        ftp_vfs_close(&hash->file);
+        ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to fseek path: %s", strerror(errno), pathname->s);
+    } else {
+#if FTP_VFS_ADVISE
+        ftp_vfs_advise(&hash->file, 0, 0, FtpVfsAdvice_SEQUENTIAL);
+#endif
+        hash_init(&hash->ctx, type);
+        hash->active = true;
+        g_ftp.hash_count++;
+
+        // small files are done straight away.
+        ftp_hash_progress(session);
+    }
+}
+
+// XCRC <SP> <pathname> <CRLF>
+// XCRC <SP> "<pathname>" [<SP> <start> [<SP> <end>]] <CRLF>
+// the path has to be quoted if the range is given, end is the offset
+// hashing stops at. otherwise REST / RANG set the range.
+static void ftp_hash_x(struct FtpSession* session, const char* data, enum HashType type) {
+    struct Pathname pathname = {0};
+    size_t start = session->server_marker;
+    size_t end = session->range_end;
+    int rc;
+
+    if (data[0] == '"' && strchr(data + 1, '"')) {
+        const char* quote = strchr(data + 1, '"');
+        const char* args = quote + 1;
+        rc = snprintf(pathname.s, sizeof(pathname), "%.*s", (int)(quote - data - 1), data + 1);
+
+        if (*args) {
+            char* end_ptr;
+            start = strtoull(args, &end_ptr, 10);
+            if (end_ptr == args || *args != ' ') {
+                rc = -1;
+            } else if (*end_ptr) {
+                args = end_ptr;
+                end = strtoull(args, &end_ptr, 10);
+                if (end_ptr == args || *args != ' ' || *end_ptr || (end && end <= start)) {
+                    rc = -1;
+                }
+            } else {
+                end = 0;
+            }
+        }
+    } else {
+        rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    }
+
+    if (rc <= 0 || rc >= sizeof(pathname)) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    } else {
+        ftp_hash_start(session, &pathname, type, true, start, end);
+    }
+}
+
+// HASH <SP> <pathname> <CRLF> | 213, 500, 501, 550, 554
+// SOURCE: https://datatracker.ietf.org/doc/html/draft-bryan-ftpext-hash
+// the algorithm is set with OPTS HASH, the range with REST or RANG.
+static void ftp_cmd_HASH(struct FtpSession* session, const char* data) {
+    struct Pathname pathname = {0};
+    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+
+    if (rc <= 0 || rc >= sizeof(pathname)) {
+        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    } else {
+        ftp_hash_start(session, &pathname, session->hash.type, false, session->server_marker, session->range_end);
+    }
+}
+
+// XCRC / XMD5 / XSHA1 / XSHA256 <SP> <pathname> <CRLF> | 250, 500, 501, 550, 554
+static void ftp_cmd_XCRC(struct FtpSession* session, const char* data) {
+    ftp_hash_x(session, data, HashType_CRC32);
+}
+
+static void ftp_cmd_XMD5(struct FtpSession* session, const char* data) {
+    ftp_hash_x(session, data, HashType_MD5);
+}
+
+static void ftp_cmd_XSHA1(struct FtpSession* session, const char* data) {
+    ftp_hash_x(session, data, HashType_SHA1);
+}
+
+static void ftp_cmd_XSHA256(struct FtpSession* session, const char* data) {
+    ftp_hash_x(session, data, HashType_SHA256);
+}
+#endif
+
 static const struct FtpCommand FTP_COMMANDS[] = {
     // ACCESS CONTROL COMMANDS: https://datatracker.ietf.org/doc/html/rfc959#section-4
     { .name = "USER", .func = ftp_cmd_USER, .auth_required = 0, .args_required = 1, .data_connection_required = 0 },
@@ -1260,6 +5616,7 @@ static const struct FtpCommand FTP_COMMANDS[] = {
     { .name = "APPE", .func = ftp_cmd_APPE, .auth_required = 1, .args_required = 1, .data_connection_required = 1 },
     { .name = "ALLO", .func = ftp_cmd_ALLO, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
     { .name = "REST", .func = ftp_cmd_REST, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
+    { .name = "RANG", .func = ftp_cmd_RANG, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
     { .name = "RNFR", .func = ftp_cmd_RNFR, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
     { .name = "RNTO", .func = ftp_cmd_RNTO, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
     { .name = "ABOR", .func = ftp_cmd_ABOR, .auth_required = 0, .args_required = 0, .data_connection_required = 0 },
@@ -1281,6 +5638,14 @@ static const struct FtpCommand FTP_COMMANDS[] = {
     { .name = "SIZE", .func = ftp_cmd_SIZE, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
     { .name = "MDTM", .func = ftp_cmd_MDTM, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
     { .name = "OPTS", .func = ftp_cmd_OPTS, .auth_required = 0, .args_required = 1, .data_connection_required = 0 },
+#if FTP_HASH
+    // draft-bryan-ftpext-hash: https://datatracker.ietf.org/doc/html/draft-bryan-ftpext-hash
+    { .name = "HASH", .func = ftp_cmd_HASH, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
+    { .name = "XCRC", .func = ftp_cmd_XCRC, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
+    { .name = "XMD5", .func = ftp_cmd_XMD5, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
+    { .name = "XSHA1", .func = ftp_cmd_XSHA1, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
+    { .name = "XSHA256", .func = ftp_cmd_XSHA256, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
+#endif
 };
 
 static int ftp_session_init(struct FtpSession* session) {
@@ -1294,6 +5659,7 @@ static int ftp_session_init(struct FtpSession* session) {
     } else {
         ftp_set_server_socket_options(&session->control_sock);
         session->control_sockaddr = sa;
+        session->peer_sockaddr = sa;
         addr_len = sizeof(session->control_sockaddr);
 
         rc = ftp_socket_getsockname(&session->control_sock, (struct sockaddr*)&session->control_sockaddr, &addr_len);
@@ -1305,7 +5671,16 @@ static int ftp_session_init(struct FtpSession* session) {
             session->state = FTP_SESSION_STATE_POLLIN;
             ftp_update_session_time(session);
             strcpy(session->pwd.s, "/");
+#if FTP_HASH
+            session->hash.type = HashType_SHA256;
+#endif
             g_ftp.session_count++;
+
+            if (g_ftp.event_callback) {
+                struct FtpSrvEvent event = { .type = FTP_API_EVENT_TYPE_SESSION_OPEN };
+                ftp_event_emit(session, &event);
+            }
+
             ftp_client_msg(session, 220, "Service ready for new user.");
             return 0;
         }
@@ -1315,14 +5690,23 @@ static int ftp_session_init(struct FtpSession* session) {
 static void ftp_session_close(struct FtpSession* session) {
     if (session->state != FTP_SESSION_STATE_NONE) {
         ftp_data_transfer_end(session);
+        ftp_prefetch_stop(session);
+        ftp_hash_stop(session);
+        ftp_watch_stop(session);
         ftp_socket_close(&session->control_sock);
+
+        if (g_ftp.event_callback) {
+            struct FtpSrvEvent event = { .type = FTP_API_EVENT_TYPE_SESSION_CLOSE };
+            ftp_event_emit(session, &event);
+        }
+
         memset(session, 0, sizeof(*session));
         g_ftp.session_count--;
     }
 }
 
 static void ftp_session_progress_line(struct FtpSession* session, const char* line, size_t line_len) {
-    char cmd_name[5] = {0};
+    char cmd_name[8] = {0};
     int rc = snprintf(cmd_name, sizeof(cmd_name), "%s", line);
     if (rc <= 0) {
         ftp_client_msg(session, 500, "Syntax error, command unrecognized.");
@@ -1335,7 +5719,24 @@ static void ftp_session_progress_line(struct FtpSession* session, const char* li
             }
         }
 
-        ftp_log_callback(FTP_API_LOG_TYPE_COMMAND, cmd_name);
+        if (g_ftp.event_callback) {
+            // never pass the password along.
+            const char* args = strchr(line, ' ');
+            if (args && !strncasecmp(cmd_name, "PASS", sizeof(cmd_name))) {
+                args = NULL;
+            } else if (args) {
+                args++;
+            }
+
+            struct FtpSrvEvent event = {
+                .type = FTP_API_EVENT_TYPE_COMMAND,
+                .name = cmd_name,
+                .text = args,
+                .text_len = args ? strlen(args) : 0,
+            };
+            ftp_event_emit(session, &event);
+        }
+        FTP_TRACE3(command__dispatch, ftp_session_index(session), cmd_name, line_len);
 
         // find command and execute
         int command_id = -1;
@@ -1349,7 +5750,7 @@ static void ftp_session_progress_line(struct FtpSession* session, const char* li
 
         if (command_id < 0 && g_ftp.cfg.custom_command && g_ftp.cfg.custom_command_count) {
             for (size_t i = 0; i < g_ftp.cfg.custom_command_count; i++) {
-                if (!strncasecmp(cmd_name, g_ftp.cfg.custom_command[i].name, sizeof(cmd_name))) {
+                if (!strncasecmp(cmd_name, g_ftp.cfg.custom_command[i].name, sizeof(g_ftp.cfg.custom_command[i].name))) {
                     custom_command = true;
                     command_id = i;
                     break;
@@ -1413,6 +5814,65 @@ static void ftp_session_send(struct FtpSession* session) {
     ftp_update_session_time(session);
 }
 
+// true if cmd_buf has a full line for the command name, or any line if
+// name is NULL.
+static bool ftp_session_has_line(const struct FtpSession* session, const char* name) {
+    const size_t name_len = name ? strlen(name) : 0;
+    size_t start = 0;
+    for (size_t i = 0; i + 1 < session->cmd_buf_size; i++) {
+        if (!memcmp(session->cmd_buf + i, TELNET_EOL, strlen(TELNET_EOL))) {
+            const char* line = session->cmd_buf + start;
+            const size_t line_len = i - start;
+            if (!name || (line_len >= name_len && !strncasecmp(line, name, name_len) && (line_len == name_len || line[name_len] == ' '))) {
+                return true;
+            }
+            start = i + strlen(TELNET_EOL);
+        }
+    }
+    return false;
+}
+
+// runs each full line in cmd_buf. stops while a file is being hashed or
+// SITE CHANGES is waiting, the rest are run once the reply has been sent.
+static void ftp_session_progress_lines(struct FtpSession* session) {
+    // ABOR doesn't wait behind a hash, it stops it and then runs as usual.
+    if (ftp_hash_busy(session) && ftp_session_has_line(session, "ABOR")) {
+        ftp_hash_stop(session);
+        ftp_client_msg(session, 426, "Requested action aborted, hash aborted.");
+    }
+
+    // SITE CHANGES doesn't hold up the next command, it replies with what
+    // has changed so far and the command runs after it.
+    if (ftp_watch_busy(session) && ftp_session_has_line(session, NULL)) {
+        ftp_watch_wait_progress(session, true);
+    }
+
+    while (session->cmd_buf_size && !ftp_session_busy(session)) {
+        size_t line_len = 0;
+        for (size_t i = 0; i < session->cmd_buf_size - 1; i++) {
+            if (!memcmp(session->cmd_buf + i, TELNET_EOL, strlen(TELNET_EOL))) {
+                // replace TELNET_EOL with NULL as to terminate the string.
+                session->cmd_buf[i] = '\0';
+                line_len = i + strlen(TELNET_EOL);
+                break;
+            }
+        }
+
+        if (!line_len) {
+            // no room for TELNET_EOL, so reset the buffer.
+            if (session->cmd_buf_size == sizeof(session->cmd_buf)) {
+                session->cmd_buf_size = 0;
+            }
+            break;
+        }
+
+        // consume line.
+        ftp_session_progress_line(session, session->cmd_buf, line_len);
+        memcpy(session->cmd_buf, session->cmd_buf + line_len, session->cmd_buf_size - line_len);
+        session->cmd_buf_size -= line_len;
+    }
+}
+
 static void ftp_session_poll(struct FtpSession* session) {
     int rc = ftp_socket_recv(&session->control_sock, session->cmd_buf + session->cmd_buf_size, sizeof(session->cmd_buf) - session->cmd_buf_size, 0);
     if (rc < 0) {
@@ -1423,30 +5883,7 @@ static void ftp_session_poll(struct FtpSession* session) {
         ftp_session_close(session);
     } else {
         session->cmd_buf_size += rc;
-        while (session->cmd_buf_size) {
-            size_t line_len = 0;
-            for (size_t i = 0; i < session->cmd_buf_size - 1; i++) {
-                if (!memcmp(session->cmd_buf + i, TELNET_EOL, strlen(TELNET_EOL))) {
-                    // replace TELNET_EOL with NULL as to terminate the string.
-                    session->cmd_buf[i] = '\0';
-                    line_len = i + strlen(TELNET_EOL);
-                    break;
-                }
-            }
-
-            if (!line_len) {
-                // no room for TELNET_EOL, so reset the buffer.
-                if (session->cmd_buf_size == sizeof(session->cmd_buf)) {
-                    session->cmd_buf_size = 0;
-                }
-                break;
-            }
-
-            // consume line.
-            ftp_session_progress_line(session, session->cmd_buf, line_len);
-            memcpy(session->cmd_buf, session->cmd_buf + line_len, session->cmd_buf_size - line_len);
-            session->cmd_buf_size -= line_len;
-        }
+        ftp_session_progress_lines(session);
     }
 
     ftp_update_session_time(session);
@@ -1461,6 +5898,34 @@ int ftpsrv_init(const struct FtpSrvConfig* cfg) {
         memset(&g_ftp, 0, sizeof(g_ftp));
         memcpy(&g_ftp.cfg, cfg, sizeof(*cfg));
         g_ftp.initialised = 1;
+        ftp_stat_cache_flush();
+
+#if FTP_READ_SHARE_SEGMENTS
+        // only resident when used, sharing is turned off if it can't be allocated.
+        if (g_ftp.cfg.read_share && !(g_ftp.read_share_segments = calloc(FTP_READ_SHARE_SEGMENTS, sizeof(*g_ftp.read_share_segments)))) {
+            g_ftp.cfg.read_share = false;
+        }
+#endif
+
+#if FTP_FILE_CACHE_SIZE
+        if (g_ftp.cfg.file_cache_size > FTP_FILE_CACHE_SIZE) {
+            g_ftp.cfg.file_cache_size = FTP_FILE_CACHE_SIZE;
+        }
+        if (g_ftp.cfg.file_cache_size && !(g_ftp.file_cache_data = malloc(g_ftp.cfg.file_cache_size))) {
+            g_ftp.cfg.file_cache_size = 0;
+        }
+#endif
+
+#if FTP_HASH
+        g_ftp.cfg.upload_hash[sizeof(g_ftp.cfg.upload_hash) - 1] = '\0';
+        g_ftp.upload_hash = g_ftp.cfg.upload_hash[0] && !hash_from_name(g_ftp.cfg.upload_hash, &g_ftp.upload_hash_type);
+#endif
+
+        if (cfg->event_callback) {
+            g_ftp.event_callback = cfg->event_callback;
+        } else if (cfg->log_callback) {
+            g_ftp.event_callback = ftp_legacy_log_callback;
+        }
 
         rc = ftp_socket_open(&g_ftp.server_sock, PF_INET, SOCK_STREAM, 0);
         if (rc < 0) {
@@ -1522,7 +5987,9 @@ int ftpsrv_loop(int timeout_ms) {
         struct FtpSession* session = &g_ftp.sessions[i];
 
         if (session->state != FTP_SESSION_STATE_NONE) {
-            if (session->state == FTP_SESSION_STATE_POLLIN) {
+            // commands are still read while busy, so that ABOR and hangups are
+            // seen, but the rest are only run in order once it's done.
+            if (session->state == FTP_SESSION_STATE_POLLIN && session->cmd_buf_size < sizeof(session->cmd_buf)) {
                 fds[si].fd = &session->control_sock;
                 fds[si].events = FtpSocketPollType_IN;
             } else if (session->state == FTP_SESSION_STATE_POLLOUT) {
@@ -1542,7 +6009,7 @@ int ftpsrv_loop(int timeout_ms) {
                     }
                 } else {
                     fds[sd].fd = &session->data_sock;
-                    if (session->transfer.mode == FTP_TRANSFER_MODE_STOR) {
+                    if (ftp_transfer_is_recv(session)) {
                         fds[sd].events = FtpSocketPollType_IN;
                     } else {
                         fds[sd].events = FtpSocketPollType_OUT;
@@ -1552,6 +6019,18 @@ int ftpsrv_loop(int timeout_ms) {
         }
     }
 
+#if FTP_HASH
+    // hashing carries on as soon as the sockets have been checked.
+    if (g_ftp.hash_count) {
+        timeout_ms = 0;
+    }
+#endif
+
+    // waiting sessions are checked for changes every FTP_WATCH_INTERVAL.
+    if (ftp_watch_waiting() && (timeout_ms < 0 || timeout_ms > FTP_WATCH_INTERVAL)) {
+        timeout_ms = FTP_WATCH_INTERVAL;
+    }
+
     const int rc = ftp_socket_poll(fds, poll_fds, nfds, timeout_ms);
     if (rc < 0) {
         return FTP_API_LOOP_ERROR_INIT;
@@ -1567,6 +6046,8 @@ int ftpsrv_loop(int timeout_ms) {
             }
         }
 
+        ftp_watch_progress(false);
+
         for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
             const size_t si = 1 + i * 2;
             const size_t sd = 1 + i * 2 + 1;
@@ -1591,6 +6072,20 @@ int ftpsrv_loop(int timeout_ms) {
                     }
                 }
             }
+
+            if (ftp_hash_busy(session)) {
+                ftp_hash_progress(session);
+                if (!ftp_session_busy(session)) {
+                    ftp_session_progress_lines(session);
+                }
+            }
+
+            if (ftp_watch_busy(session)) {
+                ftp_watch_wait_progress(session, false);
+                if (!ftp_session_busy(session)) {
+                    ftp_session_progress_lines(session);
+                }
+            }
         }
     }
 
@@ -1609,5 +6104,66 @@ void ftpsrv_exit(void) {
     }
 
     ftp_socket_close(&g_ftp.server_sock);
+
+#if FTP_READ_SHARE_SEGMENTS
+    free(g_ftp.read_share_segments);
+    g_ftp.read_share_segments = NULL;
+#endif
+
+#if FTP_FILE_CACHE_SIZE
+    free(g_ftp.file_cache_data);
+    g_ftp.file_cache_data = NULL;
+#endif
+
     g_ftp.initialised = 0;
 }
+
+int ftpsrv_event_format(const struct FtpSrvEvent* event, char* buf, unsigned size) {
+    int rc = -1;
+
+    if (!event || !buf || !size) {
+        return rc;
+    }
+
+    const unsigned char* ip = (const unsigned char*)&event->addr;
+
+    switch (event->type) {
+        case FTP_API_EVENT_TYPE_SESSION_OPEN:
+            rc = snprintf(buf, size, "[%u] connected from %u.%u.%u.%u:%u", event->session, ip[0], ip[1], ip[2], ip[3], event->port);
+            break;
+        case FTP_API_EVENT_TYPE_SESSION_CLOSE:
+            rc = snprintf(buf, size, "[%u] disconnected %u.%u.%u.%u:%u", event->session, ip[0], ip[1], ip[2], ip[3], event->port);
+            break;
+        case FTP_API_EVENT_TYPE_COMMAND:
+            if (event->text) {
+                rc = snprintf(buf, size, "[%u] %s %.*s", event->session, event->name, (int)event->text_len, event->text);
+            } else {
+                rc = snprintf(buf, size, "[%u] %s", event->session, event->name);
+            }
+            break;
+        case FTP_API_EVENT_TYPE_REPLY:
+            rc = snprintf(buf, size, "[%u] %.*s", event->session, (int)event->text_len, event->text);
+            break;
+        case FTP_API_EVENT_TYPE_ERROR:
+            if (event->err) {
+                rc = snprintf(buf, size, "[%u] %.*s (errno %d)", event->session, (int)event->text_len, event->text, event->err);
+            } else {
+                rc = snprintf(buf, size, "[%u] %.*s", event->session, (int)event->text_len, event->text);
+            }
+            break;
+        case FTP_API_EVENT_TYPE_TRANSFER_START:
+            rc = snprintf(buf, size, "[%u] %s started at offset %llu", event->session, event->name, event->offset);
+            break;
+        case FTP_API_EVENT_TYPE_TRANSFER_END:
+            rc = snprintf(buf, size, "[%u] %s finished, %llu bytes in %u ms", event->session, event->name, event->bytes, event->duration_ms);
+            break;
+    }
+
+    if (rc < 0) {
+        return -1;
+    } else if (rc >= size) {
+        return size - 1;
+    }
+
+    return rc;
+}
@@ -17,12 +17,42 @@ enum FTP_API_LOG_TYPE {
     FTP_API_LOG_TYPE_ERROR,
 };
 
+enum FTP_API_EVENT_TYPE {
+    FTP_API_EVENT_TYPE_SESSION_OPEN,   // a client connected.
+    FTP_API_EVENT_TYPE_SESSION_CLOSE,  // a client disconnected or timed out.
+    FTP_API_EVENT_TYPE_COMMAND,        // a command was received.
+    FTP_API_EVENT_TYPE_REPLY,          // a reply (code < 400) was sent.
+    FTP_API_EVENT_TYPE_TRANSFER_START, // a data transfer was started.
+    FTP_API_EVENT_TYPE_TRANSFER_END,   // a data transfer finished or was aborted.
+    FTP_API_EVENT_TYPE_ERROR,          // an error reply (code >= 400) was sent.
+};
+
 enum FTP_API_LOOP_ERROR {
     FTP_API_LOOP_ERROR_OK,
     FTP_API_LOOP_ERROR_INIT, // call ftpsrv_exit and ftpsrv_init again
 };
 
+// raw event data, only the fields relevant to the type are set.
+// pointers are only valid for the duration of the callback.
+struct FtpSrvEvent {
+    enum FTP_API_EVENT_TYPE type;
+    unsigned session;            // index of the session slot.
+    unsigned addr;               // peer ipv4 address, network byte order.
+    unsigned port;               // peer port, host byte order.
+
+    unsigned code;               // REPLY / ERROR: reply code.
+    int err;                     // ERROR: errno at the time of the reply.
+    const char* name;            // COMMAND: verb, TRANSFER_*: transfer verb.
+    const char* text;            // COMMAND: args (NULL for PASS), REPLY / ERROR: reply text.
+    unsigned text_len;
+
+    unsigned long long offset;   // TRANSFER_*: file offset the transfer started at.
+    unsigned long long bytes;    // TRANSFER_END: bytes moved on the data connection.
+    unsigned duration_ms;        // TRANSFER_END: time since TRANSFER_START.
+};
+
 typedef void (*FtpSrvLogCallback)(enum FTP_API_LOG_TYPE, const char*);
+typedef void (*FtpSrvEventCallback)(const struct FtpSrvEvent* event, void* userdata);
 typedef void (*FtpSrvProgressCallback)(void);
 
 struct FtpSrvCustomCommand {
@@ -48,10 +78,50 @@ struct FtpSrvConfig {
     bool use_localtime;
     // if set, sessions will be closed once this is elapsed.
     unsigned timeout;
+    // if set, stat results (including ENOENT) are cached for this long.
+    // changes made through the server are seen immediately, others once
+    // the entry expires.
+    unsigned stat_cache_ttl_ms;
+    // if set, sessions reading the same file share the blocks read, see
+    // FTP_READ_SHARE_SEGMENTS.
+    bool read_share;
+    // if set, small files are kept in memory, up to this many bytes
+    // (capped at FTP_FILE_CACHE_SIZE). a file is only cached once it has
+    // been asked for file_cache_admit times.
+    unsigned file_cache_size;
+    unsigned file_cache_admit;
+    // if set, the start of the next files in the last dir listed is read
+    // ahead while one is downloaded (up to FTP_PREFETCH_WINDOW files), at
+    // most prefetch_size bytes of each (0 for the whole file).
+    unsigned prefetch_files;
+    unsigned prefetch_size;
+    // if set, RETRs of files at least this large are hinted as sequential
+    // and dropped from the page cache as they are sent, and uploads past
+    // this size are written back and dropped as they arrive, every
+    // page_cache_window bytes (0 for FTP_VFS_ADVISE_WINDOW).
+    // needs FTP_VFS_ADVISE.
+    unsigned page_cache_min_size;
+    unsigned page_cache_window;
+    // if set, uploads are flushed to disk every upload_journal bytes, and
+    // the offset is written to a journal next to the file (see
+    // FTP_UPLOAD_JOURNAL_SUFFIX), which SIZE reports until the upload
+    // completes. needs FTP_UPLOAD_JOURNAL.
+    unsigned upload_journal;
+    // if set, uploads of whole files are hashed as they arrive with this
+    // algorithm (a HASH name, such as "CRC32C" or "SHA-256"). the digest is
+    // added to the 226 reply and kept next to the file (see
+    // FTP_HASH_SIDECAR_SUFFIX), so that HASH can reply without reading the
+    // file again. needs FTP_HASH.
+    char upload_hash[16];
 
     const struct FtpSrvCustomCommand* custom_command;
     unsigned custom_command_count;
 
+    // if set, raw events are passed here and log_callback is not called.
+    FtpSrvEventCallback event_callback;
+    void* event_userdata;
+
+    // legacy string callback, only receives COMMAND, REPLY and ERROR.
     FtpSrvLogCallback log_callback;
     FtpSrvProgressCallback progress_callback;
 };
@@ -60,6 +130,10 @@ int ftpsrv_init(const struct FtpSrvConfig* cfg);
 int ftpsrv_loop(int timeout_ms);
 void ftpsrv_exit(void);
 
+// formats an event into a single line of text, returns the length written
+// (excluding the NULL terminator), or -1 on error.
+int ftpsrv_event_format(const struct FtpSrvEvent* event, char* buf, unsigned size);
+
 #ifdef __cplusplus
 }
 #endif
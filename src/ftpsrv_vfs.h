@@ -14,6 +14,14 @@ enum FtpVfsOpenMode {
     FtpVfsOpenMode_READ,
     FtpVfsOpenMode_WRITE, // create and truncate is implicitly implied
     FtpVfsOpenMode_APPEND,
+    FtpVfsOpenMode_UPDATE, // write, create but keep existing data
+};
+
+// page cache hints, see ftp_vfs_advise().
+enum FtpVfsAdvice {
+    FtpVfsAdvice_SEQUENTIAL, // the range will be read in order, read further ahead.
+    FtpVfsAdvice_WRITEOUT,   // start writing the range back, don't wait for it.
+    FtpVfsAdvice_DONTNEED,   // the range won't be used again, written data is flushed first.
 };
 
 // todo: finish below
@@ -64,6 +72,16 @@ int ftp_vfs_write(struct FtpVfsFile* f, const void* buf, size_t size);
 int ftp_vfs_seek(struct FtpVfsFile* f, const void* buf, size_t size, size_t off);
 int ftp_vfs_close(struct FtpVfsFile* f);
 int ftp_vfs_isfile_open(struct FtpVfsFile* f);
+// optional, only needed by backends wrapped in vfs/vfs_buffered, and
+// fallocate if FTP_SEGMENT_UPLOADS is set.
+// fallocate grows the file to off + size, ftruncate sets the size.
+int ftp_vfs_fallocate(struct FtpVfsFile* f, size_t off, size_t size);
+int ftp_vfs_ftruncate(struct FtpVfsFile* f, size_t size);
+// optional, only needed if FTP_VFS_ADVISE is set. size 0 means to the end.
+int ftp_vfs_advise(struct FtpVfsFile* f, size_t off, size_t size, enum FtpVfsAdvice advice);
+// optional, only needed if FTP_UPLOAD_JOURNAL is set. returns once what
+// has been written is on disk.
+int ftp_vfs_sync(struct FtpVfsFile* f);
 
 int ftp_vfs_opendir(struct FtpVfsDir* f, const char* path);
 const char* ftp_vfs_readdir(struct FtpVfsDir* f, struct FtpVfsDirEntry* entry);
@@ -71,6 +89,20 @@ int ftp_vfs_dirlstat(struct FtpVfsDir* f, const struct FtpVfsDirEntry* entry, co
 int ftp_vfs_closedir(struct FtpVfsDir* f);
 int ftp_vfs_isdir_open(struct FtpVfsDir* f);
 
+// optional, only needed if FTP_PREFETCH_WINDOW is set.
+// hints that the first size bytes of path will be read soon, must not block.
+int ftp_vfs_prefetch(const char* path, size_t size);
+
+// optional, only needed if FTP_WATCH_DIRS is set. watch_add returns an id
+// for the dir, the same one if it is already watched, or -1 if it can't be
+// watched (ENOSYS if the vfs can't watch dirs), in which case it's polled.
+// watch_read returns 1 with the id and the name of the entry that changed
+// (empty if the dir itself changed), 0 if nothing has changed, and must not
+// block. the id is -1 if changes were dropped.
+int ftp_vfs_watch_add(const char* path);
+int ftp_vfs_watch_remove(int id);
+int ftp_vfs_watch_read(int* id, char* name, size_t size);
+
 int ftp_vfs_stat(const char* path, struct stat* st);
 int ftp_vfs_lstat(const char* path, struct stat* st);
 int ftp_vfs_mkdir(const char* path);
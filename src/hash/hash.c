@@ -0,0 +1,549 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#include "hash.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+// the x86 kernels are picked at runtime, so that builds still run on
+// cpus without the extensions. arm only uses the crc instructions if the
+// build targets them (-march=armv8-a+crc).
+#if !defined(HASH_X86) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define HASH_X86 1
+#endif
+
+#if defined(HASH_X86) && HASH_X86
+    #include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+    #include <arm_acle.h>
+    #define HASH_ARM_CRC 1
+#endif
+
+static const char* const HASH_NAMES[HashType_COUNT] = {
+    [HashType_CRC32] = "CRC32",
+    [HashType_CRC32C] = "CRC32C",
+    [HashType_MD5] = "MD5",
+    [HashType_SHA1] = "SHA-1",
+    [HashType_SHA256] = "SHA-256",
+};
+
+static const uint8_t HASH_SIZES[HashType_COUNT] = {
+    [HashType_CRC32] = 4,
+    [HashType_CRC32C] = 4,
+    [HashType_MD5] = 16,
+    [HashType_SHA1] = 20,
+    [HashType_SHA256] = 32,
+};
+
+static inline uint32_t rotl32(uint32_t v, unsigned n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+static inline uint32_t rotr32(uint32_t v, unsigned n) {
+    return (v >> n) | (v << (32 - n));
+}
+
+static inline uint32_t load_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void store_le32(uint8_t* p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+#if defined(HASH_X86) && HASH_X86
+static int g_x86_sha = -1;
+static int g_x86_crc;
+
+static void hash_cpu_init(void) {
+    if (g_x86_sha < 0) {
+        __builtin_cpu_init();
+        g_x86_sha = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+        g_x86_crc = __builtin_cpu_supports("sse4.2");
+    }
+}
+#endif
+
+// crc32 (ieee) and crc32c (castagnoli), slicing-by-8: 8 bytes per step
+// through 8 tables.
+static uint32_t g_crc_table[2][8][256];
+static bool g_crc_ready[2];
+
+static void crc_init_tables(uint32_t table[8][256], uint32_t poly) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+        }
+        table[0][i] = c;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            const uint32_t prev = table[t - 1][i];
+            table[t][i] = (prev >> 8) ^ table[0][prev & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc_update_c(uint32_t table[8][256], uint32_t crc, const uint8_t* p, size_t size) {
+    while (size >= 8) {
+        const uint32_t one = load_le32(p) ^ crc;
+        const uint32_t two = load_le32(p + 4);
+        crc = table[7][one & 0xFF] ^ table[6][(one >> 8) & 0xFF] ^
+              table[5][(one >> 16) & 0xFF] ^ table[4][one >> 24] ^
+              table[3][two & 0xFF] ^ table[2][(two >> 8) & 0xFF] ^
+              table[1][(two >> 16) & 0xFF] ^ table[0][two >> 24];
+        p += 8;
+        size -= 8;
+    }
+
+    while (size--) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(HASH_X86) && HASH_X86
+// the sse4.2 crc32 instruction is crc32c only.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_x86(uint32_t crc, const uint8_t* p, size_t size) {
+    uint64_t c = crc;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+
+    crc = c;
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+#if defined(HASH_ARM_CRC) && HASH_ARM_CRC
+static uint32_t crc_update_arm(bool castagnoli, uint32_t crc, const uint8_t* p, size_t size) {
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = castagnoli ? __crc32cd(crc, v) : __crc32d(crc, v);
+    }
+
+    while (size--) {
+        crc = castagnoli ? __crc32cb(crc, *p) : __crc32b(crc, *p);
+        p++;
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc_update(enum HashType type, uint32_t crc, const uint8_t* p, size_t size) {
+    const bool castagnoli = type == HashType_CRC32C;
+#if defined(HASH_X86) && HASH_X86
+    if (castagnoli && g_x86_crc) {
+        return crc32c_update_x86(crc, p, size);
+    }
+#elif defined(HASH_ARM_CRC) && HASH_ARM_CRC
+    return crc_update_arm(castagnoli, crc, p, size);
+#endif
+    return crc_update_c(g_crc_table[castagnoli], crc, p, size);
+}
+
+// SOURCE: https://datatracker.ietf.org/doc/html/rfc1321
+static const uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t MD5_S[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_blocks(uint32_t h[4], const uint8_t* p, size_t count) {
+    for (; count; count--, p += 64) {
+        uint32_t m[16];
+        for (int i = 0; i < 16; i++) {
+            m[i] = load_le32(p + i * 4);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        #define MD5_ROUND(f, g) do { \
+            const uint32_t t = (f) + a + MD5_K[i] + m[g]; \
+            a = d; d = c; c = b; b += rotl32(t, MD5_S[i]); \
+        } while (0)
+
+        int i = 0;
+        for (; i < 16; i++) MD5_ROUND((b & c) | (~b & d), i);
+        for (; i < 32; i++) MD5_ROUND((d & b) | (~d & c), (5 * i + 1) & 15);
+        for (; i < 48; i++) MD5_ROUND(b ^ c ^ d, (3 * i + 5) & 15);
+        for (; i < 64; i++) MD5_ROUND(c ^ (b | ~d), (7 * i) & 15);
+        #undef MD5_ROUND
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    }
+}
+
+// SOURCE: https://datatracker.ietf.org/doc/html/rfc3174
+static void sha1_blocks_c(uint32_t h[5], const uint8_t* p, size_t count) {
+    for (; count; count--, p += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(p + i * 4);
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        #define SHA1_ROUND(f, k) do { \
+            const uint32_t t = rotl32(a, 5) + (f) + e + (k) + w[i]; \
+            e = d; d = c; c = rotl32(b, 30); b = a; a = t; \
+        } while (0)
+
+        // a loop for each group of rounds keeps the branches out of them.
+        int i = 0;
+        for (; i < 20; i++) SHA1_ROUND((b & c) | (~b & d), 0x5A827999);
+        for (; i < 40; i++) SHA1_ROUND(b ^ c ^ d, 0x6ED9EBA1);
+        for (; i < 60; i++) SHA1_ROUND((b & c) | (b & d) | (c & d), 0x8F1BBCDC);
+        for (; i < 80; i++) SHA1_ROUND(b ^ c ^ d, 0xCA62C1D6);
+        #undef SHA1_ROUND
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+}
+
+#if defined(HASH_X86) && HASH_X86
+// 4 rounds per step, the message schedule is kept in 4 registers.
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_ni(uint32_t h[5], const uint8_t* p, size_t count) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[0]), 0x1B);
+    __m128i e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+    for (; count; count--, p += 64) {
+        const __m128i abcd_save = abcd;
+        const __m128i e_save = e0;
+        __m128i prev = abcd;
+        __m128i w[4];
+
+        for (int i = 0; i < 20; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + i * 16)), mask);
+            } else {
+                // w[i] = msg2(msg1(w[i - 4], w[i - 3]) ^ w[i - 2], w[i - 1]).
+                const __m128i msg = _mm_xor_si128(_mm_sha1msg1_epu32(w[i & 3], w[(i - 3) & 3]), w[(i - 2) & 3]);
+                w[i & 3] = _mm_sha1msg2_epu32(msg, w[(i - 1) & 3]);
+            }
+
+            // e comes from abcd as it was 4 rounds back.
+            const __m128i e = i ? _mm_sha1nexte_epu32(prev, w[i & 3]) : _mm_add_epi32(e0, w[0]);
+            prev = abcd;
+            switch (i / 5) {
+                case 0: abcd = _mm_sha1rnds4_epu32(abcd, e, 0); break;
+                case 1: abcd = _mm_sha1rnds4_epu32(abcd, e, 1); break;
+                case 2: abcd = _mm_sha1rnds4_epu32(abcd, e, 2); break;
+                default: abcd = _mm_sha1rnds4_epu32(abcd, e, 3); break;
+            }
+        }
+
+        e0 = _mm_sha1nexte_epu32(prev, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i*)&h[0], _mm_shuffle_epi32(abcd, 0x1B));
+    h[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+// SOURCE: https://datatracker.ietf.org/doc/html/rfc6234
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_blocks_c(uint32_t h[8], const uint8_t* p, size_t count) {
+    for (; count; count--, p += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(p + i * 4);
+        }
+        for (int i = 16; i < 64; i++) {
+            const uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            const uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+            const uint32_t ch = (e & f) ^ (~e & g);
+            const uint32_t t1 = hh + s1 + ch + SHA256_K[i] + w[i];
+            const uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+            const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            const uint32_t t2 = s0 + maj;
+
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+}
+
+#if defined(HASH_X86) && HASH_X86
+// 4 rounds per step, the message schedule is kept in 4 registers.
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_ni(uint32_t h[8], const uint8_t* p, size_t count) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // the instructions want the state as ABEF / CDGH.
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; count; count--, p += 64) {
+        const __m128i abef = state0;
+        const __m128i cdgh = state1;
+        __m128i w[4];
+
+        for (int i = 0; i < 16; i++) {
+            __m128i msg;
+            if (i < 4) {
+                msg = w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + i * 16)), mask);
+            } else {
+                // w[i] = msg2(msg1(w[i - 4], w[i - 3]) + w[i - 2 .. i - 1] shifted by one word, w[i - 1]).
+                const __m128i prev = w[(i - 1) & 3];
+                msg = _mm_sha256msg1_epu32(w[i & 3], w[(i - 3) & 3]);
+                msg = _mm_add_epi32(msg, _mm_alignr_epi8(prev, w[(i - 2) & 3], 4));
+                msg = w[i & 3] = _mm_sha256msg2_epu32(msg, prev);
+            }
+
+            msg = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i*)&SHA256_K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&h[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+static void sha256_blocks(uint32_t h[8], const uint8_t* p, size_t count) {
+#if defined(HASH_X86) && HASH_X86
+    if (g_x86_sha) {
+        sha256_blocks_ni(h, p, count);
+        return;
+    }
+#endif
+    sha256_blocks_c(h, p, count);
+}
+
+static void sha1_blocks(uint32_t h[5], const uint8_t* p, size_t count) {
+#if defined(HASH_X86) && HASH_X86
+    if (g_x86_sha) {
+        sha1_blocks_ni(h, p, count);
+        return;
+    }
+#endif
+    sha1_blocks_c(h, p, count);
+}
+
+static void hash_blocks(struct HashCtx* ctx, const uint8_t* p, size_t count) {
+    switch (ctx->type) {
+        case HashType_MD5: md5_blocks(ctx->state.h, p, count); break;
+        case HashType_SHA1: sha1_blocks(ctx->state.h, p, count); break;
+        case HashType_SHA256: sha256_blocks(ctx->state.h, p, count); break;
+        default: break;
+    }
+}
+
+void hash_init(struct HashCtx* ctx, enum HashType type) {
+    static const uint32_t MD5_H[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    static const uint32_t SHA1_H[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    static const uint32_t SHA256_H[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->type = type;
+#if defined(HASH_X86) && HASH_X86
+    hash_cpu_init();
+#endif
+
+    switch (type) {
+        case HashType_CRC32:
+        case HashType_CRC32C: {
+            const bool castagnoli = type == HashType_CRC32C;
+            if (!g_crc_ready[castagnoli]) {
+                crc_init_tables(g_crc_table[castagnoli], castagnoli ? 0x82F63B78 : 0xEDB88320);
+                g_crc_ready[castagnoli] = true;
+            }
+            ctx->state.crc = 0xFFFFFFFF;
+        }   break;
+        case HashType_MD5:
+            memcpy(ctx->state.h, MD5_H, sizeof(MD5_H));
+            break;
+        case HashType_SHA1:
+            memcpy(ctx->state.h, SHA1_H, sizeof(SHA1_H));
+            break;
+        case HashType_SHA256:
+            memcpy(ctx->state.h, SHA256_H, sizeof(SHA256_H));
+            break;
+        default:
+            break;
+    }
+}
+
+void hash_update(struct HashCtx* ctx, const void* data, size_t size) {
+    const uint8_t* p = data;
+    ctx->len += size;
+
+    if (ctx->type == HashType_CRC32 || ctx->type == HashType_CRC32C) {
+        ctx->state.crc = crc_update(ctx->type, ctx->state.crc, p, size);
+        return;
+    }
+
+    if (ctx->block_len) {
+        const size_t n = size < 64 - ctx->block_len ? size : 64 - ctx->block_len;
+        memcpy(ctx->block + ctx->block_len, p, n);
+        ctx->block_len += n;
+        p += n;
+        size -= n;
+
+        if (ctx->block_len < 64) {
+            return;
+        }
+        hash_blocks(ctx, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+
+    // whole blocks are hashed straight from the caller's buffer.
+    if (size >= 64) {
+        hash_blocks(ctx, p, size / 64);
+        p += size & ~(size_t)63;
+        size &= 63;
+    }
+
+    memcpy(ctx->block, p, size);
+    ctx->block_len = size;
+}
+
+void hash_final(struct HashCtx* ctx, uint8_t* out) {
+    if (ctx->type == HashType_CRC32 || ctx->type == HashType_CRC32C) {
+        store_be32(out, ~ctx->state.crc);
+        return;
+    }
+
+    // pad with 0x80 then zeros, leaving 8 bytes for the length in bits.
+    const uint64_t bits = ctx->len * 8;
+    ctx->block[ctx->block_len++] = 0x80;
+    if (ctx->block_len > 56) {
+        memset(ctx->block + ctx->block_len, 0, 64 - ctx->block_len);
+        hash_blocks(ctx, ctx->block, 1);
+        ctx->block_len = 0;
+    }
+    memset(ctx->block + ctx->block_len, 0, 56 - ctx->block_len);
+
+    const size_t words = hash_size(ctx->type) / 4;
+    if (ctx->type == HashType_MD5) {
+        store_le32(ctx->block + 56, bits);
+        store_le32(ctx->block + 60, bits >> 32);
+        hash_blocks(ctx, ctx->block, 1);
+        for (size_t i = 0; i < words; i++) {
+            store_le32(out + i * 4, ctx->state.h[i]);
+        }
+    } else {
+        store_be32(ctx->block + 56, bits >> 32);
+        store_be32(ctx->block + 60, bits);
+        hash_blocks(ctx, ctx->block, 1);
+        for (size_t i = 0; i < words; i++) {
+            store_be32(out + i * 4, ctx->state.h[i]);
+        }
+    }
+}
+
+size_t hash_size(enum HashType type) {
+    return type < HashType_COUNT ? HASH_SIZES[type] : 0;
+}
+
+const char* hash_name(enum HashType type) {
+    return type < HashType_COUNT ? HASH_NAMES[type] : "";
+}
+
+int hash_from_name(const char* name, enum HashType* type) {
+    for (int i = 0; i < HashType_COUNT; i++) {
+        const char* a = name;
+        const char* b = HASH_NAMES[i];
+        while (*a && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+            a++;
+            b++;
+        }
+
+        if (!*a && !*b) {
+            *type = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void hash_to_hex(const uint8_t* digest, size_t size, char* out) {
+    static const char HEX[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; i++) {
+        out[i * 2] = HEX[digest[i] >> 4];
+        out[i * 2 + 1] = HEX[digest[i] & 0xF];
+    }
+    out[size * 2] = '\0';
+}
+
+uint32_t hash_rolling(const void* data, size_t size) {
+    const uint8_t* p = data;
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < size; i++) {
+        a += p[i];
+        b += (uint32_t)(size - i) * p[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
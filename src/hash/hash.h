@@ -0,0 +1,62 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef HASH_TJ_H
+#define HASH_TJ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+// incremental hashing, used by HASH / XCRC / XMD5 / XSHA1 / XSHA256.
+// crc32c uses the sse4.2 / armv8 crc instructions, and sha1 / sha256 the
+// x86 sha extensions when the cpu has them, otherwise the portable code is used.
+enum HashType {
+    HashType_CRC32,
+    HashType_CRC32C,
+    HashType_MD5,
+    HashType_SHA1,
+    HashType_SHA256,
+    HashType_COUNT,
+};
+
+#define HASH_MAX_SIZE 32
+
+struct HashCtx {
+    enum HashType type;
+    uint64_t len;          // bytes hashed so far.
+    union {
+        uint32_t crc;      // crc32 and crc32c.
+        uint32_t h[8];     // md5 uses 4, sha1 5 and sha256 8.
+    } state;
+    uint8_t block[64];     // partial block, not used by the crcs.
+    size_t block_len;
+};
+
+void hash_init(struct HashCtx* ctx, enum HashType type);
+void hash_update(struct HashCtx* ctx, const void* data, size_t size);
+// writes hash_size() bytes to out.
+void hash_final(struct HashCtx* ctx, uint8_t* out);
+
+size_t hash_size(enum HashType type);
+// the names used by HASH, such as "SHA-256".
+const char* hash_name(enum HashType type);
+// returns 0 and sets type if the name is known (case insensitive).
+int hash_from_name(const char* name, enum HashType* type);
+// writes size * 2 lower case hex digits and a NULL terminator.
+void hash_to_hex(const uint8_t* digest, size_t size, char* out);
+
+// the rsync weak checksum of a block, a = sum(x[i]) and b = sum((size - i) * x[i]),
+// both mod 2^16, returned as a | b << 16. used by SITE DELTASIG, clients
+// roll it over their file a byte at a time to find blocks that match.
+uint32_t hash_rolling(const void* data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HASH_TJ_H
@@ -4,18 +4,73 @@
 #include <stdarg.h>
 #include <string.h>
 
+// number of records in the ring, must be a power of 2.
+#ifndef LOG_RING_SIZE
+    #define LOG_RING_SIZE 32
+#endif
+
+// max length of a single record, longer messages are truncated.
+#ifndef LOG_RECORD_SIZE
+    #define LOG_RECORD_SIZE 512
+#endif
+
+// records are copied here and written to the file in a single write.
+#ifndef LOG_BATCH_SIZE
+    #define LOG_BATCH_SIZE (1024 * 4)
+#endif
+
+#if (LOG_RING_SIZE & (LOG_RING_SIZE - 1)) != 0
+    #error LOG_RING_SIZE must be a power of 2
+#endif
+
+#define LOG_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define LOG_STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+
+struct LogRecord {
+    int type;
+    unsigned len;
+    char msg[LOG_RECORD_SIZE];
+};
+
 static struct FtpVfsFile g_log_file = {0};
 static int g_has_log_file = 0;
 
+static struct LogRecord g_ring[LOG_RING_SIZE];
+static unsigned g_head; // only written by the producer.
+static unsigned g_tail; // only written by the consumer.
+static unsigned g_dropped; // only written by the producer.
+static unsigned g_dropped_reported; // only used by the consumer.
+static int g_threaded; // the consumer is another thread, see log_file_set_threaded().
+
+static char g_batch[LOG_BATCH_SIZE];
+
+void log_file_push(int type, const char* msg) {
+    const unsigned head = g_head;
+    if (head - LOG_LOAD(g_tail) >= LOG_RING_SIZE) {
+        // nothing else drains it, such as while starting up, so make room.
+        if (g_threaded) {
+            LOG_STORE(g_dropped, g_dropped + 1);
+            return;
+        }
+        log_file_flush(NULL, NULL);
+    }
+
+    struct LogRecord* r = &g_ring[head & (LOG_RING_SIZE - 1)];
+    size_t len = strlen(msg);
+    if (len >= sizeof(r->msg)) {
+        len = sizeof(r->msg) - 1;
+    }
+
+    memcpy(r->msg, msg, len);
+    r->msg[len] = '\0';
+    r->len = len;
+    r->type = type;
+    LOG_STORE(g_head, head + 1);
+}
+
 void log_file_write(const char* msg) {
     if (g_has_log_file) {
-        const size_t len = strlen(msg);
-        if (len) {
-            ftp_vfs_write(&g_log_file, msg, len);
-            if (msg[len - 1] != '\n') {
-                ftp_vfs_write(&g_log_file, "\n", 1);
-            }
-        }
+        log_file_push(LOG_FILE_TYPE_FILE_ONLY, msg);
     }
 }
 
@@ -30,17 +85,83 @@ void log_file_fwrite(const char* fmt, ...) {
     }
 }
 
+static void log_batch_append(size_t* off, const char* msg, size_t len) {
+    if (!len) {
+        return;
+    }
+
+    const int eol = msg[len - 1] != '\n';
+    if (*off + len + eol > sizeof(g_batch)) {
+        ftp_vfs_write(&g_log_file, g_batch, *off);
+        *off = 0;
+    }
+
+    memcpy(g_batch + *off, msg, len);
+    *off += len;
+    if (eol) {
+        g_batch[(*off)++] = '\n';
+    }
+}
+
+unsigned log_file_flush(LogFileFlushCallback cb, void* userdata) {
+    const unsigned head = LOG_LOAD(g_head);
+    unsigned tail = g_tail;
+    unsigned count = 0;
+    size_t off = 0;
+
+    for (; tail != head; tail++, count++) {
+        const struct LogRecord* r = &g_ring[tail & (LOG_RING_SIZE - 1)];
+
+        if (cb) {
+            cb(r->type, r->msg, userdata);
+        }
+
+        if (g_has_log_file) {
+            log_batch_append(&off, r->msg, r->len);
+        }
+
+        // hand the slot back as soon as we're done with it.
+        LOG_STORE(g_tail, tail + 1);
+    }
+
+    if (g_has_log_file) {
+        const unsigned dropped = LOG_LOAD(g_dropped);
+        if (dropped != g_dropped_reported) {
+            char buf[64];
+            const int len = snprintf(buf, sizeof(buf), "log: dropped %u records", dropped - g_dropped_reported);
+            log_batch_append(&off, buf, len);
+            g_dropped_reported = dropped;
+        }
+
+        if (off) {
+            ftp_vfs_write(&g_log_file, g_batch, off);
+        }
+    }
+
+    return count;
+}
+
+unsigned log_file_dropped(void) {
+    return LOG_LOAD(g_dropped);
+}
+
+void log_file_set_threaded(int threaded) {
+    g_threaded = threaded;
+}
+
 void log_file_init(const char* path, const char* init_msg) {
     if (!g_has_log_file) {
         ftp_vfs_unlink(path);
-        g_has_log_file = !ftp_vfs_open(&g_log_file, path, FtpVfsOpenMode_APPEND);
+        g_has_log_file = ftp_vfs_open(&g_log_file, path, FtpVfsOpenMode_APPEND) >= 0;
         log_file_write(init_msg);
+        log_file_flush(NULL, NULL);
     }
 }
 
 void log_file_exit(void) {
     if (g_has_log_file) {
         log_file_write("goodbye :)");
+        log_file_flush(NULL, NULL);
         ftp_vfs_close(&g_log_file);
         g_has_log_file = 0;
     }
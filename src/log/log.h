@@ -9,8 +9,31 @@
 extern "C" {
 #endif
 
+// the type of records from log_file_write() / log_file_fwrite(), which are
+// only meant for the file. flush callbacks should skip them.
+#define LOG_FILE_TYPE_FILE_ONLY (-1)
+
+// called for each record during a flush, type is whatever was pushed.
+typedef void (*LogFileFlushCallback)(int type, const char* msg, void* userdata);
+
+// the below are the producer side of a single-producer / single-consumer
+// ring, only one thread may push at a time. they never block, if the ring
+// is full then the record is dropped and counted. unless log_file_set_threaded()
+// was called, the ring is flushed to make room instead.
 void log_file_write(const char* msg);
 void log_file_fwrite(const char* fmt, ...);
+// same as log_file_write(), but queues the record even if no file is open.
+void log_file_push(int type, const char* msg);
+
+// consumer side, drains the ring, writes the records to the log file
+// in batches and calls cb (if set) for each one.
+// returns the number of records drained.
+unsigned log_file_flush(LogFileFlushCallback cb, void* userdata);
+// total number of records dropped due to the ring being full.
+unsigned log_file_dropped(void);
+// set while another thread drains the ring, so the producer must not flush.
+void log_file_set_threaded(int threaded);
+
 void log_file_init(const char* path, const char* init_msg);
 void log_file_exit(void);
 
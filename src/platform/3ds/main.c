@@ -74,6 +74,7 @@ static void processEvents(void) {
             }
         }
 
+        log_file_flush(NULL, NULL);
         g_num_events = 0;
         free(g_callback_data);
         g_callback_data = NULL;
@@ -0,0 +1,589 @@
+// Copyright 2024 TotalJustice.
+// SPDX-License-Identifier: MIT
+#include "ftpsrv_socket.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef LOOPBACK_MAX_SOCKETS
+    #define LOOPBACK_MAX_SOCKETS 64
+#endif
+
+// bytes buffered per direction, must be a power of 2.
+#ifndef LOOPBACK_PIPE_SIZE
+    #define LOOPBACK_PIPE_SIZE (1024 * 64)
+#endif
+
+// number of in flight sends per direction, must be a power of 2.
+#ifndef LOOPBACK_MAX_SEGMENTS
+    #define LOOPBACK_MAX_SEGMENTS 64
+#endif
+
+#ifndef LOOPBACK_BACKLOG
+    #define LOOPBACK_BACKLOG 8
+#endif
+
+#if (LOOPBACK_PIPE_SIZE & (LOOPBACK_PIPE_SIZE - 1)) != 0
+    #error LOOPBACK_PIPE_SIZE must be a power of 2
+#endif
+
+#if (LOOPBACK_MAX_SEGMENTS & (LOOPBACK_MAX_SEGMENTS - 1)) != 0
+    #error LOOPBACK_MAX_SEGMENTS must be a power of 2
+#endif
+
+enum LoopbackState {
+    LoopbackState_FREE,
+    LoopbackState_OPEN,
+    LoopbackState_LISTEN,
+    LoopbackState_CONNECTED,
+};
+
+// a send becomes visible to the reader once the clock reaches its time.
+struct LoopbackSegment {
+    uint64_t end;
+    uint64_t time;
+};
+
+struct LoopbackPipe {
+    uint8_t data[LOOPBACK_PIPE_SIZE];
+    uint64_t head;  // total bytes written.
+    uint64_t ready; // total bytes that have been delivered.
+    uint64_t tail;  // total bytes read.
+    struct LoopbackSegment seg[LOOPBACK_MAX_SEGMENTS];
+    unsigned seg_head;
+    unsigned seg_tail;
+};
+
+struct LoopbackSocket {
+    enum LoopbackState state;
+    struct sockaddr_in addr;
+    int peer; // handle, 0 if none or closed.
+
+    // receive side.
+    struct LoopbackPipe rx;
+    bool eof;
+    uint64_t eof_time;
+
+    // send side, the link that feeds the peer's rx pipe.
+    uint64_t bandwidth;
+    uint64_t latency_us;
+    uint64_t link_free_us;
+
+    int backlog[LOOPBACK_BACKLOG];
+    unsigned backlog_count;
+    unsigned backlog_max;
+};
+
+static struct LoopbackSocket g_sockets[LOOPBACK_MAX_SOCKETS];
+static uint64_t g_now_us;
+static uint64_t g_default_bandwidth;
+static uint64_t g_default_latency_us;
+static unsigned g_next_port = 32768;
+static struct LoopbackStats g_stats;
+
+static struct LoopbackSocket* loopback_get(int h) {
+    if (h <= 0 || h > LOOPBACK_MAX_SOCKETS || g_sockets[h - 1].state == LoopbackState_FREE) {
+        return NULL;
+    }
+    return &g_sockets[h - 1];
+}
+
+static int loopback_alloc(void) {
+    for (int i = 0; i < LOOPBACK_MAX_SOCKETS; i++) {
+        struct LoopbackSocket* s = &g_sockets[i];
+        if (s->state == LoopbackState_FREE) {
+            memset(&s->addr, 0, sizeof(s->addr));
+            s->peer = 0;
+            // the pipe data doesn't need clearing.
+            memset(&s->rx.head, 0, sizeof(*s) - offsetof(struct LoopbackSocket, rx.head));
+            s->state = LoopbackState_OPEN;
+            s->bandwidth = g_default_bandwidth;
+            s->latency_us = g_default_latency_us;
+            return i + 1;
+        }
+    }
+
+    errno = EMFILE;
+    return -1;
+}
+
+static bool loopback_port_in_use(unsigned port) {
+    for (int i = 0; i < LOOPBACK_MAX_SOCKETS; i++) {
+        const struct LoopbackSocket* s = &g_sockets[i];
+        if (s->state != LoopbackState_FREE && ntohs(s->addr.sin_port) == port) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static unsigned loopback_ephemeral_port(void) {
+    for (int i = 0; i < 65536; i++) {
+        const unsigned port = g_next_port;
+        g_next_port = g_next_port == 65535 ? 32768 : g_next_port + 1;
+        if (!loopback_port_in_use(port)) {
+            return port;
+        }
+    }
+    return 0;
+}
+
+static void pipe_update(struct LoopbackPipe* p) {
+    while (p->seg_tail != p->seg_head) {
+        const struct LoopbackSegment* seg = &p->seg[p->seg_tail & (LOOPBACK_MAX_SEGMENTS - 1)];
+        if (seg->time > g_now_us) {
+            break;
+        }
+        p->ready = seg->end;
+        p->seg_tail++;
+    }
+}
+
+static size_t pipe_space(const struct LoopbackPipe* p) {
+    if (p->seg_head - p->seg_tail == LOOPBACK_MAX_SEGMENTS) {
+        return 0;
+    }
+    return LOOPBACK_PIPE_SIZE - (p->head - p->tail);
+}
+
+static size_t pipe_readable(struct LoopbackPipe* p) {
+    pipe_update(p);
+    return p->ready - p->tail;
+}
+
+static bool socket_readable(struct LoopbackSocket* s) {
+    if (pipe_readable(&s->rx)) {
+        return true;
+    }
+    // eof is only seen once everything sent before it has been read.
+    return s->eof && s->eof_time <= g_now_us && s->rx.tail == s->rx.head;
+}
+
+static bool socket_writable(struct LoopbackSocket* s) {
+    struct LoopbackSocket* peer = loopback_get(s->peer);
+    // writing to a closed peer fails, which counts as ready.
+    return !peer || pipe_space(&peer->rx);
+}
+
+// time at which the next byte sent by s would arrive.
+static uint64_t link_schedule(struct LoopbackSocket* s, size_t size) {
+    uint64_t start = s->link_free_us > g_now_us ? s->link_free_us : g_now_us;
+    if (s->bandwidth) {
+        start += (size * 1000000 + s->bandwidth - 1) / s->bandwidth;
+    }
+    s->link_free_us = start;
+    return start + s->latency_us;
+}
+
+void loopback_reset(void) {
+    memset(g_sockets, 0, sizeof(g_sockets));
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_now_us = 0;
+    g_next_port = 32768;
+}
+
+uint64_t loopback_now_us(void) {
+    return g_now_us;
+}
+
+void loopback_advance_us(uint64_t us) {
+    g_now_us += us;
+}
+
+uint64_t loopback_next_event_us(void) {
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < LOOPBACK_MAX_SOCKETS; i++) {
+        struct LoopbackSocket* s = &g_sockets[i];
+        if (s->state == LoopbackState_FREE) {
+            continue;
+        }
+
+        pipe_update(&s->rx);
+        if (s->rx.seg_tail != s->rx.seg_head) {
+            const uint64_t t = s->rx.seg[s->rx.seg_tail & (LOOPBACK_MAX_SEGMENTS - 1)].time;
+            next = t < next ? t : next;
+        }
+        if (s->eof && s->eof_time > g_now_us) {
+            next = s->eof_time < next ? s->eof_time : next;
+        }
+    }
+
+    return next;
+}
+
+void loopback_set_default_link(uint64_t bandwidth, uint64_t latency_us) {
+    g_default_bandwidth = bandwidth;
+    g_default_latency_us = latency_us;
+}
+
+int loopback_set_link(int h, uint64_t bandwidth, uint64_t latency_us) {
+    struct LoopbackSocket* s = loopback_get(h);
+    if (!s) {
+        errno = EBADF;
+        return -1;
+    }
+
+    s->bandwidth = bandwidth;
+    s->latency_us = latency_us;
+
+    struct LoopbackSocket* peer = loopback_get(s->peer);
+    if (peer) {
+        peer->bandwidth = bandwidth;
+        peer->latency_us = latency_us;
+    }
+    return 0;
+}
+
+static int loopback_connect_handle(int h, const struct sockaddr_in* addr) {
+    struct LoopbackSocket* s = loopback_get(h);
+    if (!s) {
+        errno = EBADF;
+        return -1;
+    }
+
+    struct LoopbackSocket* listener = NULL;
+    for (int i = 0; i < LOOPBACK_MAX_SOCKETS; i++) {
+        if (g_sockets[i].state == LoopbackState_LISTEN && g_sockets[i].addr.sin_port == addr->sin_port) {
+            listener = &g_sockets[i];
+            break;
+        }
+    }
+
+    if (!listener) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    if (listener->backlog_count >= listener->backlog_max) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    const int other = loopback_alloc();
+    if (other < 0) {
+        return -1;
+    }
+
+    struct LoopbackSocket* o = &g_sockets[other - 1];
+    o->state = LoopbackState_CONNECTED;
+    o->addr = listener->addr;
+    o->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    o->peer = h;
+    o->bandwidth = s->bandwidth;
+    o->latency_us = s->latency_us;
+
+    if (!s->addr.sin_port) {
+        s->addr.sin_family = PF_INET;
+        s->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        s->addr.sin_port = htons(loopback_ephemeral_port());
+    }
+    s->state = LoopbackState_CONNECTED;
+    s->peer = other;
+
+    listener->backlog[listener->backlog_count++] = other;
+    return 0;
+}
+
+int loopback_connect(const struct sockaddr_in* addr) {
+    const int h = loopback_alloc();
+    if (h < 0) {
+        return -1;
+    }
+
+    if (loopback_connect_handle(h, addr)) {
+        g_sockets[h - 1].state = LoopbackState_FREE;
+        return -1;
+    }
+
+    return h;
+}
+
+int loopback_listen(unsigned port) {
+    const int h = loopback_alloc();
+    if (h < 0) {
+        return -1;
+    }
+
+    if (!port) {
+        port = loopback_ephemeral_port();
+    } else if (loopback_port_in_use(port)) {
+        g_sockets[h - 1].state = LoopbackState_FREE;
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    struct LoopbackSocket* s = &g_sockets[h - 1];
+    s->addr.sin_family = PF_INET;
+    s->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    s->addr.sin_port = htons(port);
+    s->state = LoopbackState_LISTEN;
+    s->backlog_max = LOOPBACK_BACKLOG;
+    return h;
+}
+
+int loopback_accept(int h) {
+    struct LoopbackSocket* s = loopback_get(h);
+    if (!s || s->state != LoopbackState_LISTEN) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!s->backlog_count) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    const int other = s->backlog[0];
+    memmove(s->backlog, s->backlog + 1, --s->backlog_count * sizeof(*s->backlog));
+    return other;
+}
+
+int loopback_send(int h, const void* buf, size_t size) {
+    struct LoopbackSocket* s = loopback_get(h);
+    if (!s || s->state != LoopbackState_CONNECTED) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    struct LoopbackSocket* peer = loopback_get(s->peer);
+    if (!peer) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    struct LoopbackPipe* p = &peer->rx;
+    const size_t space = pipe_space(p);
+    if (!space) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (size > space) {
+        size = space;
+    }
+
+    const size_t off = p->head & (LOOPBACK_PIPE_SIZE - 1);
+    const size_t first = size < LOOPBACK_PIPE_SIZE - off ? size : LOOPBACK_PIPE_SIZE - off;
+    memcpy(p->data + off, buf, first);
+    memcpy(p->data, (const uint8_t*)buf + first, size - first);
+    p->head += size;
+
+    struct LoopbackSegment* seg = &p->seg[p->seg_head++ & (LOOPBACK_MAX_SEGMENTS - 1)];
+    seg->end = p->head;
+    seg->time = link_schedule(s, size);
+
+    g_stats.sends++;
+    g_stats.bytes += size;
+    return size;
+}
+
+int loopback_recv(int h, void* buf, size_t size) {
+    struct LoopbackSocket* s = loopback_get(h);
+    if (!s || s->state != LoopbackState_CONNECTED) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    g_stats.recvs++;
+    struct LoopbackPipe* p = &s->rx;
+    const size_t avail = pipe_readable(p);
+    if (!avail) {
+        if (s->eof && s->eof_time <= g_now_us && p->tail == p->head) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (size > avail) {
+        size = avail;
+    }
+
+    const size_t off = p->tail & (LOOPBACK_PIPE_SIZE - 1);
+    const size_t first = size < LOOPBACK_PIPE_SIZE - off ? size : LOOPBACK_PIPE_SIZE - off;
+    memcpy(buf, p->data + off, first);
+    memcpy((uint8_t*)buf + first, p->data, size - first);
+    p->tail += size;
+    return size;
+}
+
+void loopback_close(int h) {
+    struct LoopbackSocket* s = loopback_get(h);
+    if (!s) {
+        return;
+    }
+
+    // the peer sees eof after everything already sent has arrived.
+    struct LoopbackSocket* peer = loopback_get(s->peer);
+    if (peer && peer->peer == h) {
+        peer->eof = true;
+        peer->eof_time = link_schedule(s, 0);
+        peer->peer = 0;
+    }
+
+    // drop any connections that were never accepted.
+    if (s->state == LoopbackState_LISTEN) {
+        for (unsigned i = 0; i < s->backlog_count; i++) {
+            loopback_close(s->backlog[i]);
+        }
+    }
+
+    s->state = LoopbackState_FREE;
+}
+
+const struct LoopbackStats* loopback_stats(void) {
+    return &g_stats;
+}
+
+int ftp_socket_open_loopback(struct FtpSocket* sock, int domain, int type, int protocol) {
+    const int h = loopback_alloc();
+    sock->s = h < 0 ? 0 : h;
+    return h;
+}
+
+int ftp_socket_recv_loopback(struct FtpSocket* sock, void* buf, size_t size, int flags) {
+    return loopback_recv(sock->s, buf, size);
+}
+
+int ftp_socket_send_loopback(struct FtpSocket* sock, const void* buf, size_t size, int flags) {
+    return loopback_send(sock->s, buf, size);
+}
+
+int ftp_socket_close_loopback(struct FtpSocket* sock) {
+    if (sock->s) {
+        loopback_close(sock->s);
+        sock->s = 0;
+    }
+    return 0;
+}
+
+int ftp_socket_accept_loopback(struct FtpSocket* sock_out, struct FtpSocket* listen_sock, struct sockaddr* addr, size_t* addrlen) {
+    const int h = loopback_accept(listen_sock->s);
+    if (h < 0) {
+        return -1;
+    }
+
+    sock_out->s = h;
+    if (addr && addrlen && *addrlen >= sizeof(struct sockaddr_in)) {
+        const struct LoopbackSocket* peer = loopback_get(g_sockets[h - 1].peer);
+        if (peer) {
+            memcpy(addr, &peer->addr, sizeof(peer->addr));
+        } else {
+            memset(addr, 0, sizeof(struct sockaddr_in));
+        }
+        *addrlen = sizeof(struct sockaddr_in);
+    }
+    return h;
+}
+
+int ftp_socket_bind_loopback(struct FtpSocket* sock, struct sockaddr* addr, size_t addrlen) {
+    struct LoopbackSocket* s = loopback_get(sock->s);
+    if (!s || addrlen < sizeof(struct sockaddr_in)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sockaddr_in sa;
+    memcpy(&sa, addr, sizeof(sa));
+    if (!sa.sin_port) {
+        sa.sin_port = htons(loopback_ephemeral_port());
+    } else if (loopback_port_in_use(ntohs(sa.sin_port))) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    s->addr = sa;
+    return 0;
+}
+
+int ftp_socket_connect_loopback(struct FtpSocket* sock, struct sockaddr* addr, size_t addrlen) {
+    if (addrlen < sizeof(struct sockaddr_in)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sockaddr_in sa;
+    memcpy(&sa, addr, sizeof(sa));
+    return loopback_connect_handle(sock->s, &sa);
+}
+
+int ftp_socket_listen_loopback(struct FtpSocket* sock, int backlog) {
+    struct LoopbackSocket* s = loopback_get(sock->s);
+    if (!s) {
+        errno = EBADF;
+        return -1;
+    }
+
+    s->state = LoopbackState_LISTEN;
+    s->backlog_max = backlog > 0 && backlog < LOOPBACK_BACKLOG ? backlog : LOOPBACK_BACKLOG;
+    return 0;
+}
+
+int ftp_socket_getsockname_loopback(struct FtpSocket* sock, struct sockaddr* addr, size_t* addrlen) {
+    const struct LoopbackSocket* s = loopback_get(sock->s);
+    if (!s || *addrlen < sizeof(struct sockaddr_in)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(addr, &s->addr, sizeof(s->addr));
+    *addrlen = sizeof(s->addr);
+    return 0;
+}
+
+static int loopback_poll_once(struct FtpSocketPollEntry* entries, size_t nfds) {
+    int rc = 0;
+
+    for (size_t i = 0; i < nfds; i++) {
+        if (!entries[i].fd) {
+            continue;
+        }
+
+        entries[i].revents = 0;
+        struct LoopbackSocket* s = loopback_get(entries[i].fd->s);
+        if (!s) {
+            entries[i].revents = FtpSocketPollType_ERROR;
+        } else if (s->state == LoopbackState_LISTEN) {
+            if ((entries[i].events & FtpSocketPollType_IN) && s->backlog_count) {
+                entries[i].revents |= FtpSocketPollType_IN;
+            }
+        } else if (s->state == LoopbackState_CONNECTED) {
+            if ((entries[i].events & FtpSocketPollType_IN) && socket_readable(s)) {
+                entries[i].revents |= FtpSocketPollType_IN;
+            }
+            if ((entries[i].events & FtpSocketPollType_OUT) && socket_writable(s)) {
+                entries[i].revents |= FtpSocketPollType_OUT;
+            }
+        }
+
+        if (entries[i].revents) {
+            rc++;
+        }
+    }
+
+    return rc;
+}
+
+int ftp_socket_poll_loopback(struct FtpSocketPollEntry* entries, struct FtpSocketPollFd* fds, size_t nfds, int timeout) {
+    g_stats.polls++;
+
+    int rc = loopback_poll_once(entries, nfds);
+    if (rc || !timeout) {
+        return rc;
+    }
+
+    // nothing is ready, jump to the next delivery rather than waiting.
+    uint64_t next = loopback_next_event_us();
+    if (timeout > 0 && next > g_now_us + (uint64_t)timeout * 1000) {
+        next = g_now_us + (uint64_t)timeout * 1000;
+    }
+
+    if (next != UINT64_MAX) {
+        g_now_us = next;
+        rc = loopback_poll_once(entries, nfds);
+    }
+
+    return rc;
+}
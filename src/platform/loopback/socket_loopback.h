@@ -0,0 +1,87 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// in-memory sockets with a simulated clock, used to drive the server
+// without the kernel tcp stack. everything is single threaded, the
+// server and the clients must be run from the same thread.
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct FtpSocketPollFd {
+    int pad;
+};
+
+struct FtpSocket {
+    int s; // handle + 1, 0 if closed.
+};
+
+int ftp_socket_open_loopback(struct FtpSocket* sock, int domain, int type, int protocol);
+int ftp_socket_recv_loopback(struct FtpSocket* sock, void* buf, size_t size, int flags);
+int ftp_socket_send_loopback(struct FtpSocket* sock, const void* buf, size_t size, int flags);
+int ftp_socket_close_loopback(struct FtpSocket* sock);
+int ftp_socket_accept_loopback(struct FtpSocket* sock_out, struct FtpSocket* listen_sock, struct sockaddr* addr, size_t* addrlen);
+int ftp_socket_bind_loopback(struct FtpSocket* sock, struct sockaddr* addr, size_t addrlen);
+int ftp_socket_connect_loopback(struct FtpSocket* sock, struct sockaddr* addr, size_t addrlen);
+int ftp_socket_listen_loopback(struct FtpSocket* sock, int backlog);
+int ftp_socket_getsockname_loopback(struct FtpSocket* sock, struct sockaddr* addr, size_t* addrlen);
+// if nothing is ready and timeout != 0, the clock jumps to the next
+// delivery (capped at timeout), it never sleeps.
+int ftp_socket_poll_loopback(struct FtpSocketPollEntry* entries, struct FtpSocketPollFd* fds, size_t nfds, int timeout);
+
+static inline int ftp_socket_set_option_loopback(struct FtpSocket* sock, int enable) {
+    return 0;
+}
+
+// driver side, handles are the same as FtpSocket.s.
+void loopback_reset(void);
+uint64_t loopback_now_us(void);
+void loopback_advance_us(uint64_t us);
+// time of the next pending delivery, UINT64_MAX if there is none.
+uint64_t loopback_next_event_us(void);
+// bandwidth in bytes per second (0 = unlimited), one way latency in us.
+// the default is applied to every new connection.
+void loopback_set_default_link(uint64_t bandwidth, uint64_t latency_us);
+int loopback_set_link(int h, uint64_t bandwidth, uint64_t latency_us);
+
+int loopback_connect(const struct sockaddr_in* addr);
+int loopback_listen(unsigned port);
+int loopback_accept(int h);
+// non-blocking, return -1 with errno EAGAIN if they would block.
+int loopback_send(int h, const void* buf, size_t size);
+int loopback_recv(int h, void* buf, size_t size);
+void loopback_close(int h);
+
+// number of calls made into the backend, for per-op accounting.
+struct LoopbackStats {
+    uint64_t polls;
+    uint64_t sends;
+    uint64_t recvs;
+    uint64_t bytes;
+};
+const struct LoopbackStats* loopback_stats(void);
+
+#define ftp_socket_open ftp_socket_open_loopback
+#define ftp_socket_recv ftp_socket_recv_loopback
+#define ftp_socket_send ftp_socket_send_loopback
+#define ftp_socket_close ftp_socket_close_loopback
+#define ftp_socket_accept ftp_socket_accept_loopback
+#define ftp_socket_bind ftp_socket_bind_loopback
+#define ftp_socket_connect ftp_socket_connect_loopback
+#define ftp_socket_listen ftp_socket_listen_loopback
+#define ftp_socket_getsockname ftp_socket_getsockname_loopback
+#define ftp_socket_set_reuseaddr_enable ftp_socket_set_option_loopback
+#define ftp_socket_set_nodelay_enable ftp_socket_set_option_loopback
+#define ftp_socket_set_keepalive_enable ftp_socket_set_option_loopback
+#define ftp_socket_set_throughput_enable ftp_socket_set_option_loopback
+#define ftp_socket_set_nonblocking_enable ftp_socket_set_option_loopback
+#define ftp_socket_poll ftp_socket_poll_loopback
+
+#ifdef __cplusplus
+}
+#endif
@@ -49,7 +49,9 @@ static void poll_ftp(void) {
     }
 
     if (g_ftp_init) {
-        if (ftpsrv_loop(500) != FTP_API_LOOP_ERROR_OK) {
+        const int rc = ftpsrv_loop(500);
+        log_file_flush(NULL, NULL);
+        if (rc != FTP_API_LOOP_ERROR_OK) {
             ftpsrv_exit();
             g_ftp_init = false;
         }
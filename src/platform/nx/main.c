@@ -25,20 +25,12 @@
 #define TEXT_YELLOW "\033[33;1m"
 #define TEXT_BLUE "\033[34;1m"
 
-struct CallbackData {
-    enum FTP_API_LOG_TYPE type;
-    char msg[1024];
-};
-
 static const char* INI_PATH = "/config/ftpsrv/config.ini";
 static const char* LOG_PATH = "/config/ftpsrv/log.txt";
 static struct FtpSrvConfig g_ftpsrv_config = {0};
 static bool g_led_enabled = false;
 
 static PadState g_pad = {0};
-static Mutex g_mutex = {0};
-static struct CallbackData* g_callback_data = NULL;
-static u32 g_num_events = 0;
 static volatile bool g_should_exit = false;
 
 static bool IsApplication(void) {
@@ -51,12 +43,8 @@ static void ftp_log_callback(enum FTP_API_LOG_TYPE type, const char* msg) {
         led_flash();
     }
 
-    mutexLock(&g_mutex);
-        g_num_events++;
-        g_callback_data = realloc(g_callback_data, g_num_events * sizeof(*g_callback_data));
-        g_callback_data[g_num_events-1].type = type;
-        strcpy(g_callback_data[g_num_events-1].msg, msg);
-    mutexUnlock(&g_mutex);
+    // never blocks the server thread, the main thread drains this.
+    log_file_push(type, msg);
 }
 
 static void ftp_progress_callback(void) {
@@ -65,31 +53,26 @@ static void ftp_progress_callback(void) {
     }
 }
 
-static void processEvents(void) {
-    mutexLock(&g_mutex);
-    if (g_num_events) {
-        for (int i = 0; i < g_num_events; i++) {
-            log_file_write(g_callback_data[i].msg);
-
-            switch (g_callback_data[i].type) {
-                case FTP_API_LOG_TYPE_COMMAND:
-                    printf(TEXT_BLUE "Command:  %s" TEXT_NORMAL "\n", g_callback_data[i].msg);
-                    break;
-                case FTP_API_LOG_TYPE_RESPONSE:
-                    printf(TEXT_GREEN "Response: %s" TEXT_NORMAL "\n", g_callback_data[i].msg);
-                    break;
-                case FTP_API_LOG_TYPE_ERROR:
-                    printf(TEXT_RED "Error:    %s" TEXT_NORMAL "\n", g_callback_data[i].msg);
-                    break;
-            }
-        }
+static void printEvent(int type, const char* msg, void* userdata) {
+    switch (type) {
+        case FTP_API_LOG_TYPE_COMMAND:
+            printf(TEXT_BLUE "Command:  %s" TEXT_NORMAL "\n", msg);
+            break;
+        case FTP_API_LOG_TYPE_RESPONSE:
+            printf(TEXT_GREEN "Response: %s" TEXT_NORMAL "\n", msg);
+            break;
+        case FTP_API_LOG_TYPE_ERROR:
+            printf(TEXT_RED "Error:    %s" TEXT_NORMAL "\n", msg);
+            break;
+        case LOG_FILE_TYPE_FILE_ONLY:
+            break;
+    }
+}
 
-        g_num_events = 0;
-        free(g_callback_data);
-        g_callback_data = NULL;
+static void processEvents(void) {
+    if (log_file_flush(printEvent, NULL)) {
         consoleUpdate(NULL);
     }
-    mutexUnlock(&g_mutex);
 }
 
 static void ftp_thread(void* arg) {
@@ -115,6 +98,7 @@ static void consolePrint(const char* fmt, ...) {
 
 static int error_loop(const char* msg) {
     log_file_write(msg);
+    processEvents();
     printf("Error: %s\n\n", msg);
     printf("Modify the config at: %s\n\n", INI_PATH);
     printf("\tPress (+) to exit...\n");
@@ -210,12 +194,14 @@ int main(int argc, char** argv) {
     printf("\n");
     consoleUpdate(NULL);
 
-    mutexInit(&g_mutex);
     Thread thread;
     if (R_FAILED(threadCreate(&thread, ftp_thread, NULL, NULL, 1024*16, 0x31, 1))) {
         error_loop("threadCreate() failed");
     } else {
+        // the server thread pushes from now on, only this thread drains.
+        log_file_set_threaded(1);
         if (R_FAILED(threadStart(&thread))) {
+            log_file_set_threaded(0);
             error_loop("threadStart() failed");
         } else {
             while (appletMainLoop()) {
@@ -230,13 +216,11 @@ int main(int argc, char** argv) {
             }
             g_should_exit = 1;
             threadWaitForExit(&thread);
+            log_file_set_threaded(0);
+            processEvents();
         }
         threadClose(&thread);
     }
-
-    if (g_callback_data) {
-        free(g_callback_data);
-    }
 }
 
 #define TCP_TX_BUF_SIZE (1024 * 64)
@@ -80,7 +80,10 @@ int main(void) {
     while (1) {
         ftpsrv_init(&g_ftpsrv_config);
         while (1) {
-            if (ftpsrv_loop(timeout) != FTP_API_LOOP_ERROR_OK) {
+            const int rc = ftpsrv_loop(timeout);
+            // single threaded, so batch up everything logged this loop.
+            log_file_flush(NULL, NULL);
+            if (rc != FTP_API_LOOP_ERROR_OK) {
                 svcSleepThread(1000000000);
                 break;
             }
@@ -134,6 +134,10 @@ int vfs_stdio_internal_open(struct VfsStdioFile* f, const char* path, enum FtpVf
             flags = O_WRONLY | O_CREAT | O_APPEND;
             args = 0666;
             break;
+        case FtpVfsOpenMode_UPDATE:
+            flags = O_WRONLY | O_CREAT;
+            args = 0666;
+            break;
     }
 
     f->fd = open(path, flags, args);
@@ -2,6 +2,10 @@
  * Copyright 2024 TotalJustice.
  * SPDX-License-Identifier: MIT
  */
+// for sync_file_range().
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
 
 #include "ftpsrv_vfs.h"
 
@@ -9,6 +13,8 @@
 #include <sys/stat.h>
 
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 
@@ -27,6 +33,13 @@ int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mod
         case FtpVfsOpenMode_APPEND:
             f->fd = fopen(path, "wb+");
             break;
+        case FtpVfsOpenMode_UPDATE:
+            // there's no mode that creates without truncating.
+            f->fd = fopen(path, "rb+");
+            if (!f->fd && errno == ENOENT) {
+                f->fd = fopen(path, "wb");
+            }
+            break;
     }
 
     if (!f->fd) {
@@ -61,6 +74,126 @@ int ftp_vfs_isfile_open(struct FtpVfsFile* f) {
     return f->fd != NULL;
 }
 
+int ftp_vfs_fallocate(struct FtpVfsFile* f, size_t off, size_t size) {
+#if defined(HAVE_POSIX_FALLOCATE) && HAVE_POSIX_FALLOCATE
+    if (fflush(f->fd)) {
+        return -1;
+    }
+    // returns the error rather than setting errno.
+    const int rc = posix_fallocate(fileno(f->fd), off, size);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_ftruncate(struct FtpVfsFile* f, size_t size) {
+#if defined(HAVE_FTRUNCATE) && HAVE_FTRUNCATE
+    if (fflush(f->fd)) {
+        return -1;
+    }
+    return ftruncate(fileno(f->fd), size);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_advise(struct FtpVfsFile* f, size_t off, size_t size, enum FtpVfsAdvice advice) {
+    // anything still in the FILE buffer isn't in the page cache yet.
+    if (advice != FtpVfsAdvice_SEQUENTIAL && fflush(f->fd)) {
+        return -1;
+    }
+
+    int rc = 0;
+    switch (advice) {
+        case FtpVfsAdvice_SEQUENTIAL:
+#if defined(HAVE_POSIX_FADVISE) && HAVE_POSIX_FADVISE
+            rc = posix_fadvise(fileno(f->fd), off, size, POSIX_FADV_SEQUENTIAL);
+#else
+            rc = ENOSYS;
+#endif
+            break;
+        case FtpVfsAdvice_WRITEOUT:
+#if defined(HAVE_SYNC_FILE_RANGE) && HAVE_SYNC_FILE_RANGE
+            return sync_file_range(fileno(f->fd), off, size, SYNC_FILE_RANGE_WRITE);
+#else
+            rc = ENOSYS;
+#endif
+            break;
+        case FtpVfsAdvice_DONTNEED:
+#if defined(HAVE_SYNC_FILE_RANGE) && HAVE_SYNC_FILE_RANGE
+            // dirty pages are skipped by DONTNEED, so wait for them first.
+            // this is a no-op for ranges that have only been read.
+            sync_file_range(fileno(f->fd), off, size, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#if defined(HAVE_POSIX_FADVISE) && HAVE_POSIX_FADVISE
+            rc = posix_fadvise(fileno(f->fd), off, size, POSIX_FADV_DONTNEED);
+#else
+            rc = ENOSYS;
+#endif
+            break;
+    }
+
+    // posix_fadvise returns the error rather than setting errno.
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int ftp_vfs_sync(struct FtpVfsFile* f) {
+    if (fflush(f->fd)) {
+        return -1;
+    }
+#if defined(HAVE_FSYNC) && HAVE_FSYNC
+    return fsync(fileno(f->fd));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_prefetch(const char* path, size_t size) {
+#if defined(HAVE_POSIX_FADVISE) && HAVE_POSIX_FADVISE
+    FILE* fd = fopen(path, "rb");
+    if (!fd) {
+        return -1;
+    }
+
+    const int rc = posix_fadvise(fileno(fd), 0, size, POSIX_FADV_WILLNEED);
+    fclose(fd);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_watch_add(const char* path) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_watch_remove(int id) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_watch_read(int* id, char* name, size_t size) {
+    return 0;
+}
+
 int ftp_vfs_opendir(struct FtpVfsDir* f, const char* path) {
     f->fd = opendir(path);
     if (!f->fd) {
@@ -4,6 +4,11 @@
  */
 #include "ftpsrv.h"
 #include "args/args.h"
+#include "trace/trace.h"
+#include "ftpsrv_vfs.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,7 +31,22 @@ enum ArgsId {
     ArgsId_pass,
     ArgsId_anon,
     ArgsId_timeout,
-    ArgsId_localtime
+    ArgsId_localtime,
+    ArgsId_trace,
+    ArgsId_statcache,
+    ArgsId_readshare,
+    ArgsId_filecache,
+    ArgsId_cacheadmit,
+    ArgsId_prefetch,
+    ArgsId_prefetchsize,
+    ArgsId_dropbehind,
+    ArgsId_dropwindow,
+    ArgsId_journal,
+    ArgsId_uploadhash,
+    ArgsId_direct,
+    ArgsId_readahead,
+    ArgsId_writebehind,
+    ArgsId_prealloc,
 };
 
 #define ARGS_ENTRY(_key, _type, _single) \
@@ -41,22 +61,79 @@ static const struct ArgsMeta ARGS_META[] = {
     ARGS_ENTRY(anon, ArgsValueType_BOOL, 'a')
     ARGS_ENTRY(timeout, ArgsValueType_INT, 't')
     ARGS_ENTRY(localtime, ArgsValueType_BOOL, 0)
+    ARGS_ENTRY(trace, ArgsValueType_STR, 0)
+    ARGS_ENTRY(statcache, ArgsValueType_INT, 0)
+    ARGS_ENTRY(readshare, ArgsValueType_BOOL, 0)
+    ARGS_ENTRY(filecache, ArgsValueType_INT, 0)
+    ARGS_ENTRY(cacheadmit, ArgsValueType_INT, 0)
+    ARGS_ENTRY(prefetch, ArgsValueType_INT, 0)
+    ARGS_ENTRY(prefetchsize, ArgsValueType_INT, 0)
+    ARGS_ENTRY(dropbehind, ArgsValueType_INT, 0)
+    ARGS_ENTRY(dropwindow, ArgsValueType_INT, 0)
+    ARGS_ENTRY(journal, ArgsValueType_INT, 0)
+    ARGS_ENTRY(uploadhash, ArgsValueType_STR, 0)
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    ARGS_ENTRY(direct, ArgsValueType_STR, 0)
+#endif
+#if defined(FTP_VFS_BUFFERED) && FTP_VFS_BUFFERED
+    ARGS_ENTRY(readahead, ArgsValueType_INT, 0)
+    ARGS_ENTRY(writebehind, ArgsValueType_INT, 0)
+    ARGS_ENTRY(prealloc, ArgsValueType_INT, 0)
+#endif
 };
 
-static void ftp_log_callback(enum FTP_API_LOG_TYPE type, const char* msg) {
-    switch (type) {
-        case FTP_API_LOG_TYPE_COMMAND:
+static void ftp_event_callback(const struct FtpSrvEvent* event, void* userdata) {
+    trace_event(event);
+
+    char msg[1024];
+    if (ftpsrv_event_format(event, msg, sizeof(msg)) < 0) {
+        return;
+    }
+
+    switch (event->type) {
+        case FTP_API_EVENT_TYPE_COMMAND:
             printf(TEXT_BLUE "Command:  %s" TEXT_NORMAL "\n", msg);
             break;
-        case FTP_API_LOG_TYPE_RESPONSE:
+        case FTP_API_EVENT_TYPE_REPLY:
             printf(TEXT_GREEN "Response: %s" TEXT_NORMAL "\n", msg);
             break;
-        case FTP_API_LOG_TYPE_ERROR:
+        case FTP_API_EVENT_TYPE_ERROR:
             printf(TEXT_RED "Error:    %s" TEXT_NORMAL "\n", msg);
             break;
+        case FTP_API_EVENT_TYPE_SESSION_OPEN:
+        case FTP_API_EVENT_TYPE_SESSION_CLOSE:
+            printf(TEXT_YELLOW "Session:  %s" TEXT_NORMAL "\n", msg);
+            break;
+        case FTP_API_EVENT_TYPE_TRANSFER_START:
+        case FTP_API_EVENT_TYPE_TRANSFER_END:
+            printf(TEXT_YELLOW "Transfer: %s" TEXT_NORMAL "\n", msg);
+            break;
     }
 }
 
+// set by SIGINT / SIGTERM, the loop then exits so that the trace is closed.
+static volatile sig_atomic_t g_quit = 0;
+
+static void on_quit_signal(int sig) {
+    (void)sig;
+    g_quit = 1;
+}
+
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+// a size in bytes, which may be larger than an int.
+static bool parse_size(const char* str, size_t* out) {
+    char* end;
+    errno = 0;
+    const unsigned long long v = strtoull(str, &end, 10);
+    if (*str < '0' || *str > '9' || *end || errno == ERANGE || v > SIZE_MAX) {
+        return false;
+    }
+
+    *out = v;
+    return true;
+}
+#endif
+
 static int print_usage(int code) {
     printf("\
 [ftpsrv " FTPSRV_VERSION_STR " By TotalJustice] \n\n\
@@ -69,15 +146,49 @@ Usage\n\n\
     -a, --anon      = Enable anonymous login.\n\
     -t, --timeout   = Set session timeout in seconds.\n\
     --localtime     = Use local time over gm time.\n\
-    \n");
+    --trace         = Record every session's commands to a binary trace file.\n\
+    --statcache     = Cache stat results for this many ms.\n\
+    --readshare     = Share reads between sessions downloading the same file.\n\
+    --filecache     = Keep up to this many bytes of small files in memory.\n\
+    --cacheadmit    = Cache a file once it has been downloaded this many times.\n\
+    --prefetch      = Read ahead this many files in listing order.\n\
+    --prefetchsize  = Bytes of each file to read ahead.\n\
+    --dropbehind    = Keep transfers of files this large out of the page cache.\n\
+    --dropwindow    = Bytes between page cache drops.\n\
+    --journal       = Flush uploads and record their offset every this many bytes.\n\
+    --uploadhash    = Hash uploads with this algorithm (CRC32C, SHA-256...) and keep the digest.\n");
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    printf("\
+    --direct        = Use O_DIRECT for files this large, 0 to disable.\n");
+#endif
+#if defined(FTP_VFS_BUFFERED) && FTP_VFS_BUFFERED
+    printf("\
+    --readahead     = Read buffer size in bytes, 0 to disable.\n\
+    --writebehind   = Write buffer size in bytes, 0 to disable.\n\
+    --prealloc      = Grow uploads by this many bytes at a time, 0 to disable.\n");
+#endif
+    printf("\n");
 
     return code;
 }
 
 int main(int argc, char** argv) {
     struct FtpSrvConfig ftpsrv_config = {
-        .log_callback = ftp_log_callback,
+        .event_callback = ftp_event_callback,
+        .prefetch_size = 1024 * 1024,
+    };
+
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    struct VfsUnistdConfig unistd_config = {0};
+#endif
+
+#if defined(FTP_VFS_BUFFERED) && FTP_VFS_BUFFERED
+    struct VfsBufferedConfig vfs_config = {
+        .read_size = VFS_BUFFERED_READ_SIZE,
+        .write_size = VFS_BUFFERED_WRITE_SIZE,
+        .prealloc_size = VFS_BUFFERED_PREALLOC_SIZE,
     };
+#endif
 
     int arg_index = 1;
     struct ArgsData arg_data;
@@ -105,6 +216,61 @@ int main(int argc, char** argv) {
             case ArgsId_localtime:
                 ftpsrv_config.use_localtime = arg_data.value.b;
                 break;
+            case ArgsId_trace:
+                if (trace_open(arg_data.value.s)) {
+                    fprintf(stderr, "failed to open trace [%s]\n", arg_data.value.s);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case ArgsId_statcache:
+                ftpsrv_config.stat_cache_ttl_ms = arg_data.value.i;
+                break;
+            case ArgsId_readshare:
+                ftpsrv_config.read_share = arg_data.value.b;
+                break;
+            case ArgsId_filecache:
+                ftpsrv_config.file_cache_size = arg_data.value.i;
+                break;
+            case ArgsId_cacheadmit:
+                ftpsrv_config.file_cache_admit = arg_data.value.i;
+                break;
+            case ArgsId_prefetch:
+                ftpsrv_config.prefetch_files = arg_data.value.i;
+                break;
+            case ArgsId_prefetchsize:
+                ftpsrv_config.prefetch_size = arg_data.value.i;
+                break;
+            case ArgsId_dropbehind:
+                ftpsrv_config.page_cache_min_size = arg_data.value.i;
+                break;
+            case ArgsId_dropwindow:
+                ftpsrv_config.page_cache_window = arg_data.value.i;
+                break;
+            case ArgsId_journal:
+                ftpsrv_config.upload_journal = arg_data.value.i;
+                break;
+            case ArgsId_uploadhash:
+                snprintf(ftpsrv_config.upload_hash, sizeof(ftpsrv_config.upload_hash), "%s", arg_data.value.s);
+                break;
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+            case ArgsId_direct:
+                if (!parse_size(arg_data.value.s, &unistd_config.direct_min_size)) {
+                    fprintf(stderr, "arg [--%s] had bad value [%s]\n", ARGS_META[arg_data.meta_index].key, arg_data.value.s);
+                    return print_usage(EXIT_FAILURE);
+                }
+                break;
+#endif
+#if defined(FTP_VFS_BUFFERED) && FTP_VFS_BUFFERED
+            case ArgsId_readahead:
+                vfs_config.read_size = arg_data.value.i;
+                break;
+            case ArgsId_writebehind:
+                vfs_config.write_size = arg_data.value.i;
+                break;
+            case ArgsId_prealloc:
+                vfs_config.prealloc_size = arg_data.value.i;
+                break;
+#endif
         }
     }
 
@@ -148,20 +314,46 @@ int main(int argc, char** argv) {
     }
     printf(TEXT_YELLOW "timeout: %us" TEXT_NORMAL "\n", ftpsrv_config.timeout);
     printf(TEXT_YELLOW "use_localtime: %u" TEXT_NORMAL "\n", ftpsrv_config.use_localtime);
+    printf(TEXT_YELLOW "stat_cache_ttl: %ums" TEXT_NORMAL "\n", ftpsrv_config.stat_cache_ttl_ms);
+    printf(TEXT_YELLOW "read_share: %u" TEXT_NORMAL "\n", ftpsrv_config.read_share);
+    printf(TEXT_YELLOW "file_cache: %u bytes, admit after %u" TEXT_NORMAL "\n", ftpsrv_config.file_cache_size, ftpsrv_config.file_cache_admit);
+    printf(TEXT_YELLOW "prefetch: %u files, %u bytes each" TEXT_NORMAL "\n", ftpsrv_config.prefetch_files, ftpsrv_config.prefetch_size);
+    printf(TEXT_YELLOW "page_cache: drop behind %u bytes, window %u" TEXT_NORMAL "\n", ftpsrv_config.page_cache_min_size, ftpsrv_config.page_cache_window);
+    printf(TEXT_YELLOW "upload_journal: %u" TEXT_NORMAL "\n", ftpsrv_config.upload_journal);
+    printf(TEXT_YELLOW "upload_hash: %s" TEXT_NORMAL "\n", ftpsrv_config.upload_hash);
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    printf(TEXT_YELLOW "direct: %zu" TEXT_NORMAL "\n", unistd_config.direct_min_size);
+    vfs_unistd_init(&unistd_config);
+#endif
+#if defined(FTP_VFS_BUFFERED) && FTP_VFS_BUFFERED
+    printf(TEXT_YELLOW "readahead: %zu writebehind: %zu prealloc: %zu" TEXT_NORMAL "\n", vfs_config.read_size, vfs_config.write_size, vfs_config.prealloc_size);
+    vfs_buffered_init(&vfs_config);
+#endif
 
     int timeout = -1;
     if (ftpsrv_config.timeout) {
         timeout = 1000 * ftpsrv_config.timeout;
     }
 
-    while (1) {
+    // no SA_RESTART, so that a signal wakes the poll.
+    struct sigaction sa = { .sa_handler = on_quit_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!g_quit) {
         ftpsrv_init(&ftpsrv_config);
-        while (1) {
+        while (!g_quit) {
             if (ftpsrv_loop(timeout) != FTP_API_LOOP_ERROR_OK) {
-                sleep(1);
+                if (!g_quit) {
+                    sleep(1);
+                }
                 break;
             }
         }
         ftpsrv_exit();
     }
+
+    trace_close();
+    return EXIT_SUCCESS;
 }
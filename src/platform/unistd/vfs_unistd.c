@@ -2,6 +2,10 @@
  * Copyright 2024 TotalJustice.
  * SPDX-License-Identifier: MIT
  */
+// for sync_file_range() and O_DIRECT.
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
 
 #include "ftpsrv_vfs.h"
 
@@ -9,6 +13,9 @@
 #include <sys/stat.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -17,6 +24,167 @@
     #define lstat stat
 #endif
 
+#if defined(HAVE_INOTIFY) && HAVE_INOTIFY
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// opened by the first watch, events are read a buffer at a time.
+static int g_watch_fd = -1;
+static size_t g_watch_off;
+static size_t g_watch_len;
+static union {
+    struct inotify_event event; // for the alignment.
+    char buf[4096];
+} g_watch_buf;
+#endif
+
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+#define DIRECT_MASK ((size_t)VFS_UNISTD_DIRECT_ALIGN - 1)
+
+static struct VfsUnistdConfig g_cfg;
+
+void vfs_unistd_init(const struct VfsUnistdConfig* cfg) {
+    g_cfg = *cfg;
+}
+
+static int set_direct(int fd, int enable) {
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, enable ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+// O_DIRECT io can still be rejected after the flag was accepted, in which
+// case it's turned off and the same io is done through the page cache.
+static int fallback(struct FtpVfsFile* f) {
+    if (errno != EINVAL || f->direct_failed || set_direct(f->fd, 0)) {
+        return 0;
+    }
+    f->direct_failed = 1;
+    return 1;
+}
+
+static int pwrite_all(struct FtpVfsFile* f, const unsigned char* buf, size_t size, size_t off) {
+    while (size) {
+        const ssize_t n = pwrite(f->fd, buf, size, off);
+        if (n <= 0) {
+            if (n < 0 && fallback(f)) {
+                continue;
+            }
+            if (!n) {
+                errno = EIO;
+            }
+            return -1;
+        }
+
+        buf += n;
+        size -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// turns on O_DIRECT, pos must be aligned.
+static int direct_start(struct FtpVfsFile* f) {
+    void* buf;
+    if (posix_memalign(&buf, VFS_UNISTD_DIRECT_ALIGN, VFS_UNISTD_DIRECT_BUFFER)) {
+        return -1;
+    }
+
+    if (set_direct(f->fd, 1)) {
+        f->direct_failed = 1;
+        free(buf);
+        return -1;
+    }
+
+    f->direct_buf = buf;
+    f->direct_pos = f->pos;
+    f->direct_len = 0;
+    return 0;
+}
+
+// writes out whatever is pending and goes back to normal io with the fd
+// at pos. the partial block at the end can't be written with O_DIRECT.
+static int direct_stop(struct FtpVfsFile* f) {
+    int rc = 0;
+    if (f->is_write && f->direct_len) {
+        const size_t aligned = f->direct_len & ~DIRECT_MASK;
+        if (pwrite_all(f, f->direct_buf, aligned, f->direct_pos)) {
+            rc = -1;
+        } else if (aligned != f->direct_len) {
+            if (!f->direct_failed && set_direct(f->fd, 0)) {
+                rc = -1;
+            } else {
+                rc = pwrite_all(f, f->direct_buf + aligned, f->direct_len - aligned, f->direct_pos + aligned);
+            }
+        }
+    }
+
+    const int err = errno;
+    free(f->direct_buf);
+    f->direct_buf = NULL;
+    if (!f->direct_failed) {
+        set_direct(f->fd, 0);
+    }
+    if (lseek(f->fd, f->pos, SEEK_SET) < 0 && !rc) {
+        rc = -1;
+    } else if (rc) {
+        errno = err;
+    }
+    return rc;
+}
+
+static int direct_read(struct FtpVfsFile* f, void* buf, size_t size) {
+    if (f->pos < f->direct_pos || f->pos >= f->direct_pos + f->direct_len) {
+        const size_t off = f->pos & ~DIRECT_MASK;
+        ssize_t n;
+        while ((n = pread(f->fd, f->direct_buf, VFS_UNISTD_DIRECT_BUFFER, off)) < 0 && fallback(f)) {
+        }
+        if (n <= 0) {
+            return n;
+        }
+
+        f->direct_pos = off;
+        f->direct_len = n;
+        if (f->pos >= off + n) {
+            return 0;
+        }
+    }
+
+    const size_t avail = f->direct_pos + f->direct_len - f->pos;
+    const size_t n = size < avail ? size : avail;
+    memcpy(buf, f->direct_buf + (f->pos - f->direct_pos), n);
+    f->pos += n;
+    return n;
+}
+
+static int direct_write(struct FtpVfsFile* f, const void* buf, size_t size) {
+    const unsigned char* p = buf;
+    size_t left = size;
+
+    while (left) {
+        const size_t n = left < VFS_UNISTD_DIRECT_BUFFER - f->direct_len ? left : VFS_UNISTD_DIRECT_BUFFER - f->direct_len;
+        memcpy(f->direct_buf + f->direct_len, p, n);
+        f->direct_len += n;
+        p += n;
+        left -= n;
+
+        if (f->direct_len == VFS_UNISTD_DIRECT_BUFFER) {
+            if (pwrite_all(f, f->direct_buf, f->direct_len, f->direct_pos)) {
+                return -1;
+            }
+            f->direct_pos += f->direct_len;
+            f->direct_len = 0;
+        }
+    }
+
+    f->pos += size;
+    return size;
+}
+#endif
+
 int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mode) {
     int flags = 0, args = 0;
 
@@ -33,31 +201,128 @@ int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mod
             flags = O_WRONLY | O_CREAT | O_APPEND;
             args = 0666;
             break;
+        case FtpVfsOpenMode_UPDATE:
+            flags = O_WRONLY | O_CREAT;
+            args = 0666;
+            break;
     }
 
     f->fd = open(path, flags, args);
     if (f->fd >= 0) {
         f->valid = 1;
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+        f->direct_buf = NULL;
+        f->pos = 0;
+        f->is_write = mode == FtpVfsOpenMode_WRITE || mode == FtpVfsOpenMode_UPDATE;
+        f->direct_failed = 0;
+
+        // if it can't be used, the file is read as normal.
+        struct stat st;
+        if (mode == FtpVfsOpenMode_READ && g_cfg.direct_min_size && !fstat(f->fd, &st) && (size_t)st.st_size >= g_cfg.direct_min_size) {
+            direct_start(f);
+        }
+#endif
     }
     return f->fd;
 }
 
 int ftp_vfs_read(struct FtpVfsFile* f, void* buf, size_t size) {
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    if (f->direct_buf) {
+        return direct_read(f, buf, size);
+    }
+
+    const int n = read(f->fd, buf, size);
+    if (n > 0) {
+        f->pos += n;
+    }
+    return n;
+#else
     return read(f->fd, buf, size);
+#endif
 }
 
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+static int write_all(struct FtpVfsFile* f, const void* buf, size_t size) {
+    const unsigned char* p = buf;
+    while (size) {
+        const ssize_t n = write(f->fd, p, size);
+        if (n <= 0) {
+            if (!n) {
+                errno = EIO;
+            }
+            return -1;
+        }
+
+        p += n;
+        size -= n;
+        f->pos += n;
+    }
+    return 0;
+}
+#endif
+
 int ftp_vfs_write(struct FtpVfsFile* f, const void* buf, size_t size) {
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    if (f->direct_buf) {
+        return direct_write(f, buf, size);
+    }
+
+    // uploads switch over once they are large enough, writing up to the
+    // next aligned offset through the page cache first.
+    if (f->is_write && g_cfg.direct_min_size && f->pos >= g_cfg.direct_min_size && !f->direct_failed) {
+        const size_t head = (VFS_UNISTD_DIRECT_ALIGN - (f->pos & DIRECT_MASK)) & DIRECT_MASK;
+        if (head < size) {
+            if (write_all(f, buf, head)) {
+                return -1;
+            }
+            if (!direct_start(f)) {
+                return direct_write(f, (const unsigned char*)buf + head, size - head) < 0 ? -1 : (int)size;
+            }
+            return write_all(f, (const unsigned char*)buf + head, size - head) ? -1 : (int)size;
+        }
+    }
+
+    const int n = write(f->fd, buf, size);
+    if (n > 0) {
+        f->pos += n;
+    }
+    return n;
+#else
     return write(f->fd, buf, size);
+#endif
 }
 
 int ftp_vfs_seek(struct FtpVfsFile* f, const void* buf, size_t size, size_t off) {
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    // reads are served from wherever pos is, writes are flushed first.
+    if (f->direct_buf && !f->is_write) {
+        f->pos = off;
+        return 0;
+    }
+
+    if (f->direct_buf && direct_stop(f)) {
+        return -1;
+    }
+
+    f->pos = off;
+#endif
     return lseek(f->fd, off, SEEK_SET);
 }
 
 int ftp_vfs_close(struct FtpVfsFile* f) {
     int rc = 0;
     if (ftp_vfs_isfile_open(f)) {
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+        if (f->direct_buf) {
+            rc = direct_stop(f);
+        }
+        if (close(f->fd) && !rc) {
+            rc = -1;
+        }
+#else
         rc = close(f->fd);
+#endif
         f->fd = -1;
         f->valid = 0;
     }
@@ -68,6 +333,173 @@ int ftp_vfs_isfile_open(struct FtpVfsFile* f) {
     return f->valid && f->fd >= 0;
 }
 
+int ftp_vfs_fallocate(struct FtpVfsFile* f, size_t off, size_t size) {
+#if defined(HAVE_POSIX_FALLOCATE) && HAVE_POSIX_FALLOCATE
+    // returns the error rather than setting errno.
+    const int rc = posix_fallocate(f->fd, off, size);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_ftruncate(struct FtpVfsFile* f, size_t size) {
+#if defined(HAVE_FTRUNCATE) && HAVE_FTRUNCATE
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    if (f->direct_buf && f->is_write && direct_stop(f)) {
+        return -1;
+    }
+#endif
+    return ftruncate(f->fd, size);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_advise(struct FtpVfsFile* f, size_t off, size_t size, enum FtpVfsAdvice advice) {
+    int rc = 0;
+    switch (advice) {
+        case FtpVfsAdvice_SEQUENTIAL:
+#if defined(HAVE_POSIX_FADVISE) && HAVE_POSIX_FADVISE
+            rc = posix_fadvise(f->fd, off, size, POSIX_FADV_SEQUENTIAL);
+#else
+            rc = ENOSYS;
+#endif
+            break;
+        case FtpVfsAdvice_WRITEOUT:
+#if defined(HAVE_SYNC_FILE_RANGE) && HAVE_SYNC_FILE_RANGE
+            return sync_file_range(f->fd, off, size, SYNC_FILE_RANGE_WRITE);
+#else
+            rc = ENOSYS;
+#endif
+            break;
+        case FtpVfsAdvice_DONTNEED:
+#if defined(HAVE_SYNC_FILE_RANGE) && HAVE_SYNC_FILE_RANGE
+            // dirty pages are skipped by DONTNEED, so wait for them first.
+            // this is a no-op for ranges that have only been read.
+            sync_file_range(f->fd, off, size, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#if defined(HAVE_POSIX_FADVISE) && HAVE_POSIX_FADVISE
+            rc = posix_fadvise(f->fd, off, size, POSIX_FADV_DONTNEED);
+#else
+            rc = ENOSYS;
+#endif
+            break;
+    }
+
+    // posix_fadvise returns the error rather than setting errno.
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int ftp_vfs_sync(struct FtpVfsFile* f) {
+#if defined(HAVE_FSYNC) && HAVE_FSYNC
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    if (f->direct_buf && f->is_write && direct_stop(f)) {
+        return -1;
+    }
+#endif
+    return fsync(f->fd);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_prefetch(const char* path, size_t size) {
+#if defined(HAVE_POSIX_FADVISE) && HAVE_POSIX_FADVISE
+    const int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // starts the read in the background, the pages stay cached after close.
+    const int rc = posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+    close(fd);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_watch_add(const char* path) {
+#if defined(HAVE_INOTIFY) && HAVE_INOTIFY
+    if (g_watch_fd < 0) {
+        g_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (g_watch_fd < 0) {
+            return -1;
+        }
+    }
+    return inotify_add_watch(g_watch_fd, path, WATCH_MASK);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_watch_remove(int id) {
+#if defined(HAVE_INOTIFY) && HAVE_INOTIFY
+    return inotify_rm_watch(g_watch_fd, id);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_watch_read(int* id, char* name, size_t size) {
+#if defined(HAVE_INOTIFY) && HAVE_INOTIFY
+    if (g_watch_fd < 0) {
+        return 0;
+    }
+
+    for (;;) {
+        if (g_watch_off >= g_watch_len) {
+            const ssize_t n = read(g_watch_fd, g_watch_buf.buf, sizeof(g_watch_buf.buf));
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            } else if (n <= 0) {
+                return -1;
+            }
+            g_watch_off = 0;
+            g_watch_len = n;
+        }
+
+        const struct inotify_event* event = (const struct inotify_event*)(g_watch_buf.buf + g_watch_off);
+        g_watch_off += sizeof(*event) + event->len;
+
+        // sent once a watch is gone, the DELETE_SELF / MOVE_SELF before it
+        // has already been reported.
+        if (event->mask & IN_IGNORED) {
+            continue;
+        }
+
+        *id = (event->mask & IN_Q_OVERFLOW) ? -1 : event->wd;
+        name[0] = '\0';
+        // names that don't fit are reported as a change to the dir.
+        if (event->len && !(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && strlen(event->name) < size) {
+            strcpy(name, event->name);
+        }
+        return 1;
+    }
+#else
+    return 0;
+#endif
+}
+
 int ftp_vfs_opendir(struct FtpVfsDir* f, const char* path) {
     f->fd = opendir(path);
     if (!f->fd) {
@@ -6,12 +6,47 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <sys/stat.h>
 #include <dirent.h>
 
+// large files can be read / written with O_DIRECT, see vfs_unistd_init().
+#if !defined(VFS_UNISTD_DIRECT) && defined(__linux__)
+    #define VFS_UNISTD_DIRECT 1
+#endif
+
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+// alignment of O_DIRECT offsets, sizes and buffers.
+#ifndef VFS_UNISTD_DIRECT_ALIGN
+    #define VFS_UNISTD_DIRECT_ALIGN (1024 * 4)
+#endif
+
+// size of the aligned buffer that O_DIRECT io goes through.
+#ifndef VFS_UNISTD_DIRECT_BUFFER
+    #define VFS_UNISTD_DIRECT_BUFFER (1024 * 1024 * 1)
+#endif
+
+struct VfsUnistdConfig {
+    // files at least this large bypass the page cache, 0 to disable.
+    // downloads are checked on open, uploads once they reach this size.
+    size_t direct_min_size;
+};
+
+// only affects files opened after the call.
+void vfs_unistd_init(const struct VfsUnistdConfig* cfg);
+#endif
+
 struct FtpVfsFile {
     int fd;
     int valid;
+#if defined(VFS_UNISTD_DIRECT) && VFS_UNISTD_DIRECT
+    unsigned char* direct_buf; // set while io goes through O_DIRECT.
+    size_t direct_pos;         // file offset of direct_buf[0], aligned.
+    size_t direct_len;         // read: valid bytes in direct_buf, write: bytes pending.
+    size_t pos;                // file offset of the next read / write.
+    int is_write;              // opened with WRITE, APPEND never uses O_DIRECT.
+    int direct_failed;         // the fs rejected O_DIRECT, don't try again.
+#endif
 };
 
 struct FtpVfsDir {
@@ -0,0 +1,158 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#include "trace.h"
+#include "ftpsrv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static FILE* g_trace_file = NULL;
+static uint64_t g_trace_start = 0;
+
+static uint64_t trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void trace_write(uint8_t type, uint32_t session, uint64_t value, const char* name, size_t name_len, const char* text, size_t text_len) {
+    if (name_len > UINT8_MAX) {
+        name_len = UINT8_MAX;
+    }
+    if (text_len > UINT16_MAX) {
+        text_len = UINT16_MAX;
+    }
+
+    const struct TraceRecord record = {
+        .type = type,
+        .name_len = name_len,
+        .text_len = text_len,
+        .session = session,
+        .time_us = trace_now_us() - g_trace_start,
+        .value = value,
+    };
+
+    fwrite(&record, sizeof(record), 1, g_trace_file);
+    if (name_len) {
+        fwrite(name, 1, name_len, g_trace_file);
+    }
+    if (text_len) {
+        fwrite(text, 1, text_len, g_trace_file);
+    }
+}
+
+int trace_open(const char* path) {
+    trace_close();
+
+    g_trace_file = fopen(path, "wb");
+    if (!g_trace_file) {
+        return -1;
+    }
+
+    const uint32_t version = TRACE_VERSION;
+    fwrite(TRACE_MAGIC, 1, 8, g_trace_file);
+    fwrite(&version, sizeof(version), 1, g_trace_file);
+    g_trace_start = trace_now_us();
+    return 0;
+}
+
+void trace_event(const struct FtpSrvEvent* event) {
+    if (!g_trace_file) {
+        return;
+    }
+
+    const char* name = event->name ? event->name : "";
+    const char* text = event->text ? event->text : "";
+
+    switch (event->type) {
+        case FTP_API_EVENT_TYPE_SESSION_OPEN:
+            trace_write(TraceRecordType_OPEN, event->session, 0, NULL, 0, NULL, 0);
+            break;
+        case FTP_API_EVENT_TYPE_SESSION_CLOSE:
+            trace_write(TraceRecordType_CLOSE, event->session, 0, NULL, 0, NULL, 0);
+            // so that finished sessions survive the server being killed.
+            fflush(g_trace_file);
+            break;
+        case FTP_API_EVENT_TYPE_COMMAND:
+            trace_write(TraceRecordType_COMMAND, event->session, 0, name, strlen(name), text, event->text ? event->text_len : 0);
+            break;
+        case FTP_API_EVENT_TYPE_REPLY:
+        case FTP_API_EVENT_TYPE_ERROR:
+            trace_write(TraceRecordType_REPLY, event->session, event->code, NULL, 0, NULL, 0);
+            break;
+        case FTP_API_EVENT_TYPE_TRANSFER_END:
+            trace_write(TraceRecordType_TRANSFER, event->session, event->bytes, name, strlen(name), NULL, 0);
+            break;
+        case FTP_API_EVENT_TYPE_TRANSFER_START:
+            break;
+    }
+}
+
+void trace_close(void) {
+    if (g_trace_file) {
+        fclose(g_trace_file);
+        g_trace_file = NULL;
+    }
+}
+
+int trace_load(struct TraceFile* f, const char* path) {
+    memset(f, 0, sizeof(*f));
+
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    int rc = -1;
+    if (!fseek(file, 0, SEEK_END)) {
+        const long size = ftell(file);
+        if (size >= 12 && !fseek(file, 0, SEEK_SET)) {
+            f->data = malloc(size);
+            if (f->data && fread(f->data, 1, size, file) == (size_t)size) {
+                uint32_t version;
+                memcpy(&version, f->data + 8, sizeof(version));
+                if (!memcmp(f->data, TRACE_MAGIC, 8) && version == TRACE_VERSION) {
+                    f->size = size;
+                    f->offset = 12;
+                    rc = 0;
+                }
+            }
+        }
+    }
+
+    fclose(file);
+    if (rc) {
+        trace_free(f);
+    }
+    return rc;
+}
+
+int trace_next(struct TraceFile* f, struct TraceEntry* out) {
+    if (f->offset == f->size) {
+        return 0;
+    }
+
+    if (f->size - f->offset < sizeof(out->record)) {
+        return -1;
+    }
+
+    memcpy(&out->record, f->data + f->offset, sizeof(out->record));
+    const size_t len = out->record.name_len + out->record.text_len;
+    if (f->size - f->offset - sizeof(out->record) < len) {
+        return -1;
+    }
+
+    out->name = (const char*)f->data + f->offset + sizeof(out->record);
+    out->text = out->name + out->record.name_len;
+    f->offset += sizeof(out->record) + len;
+    return 1;
+}
+
+void trace_free(struct TraceFile* f) {
+    free(f->data);
+    memset(f, 0, sizeof(*f));
+}
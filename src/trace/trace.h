@@ -0,0 +1,69 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef TRACE_TJ_H
+#define TRACE_TJ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct FtpSrvEvent;
+
+#define TRACE_MAGIC "FTPTRACE"
+#define TRACE_VERSION 1
+
+// file layout:
+// - 8 byte magic, u32 version.
+// - records, each is a TraceRecord followed by name_len bytes of name
+//   then text_len bytes of text (not NULL terminated).
+// all values are in host byte order.
+enum TraceRecordType {
+    TraceRecordType_OPEN = 1,   // session connected.
+    TraceRecordType_CLOSE,      // session disconnected.
+    TraceRecordType_COMMAND,    // name = verb, text = args (empty for PASS).
+    TraceRecordType_REPLY,      // value = reply code.
+    TraceRecordType_TRANSFER,   // name = transfer verb, value = bytes moved.
+};
+
+struct TraceRecord {
+    uint8_t type;
+    uint8_t name_len;
+    uint16_t text_len;
+    uint32_t session;   // slot index, reused after a close.
+    uint64_t time_us;   // time since the trace was opened.
+    uint64_t value;
+};
+
+// capture, the event callback should pass every event to trace_event().
+int trace_open(const char* path);
+void trace_event(const struct FtpSrvEvent* event);
+void trace_close(void);
+
+// replay side, a trace is loaded into memory in one go.
+struct TraceFile {
+    uint8_t* data;
+    size_t size;
+    size_t offset;
+};
+
+struct TraceEntry {
+    struct TraceRecord record;
+    const char* name;   // NOT NULL terminated, use record.name_len.
+    const char* text;   // NOT NULL terminated, use record.text_len.
+};
+
+int trace_load(struct TraceFile* f, const char* path);
+// returns 1 if an entry was read, 0 at the end of the trace, -1 if corrupt.
+int trace_next(struct TraceFile* f, struct TraceEntry* out);
+void trace_free(struct TraceFile* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TRACE_TJ_H
@@ -0,0 +1,244 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#include "ftpsrv_vfs.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static struct VfsBufferedConfig g_cfg = {
+    .read_size = VFS_BUFFERED_READ_SIZE,
+    .write_size = VFS_BUFFERED_WRITE_SIZE,
+    .prealloc_size = VFS_BUFFERED_PREALLOC_SIZE,
+};
+
+void vfs_buffered_init(const struct VfsBufferedConfig* cfg) {
+    g_cfg = *cfg;
+}
+
+// grows the file before writing past what has already been allocated.
+// if the fs doesn't support it, stop trying and write as normal.
+static void prealloc(struct FtpVfsFile* f, size_t size) {
+    const size_t end = f->inner_off + size;
+    if (!f->prealloc_size || end <= f->prealloc_end) {
+        return;
+    }
+
+    const size_t start = f->prealloc_end > f->inner_off ? f->prealloc_end : f->inner_off;
+    const size_t new_end = (end / f->prealloc_size + 1) * f->prealloc_size;
+    if (vfs_buffered_inner_fallocate(&f->inner, start, new_end - start)) {
+        f->prealloc_size = 0;
+    } else {
+        f->prealloc_end = new_end;
+    }
+}
+
+// the wrapped vfs may write less than asked, keep going until it's all out.
+static int write_all(struct FtpVfsFile* f, const void* buf, size_t size) {
+    const unsigned char* p = buf;
+    prealloc(f, size);
+
+    while (size) {
+        const int n = vfs_buffered_inner_write(&f->inner, p, size);
+        if (n <= 0) {
+            if (!n) {
+                errno = EIO;
+            }
+            return -1;
+        }
+
+        p += n;
+        size -= n;
+        f->inner_off += n;
+    }
+
+    if (f->inner_off > f->end) {
+        f->end = f->inner_off;
+    }
+
+    return 0;
+}
+
+static int flush_write(struct FtpVfsFile* f) {
+    const size_t size = f->buf_off;
+    f->buf_off = 0;
+    return size ? write_all(f, f->buf, size) : 0;
+}
+
+int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mode) {
+    const int rc = vfs_buffered_inner_open(&f->inner, path, mode);
+    if (rc < 0) {
+        return rc;
+    }
+
+    f->is_write = mode != FtpVfsOpenMode_READ;
+    f->buf_size = f->is_write ? g_cfg.write_size : g_cfg.read_size;
+    f->buf = NULL;
+    // fallback to unbuffered if out of memory.
+    if (f->buf_size && !(f->buf = malloc(f->buf_size))) {
+        f->buf_size = 0;
+    }
+
+    f->buf_off = f->buf_len = f->buf_pos = 0;
+    f->inner_off = f->end = f->prealloc_end = 0;
+    // only new files are grown, as the size is cut back to what was written
+    // on close. the offset of an appended file isn't known either.
+    f->prealloc_size = mode == FtpVfsOpenMode_WRITE ? g_cfg.prealloc_size : 0;
+    f->valid = 1;
+    return rc;
+}
+
+int ftp_vfs_read(struct FtpVfsFile* f, void* buf, size_t size) {
+    if (!f->buf) {
+        return vfs_buffered_inner_read(&f->inner, buf, size);
+    }
+
+    // serve from the buffer if the offset is inside it.
+    if (f->buf_off < f->buf_len) {
+        const size_t n = size < f->buf_len - f->buf_off ? size : f->buf_len - f->buf_off;
+        memcpy(buf, f->buf + f->buf_off, n);
+        f->buf_off += n;
+        return n;
+    }
+
+    const size_t off = f->buf_pos + f->buf_off;
+    if (f->inner_off != off) {
+        if (vfs_buffered_inner_seek(&f->inner, NULL, 0, off) < 0) {
+            return -1;
+        }
+        f->inner_off = off;
+    }
+
+    // reads as large as the buffer skip it.
+    if (size >= f->buf_size) {
+        const int n = vfs_buffered_inner_read(&f->inner, buf, size);
+        if (n > 0) {
+            f->inner_off += n;
+            f->buf_pos = f->inner_off;
+            f->buf_off = f->buf_len = 0;
+        }
+        return n;
+    }
+
+    const int n = vfs_buffered_inner_read(&f->inner, f->buf, f->buf_size);
+    if (n <= 0) {
+        return n;
+    }
+
+    f->inner_off += n;
+    f->buf_pos = off;
+    f->buf_len = n;
+    f->buf_off = size < (size_t)n ? size : (size_t)n;
+    memcpy(buf, f->buf, f->buf_off);
+    return f->buf_off;
+}
+
+int ftp_vfs_write(struct FtpVfsFile* f, const void* buf, size_t size) {
+    if (f->buf) {
+        if (f->buf_off + size > f->buf_size && flush_write(f)) {
+            return -1;
+        }
+
+        if (size < f->buf_size) {
+            memcpy(f->buf + f->buf_off, buf, size);
+            f->buf_off += size;
+            return size;
+        }
+    }
+
+    if (write_all(f, buf, size)) {
+        return -1;
+    }
+    return size;
+}
+
+int ftp_vfs_seek(struct FtpVfsFile* f, const void* buf, size_t size, size_t off) {
+    if (!f->is_write && f->buf) {
+        // rewinding after a partial send lands inside the buffer, so this
+        // is usually free. otherwise the seek happens on the next read.
+        if (off >= f->buf_pos && off <= f->buf_pos + f->buf_len) {
+            f->buf_off = off - f->buf_pos;
+        } else {
+            f->buf_pos = off;
+            f->buf_off = f->buf_len = 0;
+        }
+        return 0;
+    }
+
+    if (f->is_write && flush_write(f)) {
+        return -1;
+    }
+
+    const int rc = vfs_buffered_inner_seek(&f->inner, buf, size, off);
+    if (rc >= 0) {
+        f->inner_off = off;
+    }
+    return rc;
+}
+
+int ftp_vfs_close(struct FtpVfsFile* f) {
+    if (!ftp_vfs_isfile_open(f)) {
+        return 0;
+    }
+
+    int rc = 0;
+    if (f->is_write) {
+        rc = flush_write(f);
+        // give back whatever was grown past the end of the data.
+        if (f->prealloc_end > f->end && vfs_buffered_inner_ftruncate(&f->inner, f->end) && !rc) {
+            rc = -1;
+        }
+    }
+
+    const int err = errno;
+    if (vfs_buffered_inner_close(&f->inner) && !rc) {
+        rc = -1;
+    } else if (rc) {
+        errno = err;
+    }
+
+    free(f->buf);
+    f->buf = NULL;
+    f->valid = 0;
+    return rc;
+}
+
+int ftp_vfs_isfile_open(struct FtpVfsFile* f) {
+    return f->valid && vfs_buffered_inner_isfile_open(&f->inner);
+}
+
+int ftp_vfs_fallocate(struct FtpVfsFile* f, size_t off, size_t size) {
+    if (f->is_write && flush_write(f)) {
+        return -1;
+    }
+    return vfs_buffered_inner_fallocate(&f->inner, off, size);
+}
+
+int ftp_vfs_ftruncate(struct FtpVfsFile* f, size_t size) {
+    if (f->is_write && flush_write(f)) {
+        return -1;
+    }
+
+    const int rc = vfs_buffered_inner_ftruncate(&f->inner, size);
+    if (!rc) {
+        f->end = f->prealloc_end = size;
+    }
+    return rc;
+}
+
+int ftp_vfs_advise(struct FtpVfsFile* f, size_t off, size_t size, enum FtpVfsAdvice advice) {
+    if (f->is_write && advice != FtpVfsAdvice_SEQUENTIAL && flush_write(f)) {
+        return -1;
+    }
+    return vfs_buffered_inner_advise(&f->inner, off, size, advice);
+}
+
+int ftp_vfs_sync(struct FtpVfsFile* f) {
+    if (f->is_write && flush_write(f)) {
+        return -1;
+    }
+    return vfs_buffered_inner_sync(&f->inner);
+}
@@ -0,0 +1,82 @@
+// Copyright 2024 TotalJustice.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// wraps the file functions of another vfs (VFS_BUFFERED_INNER_HEADER) with
+// read-ahead and write-behind buffers, and grows files being written in
+// large extents, so that small network reads / writes become large
+// sequential disk io. everything else is passed straight through.
+//
+// to use, set FTP_VFS_HEADER to this file and build vfs_buffered.c and
+// vfs_buffered_inner.c, with VFS_BUFFERED_INNER_HEADER / _SOURCE set to
+// the header and source of the wrapped vfs (see ftp_add_vfs_buffered()).
+#include <stddef.h>
+
+// defaults, can be changed at runtime with vfs_buffered_init().
+#ifndef VFS_BUFFERED_READ_SIZE
+    #define VFS_BUFFERED_READ_SIZE (1024 * 1024 * 1)
+#endif
+
+#ifndef VFS_BUFFERED_WRITE_SIZE
+    #define VFS_BUFFERED_WRITE_SIZE (1024 * 1024 * 1)
+#endif
+
+#ifndef VFS_BUFFERED_PREALLOC_SIZE
+    #define VFS_BUFFERED_PREALLOC_SIZE (1024 * 1024 * 8)
+#endif
+
+struct VfsBufferedConfig {
+    size_t read_size;     // read-ahead buffer, 0 to disable.
+    size_t write_size;    // write-behind buffer, 0 to disable.
+    size_t prealloc_size; // files being written are grown by this much at a time, 0 to disable.
+};
+
+// only affects files opened after the call.
+void vfs_buffered_init(const struct VfsBufferedConfig* cfg);
+
+#ifdef VFS_BUFFERED_INNER_HEADER
+
+#if defined(VFS_BUFFERED_INNER) && VFS_BUFFERED_INNER
+    // building the wrapped vfs, FtpVfsFile is already renamed.
+    #include VFS_BUFFERED_INNER_HEADER
+#else
+    #define FtpVfsFile VfsBufferedInnerFile
+    #include VFS_BUFFERED_INNER_HEADER
+    #undef FtpVfsFile
+
+struct FtpVfsFile {
+    struct VfsBufferedInnerFile inner;
+    unsigned char* buf; // NULL if unbuffered.
+    size_t buf_size;
+    size_t buf_off;     // read: next byte to return, write: bytes pending.
+    size_t buf_len;     // read: valid bytes in buf.
+    size_t buf_pos;     // file offset of buf[0].
+    size_t inner_off;   // file offset of the wrapped file.
+    size_t prealloc_size;
+    size_t prealloc_end; // size the file has been grown to, 0 if none.
+    size_t end;          // furthest byte written.
+    int is_write;
+    int valid;
+};
+#endif
+
+int vfs_buffered_inner_open(struct VfsBufferedInnerFile* f, const char* path, enum FtpVfsOpenMode mode);
+int vfs_buffered_inner_read(struct VfsBufferedInnerFile* f, void* buf, size_t size);
+int vfs_buffered_inner_write(struct VfsBufferedInnerFile* f, const void* buf, size_t size);
+int vfs_buffered_inner_seek(struct VfsBufferedInnerFile* f, const void* buf, size_t size, size_t off);
+int vfs_buffered_inner_close(struct VfsBufferedInnerFile* f);
+int vfs_buffered_inner_isfile_open(struct VfsBufferedInnerFile* f);
+int vfs_buffered_inner_fallocate(struct VfsBufferedInnerFile* f, size_t off, size_t size);
+int vfs_buffered_inner_ftruncate(struct VfsBufferedInnerFile* f, size_t size);
+int vfs_buffered_inner_advise(struct VfsBufferedInnerFile* f, size_t off, size_t size, enum FtpVfsAdvice advice);
+int vfs_buffered_inner_sync(struct VfsBufferedInnerFile* f);
+
+#endif // VFS_BUFFERED_INNER_HEADER
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,26 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+// builds the wrapped vfs with its file type and functions renamed, so that
+// vfs_buffered.c can provide the public ones. everything else (dirs, stat,
+// mkdir etc) keeps its name and is used as is.
+#define VFS_BUFFERED_INNER 1
+
+#define FtpVfsFile VfsBufferedInnerFile
+#define ftp_vfs_open vfs_buffered_inner_open
+#define ftp_vfs_read vfs_buffered_inner_read
+#define ftp_vfs_write vfs_buffered_inner_write
+#define ftp_vfs_seek vfs_buffered_inner_seek
+#define ftp_vfs_close vfs_buffered_inner_close
+#define ftp_vfs_isfile_open vfs_buffered_inner_isfile_open
+#define ftp_vfs_fallocate vfs_buffered_inner_fallocate
+#define ftp_vfs_ftruncate vfs_buffered_inner_ftruncate
+#define ftp_vfs_advise vfs_buffered_inner_advise
+#define ftp_vfs_sync vfs_buffered_inner_sync
+
+#ifdef VFS_BUFFERED_INNER_SOURCE
+    #include VFS_BUFFERED_INNER_SOURCE
+#else
+    #error VFS_BUFFERED_INNER_SOURCE not set to the source file path!
+#endif